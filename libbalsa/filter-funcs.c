@@ -36,6 +36,7 @@
 
 #include "filter-funcs.h"
 #include "filter-private.h"
+#include "misc.h"
 
 /* Conditions */
 
@@ -80,6 +81,7 @@ lbcond_new(ConditionMatchType type, gboolean negated)
     cond->type      = type;
     cond->negate    = !!negated;
     cond->ref_count = 1;
+    cond->program   = NULL;
 
     return cond;
 }
@@ -137,6 +139,52 @@ libbalsa_condition_new_string(gboolean negated, unsigned headers,
 
     return cond;
 }
+/* REGEX <fields> "<regex>"[ "<regex>"...] */
+static LibBalsaCondition*
+libbalsa_condition_new_regex_parse(gboolean negated, gchar **string)
+{
+    LibBalsaCondition *cond;
+    gchar *str;
+    int i, headers = atoi(*string);
+    for(i=0; (*string)[i] && isdigit((int)(*string)[i]); i++)
+        ;
+    if((*string)[i] != ' ')
+        return NULL;
+    *string += i+1;
+    if((str = get_quoted_string(string)) == NULL)
+        return NULL;
+    cond = libbalsa_condition_new_regex(negated, headers, str);
+    while((*string)[0] == ' ' && (*string)[1] == '"') {
+        LibBalsaConditionRegex *reg = libbalsa_condition_regex_new();
+
+        ++*string;
+        libbalsa_condition_regex_set(reg, get_quoted_string(string));
+        cond->match.regex.regexs =
+            g_slist_append(cond->match.regex.regexs, reg);
+    }
+
+    return cond;
+}
+
+/* libbalsa_condition_new_regex:
+ * steals the regex string.  User headers are not supported.
+ */
+LibBalsaCondition*
+libbalsa_condition_new_regex(gboolean negated, unsigned headers,
+                             gchar *regex)
+{
+    LibBalsaCondition *cond;
+    LibBalsaConditionRegex *reg;
+
+    cond = lbcond_new(CONDITION_REGEX, negated);
+    cond->match.regex.fields = headers & ~CONDITION_MATCH_US_HEAD;
+    reg = libbalsa_condition_regex_new();
+    libbalsa_condition_regex_set(reg, regex);
+    cond->match.regex.regexs = g_slist_prepend(NULL, reg);
+
+    return cond;
+}
+
 LibBalsaCondition*
 libbalsa_condition_new_date(gboolean negated, time_t *from, time_t *to)
 {
@@ -285,6 +333,7 @@ libbalsa_condition_new_from_string(gchar **string)
         LibBalsaCondition *(*parser)(gboolean negate, gchar **str);
     } cond_types[] = {
         { "STRING ", 7, libbalsa_condition_new_string_parse },
+        { "REGEX ",  6, libbalsa_condition_new_regex_parse  },
         { "DATE ",   5, libbalsa_condition_new_date_parse   },
         { "FLAG ",   5, libbalsa_condition_new_flag   },
         { "AND ",    4, libbalsa_condition_new_and    },
@@ -313,6 +362,7 @@ cond_to_string(LibBalsaCondition * cond, GString *res)
 {
     char str[80];
     GDate date;
+    GSList *l;
 
     if(cond->negate)
         g_string_append(res, "NOT ");
@@ -327,9 +377,13 @@ cond_to_string(LibBalsaCondition * cond, GString *res)
         append_quoted_string(res, cond->match.string.string);
 	break;
     case CONDITION_REGEX:
-#if 0
-        /* FIXME! */
-#endif        
+        g_string_append_printf(res, "REGEX %u", cond->match.regex.fields);
+        for (l = cond->match.regex.regexs; l; l = l->next) {
+            g_string_append_c(res, ' ');
+            append_quoted_string(res,
+                                 ((LibBalsaConditionRegex *) l->data)->
+                                 string);
+        }
 	break;
     case CONDITION_DATE:
         g_string_append(res, "DATE ");
@@ -433,6 +487,7 @@ libbalsa_condition_to_string_user(LibBalsaCondition *cond)
 {
     GDate date;
     char str[80];
+    GSList *l;
     GString *res = g_string_new("");
 
     if(cond->negate)
@@ -445,9 +500,13 @@ libbalsa_condition_to_string_user(LibBalsaCondition *cond)
         append_quoted_string(res, cond->match.string.string);
 	break;
     case CONDITION_REGEX:
-#if 0
-        /* FIXME! */
-#endif        
+        append_header_names(cond, res);
+        for (l = cond->match.regex.regexs; l; l = l->next) {
+            g_string_append_c(res, ' ');
+            append_quoted_string(res,
+                                 ((LibBalsaConditionRegex *) l->data)->
+                                 string);
+        }
 	break;
     case CONDITION_DATE:
 	if (cond->match.date.date_low) {
@@ -486,6 +545,12 @@ libbalsa_condition_to_string_user(LibBalsaCondition *cond)
  *    condition_regex *reg - the filter_regex structure to clear
  *    gpointer throwaway - unused
  */
+LibBalsaConditionRegex*
+libbalsa_condition_regex_new(void)
+{
+    return g_new0(LibBalsaConditionRegex, 1);
+}
+
 void
 libbalsa_condition_regex_free(LibBalsaConditionRegex* reg, gpointer throwaway)
 {
@@ -493,13 +558,27 @@ libbalsa_condition_regex_free(LibBalsaConditionRegex* reg, gpointer throwaway)
 	return;
 
     g_free(reg->string);
-    if (reg->compiled) 
+    libbalsa_condition_regex_clear(reg);
+    g_free(reg);
+}				/* end condition_regex_free() */
+
+/* Forget what was compiled from the string, and whether it compiled. */
+void
+libbalsa_condition_regex_clear(LibBalsaConditionRegex * reg)
+{
+    if (reg->compiled) {
 #if USE_GREGEX
         g_regex_unref(reg->compiled);
 #else                           /* USE_GREGEX */
 	regfree(reg->compiled);
+        g_free(reg->compiled);
 #endif                          /* USE_GREGEX */
-}				/* end condition_regex_free() */
+        reg->compiled = NULL;
+    }
+    g_free(reg->literal);
+    reg->literal = NULL;
+    reg->invalid = FALSE;
+}
 
 void 
 regexs_free(GSList * regexs)
@@ -521,13 +600,15 @@ libbalsa_condition_unref(LibBalsaCondition* cond)
     if (--cond->ref_count > 0)
         return;
 
+    libbalsa_condition_reset_program(cond);
     switch (cond->type) {
     case CONDITION_STRING:
 	g_free(cond->match.string.string);
 	g_free(cond->match.string.user_header);
 	break;
     case CONDITION_REGEX:
-	/* FIXME: regexs_free(cond->match.regexs); */
+	regexs_free(cond->match.regex.regexs);
+        break;
     case CONDITION_DATE:
     case CONDITION_FLAG:
 	/* nothing to do */
@@ -611,6 +692,7 @@ gboolean
 libbalsa_condition_compare(LibBalsaCondition *c1,LibBalsaCondition *c2)
 {
     gboolean res = FALSE;
+    GSList *l1, *l2;
 
     if (c1 == c2) 
         return TRUE;
@@ -624,11 +706,13 @@ libbalsa_condition_compare(LibBalsaCondition *c1,LibBalsaCondition *c2)
         res = lbcond_compare_string_conditions(c1, c2);
         break;
     case CONDITION_REGEX:
-#if 0
-        if ((c2->type == CONDITION_REGEX) && FIXME!
-            compare_regexs(c1->match.regexs,c2->match.regexs))
-            OK = TRUE;
-#endif
+        res = (c1->match.regex.fields == c2->match.regex.fields);
+        for (l1 = c1->match.regex.regexs, l2 = c2->match.regex.regexs;
+             res && l1 && l2; l1 = l1->next, l2 = l2->next)
+            res = (strcmp(((LibBalsaConditionRegex *) l1->data)->string,
+                          ((LibBalsaConditionRegex *) l2->data)->string)
+                   == 0);
+        res = res && !l1 && !l2;
         break;
     case CONDITION_DATE:
         res = (c1->match.date.date_low == c2->match.date.date_low &&
@@ -654,62 +738,319 @@ libbalsa_condition_compare(LibBalsaCondition *c1,LibBalsaCondition *c2)
     return res;
 }
 
-/* BIG FIXME : result of certain function of regex compilation are useless
- * and we should have a way to tell which regexs we were unable to compile
- * that's for later
+/*
+ * condition_regex_skip_bracket()
+ *
+ * Returns the position after the bracket expression starting at p, or
+ * NULL if it is not terminated.
  */
+static const gchar *
+condition_regex_skip_bracket(const gchar * p)
+{
+    ++p;
+    if (*p == '^')
+        ++p;
+    if (*p == ']')
+        ++p;
+    while (*p && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+            gchar end[3] = { p[1], ']', '\0' };
+            const gchar *q = strstr(p + 2, end);
+            if (!q)
+                return NULL;
+            p = q + 2;
+            continue;
+        }
+        if (*p == '\\' && p[1])
+            ++p;
+        ++p;
+    }
+
+    return *p ? p + 1 : NULL;
+}
+
 /*
- * condition_regcomp()
+ * condition_regex_skip_escape()
  *
- * Compiles a regex for a filter (only if compiled field is NULL)
+ * p points after a backslash followed by a letter or digit; returns
+ * the position after the whole escape sequence (\x{41}, \k<name>,
+ * \12...), or NULL if it is not terminated.
+ */
+static const gchar *
+condition_regex_skip_escape(const gchar * p)
+{
+    const gchar *close = NULL;
+
+    switch (*p) {
+    case '{':
+        close = "}";
+        break;
+    case '<':
+        close = ">";
+        break;
+    case '\'':
+        close = "'";
+        break;
+    }
+    if (close && !(p = strstr(p + 1, close)))
+        return NULL;
+    if (close)
+        ++p;
+    while (g_ascii_isalnum(*p))
+        ++p;
+
+    return p;
+}
+
+static void
+condition_regex_end_run(GString * run, gchar ** best)
+{
+    if (run->len >= 2 && (!*best || run->len > strlen(*best))) {
+        g_free(*best);
+        *best = g_strdup(run->str);
+    }
+    g_string_truncate(run, 0);
+}
+
+/*
+ * condition_regex_literal()
+ *
+ * Returns the longest run of literal characters that every match of
+ * the pattern must contain, or NULL if none could be found; the caller
+ * may then use strstr as a cheap prefilter before running the regex.
+ * Anything the scanner does not understand only makes the result
+ * shorter or NULL, never wrong.
+ */
+static gchar *
+condition_regex_literal(const gchar * pattern)
+{
+    const gchar *p = pattern;
+    GString *run = g_string_new(NULL);
+    gchar *best = NULL;
+
+    while (p && *p) {
+        switch (*p) {
+        case '|':
+            /* Alternation at top level: nothing is required. */
+        case ')':
+            p = NULL;
+            break;
+        case '(': {
+            gint depth = 0;
+
+            if (p[1] == '?' || p[1] == '*') {
+                /* Options or verbs may change how literals match. */
+                p = NULL;
+                break;
+            }
+            condition_regex_end_run(run, &best);
+            do {
+                if (*p == '[') {
+                    p = condition_regex_skip_bracket(p);
+                    continue;
+                }
+                if (*p == '\\' && p[1])
+                    ++p;
+                else if (*p == '(')
+                    ++depth;
+                else if (*p == ')')
+                    --depth;
+                ++p;
+            } while (p && *p && depth > 0);
+            if (depth > 0)
+                p = NULL;
+            break;
+        }
+        case '[':
+            condition_regex_end_run(run, &best);
+            p = condition_regex_skip_bracket(p);
+            break;
+        case '.':
+        case '^':
+        case '$':
+        case '+':
+            /* For '+' the preceding character is still required. */
+            condition_regex_end_run(run, &best);
+            ++p;
+            break;
+        case '*':
+        case '?':
+        case '{':
+            /* The preceding character may be absent. */
+            if (run->len > 0) {
+                const gchar *last =
+                    g_utf8_find_prev_char(run->str, run->str + run->len);
+                g_string_truncate(run, last ? last - run->str : 0);
+            }
+            condition_regex_end_run(run, &best);
+            if (*p == '{' && (p = strchr(p, '}')) == NULL)
+                break;
+            ++p;
+            break;
+        case '\\':
+            if (p[1] == 'Q' || p[1] == '\0') {
+                p = NULL;
+                break;
+            }
+            if (g_ascii_isalnum(p[1])) {
+                /* A class, an assertion or a coded character. */
+                condition_regex_end_run(run, &best);
+                p = condition_regex_skip_escape(p + 2);
+                break;
+            }
+            ++p;
+            /* Fall through: an escaped punctuation character. */
+        default: {
+            const gchar *next = g_utf8_next_char(p);
+            g_string_append_len(run, p, next - p);
+            p = next;
+            break;
+        }
+        }
+    }
+
+    if (p)
+        condition_regex_end_run(run, &best);
+    else {
+        g_free(best);
+        best = NULL;
+    }
+    g_string_free(run, TRUE);
+
+    return best;
+}
+
+/*
+ * libbalsa_condition_regex_compile()
+ *
+ * Compiles a regex for a filter (only if compiled field is NULL); a
+ * regex that failed to compile is not tried again. The matcher calls
+ * it too, and conditions may be shared between threads, so the results
+ * are stored with an atomic exchange.
  *
  * Arguments:
  *    condition_regex *cre - the condition_regex struct to compile
  * Returns : TRUE if compilation went well, FALSE else
- * Position filter_errno
  */
-#if 0
-static gboolean 
-condition_regcomp(LibBalsaConditionRegex* cre)
+gboolean
+libbalsa_condition_regex_compile(LibBalsaConditionRegex* cre)
 {
+#if USE_GREGEX
+    GRegex *compiled;
+    GError *err = NULL;
+#else                           /* USE_GREGEX */
+    regex_t *compiled;
     gint rc;
+#endif                          /* USE_GREGEX */
+    gchar *literal;
 
-    filter_errno = FILTER_NOERR;
     if (cre->compiled) return TRUE;
+    if (cre->invalid || !cre->string)
+        return FALSE;
 
-    cre->compiled = g_new(regex_t,1);
-    rc = regcomp(cre->compiled, cre->string, FILTER_REGCOMP);
+#if USE_GREGEX
+    compiled = g_regex_new(cre->string,
+                           G_REGEX_OPTIMIZE | G_REGEX_MULTILINE, 0, &err);
+    if (!compiled) {
+        g_warning("Invalid regular expression \"%s\": %s", cre->string,
+                  err->message);
+        g_error_free(err);
+        cre->invalid = TRUE;
+        return FALSE;
+    }
+#else                           /* USE_GREGEX */
+    compiled = g_new(regex_t,1);
+    rc = regcomp(compiled, cre->string, FILTER_REGCOMP);
 
     if (rc != 0) {
 	gchar errorstring[256];
-	regerror(rc, cre->compiled, errorstring, 256);
-	filter_errno = FILTER_EREGSYN;
+	regerror(rc, compiled, errorstring, 256);
+        g_warning("Invalid regular expression \"%s\": %s", cre->string,
+                  errorstring);
+        g_free(compiled);
+        cre->invalid = TRUE;
 	return FALSE;
     }
+#endif                          /* USE_GREGEX */
+
+    /* The literal goes first, so that whoever sees compiled sees it. */
+    literal = condition_regex_literal(cre->string);
+    if (literal
+        && !g_atomic_pointer_compare_and_exchange((gpointer *)
+                                                  &cre->literal,
+                                                  NULL, literal))
+        g_free(literal);
+    if (!g_atomic_pointer_compare_and_exchange((gpointer *) &cre->compiled,
+                                               NULL, compiled)) {
+#if USE_GREGEX
+        g_regex_unref(compiled);
+#else                           /* USE_GREGEX */
+        regfree(compiled);
+        g_free(compiled);
+#endif                          /* USE_GREGEX */
+    }
+
     return TRUE;
-}				/* end condition_regcomp() */
+}				/* end libbalsa_condition_regex_compile() */
+
+/*
+ * libbalsa_condition_regex_get_literal()
+ *
+ * Returns the literal that every match of the regex contains, compiling
+ * the regex if needed, or NULL if it has none or does not compile; a
+ * backend may search for it before fetching what to match.
+ */
+const gchar *
+libbalsa_condition_regex_get_literal(LibBalsaConditionRegex * reg)
+{
+    if (!libbalsa_condition_regex_compile(reg))
+        return NULL;
+
+    return reg->literal;
+}
 
 /*
  * condition_compile_regexs
  *
- * Compiles all the regexs a condition has (if of type CONDITION_REGEX)
+ * Compiles all the regexs a condition has (if of type CONDITION_REGEX,
+ * or in the operands of CONDITION_AND and CONDITION_OR), going on
+ * after one that does not compile, so that each of them is reported.
  *
  * Arguments:
  *    condition * cond - the condition to compile
- *
- * Position filter_errno (by calling condition_regcomp)
+ * Returns:
+ *    gboolean - TRUE if all of them compiled.
  */
-void
+gboolean
 libbalsa_condition_compile_regexs(LibBalsaCondition* cond)
 {
     GSList * regex;
+    gboolean ok = TRUE;
+
+    if (!cond)
+        return TRUE;
+
+    switch (cond->type) {
+    case CONDITION_REGEX:
+	for (regex = cond->match.regex.regexs; regex;
+             regex = g_slist_next(regex))
+            if (!libbalsa_condition_regex_compile
+                ((LibBalsaConditionRegex *) regex->data))
+                ok = FALSE;
+        break;
+    case CONDITION_AND:
+    case CONDITION_OR:
+        if (!libbalsa_condition_compile_regexs(cond->match.andor.left))
+            ok = FALSE;
+        if (!libbalsa_condition_compile_regexs(cond->match.andor.right))
+            ok = FALSE;
+        break;
+    default:
+        break;
+    }
 
-    if (cond->type==CONDITION_REGEX)
-	for(regex=cond->match.regexs;
-            regex && condition_regcomp((LibBalsaConditionRegex*)regex->data);
-            regex=g_slist_next(regex));
+    return ok;
 }                       /* end of condition_compile_regexs */
-#endif
 /* Filters */
 
 /*
@@ -775,17 +1116,11 @@ libbalsa_filter_prepend_condition(LibBalsaFilter* fil, LibBalsaCondition* cond,
 gboolean
 libbalsa_filter_compile_regexs(LibBalsaFilter* fil)
 {
-#if 0
-    FIXME;
     filter_errno = FILTER_NOERR;
 
-    if (fil->cond_tree.conditions) {
-	GSList * lst;
-	for (lst = fil->cond_tree.conditions;
-             lst && filter_errno == FILTER_NOERR;
-             lst = g_slist_next(lst))
-	    libbalsa_condition_compile_regexs((LibBalsaCondition*) lst->data);
-	if (filter_errno != FILTER_NOERR) {
+    if (fil->condition) {
+	if (!libbalsa_condition_compile_regexs(fil->condition)) {
+            filter_errno = FILTER_EREGSYN;
 	    gchar * errorstring =
                 g_strdup_printf("Unable to compile filter %s", fil->name);
 	    filter_perror(errorstring);
@@ -796,7 +1131,6 @@ libbalsa_filter_compile_regexs(LibBalsaFilter* fil)
 	
     }
     FILTER_SETFLAG(fil, FILTER_COMPILED);
-#endif
     return TRUE;
 }                       /* end of filter_compile_regexs */
 
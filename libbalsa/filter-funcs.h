@@ -72,7 +72,9 @@ void libbalsa_conditions_free(GSList * conditions);
 LibBalsaConditionRegex* libbalsa_condition_regex_new(void);
 void libbalsa_condition_regex_free(LibBalsaConditionRegex *, gpointer);
 void regexs_free(GSList *);
-void libbalsa_condition_compile_regexs(LibBalsaCondition* cond);
+gboolean libbalsa_condition_compile_regexs(LibBalsaCondition* cond);
+const gchar *libbalsa_condition_regex_get_literal(LibBalsaConditionRegex *
+                                                 reg);
 gboolean libbalsa_condition_compare(LibBalsaCondition *c1,
                                     LibBalsaCondition *c2);
 
@@ -52,6 +52,14 @@ struct _LibBalsaConditionRegex {
 #else                           /* USE_GREGEX */
     regex_t *compiled;
 #endif                          /* USE_GREGEX */
+    gboolean invalid;           /* compilation failed */
+    gchar *literal;             /* occurs in every match, or NULL */
 };
 
+/* Compiles the regex, unless it has been tried already; FALSE if it
+ * does not compile. */
+gboolean libbalsa_condition_regex_compile(LibBalsaConditionRegex * reg);
+/* Drops what was compiled, for a new string. */
+void libbalsa_condition_regex_clear(LibBalsaConditionRegex * reg);
+
 #endif				/* __FILTER_PRIVATE_H__ */
@@ -76,13 +76,14 @@ libbalsa_filters_set_filter_list(GSList** list)
   ---- Helper functions (also exported to have a fine-grained API) -------
 */
 /* libbalsa_condition_regex_set:
-   steals the string.
+   steals the string; the new one is compiled when it is first needed.
 */
 void
 libbalsa_condition_regex_set(LibBalsaConditionRegex * reg, gchar *str)
 {
     g_free(reg->string);
     reg->string = str;
+    libbalsa_condition_regex_clear(reg);
 }
 
 const gchar*
@@ -95,128 +96,479 @@ void
 libbalsa_condition_prepend_regex(LibBalsaCondition* cond,
                                  LibBalsaConditionRegex * new_reg)
 {
-    g_warning("%s: fixme!\n", __func__);
-#if 0
-  cond->match.regexs =
-      g_slist_prepend(cond->match.regexs, new_reg);
-#endif  
+    g_return_if_fail(cond->type == CONDITION_REGEX);
+
+    cond->match.regex.regexs =
+        g_slist_prepend(cond->match.regex.regexs, new_reg);
 }
 
-gboolean
-libbalsa_condition_matches(LibBalsaCondition* cond,
-			   LibBalsaMessage * message)
+/* Compiled conditions */
+
+typedef struct {
+    LibBalsaCondition *leaf;
+    LibBalsaUtf8Needle *needle; /* string of a CONDITION_STRING leaf */
+    guint on_match;             /* next op, or one of the results */
+    guint on_no_match;
+} LibBalsaConditionOp;
+
+#define LBC_PROGRAM_TRUE  G_MAXUINT
+#define LBC_PROGRAM_FALSE (G_MAXUINT - 1)
+
+/* A program is shared by everyone who runs it, and freed with its last
+ * reference; the one kept in a condition does not reference the
+ * condition, which would never be freed otherwise. */
+struct _LibBalsaConditionProgram {
+    gint ref_count;
+    LibBalsaCondition *condition;
+    GArray *ops;
+    guint start;
+};
+
+#ifdef BALSA_USE_THREADS
+/* Guards the program kept in each condition. */
+static pthread_mutex_t condition_program_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_CONDITION_PROGRAM() \
+    pthread_mutex_lock(&condition_program_lock)
+#define UNLOCK_CONDITION_PROGRAM() \
+    pthread_mutex_unlock(&condition_program_lock)
+#else                           /* BALSA_USE_THREADS */
+#define LOCK_CONDITION_PROGRAM()
+#define UNLOCK_CONDITION_PROGRAM()
+#endif                          /* BALSA_USE_THREADS */
+
+/* Rough cost of testing a condition; anything that needs the message
+ * body is the most expensive. */
+static guint
+lbc_cost(LibBalsaCondition * cond)
 {
-    gboolean match = FALSE;
-    gchar * str;
-    GString * body;
-    gboolean will_ref;
-
-    g_return_val_if_fail(cond, FALSE); 
-    g_return_val_if_fail(message->headers != NULL, FALSE); 
+    guint cost;
 
     switch (cond->type) {
     case CONDITION_STRING:
-        will_ref =
-            (CONDITION_CHKMATCH(cond,CONDITION_MATCH_CC) ||
-             CONDITION_CHKMATCH(cond,CONDITION_MATCH_BODY));
-        if(will_ref) {
-            gboolean is_refed =
-                libbalsa_message_body_ref(message, FALSE, FALSE);
-            if (!is_refed) {
-                libbalsa_information(LIBBALSA_INFORMATION_ERROR,
-                                     _("Unable to load message body to "
-                                       "match filter"));
-                return FALSE;  /* We don't want to match if an error occurred */
-            }
+    case CONDITION_REGEX:
+        if (CONDITION_CHKMATCH(cond, CONDITION_MATCH_BODY))
+            cost = 8;
+        else if (CONDITION_CHKMATCH(cond, (CONDITION_MATCH_TO |
+                                           CONDITION_MATCH_CC |
+                                           CONDITION_MATCH_US_HEAD)))
+            cost = 4;
+        else
+            cost = 2;
+        /* Running a regex costs a little more than a substring
+         * search on the same text. */
+        return cond->type == CONDITION_REGEX ? cost + 1 : cost;
+    case CONDITION_DATE:
+        return 1;
+    case CONDITION_AND:
+    case CONDITION_OR:
+        return lbc_cost(cond->match.andor.left)
+            + lbc_cost(cond->match.andor.right);
+    case CONDITION_FLAG:
+    case CONDITION_NONE:
+        break;
+    }
+    return 0;
+}
+
+/* Emit the ops for cond, going to on_true or on_false when its value is
+ * known; returns where to start testing it. */
+static guint
+lbc_compile(LibBalsaCondition * cond, GArray * ops, guint on_true,
+            guint on_false)
+{
+    LibBalsaConditionOp op;
+
+    if (cond->negate) {
+        guint tmp = on_true;
+        on_true = on_false;
+        on_false = tmp;
+    }
+
+    switch (cond->type) {
+    case CONDITION_AND:
+    case CONDITION_OR: {
+        LibBalsaCondition *first = cond->match.andor.left;
+        LibBalsaCondition *second = cond->match.andor.right;
+        guint second_start;
+
+        if (lbc_cost(second) < lbc_cost(first)) {
+            first = cond->match.andor.right;
+            second = cond->match.andor.left;
         }
-        /* do the work */
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_TO)
-            && message->headers->to_list) {
-            str =
-                internet_address_list_to_string(message->headers->to_list,
-                                                FALSE);
-	    match=libbalsa_utf8_strstr(str,cond->match.string.string);
-	    g_free(str);
-            if(match) break;
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_FROM)
-            && message->headers->from) {
-            str =
-                internet_address_list_to_string(message->headers->from,
-                                                FALSE);
-	    match=libbalsa_utf8_strstr(str,cond->match.string.string);
-	    g_free(str);
-	    if (match) break;
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_SUBJECT)) {
-	    if (libbalsa_utf8_strstr(LIBBALSA_MESSAGE_GET_SUBJECT(message),
-                                     cond->match.string.string)) { 
-                match = TRUE;
-                break;
-            }
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_CC)
-            && message->headers->cc_list) {
-            str =
-                internet_address_list_to_string(message->headers->cc_list,
-                                                FALSE);
-	    match=libbalsa_utf8_strstr(str,cond->match.string.string);
-	    g_free(str);
-	    if (match) break;
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_US_HEAD)) {
-            if (cond->match.string.user_header) {
-                const gchar *header =
-                    libbalsa_message_get_user_header(message,
-                                                     cond->match.string.
-                                                     user_header);
-
-                if (libbalsa_utf8_strstr(header,
-                                         cond->match.string.string)) {
-                    match = TRUE;
-                    break;
-                }
-            }
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_BODY)) {
-	    if (!message->mailbox)
-		return FALSE; /* We don't want to match if an error occurred */
-            body =
-                content2reply(message->body_list, NULL, 0, FALSE, FALSE);
-	    if (body) {
-		if (body->str)
-                    match = libbalsa_utf8_strstr(body->str,
-                                                 cond->match.string.string);
-		g_string_free(body,TRUE);
-	    }
-	}
-        if(will_ref) libbalsa_message_body_unref(message);
-	break;
+        second_start = lbc_compile(second, ops, on_true, on_false);
+
+        return cond->type == CONDITION_AND ?
+            lbc_compile(first, ops, second_start, on_false) :
+            lbc_compile(first, ops, on_true, second_start);
+    }
     case CONDITION_REGEX:
+        /* Compile once here rather than for each message; a regex
+         * that does not compile never matches. */
+        libbalsa_condition_compile_regexs(cond);
         break;
+    case CONDITION_NONE:
+        /* Never matches. */
+        return on_false;
+    case CONDITION_STRING:
     case CONDITION_DATE:
-        match = message->headers->date>=cond->match.date.date_low 
-	       && (cond->match.date.date_high==0 || 
-                   message->headers->date<=cond->match.date.date_high);
-        break;
     case CONDITION_FLAG:
-        match = LIBBALSA_MESSAGE_HAS_FLAG(message, cond->match.flags);
         break;
-    case CONDITION_AND:
-        match =
-	    libbalsa_condition_matches(cond->match.andor.left, message) &&
-	    libbalsa_condition_matches(cond->match.andor.right, message);
+    }
+
+    op.leaf = cond;
+    op.needle = cond->type == CONDITION_STRING
+        && cond->match.string.string ?
+        libbalsa_utf8_needle_new(cond->match.string.string) : NULL;
+    op.on_match = on_true;
+    op.on_no_match = on_false;
+    g_array_append_val(ops, op);
+
+    return ops->len - 1;
+}
+
+static LibBalsaConditionProgram *
+lbc_program_new(LibBalsaCondition * cond)
+{
+    LibBalsaConditionProgram *program;
+
+    program = g_new(LibBalsaConditionProgram, 1);
+    program->ref_count = 1;
+    program->condition = NULL;
+    program->ops = g_array_new(FALSE, FALSE, sizeof(LibBalsaConditionOp));
+    program->start = lbc_compile(cond, program->ops, LBC_PROGRAM_TRUE,
+                                 LBC_PROGRAM_FALSE);
+
+    return program;
+}
+
+LibBalsaConditionProgram *
+libbalsa_condition_compile(LibBalsaCondition * cond)
+{
+    LibBalsaConditionProgram *program;
+
+    g_return_val_if_fail(cond != NULL, NULL);
+
+    program = lbc_program_new(cond);
+    program->condition = cond;
+    libbalsa_condition_ref(cond);
+
+    return program;
+}
+
+void
+libbalsa_condition_program_free(LibBalsaConditionProgram * program)
+{
+    guint i;
+
+    if (!program || !g_atomic_int_dec_and_test(&program->ref_count))
+        return;
+
+    for (i = 0; i < program->ops->len; i++)
+        libbalsa_utf8_needle_free(g_array_index(program->ops,
+                                                LibBalsaConditionOp,
+                                                i).needle);
+    g_array_free(program->ops, TRUE);
+    libbalsa_condition_unref(program->condition);
+    g_free(program);
+}
+
+void
+libbalsa_condition_reset_program(LibBalsaCondition * cond)
+{
+    LibBalsaConditionProgram *program;
+
+    LOCK_CONDITION_PROGRAM();
+    program = cond->program;
+    cond->program = NULL;
+    UNLOCK_CONDITION_PROGRAM();
+
+    libbalsa_condition_program_free(program);
+}
+
+/* Whether the len bytes at text contain the needle; memchr finds the
+ * candidates for its first byte. */
+static gboolean
+lbc_memmem(const gchar * text, gsize len, const gchar * needle,
+           gsize needle_len)
+{
+    const gchar *end = text + len;
+    const gchar *p;
+
+    if (needle_len == 0)
+        return TRUE;
+
+    for (p = text; (gsize) (end - p) >= needle_len
+         && (p = memchr(p, needle[0], end - p - needle_len + 1)); ++p)
+        if (memcmp(p, needle, needle_len) == 0)
+            return TRUE;
+
+    return FALSE;
+}
+
+static gboolean
+lbc_regex_match(LibBalsaConditionRegex * reg, const gchar * text,
+                gsize len)
+{
+    /* The string may have been set after the program was compiled. */
+    if (!reg->compiled && !libbalsa_condition_regex_compile(reg))
+        return FALSE;
+    /* Most texts do not contain the literal part of the pattern, and
+     * scanning for it is much cheaper than the regex engine. */
+    if (reg->literal
+        && !lbc_memmem(text, len, reg->literal, strlen(reg->literal)))
+        return FALSE;
+#if USE_GREGEX
+    return g_regex_match_full(reg->compiled, text, len, 0, 0, NULL, NULL);
+#else                           /* USE_GREGEX */
+    return regexec(reg->compiled, text, 0, NULL, FILTER_REGEXEC) == 0;
+#endif                          /* USE_GREGEX */
+}
+
+/* Whether the text matches a CONDITION_STRING leaf (a case-insensitive
+ * substring) or a CONDITION_REGEX leaf (any of its regexs); NULL text
+ * never matches.  len is the length of text, or -1 if it is not
+ * known. */
+static gboolean
+lbc_match_text(const LibBalsaConditionOp * op, const gchar * text,
+               gssize len)
+{
+    GSList *l;
+
+    if (!text)
+        return FALSE;
+
+    switch (op->leaf->type) {
+    case CONDITION_STRING:
+        return op->needle ? libbalsa_utf8_needle_find(op->needle, text) :
+            libbalsa_utf8_strstr(text, op->leaf->match.string.string);
+    case CONDITION_REGEX:
+        if (len < 0)
+            len = strlen(text);
+        for (l = op->leaf->match.regex.regexs; l; l = l->next)
+            if (lbc_regex_match((LibBalsaConditionRegex *) l->data, text,
+                                len))
+                return TRUE;
         break;
-    case CONDITION_OR:
-        match =
-	    libbalsa_condition_matches(cond->match.andor.left, message) ||
-	    libbalsa_condition_matches(cond->match.andor.right, message);
+    default:
         break;
+    }
+
+    return FALSE;
+}
+
+/* Matching a leaf: the stringified address lists and the body text are
+ * made at most once per message. */
+static LibBalsaMessage *
+lbc_match_get_message(LibBalsaConditionMatchData * md, gboolean need_body)
+{
+    if (!md->message) {
+        if (!md->mailbox
+            || !(md->message =
+                 libbalsa_mailbox_get_message(md->mailbox, md->msgno)))
+            return NULL;
+        md->own_message = TRUE;
+    }
+
+    if (need_body && !md->is_refed) {
+        if (md->ref_failed)
+            return NULL;
+        md->is_refed = libbalsa_message_body_ref(md->message, FALSE, FALSE);
+        if (!md->is_refed) {
+            libbalsa_information(LIBBALSA_INFORMATION_ERROR,
+                                 _("Unable to load message body to "
+                                   "match filter"));
+            md->ref_failed = TRUE;
+            return NULL;
+        }
+    }
+
+    return md->message;
+}
+
+static const gchar *
+lbc_match_address_list(LibBalsaConditionMatchData * md, unsigned field,
+                       InternetAddressList * list, gchar ** str)
+{
+    if (!(md->have & field)) {
+        md->have |= field;
+        if (list)
+            *str = internet_address_list_to_string(list, FALSE);
+    }
+
+    return *str;
+}
+
+/* Returns 1 on a match, 0 on a mismatch, and -1 if the message could
+ * not be loaded. */
+static gint
+lbc_match_leaf(const LibBalsaConditionOp * op,
+               LibBalsaConditionMatchData * md)
+{
+    LibBalsaCondition *cond = op->leaf;
+    LibBalsaMessage *message;
+    const gchar *str;
+    time_t date;
+
+    switch (cond->type) {
+    case CONDITION_STRING:
+    case CONDITION_REGEX:
+        /* The fields that are already at hand come first. */
+	if (CONDITION_CHKMATCH(cond, CONDITION_MATCH_SUBJECT)) {
+            if (md->mailbox)
+                str = md->subject;
+            else if ((message = lbc_match_get_message(md, FALSE)))
+                str = LIBBALSA_MESSAGE_GET_SUBJECT(message);
+            else
+                return -1;
+            if (lbc_match_text(op, str, -1))
+                return 1;
+        }
+	if (CONDITION_CHKMATCH(cond, CONDITION_MATCH_FROM)) {
+            if (md->mailbox)
+                str = md->sender;
+            else if ((message = lbc_match_get_message(md, FALSE)))
+                str = lbc_match_address_list(md, CONDITION_MATCH_FROM,
+                                             message->headers->from,
+                                             &md->from);
+            else
+                return -1;
+            if (lbc_match_text(op, str, -1))
+                return 1;
+        }
+	if (CONDITION_CHKMATCH(cond, CONDITION_MATCH_TO)) {
+            /* A message that is fetched from the mailbox has all its
+             * headers only once its body is loaded. */
+            if (!(message = lbc_match_get_message(md, md->mailbox != NULL)))
+                return -1;
+            str = lbc_match_address_list(md, CONDITION_MATCH_TO,
+                                         message->headers->to_list,
+                                         &md->to);
+            if (lbc_match_text(op, str, -1))
+                return 1;
+        }
+	if (cond->type == CONDITION_STRING
+            && CONDITION_CHKMATCH(cond, CONDITION_MATCH_US_HEAD)
+            && cond->match.string.user_header) {
+            if (!(message = lbc_match_get_message(md, FALSE)))
+                return -1;
+            str = libbalsa_message_get_user_header(message,
+                                                   cond->match.string.
+                                                   user_header);
+            if (lbc_match_text(op, str, -1))
+                return 1;
+        }
+	if (CONDITION_CHKMATCH(cond, CONDITION_MATCH_CC)) {
+            if (!(message = lbc_match_get_message(md, TRUE)))
+                return -1;
+            str = lbc_match_address_list(md, CONDITION_MATCH_CC,
+                                         message->headers->cc_list,
+                                         &md->cc);
+            if (lbc_match_text(op, str, -1))
+                return 1;
+        }
+	if (CONDITION_CHKMATCH(cond, CONDITION_MATCH_BODY)) {
+            if (!(message = lbc_match_get_message(md, TRUE))
+                || !message->mailbox)
+		return -1;
+            if (!(md->have & CONDITION_MATCH_BODY)) {
+                md->have |= CONDITION_MATCH_BODY;
+                md->body = content2reply(message->body_list, NULL, 0,
+                                         FALSE, FALSE);
+            }
+	    if (md->body
+                && lbc_match_text(op, md->body->str, md->body->len))
+                return 1;
+	}
+	return 0;
+    case CONDITION_DATE:
+        if (md->mailbox)
+            date = libbalsa_mailbox_index_get_date(md->mailbox, md->msgno);
+        else
+            date = md->message->headers->date;
+        return date >= cond->match.date.date_low
+	    && (cond->match.date.date_high == 0 ||
+                date <= cond->match.date.date_high);
+    case CONDITION_FLAG:
+        return md->mailbox ?
+            libbalsa_mailbox_msgno_has_flags(md->mailbox, md->msgno,
+                                             cond->match.flags, 0) :
+            LIBBALSA_MESSAGE_HAS_FLAG(md->message, cond->match.flags) != 0;
+    case CONDITION_AND:
+    case CONDITION_OR:
     case CONDITION_NONE:
+        /* Not leaves of a program. */
         break;
     }
-    /* To avoid warnings */
-    return cond->negate ? !match : match;
+
+    return 0;
+}
+
+gboolean
+libbalsa_condition_program_run(LibBalsaConditionProgram * program,
+                               LibBalsaConditionMatchData * md)
+{
+    guint pc = program->start;
+
+    while (pc < program->ops->len) {
+        LibBalsaConditionOp *op =
+            &g_array_index(program->ops, LibBalsaConditionOp, pc);
+        gint match = lbc_match_leaf(op, md);
+
+        if (match < 0)
+            /* We don't want to match if an error occurred: the leaf is
+             * false, whatever its negate flag says. */
+            pc = op->leaf->negate ? op->on_match : op->on_no_match;
+        else
+            pc = match ? op->on_match : op->on_no_match;
+    }
+
+    return pc == LBC_PROGRAM_TRUE;
+}
+
+void
+libbalsa_condition_match_data_clear(LibBalsaConditionMatchData * md)
+{
+    g_free(md->from);
+    g_free(md->to);
+    g_free(md->cc);
+    if (md->body)
+        g_string_free(md->body, TRUE);
+    if (md->message) {
+        if (md->is_refed)
+            libbalsa_message_body_unref(md->message);
+        if (md->own_message)
+            g_object_unref(md->message);
+    }
+}
+
+gboolean
+libbalsa_condition_matches(LibBalsaCondition* cond,
+			   LibBalsaMessage * message)
+{
+    LibBalsaConditionProgram *program;
+    LibBalsaConditionMatchData md = { NULL };
+    gboolean match;
+
+    g_return_val_if_fail(cond, FALSE); 
+    g_return_val_if_fail(message->headers != NULL, FALSE); 
+
+    /* The program is kept in the condition, which is matched against
+     * many messages, and is referenced while it runs, so that another
+     * thread may reset it meanwhile. */
+    LOCK_CONDITION_PROGRAM();
+    if (!cond->program)
+        cond->program = lbc_program_new(cond);
+    program = cond->program;
+    g_atomic_int_inc(&program->ref_count);
+    UNLOCK_CONDITION_PROGRAM();
+
+    md.message = message;
+    match = libbalsa_condition_program_run(program, &md);
+    libbalsa_condition_match_data_clear(&md);
+
+    libbalsa_condition_program_free(program);
+
+    return match;
 }
 
 /*--------- Filtering functions -------------------------------*/
@@ -378,6 +730,9 @@ libbalsa_condition_can_match(LibBalsaCondition * cond,
 		 && message->body_list == NULL)
 	    && !(CONDITION_CHKMATCH(cond, CONDITION_MATCH_US_HEAD)
 		 && message->mime_msg == NULL);
+    case CONDITION_REGEX:
+	return !(CONDITION_CHKMATCH(cond, CONDITION_MATCH_BODY)
+		 && message->body_list == NULL);
     case CONDITION_AND:
     case CONDITION_OR:
 	return libbalsa_condition_can_match(cond->match.andor.left,
@@ -389,6 +744,23 @@ libbalsa_condition_can_match(LibBalsaCondition * cond,
     }
 }
 
+/* Check whether a condition contains a CONDITION_REGEX leaf; servers
+ * cannot search for those, so backends must match them locally. */
+gboolean
+libbalsa_condition_has_regex(LibBalsaCondition * cond)
+{
+    switch (cond->type) {
+    case CONDITION_REGEX:
+        return TRUE;
+    case CONDITION_AND:
+    case CONDITION_OR:
+        return libbalsa_condition_has_regex(cond->match.andor.left)
+            || libbalsa_condition_has_regex(cond->match.andor.right);
+    default:
+        return FALSE;
+    }
+}
+
 /* Check whether a condition looks only at flags; if it does, test
  * whether the given message's flags match it, and return the result in
  * *match; used by mailbox backends to decide when the full
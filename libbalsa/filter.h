@@ -68,6 +68,11 @@ struct _LibBalsaCondition {
     gint ref_count;
     gboolean negate; /* negate the result of the condition. */
     ConditionMatchType type;
+    struct _LibBalsaConditionProgram * program;
+                     /* compiled by libbalsa_condition_matches() when
+                      * first needed; reset it with
+                      * libbalsa_condition_reset_program() when the
+                      * condition changes. */
 
     /* The match type fields */
     union _match {
@@ -86,7 +91,8 @@ struct _LibBalsaCondition {
         struct {
             unsigned fields;     /* Contains the header list for
                                   * that this search should look in. */
-            /* GSList * regexs; */
+            GSList * regexs;     /* LibBalsaConditionRegex; the condition
+                                  * matches if any of them does. */
         } regex;
         /* CONDITION_DATE */
 	struct {
@@ -114,6 +120,9 @@ LibBalsaCondition* libbalsa_condition_new_string(gboolean negated,
                                                  unsigned headers,
                                                  gchar *str,
                                                  gchar *user_header);
+LibBalsaCondition* libbalsa_condition_new_regex(gboolean negated,
+                                                unsigned headers,
+                                                gchar *regex);
 LibBalsaCondition* libbalsa_condition_new_date(gboolean negated,
                                                time_t *from, time_t *to);
 LibBalsaCondition* libbalsa_condition_new_bool_ptr(gboolean negated,
@@ -219,6 +228,46 @@ void libbalsa_condition_prepend_regex(LibBalsaCondition* cond,
 gboolean libbalsa_condition_matches(LibBalsaCondition* cond,
                                     LibBalsaMessage* message);
 
+/* Compiled conditions: the tree is flattened into a list of leaf tests,
+ * each of which says where to go on a match and on a mismatch, with the
+ * cheapest operand of each AND and OR tested first.  A leaf that needs
+ * a message that cannot be loaded is false, whatever its negate flag
+ * says. */
+typedef struct _LibBalsaConditionProgram LibBalsaConditionProgram;
+
+/* What the leaves are matched against: the message, or, if mailbox is
+ * set, the message with msgno in it, with the subject and sender that
+ * its index has; the message is then fetched only when a leaf needs
+ * it.  Clear it with libbalsa_condition_match_data_clear(), which
+ * unrefs a message that it fetched. */
+typedef struct {
+    LibBalsaMessage *message;
+    LibBalsaMailbox *mailbox;
+    guint msgno;
+    const gchar *subject;
+    const gchar *sender;
+    /* Made while matching. */
+    gboolean own_message;
+    gboolean is_refed;
+    gboolean ref_failed;
+    guint have;                 /* CONDITION_MATCH_* fields extracted */
+    gchar *from;
+    gchar *to;
+    gchar *cc;
+    GString *body;
+} LibBalsaConditionMatchData;
+
+LibBalsaConditionProgram *libbalsa_condition_compile(LibBalsaCondition *
+                                                     cond);
+gboolean libbalsa_condition_program_run(LibBalsaConditionProgram *
+                                        program,
+                                        LibBalsaConditionMatchData * md);
+void libbalsa_condition_program_free(LibBalsaConditionProgram * program);
+void libbalsa_condition_match_data_clear(LibBalsaConditionMatchData * md);
+/* Drops the program that libbalsa_condition_matches() keeps in the
+ * condition; a match that is running keeps its own reference. */
+void libbalsa_condition_reset_program(LibBalsaCondition * cond);
+
 /* Filtering functions */
 /* FIXME : perhaps I should try to use multithreading -> but we must
    therefore use lock very well */
@@ -279,6 +328,7 @@ void filter_perror(const gchar * s);
 /* Test */
 gboolean libbalsa_condition_can_match(LibBalsaCondition * cond,
 				      LibBalsaMessage * message);
+gboolean libbalsa_condition_has_regex(LibBalsaCondition * cond);
 gboolean libbalsa_condition_is_flag_only(LibBalsaCondition * cond,
                                          LibBalsaMailbox * mailbox,
                                          guint msgno, gboolean * match);
@@ -37,6 +37,7 @@
 
 #include "libbalsa.h"
 #include "libbalsa-conf.h"
+#include "libbalsa_private.h"
 #include "server.h"
 
 #include "imap-handle.h"
@@ -72,6 +73,7 @@ struct LibBalsaImapServer_ {
                                     $HOME and preserved between
                                     sessions. If FALSE, messages will be
                                     kept in /tmp and cleaned on exit. */
+    guint cache_size; /* body cache quota in kB, 0: use the default */
     unsigned has_fetch_bug:1;
     unsigned use_status:1; /**< server has fast STATUS command */
     unsigned use_idle:1;  /**< IDLE will work: no dummy firewall on the way */
@@ -506,7 +508,7 @@ libbalsa_imap_server_new_from_config(void)
     LibBalsaImapServer *imap_server;
     LibBalsaServer *server;
     gboolean d, d1;
-    gint tls_mode, conn_limit;
+    gint tls_mode, conn_limit, cache_size;
 
     tmp_server.host = libbalsa_conf_get_string("Server");
     if(strrchr(tmp_server.host, ':') == NULL) {
@@ -540,6 +542,8 @@ libbalsa_imap_server_new_from_config(void)
     if(!d) imap_server->max_connections = conn_limit;
     d1 = libbalsa_conf_get_bool_with_default("PersistentCache", &d);
     if(!d) imap_server->persistent_cache = !!d1;
+    cache_size = libbalsa_conf_get_int_with_default("CacheSize", &d);
+    if(!d && cache_size >= 0) imap_server->cache_size = cache_size;
     d1 = libbalsa_conf_get_bool_with_default("HasFetchBug", &d);
     if(!d) imap_server->has_fetch_bug = !!d1;
     d1 = libbalsa_conf_get_bool_with_default("UseStatus", &d);
@@ -603,6 +607,7 @@ libbalsa_imap_server_save_config(LibBalsaImapServer *server)
     libbalsa_server_save_config(LIBBALSA_SERVER(server));
     libbalsa_conf_set_int("ConnectionLimit", server->max_connections);
     libbalsa_conf_set_bool("PersistentCache", server->persistent_cache);
+    libbalsa_conf_set_int("CacheSize", server->cache_size);
     libbalsa_conf_set_bool("HasFetchBug", server->has_fetch_bug);
     libbalsa_conf_set_bool("UseStatus",   server->use_status);
     libbalsa_conf_set_bool("UseIdle",     server->use_idle);
@@ -873,6 +878,27 @@ libbalsa_imap_server_has_persistent_cache(LibBalsaImapServer *srv)
     return srv->persistent_cache;
 }
 
+/**
+ * libbalsa_imap_server_set_cache_size:
+ * @server: A #LibBalsaImapServer
+ * @cache_size: quota of the message body cache in bytes, 0 for the
+ * global default
+ *
+ * Sets the size to which the body cache of the server is trimmed.
+ **/
+void
+libbalsa_imap_server_set_cache_size(LibBalsaImapServer *server,
+                                    off_t cache_size)
+{
+    server->cache_size = cache_size > 0 ? (cache_size + 1023) / 1024 : 0;
+}
+
+off_t
+libbalsa_imap_server_get_cache_size(LibBalsaImapServer *server)
+{
+    return (off_t) server->cache_size * 1024;
+}
+
 /**
  * libbalsa_imap_server_force_disconnect:
  * @server: A #LibBalsaImapServer
@@ -992,6 +1018,113 @@ libbalsa_imap_server_get_use_status(LibBalsaImapServer *server)
     return server->use_status;
 }
 
+/* Per-path state of libbalsa_imap_server_check_mailboxes(). */
+struct lbis_check_info {
+    GSList *mailboxes;
+    gboolean reported;
+    unsigned unseen;
+};
+
+static void
+lbis_status_cb(ImapMboxHandle *h, const char *mbox,
+               const struct ImapStatusResult *res, void *arg)
+{
+    struct lbis_check_info *info = g_hash_table_lookup(arg, mbox);
+    unsigned i;
+
+    if (!info)
+        return; /* LIST pattern matching a mailbox we do not know */
+    info->reported = TRUE;
+    for (i = 0; res[i].item != IMSTAT_NONE; i++)
+        if (res[i].item == IMSTAT_UNSEEN)
+            info->unseen = res[i].result;
+}
+
+static void
+lbis_check_info_free(struct lbis_check_info *info)
+{
+    g_slist_free(info->mailboxes);
+    g_free(info);
+}
+
+/**
+ * libbalsa_imap_server_check_mailboxes:
+ * @server: A #LibBalsaImapServer
+ * @mailboxes: list of closed #LibBalsaMailboxImap on @server
+ *
+ * Checks all the mailboxes for unread messages with a single LIST
+ * ... RETURN (STATUS) command (RFC 5819) or, when the server cannot
+ * do it, with pipelined STATUS commands, and updates their unread
+ * flags.
+ *
+ * Returns: FALSE if the mailboxes have not been checked and need to
+ * be checked one by one.
+ **/
+gboolean
+libbalsa_imap_server_check_mailboxes(LibBalsaImapServer *server,
+                                     GSList *mailboxes)
+{
+    ImapMboxHandle *handle;
+    GHashTable *infos;
+    GPtrArray *paths;
+    GSList *l;
+    ImapResponse rc;
+
+    handle = libbalsa_imap_server_get_handle(server, NULL);
+    if (!handle)
+        return FALSE;
+    if (!server->use_status &&
+        !imap_mbox_handle_can_do(handle, IMCAP_LIST_STATUS)) {
+        /* STATUS is slow here; leave it to the \Marked check. */
+        libbalsa_imap_server_release_handle(server, handle);
+        return FALSE;
+    }
+
+    infos = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                  (GDestroyNotify) lbis_check_info_free);
+    paths = g_ptr_array_new();
+    for (l = mailboxes; l; l = l->next) {
+        const gchar *path =
+            libbalsa_mailbox_imap_get_path(LIBBALSA_MAILBOX_IMAP(l->data));
+        struct lbis_check_info *info;
+
+        if (!path)
+            path = "INBOX";
+        if (!(info = g_hash_table_lookup(infos, path))) {
+            info = g_new0(struct lbis_check_info, 1);
+            g_hash_table_insert(infos, (gpointer) path, info);
+            g_ptr_array_add(paths, (gpointer) path);
+        }
+        info->mailboxes = g_slist_prepend(info->mailboxes, l->data);
+    }
+
+    rc = imap_mbox_status_bulk(handle, paths->len,
+                               (const char **) paths->pdata,
+                               lbis_status_cb, infos);
+    libbalsa_imap_server_release_handle(server, handle);
+
+    if (rc == IMR_OK) {
+        /* Mailboxes without a response do not exist or cannot be
+         * selected: as lbm_imap_check(), report no unread messages. */
+        guint i;
+        for (i = 0; i < paths->len; i++) {
+            struct lbis_check_info *info =
+                g_hash_table_lookup(infos, paths->pdata[i]);
+            for (l = info->mailboxes; l; l = l->next) {
+                LibBalsaMailbox *mailbox = l->data;
+                libbalsa_lock_mailbox(mailbox);
+                libbalsa_mailbox_set_unread_messages_flag
+                    (mailbox, info->reported && info->unseen > 0);
+                libbalsa_unlock_mailbox(mailbox);
+            }
+        }
+    }
+    g_ptr_array_free(paths, TRUE);
+    g_hash_table_destroy(infos);
+
+    return rc == IMR_OK;
+}
+
 void
 libbalsa_imap_server_set_use_idle(LibBalsaImapServer *server, 
                                   gboolean use_idle)
@@ -20,6 +20,7 @@
 #ifndef __IMAP_SERVER_H__
 #define __IMAP_SERVER_H__
 
+#include <sys/types.h>
 #include <glib-object.h>
 
 #define LIBBALSA_TYPE_IMAP_SERVER \
@@ -55,6 +56,9 @@ int  libbalsa_imap_server_get_max_connections(LibBalsaImapServer *server);
 void libbalsa_imap_server_enable_persistent_cache(LibBalsaImapServer *server,
                                                   gboolean enable);
 gboolean libbalsa_imap_server_has_persistent_cache(LibBalsaImapServer *srv);
+void libbalsa_imap_server_set_cache_size(LibBalsaImapServer *server,
+                                         off_t cache_size);
+off_t libbalsa_imap_server_get_cache_size(LibBalsaImapServer *server);
 void libbalsa_imap_server_force_disconnect(LibBalsaImapServer *server);
 void libbalsa_imap_server_close_all_connections(void);
 gboolean libbalsa_imap_server_has_free_handles(LibBalsaImapServer *server);
@@ -75,6 +79,8 @@ gboolean libbalsa_imap_server_has_bug(LibBalsaImapServer *server,
 void libbalsa_imap_server_set_use_status(LibBalsaImapServer *server,
                                          gboolean use_status);
 gboolean libbalsa_imap_server_get_use_status(LibBalsaImapServer *server);
+gboolean libbalsa_imap_server_check_mailboxes(LibBalsaImapServer *server,
+                                              GSList *mailboxes);
 
 void libbalsa_imap_server_set_use_idle(LibBalsaImapServer *server,
                                        gboolean use_idle);
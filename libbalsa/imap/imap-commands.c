@@ -44,7 +44,7 @@ need_fetch(unsigned seqno, struct fetch_data* fd)
   ImapFetchType available_headers;
 
   g_return_val_if_fail(seqno>=1 && seqno<=fd->h->exists, 0);
-  if(fd->h->msg_cache[seqno-1] == NULL) {
+  if(imap_msg_cache_get(fd->h, seqno) == NULL) {
     /* We know nothing of that message, we need to fetch at least UID
      * and FLAGS if we are supposed to create ImapMessage structure
      * later. */
@@ -184,7 +184,8 @@ imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
 {
   gchar *mbx7;
   ImapResponse rc;
-  char* cmds[3];
+  char* cmds[4];
+  unsigned n = 0, select_cmd;
 
   IMAP_REQUIRED_STATE3_U(handle, IMHS_CONNECTED, IMHS_AUTHENTICATED,
                          IMHS_SELECTED, IMR_BAD);
@@ -198,16 +199,25 @@ imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
   mbox_view_dispose(&handle->mbox_view);
   handle->unseen = 0;
   handle->has_rights = 0;
+  handle->highestmodseq = 0;
 
   mbx7 = imap_utf8_to_mailbox(mbox);
 
-  cmds[0] = g_strdup_printf("SELECT \"%s\"", mbx7);
-  if (imap_mbox_handle_can_do(handle, IMCAP_ACL)) {
-    cmds[1] = g_strdup_printf("MYRIGHTS \"%s\"", mbx7);
-    cmds[2] = NULL;
-  } else {
-    cmds[1] = NULL;
-  }
+  /* RFC 7162: QRESYNC has to be enabled once per connection; with
+     plain CONDSTORE, the SELECT parameter enables it and makes the
+     server report HIGHESTMODSEQ. */
+  if (imap_mbox_handle_can_do(handle, IMCAP_QRESYNC) &&
+      !handle->qresync_enabled && handle->state == IMHS_AUTHENTICATED)
+    cmds[n++] = g_strdup("ENABLE QRESYNC");
+  select_cmd = n;
+  if (!imap_mbox_handle_can_do(handle, IMCAP_QRESYNC) &&
+      imap_mbox_handle_can_do(handle, IMCAP_CONDSTORE))
+    cmds[n++] = g_strdup_printf("SELECT \"%s\" (CONDSTORE)", mbx7);
+  else
+    cmds[n++] = g_strdup_printf("SELECT \"%s\"", mbx7);
+  if (imap_mbox_handle_can_do(handle, IMCAP_ACL))
+    cmds[n++] = g_strdup_printf("MYRIGHTS \"%s\"", mbx7);
+  cmds[n] = NULL;
   g_free(mbx7);
 
   if(handle->mbox != mbox) { /* we do not "reselect" */
@@ -215,10 +225,10 @@ imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
     handle->mbox = g_strdup(mbox);
   }
 
-  rc= imap_cmd_exec_cmds(handle, (const char**)&cmds[0], 0);
+  rc= imap_cmd_exec_cmds(handle, (const char**)&cmds[0], select_cmd);
 
-  g_free(cmds[0]);
-  g_free(cmds[1]);
+  while(n>0)
+    g_free(cmds[--n]);
 
   if(rc == IMR_OK) {
     handle->state = IMHS_SELECTED;
@@ -433,6 +443,64 @@ imap_mbox_status(ImapMboxHandle *r, const char*what,
   }
   return rc; 
 }
+
+/** maximum number of mailbox patterns in one LIST command. */
+#define IMAP_LIST_STATUS_CHUNK 100
+
+/** imap_mbox_status_bulk() polls the number of messages, unseen
+    messages and the next UID of cnt mailboxes. cb is called for
+    each STATUS response with the items the server returned; there
+    may be responses for mailboxes that were not asked about.  Uses
+    a single LIST ... RETURN (STATUS ...) command (RFC 5819) per
+    IMAP_LIST_STATUS_CHUNK mailboxes if the server can do it, and
+    pipelined STATUS commands otherwise. Mailboxes that do not exist
+    or cannot be selected get no response. */
+ImapResponse
+imap_mbox_status_bulk(ImapMboxHandle *h, unsigned cnt, const char **mboxes,
+                      ImapStatusCb cb, void *arg)
+{
+  static const char items[] = "MESSAGES UNSEEN UIDNEXT";
+  ImapResponse rc = IMR_OK;
+  unsigned i;
+
+  HANDLE_LOCK(h);
+  IMAP_REQUIRED_STATE2(h, IMHS_AUTHENTICATED, IMHS_SELECTED, IMR_BAD);
+  h->status_cb  = cb;
+  h->status_arg = arg;
+  if(imap_mbox_handle_can_do(h, IMCAP_LIST_STATUS)) {
+    for(i=0; i<cnt && rc == IMR_OK; i += IMAP_LIST_STATUS_CHUNK) {
+      GString *cmd = g_string_new("LIST \"\" (");
+      unsigned j;
+      for(j=i; j<cnt && j<i+IMAP_LIST_STATUS_CHUNK; j++) {
+        gchar *mbx7 = imap_utf8_to_mailbox(mboxes[j]);
+        g_string_append_printf(cmd, j>i ? " \"%s\"" : "\"%s\"", mbx7);
+        g_free(mbx7);
+      }
+      g_string_append_printf(cmd, ") RETURN (STATUS (%s))", items);
+      rc = imap_cmd_exec(h, cmd->str);
+      g_string_free(cmd, TRUE);
+    }
+  } else {
+    ImapPipeline *pipeline = imap_pipeline_new(h);
+    for(i=0; i<cnt; i++) {
+      gchar *mbx7 = imap_utf8_to_mailbox(mboxes[i]);
+      gchar *cmd = g_strdup_printf("STATUS \"%s\" (%s)", mbx7, items);
+      imap_pipeline_add(pipeline, cmd, IMPIPE_NONE, NULL, NULL);
+      g_free(cmd);
+      g_free(mbx7);
+    }
+    rc = imap_pipeline_run(pipeline);
+    /* A STATUS failing for one mailbox is not an error of the poll. */
+    if(rc == IMR_NO || rc == IMR_BAD)
+      rc = IMR_OK;
+  }
+  h->status_cb  = NULL;
+  h->status_arg = NULL;
+  HANDLE_UNLOCK(h);
+
+  return rc;
+}
+
 /* 6.3.11 APPEND Command */
 static gchar*
 enum_flag_to_str(ImapMsgFlags flg)
@@ -1122,6 +1190,88 @@ imap_mbox_handle_fetch_set(ImapMboxHandle* handle,
   return rc;
 }
 
+/* imap_mbox_handle_fetch_set_pipelined is imap_mbox_handle_fetch_set
+   for large sets: set is split into slices of at most chunk entries,
+   and the FETCH commands for all the slices are sent before the first
+   response is read, so that they cost one round trip between them
+   instead of one each. */
+ImapResponse
+imap_mbox_handle_fetch_set_pipelined(ImapMboxHandle* handle,
+                                     unsigned *set, unsigned cnt,
+                                     ImapFetchType ift, unsigned chunk)
+{
+  ImapCoalesceFunc cf;
+  unsigned i, n_slices, issued = 0;
+  unsigned *cmdnos;
+  gchar **seqs;
+  ImapFetchType *fetch_types;
+  ImapResponse rc = IMR_OK;
+
+  if(chunk == 0 || cnt <= chunk)
+    return imap_mbox_handle_fetch_set(handle, set, cnt, ift);
+
+  HANDLE_LOCK(handle);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+
+  cf = (ImapCoalesceFunc)(mbox_view_is_active(&handle->mbox_view)
+			  ? need_fetch_view_set : need_fetch_set);
+  n_slices = (cnt + chunk - 1)/chunk;
+  cmdnos = g_new(unsigned, n_slices);
+  seqs = g_new0(gchar*, n_slices);
+  fetch_types = g_new(ImapFetchType, n_slices);
+
+  for(i=0; i<n_slices; i++) {
+    struct fetch_data_set fd;
+    const char* hdr[13];
+    gchar *cmd;
+    int ics;
+
+    fd.fd.h = handle; fd.fd.ift = fd.fd.req_fetch_type = ift;
+    fd.set = set + i*chunk;
+    seqs[issued] = imap_coalesce_seq_range(1, MIN(chunk, cnt - i*chunk),
+                                           cf, &fd);
+    if(!seqs[issued]) /* we have all of this slice already */
+      continue;
+    if(issued == 0 && !imap_handle_idle_disable(handle)) {
+      rc = IMR_SEVERED;
+      break;
+    }
+    fetch_types[issued] = fd.fd.req_fetch_type;
+    ic_construct_header_list(hdr, fd.fd.req_fetch_type);
+    cmd = imap_fetch_cmd_new(seqs[issued], hdr);
+    ics = imap_cmd_start(handle, cmd, &cmdnos[issued++]);
+    g_free(cmd);
+    if(ics<0) {
+      rc = IMR_SEVERED;  /* irrecoverable connection error. */
+      break;
+    }
+  }
+
+  if(issued > 0 && rc == IMR_OK) {
+    sio_flush(handle->sio);
+    for(i=0; i<issued && handle->state != IMHS_DISCONNECTED; i++) {
+      ImapResponse slice_rc;
+      do {
+        slice_rc = imap_cmd_step(handle, cmdnos[i]);
+      } while (slice_rc == IMR_UNTAGGED);
+      if(slice_rc == IMR_OK)
+        set_avail_headers(handle, seqs[i], fetch_types[i]);
+      else if(rc == IMR_OK)
+        rc = slice_rc;
+    }
+    if(handle->state != IMHS_DISCONNECTED)
+      imap_handle_idle_enable(handle, 30);
+  }
+
+  for(i=0; i<n_slices; i++)
+    g_free(seqs[i]);
+  g_free(seqs);
+  g_free(cmdnos);
+  g_free(fetch_types);
+  HANDLE_UNLOCK(handle);
+  return rc;
+}
+
 static void
 write_nstring(unsigned seqno, ImapFetchBodyType body_type,
               const char *str, size_t len, void *fl)
@@ -1237,7 +1387,17 @@ imap_mbox_handle_fetch_rfc822(ImapMboxHandle* handle,
 
 /* When peeking into message, we need to assure that we save header
    first and body later: the order the fields are returned is in
-   principle undefined. */
+   principle undefined. The fields are passed in pieces as they
+   arrive, so the end of the header is known only once the command
+   has completed: text sent before the header is kept till then. */
+static void
+append_pending_body(char **body, size_t *length, const char *str, size_t len)
+{
+  *body = g_realloc(*body, *length + len);
+  memcpy(*body + *length, str, len);
+  *length += len;
+}
+
 struct FetchBodyHeaderText {
   FILE *out_file;
   char *body;
@@ -1258,22 +1418,14 @@ write_header_text_ordered(unsigned seqno, ImapFetchBodyType body_type,
     if (fwrite(str, 1, len, fbht->out_file) != len)
       perror("write_nstring");
     fbht->wrote_header = TRUE;
-    if(fbht->body) {
-      if (fwrite(fbht->body, 1, fbht->length, fbht->out_file) != fbht->length)
-	perror("write_nstring");
-      g_free(fbht->body); fbht->body = NULL;
-    }
     break;
   case IMAP_BODY_TYPE_TEXT:
   case IMAP_BODY_TYPE_BODY:
-    if(fbht->wrote_header) {
+    if(fbht->wrote_header && !fbht->body) {
       if (fwrite(str, 1, len, fbht->out_file) != len)
 	perror("write_nstring");
-    } else {
-      fbht->body = g_malloc(len);
-      fbht->length = len;
-      memcpy(fbht->body, str, len);
-    }
+    } else
+      append_pending_body(&fbht->body, &fbht->length, str, len);
     break;
   }
 }
@@ -1299,25 +1451,58 @@ pass_header_text_ordered(unsigned seqno, ImapFetchBodyType body_type,
   case IMAP_BODY_TYPE_HEADER:
     phto->cb(seqno, str, len, phto->arg);
     phto->wrote_header = TRUE;
-    if(phto->body) {
-      phto->cb(seqno, phto->body, phto->length, phto->arg);
-      g_free(phto->body); phto->body = NULL;
-    }
     break;
   case IMAP_BODY_TYPE_TEXT:
   case IMAP_BODY_TYPE_BODY:
-    if(phto->wrote_header) {
+    if(phto->wrote_header && !phto->body) {
       phto->cb(seqno, str, len, phto->arg);
-    } else {
-      phto->body = g_malloc(len);
-      phto->length = len;
-      memcpy(phto->body, str, len);
-    }
+    } else
+      append_pending_body(&phto->body, &phto->length, str, len);
     break;
   }
 }
 
 
+/** Resynchronizes flags of messages with UIDs up to uid_max that
+    were present when the mailbox state modseq was reached (RFC 7162).
+    The FLAGS of the messages changed since then are stored in the
+    message and flag caches. When modseq is 0, flags of all these
+    messages are fetched. If vanished is not NULL and QRESYNC is
+    enabled, the ImapUidRanges of messages expunged since modseq are
+    appended to it. */
+ImapResponse
+imap_mbox_resync_flags(ImapMboxHandle *h, ImapUID uid_max,
+                       guint64 modseq, GArray *vanished)
+{
+  gchar *cmd;
+  ImapResponse rc;
+
+  HANDLE_LOCK(h);
+  IMAP_REQUIRED_STATE1(h, IMHS_SELECTED, IMR_BAD);
+  if(uid_max == 0) {
+    HANDLE_UNLOCK(h);
+    return IMR_OK;
+  }
+  if(modseq == 0)
+    cmd = g_strdup_printf("UID FETCH 1:%u (FLAGS)", uid_max);
+  else if(vanished && h->qresync_enabled)
+    cmd = g_strdup_printf("UID FETCH 1:%u (FLAGS) "
+                          "(CHANGEDSINCE %" G_GUINT64_FORMAT " VANISHED)",
+                          uid_max, modseq);
+  else
+    cmd = g_strdup_printf("UID FETCH 1:%u (FLAGS) "
+                          "(CHANGEDSINCE %" G_GUINT64_FORMAT ")",
+                          uid_max, modseq);
+  h->vanished_earlier = vanished;
+  rc = imap_cmd_exec(h, cmd);
+  h->vanished_earlier = NULL;
+  g_free(cmd);
+  HANDLE_UNLOCK(h);
+  return rc;
+}
+
+/** Fetches the message into fl. The message is written to the file
+    piece by piece as it is read from the connection. */
 ImapResponse
 imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle, unsigned uid, 
                                   gboolean peek, FILE *fl)
@@ -1325,6 +1510,7 @@ imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle, unsigned uid,
   char cmd[80];
   ImapFetchBodyInternalCb cb = handle->body_cb;
   void          *arg = handle->body_arg;
+  gboolean  streamed = handle->body_streamed;
   ImapResponse rc;
   char *cmdstr;
   struct FetchBodyHeaderText separate_arg;
@@ -1340,6 +1526,7 @@ imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle, unsigned uid,
     handle->body_cb  = write_header_text_ordered;
     handle->body_arg = &separate_arg;
     separate_arg.body = NULL;
+    separate_arg.length = 0;
     separate_arg.wrote_header = FALSE;
     separate_arg.out_file = fl;
     cmdstr = "UID FETCH %u (BODY.PEEK[HEADER] BODY.PEEK[TEXT])";
@@ -1348,15 +1535,21 @@ imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle, unsigned uid,
     handle->body_arg = fl;
     cmdstr = "UID FETCH %u RFC822";
   }
+  handle->body_streamed = TRUE;
 
   snprintf(cmd, sizeof(cmd), cmdstr, uid);
   rc = imap_cmd_exec(handle, cmd);
   if(peek) {
-    g_free(separate_arg.body); /* This should never be needed. */
+    if(separate_arg.body && separate_arg.wrote_header &&
+       fwrite(separate_arg.body, 1, separate_arg.length, fl)
+       != separate_arg.length)
+      perror("write_nstring");
+    g_free(separate_arg.body);
   }
 
   handle->body_cb  = cb;
   handle->body_arg = arg;
+  handle->body_streamed = streamed;
   HANDLE_UNLOCK(handle);
   return rc;
 }
@@ -1388,6 +1581,41 @@ imap_binary_handler(unsigned seqno, ImapFetchBodyType body_type,
   ibd->body_cb(seqno, buf, buflen, ibd->body_arg);
 }
 
+/* imap_body_fetch_cmd() writes to cmd the FETCH command for the
+   section, together with the MIME header of the section or the
+   header of the enclosing message as requested by options. The
+   section of that header goes to prefix, or "" if there is none. */
+static void
+imap_body_fetch_cmd(char *cmd, size_t cmd_sz, char *prefix, size_t prefix_sz,
+                    unsigned seqno, const char *section, gboolean peek_only,
+                    ImapFetchBodyOptions options)
+{
+  const gchar *peek_string = peek_only ? ".PEEK" : "";
+
+  if(options == IMFB_NONE) {
+    *prefix = '\0';
+    snprintf(cmd, cmd_sz, "FETCH %u BODY%s[%s]",
+             seqno, peek_string, section);
+    return;
+  }
+  if(options == IMFB_HEADER) {
+    /* We have to strip last section part and replace it with HEADER */
+    unsigned sz;
+    const char *last_dot = strrchr(section, '.');
+    strncpy(prefix, section, prefix_sz);
+
+    if(last_dot) {
+      sz = last_dot-section+1;
+      if(sz>prefix_sz-1) sz = prefix_sz-1;
+    } else sz = 0;
+    strncpy(prefix + sz, "HEADER", prefix_sz-sz-1);
+    prefix[prefix_sz-1] = '\0';
+  } else
+    snprintf(prefix, prefix_sz, "%s.MIME", section);
+  snprintf(cmd, cmd_sz, "FETCH %u (BODY%s[%s] BODY%s[%s])",
+           seqno, peek_string, prefix, peek_string, section);
+}
+
 ImapResponse
 imap_mbox_handle_fetch_body(ImapMboxHandle* handle, 
                             unsigned seqno, const char *section,
@@ -1395,9 +1623,10 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
                             ImapFetchBodyOptions options,
                             ImapFetchBodyCb body_cb, void *arg)
 {
-  char cmd[160];
+  char cmd[160], prefix[160];
   ImapFetchBodyInternalCb fcb;
   void          *farg;
+  gboolean  fstreamed;
   ImapResponse rc;
   const gchar *peek_string = peek_only ? ".PEEK" : "";
   struct PassHeaderTextOrdered pass_ordered_data;
@@ -1406,12 +1635,14 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
   IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
   fcb = handle->body_cb;
   farg = handle->body_arg;
+  fstreamed = handle->body_streamed;
+  handle->body_streamed = TRUE;
 
   /* Use BINARY extension if possible */
   if(handle->enable_binary && options == IMFB_MIME &&
      imap_mbox_handle_can_do(handle, IMCAP_BINARY)) {
     struct ImapBinaryData ibd;
-    ImapMessage * imsg = imap_mbox_handle_get_msg(handle, seqno);
+    ImapMessage * imsg = imap_msg_cache_get(handle, seqno);
     ibd.body = imap_message_get_body_from_section(imsg, section);
     ibd.body_cb = body_cb;
     ibd.body_arg = arg;
@@ -1424,6 +1655,7 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
     if(rc != IMR_NO) { /* unknown-cte */
       handle->body_cb  = fcb;
       handle->body_arg = farg;
+      handle->body_streamed = fstreamed;
       HANDLE_UNLOCK(handle);
       return rc;
     }
@@ -1434,34 +1666,126 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
   pass_ordered_data.cb = body_cb;
   pass_ordered_data.arg = arg;
   pass_ordered_data.body = NULL;
+  pass_ordered_data.length = 0;
   pass_ordered_data.wrote_header = FALSE;
   /* Pure IMAP without extensions */
-  if(options == IMFB_NONE)
-    snprintf(cmd, sizeof(cmd), "FETCH %u BODY%s[%s]",
-             seqno, peek_string, section);
-  else {
-    char prefix[160];
-    if(options == IMFB_HEADER) {
-      /* We have to strip last section part and replace it with HEADER */
-      unsigned sz;
-      char *last_dot = strrchr(section, '.');
-      strncpy(prefix, section, sizeof(prefix));
-      
-      if(last_dot) {
-        sz = last_dot-section+1;
-        if(sz>sizeof(prefix)-1) sz = sizeof(prefix)-1;
-      } else sz = 0;
-      strncpy(prefix + sz, "HEADER", sizeof(prefix)-sz-1);
-      prefix[sizeof(prefix)-1] = '\0';
-    } else
-      snprintf(prefix, sizeof(prefix), "%s.MIME", section);
-    snprintf(cmd, sizeof(cmd), "FETCH %u (BODY%s[%s] BODY%s[%s])",
-             seqno, peek_string, prefix, peek_string, section);
-  }
+  imap_body_fetch_cmd(cmd, sizeof(cmd), prefix, sizeof(prefix),
+                      seqno, section, peek_only, options);
   rc = imap_cmd_exec(handle, cmd);
+  if(pass_ordered_data.body && pass_ordered_data.wrote_header)
+    body_cb(seqno, pass_ordered_data.body, pass_ordered_data.length, arg);
   g_free(pass_ordered_data.body);
   handle->body_cb  = fcb;
   handle->body_arg = farg;
+  handle->body_streamed = fstreamed;
+
+  HANDLE_UNLOCK(handle);
+  return rc;
+}
+
+static void
+pipeline_rc_cb(ImapMboxHandle *h, ImapResponse rc, void *arg)
+{
+  *(ImapResponse*)arg = rc;
+}
+
+/* A section fetched by imap_mbox_handle_fetch_bodies(). */
+struct FetchBodiesSection {
+  const char *section;
+  char prefix[160]; /* section of the header fetched with it */
+  struct PassHeaderTextOrdered ordered;
+};
+
+struct FetchBodiesData {
+  ImapMboxHandle *handle;
+  unsigned seqno;
+  unsigned cnt;
+  struct FetchBodiesSection *sections;
+};
+
+/* fetch_bodies_cb() passes the data to the handler of the section it
+   belongs to. */
+static void
+fetch_bodies_cb(unsigned seqno, ImapFetchBodyType body_type,
+                const char *buf, size_t buflen, void *arg)
+{
+  struct FetchBodiesData *fbd = (struct FetchBodiesData*)arg;
+  const char *section = fbd->handle->body_section;
+  unsigned i;
+
+  if(seqno != fbd->seqno)
+    return;
+  if(!section || !*section) /* BODY[HEADER] or BODY[TEXT] */
+    section = body_type == IMAP_BODY_TYPE_TEXT ? "TEXT" : "HEADER";
+  for(i=0; i<fbd->cnt; i++) {
+    struct FetchBodiesSection *s = &fbd->sections[i];
+    if(g_ascii_strcasecmp(section, s->section) == 0 ||
+       g_ascii_strcasecmp(section, s->prefix) == 0) {
+      pass_header_text_ordered(seqno, body_type, buf, buflen, &s->ordered);
+      return;
+    }
+  }
+}
+
+/** imap_mbox_handle_fetch_bodies() fetches cnt sections of message
+    seqno as imap_mbox_handle_fetch_body() does, except that the
+    BINARY extension is not used. The FETCH commands are pipelined so
+    that they cost one round trip between them. The completion code
+    of each command is stored in the rc field of its request. */
+ImapResponse
+imap_mbox_handle_fetch_bodies(ImapMboxHandle* handle, unsigned seqno,
+                              gboolean peek_only, unsigned cnt,
+                              ImapFetchBodyRequest *req)
+{
+  struct FetchBodiesData fbd;
+  ImapFetchBodyInternalCb fcb;
+  void          *farg;
+  gboolean  fstreamed;
+  ImapPipeline *pipeline;
+  ImapResponse rc;
+  unsigned i;
+
+  HANDLE_LOCK(handle);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  fcb = handle->body_cb;
+  farg = handle->body_arg;
+  fstreamed = handle->body_streamed;
+
+  fbd.handle = handle;
+  fbd.seqno = seqno;
+  fbd.cnt = cnt;
+  fbd.sections = g_new(struct FetchBodiesSection, cnt);
+  pipeline = imap_pipeline_new(handle);
+  for(i=0; i<cnt; i++) {
+    struct FetchBodiesSection *s = &fbd.sections[i];
+    char cmd[160];
+
+    s->section = req[i].section;
+    s->ordered.cb = req[i].body_handler;
+    s->ordered.arg = req[i].arg;
+    s->ordered.body = NULL;
+    s->ordered.length = 0;
+    s->ordered.wrote_header = FALSE;
+    imap_body_fetch_cmd(cmd, sizeof(cmd), s->prefix, sizeof(s->prefix),
+                        seqno, req[i].section, peek_only, req[i].options);
+    req[i].rc = IMR_SEVERED;
+    imap_pipeline_add(pipeline, cmd, IMPIPE_NONE, pipeline_rc_cb, &req[i].rc);
+  }
+
+  handle->body_cb  = fetch_bodies_cb;
+  handle->body_arg = &fbd;
+  handle->body_streamed = TRUE;
+  rc = imap_pipeline_run(pipeline);
+  for(i=0; i<cnt; i++) {
+    struct PassHeaderTextOrdered *o = &fbd.sections[i].ordered;
+    if(o->body && o->wrote_header)
+      o->cb(seqno, o->body, o->length, o->arg);
+    g_free(o->body);
+  }
+  g_free(fbd.sections);
+  handle->body_cb  = fcb;
+  handle->body_arg = farg;
+  handle->body_streamed = fstreamed;
 
   HANDLE_UNLOCK(handle);
   return rc;
@@ -1480,7 +1804,7 @@ static unsigned
 cf_flag(unsigned idx, struct msg_set *csd)
 {
   unsigned seqno = csd->seqno[idx];
-  ImapMessage *imsg = imap_mbox_handle_get_msg(csd->handle, seqno);
+  ImapMessage *imsg = imap_msg_cache_get(csd->handle, seqno);
   if(imsg &&
      ( (csd->state  && (imsg->flags & csd->flag)) || 
        (!csd->state && !(imsg->flags & csd->flag))) )
@@ -1488,22 +1812,16 @@ cf_flag(unsigned idx, struct msg_set *csd)
      else return seqno;
 }
 
-static gchar*
-imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
-		   ImapMsgFlag flg, gboolean state)
+/* imap_store_apply() records the new state of the flag in the
+   message and flag caches. */
+static void
+imap_store_apply(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
+		 ImapMsgFlag flg, gboolean state)
 {
-  gchar* cmd, *seq, *str;
-  struct msg_set csd;
   unsigned i;
 
-  csd.handle = h; csd.msgcnt = msgcnt; csd.seqno = seqno;
-  csd.flag = flg; csd.state = state;
-  if(msgcnt == 0) return NULL;
-  seq = imap_coalesce_seq_range(0, msgcnt-1, (ImapCoalesceFunc)cf_flag, &csd);
-  if(!seq) return NULL;
-  str = enum_flag_to_str(flg);
   for(i=0; i<msgcnt; i++) {
-    ImapMessage *msg = imap_mbox_handle_get_msg(h, seqno[i]);
+    ImapMessage *msg = imap_msg_cache_get(h, seqno[i]);
     ImapFlagCache *f =
       &g_array_index(h->flag_cache, ImapFlagCache, seqno[i]-1);
     f->known_flags |= flg;
@@ -1520,7 +1838,24 @@ imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
   }
   if(h->flags_cb)
     h->flags_cb(msgcnt, seqno, h->flags_arg);
+}
+
+/* imap_store_cmd_new() returns the STORE command for the messages
+   whose flag is not in the requested state yet, or NULL if there are
+   none. */
+static gchar*
+imap_store_cmd_new(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
+                   ImapMsgFlag flg, gboolean state)
+{
+  gchar* cmd, *seq, *str;
+  struct msg_set csd;
 
+  csd.handle = h; csd.msgcnt = msgcnt; csd.seqno = seqno;
+  csd.flag = flg; csd.state = state;
+  if(msgcnt == 0) return NULL;
+  seq = imap_coalesce_seq_range(0, msgcnt-1, (ImapCoalesceFunc)cf_flag, &csd);
+  if(!seq) return NULL;
+  str = enum_flag_to_str(flg);
   cmd = g_strdup_printf("Store %s %cFlags.Silent (%s)", seq,
                         state ? '+' : '-', str);
   g_free(str);
@@ -1528,6 +1863,17 @@ imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
   return cmd;
 }
 
+static gchar*
+imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
+		   ImapMsgFlag flg, gboolean state)
+{
+  gchar* cmd = imap_store_cmd_new(h, msgcnt, seqno, flg, state);
+
+  if(cmd)
+    imap_store_apply(h, msgcnt, seqno, flg, state);
+  return cmd;
+}
+
 ImapResponse
 imap_mbox_store_flag(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
                      ImapMsgFlag flg, gboolean state)
@@ -1569,6 +1915,43 @@ imap_mbox_store_flag_a(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
 
 
 /* 6.4.7 COPY Command */
+/* imap_copy_cmd_new() returns the COPY command for given set of
+   seqno and prepares the handle for storing the COPYUID response. */
+static gchar*
+imap_copy_cmd_new(ImapMboxHandle* handle, unsigned cnt, unsigned *seqno,
+                  const gchar *dest, ImapSequence *ret_sequence)
+{
+  gchar *mbx7 = imap_utf8_to_mailbox(dest);
+  char *seq = imap_coalesce_set(cnt, seqno);
+  gchar *cmd = g_strdup_printf("COPY %s \"%s\"", seq, mbx7);
+
+  g_free(seq); g_free(mbx7);
+  if(ret_sequence) {
+    ret_sequence->ranges = NULL;
+    handle->uidplus.store_response = 1;
+  } else
+    handle->uidplus.store_response = 0;
+  return cmd;
+}
+
+/* imap_copy_finish() passes the COPYUID response to ret_sequence
+   once the COPY command has completed with rc. */
+static void
+imap_copy_finish(ImapMboxHandle* handle, ImapResponse rc,
+                 gboolean use_uidplus, ImapSequence *ret_sequence)
+{
+  if(use_uidplus && ret_sequence) {
+    if(rc == IMR_OK /* && cmdno == handle->uidplus.cmdno */ ) {
+      ret_sequence->uid_validity = handle->uidplus.dst_uid_validity;
+      ret_sequence->ranges = g_list_reverse(handle->uidplus.dst);
+    } else {
+      g_list_free(handle->uidplus.dst);
+    }
+    handle->uidplus.dst = NULL;
+    handle->uidplus.store_response = 0;
+  }
+}
+
 /** imap_mbox_handle_copy() copies given set of seqno from the mailbox
     selected in handle to given mailbox on same server. */
 ImapResponse
@@ -1581,31 +1964,59 @@ imap_mbox_handle_copy(ImapMboxHandle* handle, unsigned cnt, unsigned *seqno,
   HANDLE_LOCK(handle);
   IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
   {
-    gchar *mbx7 = imap_utf8_to_mailbox(dest);
-    char *seq = imap_coalesce_set(cnt, seqno);
-    gchar *cmd = g_strdup_printf("COPY %s \"%s\"", seq, mbx7);
-    unsigned cmdno;
     gboolean use_uidplus = imap_mbox_handle_can_do(handle, IMCAP_UIDPLUS);
+    gchar *cmd = imap_copy_cmd_new(handle, cnt, seqno, dest, ret_sequence);
 
-    if(ret_sequence) {
-      ret_sequence->ranges = NULL;
-      handle->uidplus.store_response = 1;
-    } else
-      handle->uidplus.store_response = 0;
-
-    rc = imap_cmd_exec_cmdno(handle, cmd, &cmdno);
-    g_free(seq); g_free(mbx7); g_free(cmd);
-    if(use_uidplus && ret_sequence) {
-      if(rc == IMR_OK /* && cmdno == handle->uidplus.cmdno */ ) {
-	ret_sequence->uid_validity = handle->uidplus.dst_uid_validity;
-	ret_sequence->ranges = g_list_reverse(handle->uidplus.dst);
-      } else {
-	g_list_free(handle->uidplus.dst);
-      }
-      handle->uidplus.dst = NULL;
-      handle->uidplus.store_response = 0;
-    }
+    rc = imap_cmd_exec(handle, cmd);
+    g_free(cmd);
+    imap_copy_finish(handle, rc, use_uidplus, ret_sequence);
+  }
+  HANDLE_UNLOCK(handle);
+  return rc;
+}
+
+static void
+move_store_cb(ImapMboxHandle *h, ImapResponse rc, void *arg)
+{
+  struct msg_set *csd = (struct msg_set*)arg;
+
+  if(rc == IMR_OK)
+    imap_store_apply(h, csd->msgcnt, csd->seqno, csd->flag, csd->state);
+}
+
+/** imap_mbox_handle_move() moves given set of seqno from the mailbox
+    selected in handle to given mailbox on same server: the messages
+    are copied and then marked as deleted, to be removed by the next
+    expunge. The STORE command is pipelined behind the COPY and is
+    skipped if the COPY fails. */
+ImapResponse
+imap_mbox_handle_move(ImapMboxHandle* handle, unsigned cnt, unsigned *seqno,
+                      const gchar *dest,
+		      ImapSequence *ret_sequence)
+{
+  ImapPipeline *pipeline;
+  ImapResponse rc, copy_rc = IMR_SEVERED;
+  struct msg_set csd;
+  gboolean use_uidplus;
+  gchar *cmd;
+
+  HANDLE_LOCK(handle);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  use_uidplus = imap_mbox_handle_can_do(handle, IMCAP_UIDPLUS);
+  pipeline = imap_pipeline_new(handle);
+  cmd = imap_copy_cmd_new(handle, cnt, seqno, dest, ret_sequence);
+  imap_pipeline_add(pipeline, cmd, IMPIPE_NONE, pipeline_rc_cb, &copy_rc);
+  g_free(cmd);
+
+  csd.handle = handle; csd.msgcnt = cnt; csd.seqno = seqno;
+  csd.flag = IMSGF_DELETED; csd.state = TRUE;
+  cmd = imap_store_cmd_new(handle, cnt, seqno, IMSGF_DELETED, TRUE);
+  if(cmd) {
+    imap_pipeline_add(pipeline, cmd, IMPIPE_IF_OK, move_store_cb, &csd);
+    g_free(cmd);
   }
+  rc = imap_pipeline_run(pipeline);
+  imap_copy_finish(handle, copy_rc, use_uidplus, ret_sequence);
   HANDLE_UNLOCK(handle);
   return rc;
 }
@@ -1864,7 +2275,7 @@ imap_mbox_sort_msgno_client(ImapMboxHandle *handle, ImapSortKey key,
   }
   seqno_to_fetch = g_new(unsigned, cnt);
   for(i=fetch_cnt=0; i<cnt; i++) {
-    ImapMessage *imsg = imap_mbox_handle_get_msg(handle, msgno[i]);
+    ImapMessage *imsg = imap_msg_cache_get(handle, msgno[i]);
     if(!imsg || !imsg->envelope)
       seqno_to_fetch[fetch_cnt++] = msgno[i];
   }
@@ -1883,7 +2294,7 @@ imap_mbox_sort_msgno_client(ImapMboxHandle *handle, ImapSortKey key,
 
   sort_items = g_new(struct SortItem, cnt);
   for(i=0; i<cnt; i++) {
-    sort_items[i].msg = imap_mbox_handle_get_msg(handle, msgno[i]);
+    sort_items[i].msg = imap_msg_cache_get(handle, msgno[i]);
     sort_items[i].no  = msgno[i];
   }
   switch(key) {
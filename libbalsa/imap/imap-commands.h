@@ -54,6 +54,11 @@ struct ImapStatusResult {
 };
 ImapResponse imap_mbox_status(ImapMboxHandle *r, const char*what, 
                               struct ImapStatusResult *res);
+typedef void (*ImapStatusCb)(ImapMboxHandle *h, const char *mbox,
+                             const struct ImapStatusResult *res, void *arg);
+ImapResponse imap_mbox_status_bulk(ImapMboxHandle *h, unsigned cnt,
+                                   const char **mboxes,
+                                   ImapStatusCb cb, void *arg);
 typedef size_t (*ImapAppendFunc)(char*, size_t, void*);
 ImapResponse imap_mbox_append(ImapMboxHandle *handle, const char *mbox,
                               ImapMsgFlags flags, size_t sz, 
@@ -98,6 +103,10 @@ ImapResponse imap_mbox_handle_copy(ImapMboxHandle* handle,
 				   unsigned cnt, unsigned *seqno,
 				   const gchar *dest,
 				   ImapSequence *ret_sequence);
+ImapResponse imap_mbox_handle_move(ImapMboxHandle* handle,
+				   unsigned cnt, unsigned *seqno,
+				   const gchar *dest,
+				   ImapSequence *ret_sequence);
 
 ImapResponse imap_mbox_find_unseen(ImapMboxHandle * h, unsigned *msgcnt,
 				   unsigned **msgs);
@@ -111,6 +120,11 @@ ImapResponse imap_mbox_handle_fetch_range(ImapMboxHandle* handle,
 ImapResponse imap_mbox_handle_fetch_set(ImapMboxHandle* handle,
                                         unsigned *set, unsigned cnt,
                                         ImapFetchType ift);
+ImapResponse imap_mbox_handle_fetch_set_pipelined(ImapMboxHandle* handle,
+                                                  unsigned *set,
+                                                  unsigned cnt,
+                                                  ImapFetchType ift,
+                                                  unsigned chunk);
 
 typedef void (*ImapFetchBodyCb)(unsigned seqno, const char *buf,
 				size_t buflen, void* arg);
@@ -121,10 +135,15 @@ ImapResponse imap_mbox_handle_fetch_rfc822(ImapMboxHandle* handle,
                                            ImapFetchBodyCb cb,
 					   void *cb_data);
 
+ImapResponse imap_mbox_resync_flags(ImapMboxHandle *h, ImapUID uid_max,
+                                    guint64 modseq, GArray *vanished);
+
 ImapResponse imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle,
                                                unsigned uid, gboolean peek,
                                                FILE *fl);
 
+/* body_handler is called with consecutive pieces of the section as
+   they are read, not with the whole section at once. */
 ImapResponse imap_mbox_handle_fetch_body(ImapMboxHandle* handle, 
                                          unsigned seqno, 
                                          const char *section,
@@ -133,6 +152,19 @@ ImapResponse imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
                                          ImapFetchBodyCb body_handler,
                                          void *arg);
 
+typedef struct {
+  const char *section;
+  ImapFetchBodyOptions options;
+  ImapFetchBodyCb body_handler;
+  void *arg;
+  ImapResponse rc; /* set on completion */
+} ImapFetchBodyRequest;
+ImapResponse imap_mbox_handle_fetch_bodies(ImapMboxHandle* handle,
+                                           unsigned seqno,
+                                           gboolean peek_only,
+                                           unsigned cnt,
+                                           ImapFetchBodyRequest *req);
+
 /* Experimental/Expansion */
 ImapResponse imap_handle_starttls(ImapMboxHandle *handle);
 ImapResponse imap_mbox_scan(ImapMboxHandle *r, const char*what,
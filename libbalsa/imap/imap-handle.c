@@ -81,7 +81,7 @@ struct _ImapMboxHandleClass {
                         ImapMboxFlags flags, const gchar* mbox);
   void (*lsub_response)(ImapMboxHandle* handle, int delim,
                         ImapMboxFlags flags, const gchar* mbox);
-  void (*expunge_notify)(ImapMboxHandle* handle, int seqno);
+  void (*expunge_notify)(ImapMboxHandle* handle, GArray *seqnos);
   void (*exists_notify)(ImapMboxHandle* handle);
 };
 
@@ -103,8 +103,10 @@ static void imap_mbox_handle_class_init(ImapMboxHandleClass * klass);
 static void imap_mbox_handle_finalize(GObject* handle);
 
 static ImapResult imap_mbox_connect(ImapMboxHandle* handle);
+static void imap_char_class_init(void);
 
 static ImapResponse ir_handle_response(ImapMboxHandle *h);
+static void imap_expunged_flush(ImapMboxHandle *h);
 
 static ImapAddress* imap_address_from_string(const gchar *string, gchar **n);
 static gchar*       imap_address_to_string(const ImapAddress *addr);
@@ -143,9 +145,14 @@ imap_mbox_handle_init(ImapMboxHandle *handle)
   handle->has_capabilities = FALSE;
   handle->exists = 0;
   handle->recent = 0;
+  handle->highestmodseq = 0;
   handle->last_msg = NULL;
   handle->msg_cache = NULL;
+  handle->msg_serialized = NULL;
+  handle->serialized_owner = NULL;
   handle->flag_cache=  g_array_new(FALSE, TRUE, sizeof(ImapFlagCache));
+  handle->expunged  =  g_array_new(FALSE, FALSE, sizeof(unsigned));
+  handle->vanished_earlier = NULL;
   handle->doing_logout = FALSE;
 #ifdef USE_TLS
   handle->using_tls = 0;
@@ -155,6 +162,8 @@ imap_mbox_handle_init(ImapMboxHandle *handle)
   handle->cmd_info = NULL;
   handle->status_resps = g_hash_table_new_full(g_str_hash, g_str_equal,
                                                NULL, NULL);
+  handle->status_cb  = NULL;
+  handle->status_arg = NULL;
 
   handle->info_cb  = NULL;
   handle->info_arg = NULL;
@@ -178,6 +187,7 @@ imap_mbox_handle_class_init(ImapMboxHandleClass * klass)
   GObjectClass *object_class = G_OBJECT_CLASS(klass);
   
   parent_class = g_type_class_peek_parent(klass);
+  imap_char_class_init();
   imap_mbox_handle_signals[FETCH_RESPONSE] = 
     g_signal_new("fetch-response",
                  G_TYPE_FROM_CLASS(object_class),
@@ -210,8 +220,8 @@ imap_mbox_handle_class_init(ImapMboxHandleClass * klass)
                  G_SIGNAL_RUN_FIRST,
                  G_STRUCT_OFFSET(ImapMboxHandleClass, expunge_notify),
                  NULL, NULL,
-                 g_cclosure_marshal_VOID__INT, G_TYPE_NONE, 1,
-		 G_TYPE_INT);
+                 g_cclosure_marshal_VOID__POINTER, G_TYPE_NONE, 1,
+		 G_TYPE_POINTER);
 
   imap_mbox_handle_signals[EXISTS_NOTIFY] = 
     g_signal_new("exists-notify",
@@ -379,6 +389,8 @@ async_process_real(ImapMboxHandle *h)
            async_cmd);
   }
   if(ASYNC_DEBUG) printf("async_process() loop left\n");
+  /* Nothing else to read: apply the expunges reported so far. */
+  imap_expunged_flush(h);
   if(h->idle_state == IDLE_INACTIVE && async_cmd == 0) {
     if(ASYNC_DEBUG) printf("Last async command completed.\n");
     if(h->async_watch_id) {
@@ -569,6 +581,7 @@ imap_handle_disconnect(ImapMboxHandle *h)
   }
   close(h->sd);
   h->state = IMHS_DISCONNECTED;
+  g_array_set_size(h->expunged, 0);
 }
 
 int imap_mbox_is_disconnected (ImapMboxHandle *h)
@@ -614,6 +627,15 @@ imap_mbox_handle_connect(ImapMboxHandle* ret, const char *host, int over_ssl)
   return rc;
 }
 
+static void
+imap_serialized_release(ImapMboxHandle *h)
+{
+  g_free(h->msg_serialized); h->msg_serialized = NULL;
+  if(h->serialized_owner)
+    h->serialized_release(h->serialized_owner);
+  h->serialized_owner = NULL;
+}
+
 void
 imap_mbox_resize_cache(ImapMboxHandle *h, unsigned new_size)
 {
@@ -628,6 +650,14 @@ imap_mbox_resize_cache(ImapMboxHandle *h, unsigned new_size)
   g_array_set_size(h->flag_cache, new_size);
   for(i=h->exists; i<new_size; i++) 
     h->msg_cache[i] = NULL;
+  if(new_size == 0)
+    imap_serialized_release(h);
+  else if(h->msg_serialized) {
+    h->msg_serialized = g_realloc(h->msg_serialized,
+                                  new_size*sizeof(void*));
+    for(i=h->exists; i<new_size; i++)
+      h->msg_serialized[i] = NULL;
+  }
   h->exists = new_size;
 }
 
@@ -780,6 +810,7 @@ imap_mbox_connect(ImapMboxHandle* handle)
   handle->op_cancelled = FALSE;
   handle->has_capabilities = FALSE;
   handle->can_fetch_body = TRUE;
+  handle->qresync_enabled = FALSE;
   handle->idle_state = IDLE_INACTIVE;
   if(handle->sio) {
     sio_detach(handle->sio); handle->sio = NULL;
@@ -866,26 +897,100 @@ imap_make_tag(ImapCmdTag tag)
   return no;
 }
 
-static int
-imap_get_atom(struct siobuf *sio, char* atom, size_t len)
+#define IS_FLAG_CHAR(c) (strchr("(){ %*\"]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+/* we include '+' in TAG_CHAR because we want to treat forced responses
+   in same code. This may be wrong. Reconsider.
+*/
+#define IS_TAG_CHAR(c) (strchr("(){ %\"\\]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+#define IS_ASTRING_CHAR(c) (strchr("(){ %*\"\\", (c))==0&&(c)>0x1F&&(c)!=0x7F)
+
+/* Token classes of every byte, so that the tokenizers can scan the
+   read buffer in place instead of calling strchr() for every
+   character.  The table is filled from the IS_*_CHAR macros in
+   imap_mbox_handle_class_init() so that the two can never disagree,
+   and bytes are classified as (char) the same way sio_getc() returns
+   them. */
+enum {
+  IMAP_CC_ATOM    = 1 << 0,
+  IMAP_CC_FLAG    = 1 << 1,
+  IMAP_CC_TAG     = 1 << 2,
+  IMAP_CC_ASTRING = 1 << 3
+};
+static guchar imap_char_class[256];
+
+static void
+imap_char_class_init(void)
 {
   unsigned i;
+  for(i=0; i<G_N_ELEMENTS(imap_char_class); i++) {
+    int c = (char)i;
+    imap_char_class[i] =
+      (IS_ATOM_CHAR(c)    ? IMAP_CC_ATOM    : 0) |
+      (IS_FLAG_CHAR(c)    ? IMAP_CC_FLAG    : 0) |
+      (IS_TAG_CHAR(c)     ? IMAP_CC_TAG     : 0) |
+      (IS_ASTRING_CHAR(c) ? IMAP_CC_ASTRING : 0);
+  }
+}
+
+/* Scans the longest run of bytes of class cls, storing at most len-1
+   of them in token (token may be NULL when str is given, and vice
+   versa), and returns the byte that ended the run. As with the
+   sio_getc() loops this replaces, the terminating byte is consumed,
+   unless the run was cut short because token is full: then the last
+   byte stored is returned. *toklen is set to the number of bytes
+   stored in token. */
+static int
+imap_get_span(struct siobuf *sio, guchar cls, char *token, size_t len,
+              size_t *toklen, GString *str)
+{
+  size_t i = 0;
   int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_ATOM_CHAR(c); i++)
-    atom[i] = c;
+
+  while(!token || i<len-1) {
+    const char *p;
+    int avail, n, lim;
+
+    if( (p = sio_peek(sio, &avail)) == NULL) {
+      c = -1;
+      break;
+    }
+    lim = token && (size_t)avail > len-1-i ? (int)(len-1-i) : avail;
+    for(n=0; n<lim && (imap_char_class[(guchar)p[n]] & cls); n++)
+      ;
+    if(token)
+      memcpy(token+i, p, n);
+    else
+      g_string_append_len(str, p, n);
+    i += n;
+    if(n<lim) {                 /* delimiter found */
+      c = p[n];
+      sio_skip(sio, n+1);
+      break;
+    }
+    sio_skip(sio, n);
+    if(n>0)
+      c = p[n-1];
+  }
+  if(toklen)
+    *toklen = i;
+  return c;
+}
+
+static int
+imap_get_atom(struct siobuf *sio, char* atom, size_t len)
+{
+  size_t i;
+  int c = imap_get_span(sio, IMAP_CC_ATOM, atom, len, &i, NULL);
 
   atom[i] = '\0';
   return c;
 }
 
-#define IS_FLAG_CHAR(c) (strchr("(){ %*\"]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
 static int
 imap_get_flag(struct siobuf *sio, char* flag, size_t len)
 {
-  unsigned i;
-  int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_FLAG_CHAR(c); i++)
-    flag[i] = c;
+  size_t i;
+  int c = imap_get_span(sio, IMAP_CC_FLAG, flag, len, &i, NULL);
 
   if(i<len-1) {
     if (c < 0)
@@ -895,18 +1000,12 @@ imap_get_flag(struct siobuf *sio, char* flag, size_t len)
   return c;
 }
 
-/* we include '+' in TAG_CHAR because we want to treat forced responses
-   in same code. This may be wrong. Reconsider.
-*/
-#define IS_TAG_CHAR(c) (strchr("(){ %\"\\]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
 static int
 imap_cmd_get_tag(struct siobuf *sio, char* tag, size_t len)
 {
-  unsigned i;
-  int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_TAG_CHAR(c); i++) {
-    tag[i] = c;
-  }
+  size_t i;
+  int c = imap_get_span(sio, IMAP_CC_TAG, tag, len, &i, NULL);
+
   if(i<len-1) {
     if (c < 0)
       return c;
@@ -948,6 +1047,22 @@ imap_mbox_handle_get_uidnext(ImapMboxHandle* handle)
   return handle->uidnext;
 }
 
+/** Returns the HIGHESTMODSEQ reported when the mailbox was selected
+    or 0 if the server does not keep mod-sequences for it (RFC 7162). */
+guint64
+imap_mbox_handle_get_highestmodseq(ImapMboxHandle* handle)
+{
+  return handle->highestmodseq;
+}
+
+/** Tells whether the server agreed to report expunges as VANISHED
+    responses (RFC 7162). */
+gboolean
+imap_mbox_handle_qresync_enabled(ImapMboxHandle* handle)
+{
+  return handle->qresync_enabled;
+}
+
 static void
 get_delim(ImapMboxHandle* handle, int delim, ImapMboxFlags flags,
           char *folder, int *my_delim)
@@ -1018,6 +1133,7 @@ imap_mbox_handle_finalize(GObject* gobject)
   imap_mbox_resize_cache(handle, 0);
   g_free(handle->msg_cache); handle->msg_cache = NULL;
   g_array_free(handle->flag_cache, TRUE); handle->flag_cache = NULL;
+  g_array_free(handle->expunged, TRUE); handle->expunged = NULL;
   g_list_foreach(handle->acls, (GFunc)imap_user_acl_free, NULL);
   g_list_free(handle->acls); handle->acls = NULL;
   g_free(handle->quota_root); handle->quota_root = NULL;
@@ -1063,16 +1179,15 @@ imap_handle_process_tasks(ImapMboxHandle* handle)
   g_slist_free(begin);
 }
     
-ImapResponse
-imap_mbox_handle_fetch_unlocked(ImapMboxHandle* handle, const gchar *seq, 
-                       const gchar* headers[])
+/* imap_fetch_cmd_new builds the FETCH command for the sequence seq
+   and the NULL-terminated list of data items headers. */
+gchar*
+imap_fetch_cmd_new(const gchar *seq, const gchar* headers[])
 {
   char* cmd;
   int i;
   GString* hdr;
-  ImapResponse rc;
-  
-  IMAP_REQUIRED_STATE1_U(handle, IMHS_SELECTED, IMR_BAD);
+
   hdr = g_string_new(headers[0]);
   for(i=1; headers[i]; i++) {
     if (hdr->str[hdr->len - 1] != '(' && headers[i][0] != ')')
@@ -1081,6 +1196,18 @@ imap_mbox_handle_fetch_unlocked(ImapMboxHandle* handle, const gchar *seq,
   }
   cmd = g_strdup_printf("FETCH %s (%s)", seq, hdr->str);
   g_string_free(hdr, TRUE);
+  return cmd;
+}
+
+ImapResponse
+imap_mbox_handle_fetch_unlocked(ImapMboxHandle* handle, const gchar *seq, 
+                       const gchar* headers[])
+{
+  char* cmd;
+  ImapResponse rc;
+  
+  IMAP_REQUIRED_STATE1_U(handle, IMHS_SELECTED, IMR_BAD);
+  cmd = imap_fetch_cmd_new(seq, headers);
   rc = imap_cmd_exec(handle, cmd);
   g_free(cmd);
   return rc;
@@ -1100,12 +1227,32 @@ imap_mbox_handle_fetch_env(ImapMboxHandle* handle, const gchar *seq)
 }
 
 
+/* The public accessors may be called without the handle lock, so a
+   message still to be deserialized is stored in msg_cache under the
+   lock. Code holding the lock uses imap_msg_cache_get() instead;
+   messages passed to callbacks run under the lock, like flags_cb and
+   expunge-notify, are deserialized before the callback is called, so
+   that the lock is not taken again there. */
+static ImapMessage*
+imap_msg_cache_get_locking(ImapMboxHandle *h, unsigned seqno)
+{
+  ImapMessage *imsg = h->msg_cache[seqno-1];
+
+  if(imsg || !h->msg_serialized)
+    return imsg;
+
+  HANDLE_LOCK(h);
+  imsg = seqno <= h->exists ? imap_msg_cache_get(h, seqno) : NULL;
+  HANDLE_UNLOCK(h);
+  return imsg;
+}
+
 ImapMessage*
 imap_mbox_handle_get_msg(ImapMboxHandle* h, unsigned seqno)
 {
   g_return_val_if_fail(h, 0);
   g_return_val_if_fail(seqno-1<h->exists, NULL);
-  return h->msg_cache[seqno-1];
+  return imap_msg_cache_get_locking(h, seqno);
 }
 
 ImapMessage*
@@ -1115,7 +1262,7 @@ imap_mbox_handle_get_msg_v(ImapMboxHandle* h, unsigned no)
   g_return_val_if_fail(no-1<h->exists, NULL);
   if(mbox_view_is_active(&h->mbox_view))
     no = mbox_view_get_msg_no(&h->mbox_view, no);
-  return h->msg_cache[no-1];
+  return imap_msg_cache_get_locking(h, no);
 }
 unsigned
 imap_mbox_get_msg_no(ImapMboxHandle* h, unsigned no)
@@ -1856,30 +2003,27 @@ imap_message_free(ImapMessage *msg)
   g_free(msg);
 }
 
-void
-imap_mbox_handle_msg_deserialize(ImapMboxHandle *h, unsigned msgno,
-                                 void *data)
-{
-  if(msgno>=1 && msgno <=h->exists && !h->msg_cache[msgno-1])
-    h->msg_cache[msgno-1] = imap_message_deserialize(data);
-}
 /* Serialize message itself and the envelope, and the body structure
-   if available. */
+   if available. The blob is kept in the header cache file, which may
+   be read on another machine, so its fields have fixed sizes and are
+   stored little-endian; the three strings follow them. Change
+   IMAP_MSG_SERIALIZED_VERSION when the layout changes. */
 struct ImapMsgSerialized {
-  ssize_t total_size; /* for checksumming */
+  guint32 total_size; /* for checksumming */
   /* Message */
-  ImapUID      uid;
-  ImapMsgFlags flags;
-  ImapDate     internal_date; /* delivery date */
-  int rfc822size;
-  ImapFetchType available_headers;
+  guint32 uid;
+  guint32 flags;
+  gint32  rfc822size;
+  gint64  internal_date; /* delivery date */
+  guint32 available_headers;
+  guint32 reserved;      /* keeps the strings 8-byte aligned */
   gchar fetched_headers_first_char;
 };
 
 void*
 imap_message_serialize(ImapMessage *imsg)
 {
-  ssize_t tot_size;
+  gsize tot_size;
   gchar *ptr;
   gchar *strings[3];
   size_t lengths[3];
@@ -1891,20 +2035,27 @@ imap_message_serialize(ImapMessage *imsg)
   strings[0] = imsg->fetched_header_fields;
   strings[1] = imap_envelope_to_string(imsg->envelope);
   strings[2] = imap_body_to_string(imsg->body);
-  tot_size = sizeof(struct ImapMsgSerialized)-1;
+  tot_size = G_STRUCT_OFFSET(struct ImapMsgSerialized,
+                             fetched_headers_first_char);
   for(i=0; i<3; i++) {
     lengths[i] = strings[i]  ? strlen(strings[i])  : 0;
     tot_size += lengths[i] + 1;
   }
+  if(tot_size > G_MAXUINT32) {
+    g_free(strings[1]);
+    g_free(strings[2]);
+    return NULL;
+  }
 
   imes = g_malloc(tot_size);
-  imes->total_size = tot_size;
+  imes->total_size = GUINT32_TO_LE(tot_size);
   /* Message */
-  imes->uid           = imsg->uid;
-  imes->flags         = imsg->flags;
-  imes->internal_date = imsg->internal_date; /* delivery date */
-  imes->rfc822size    = imsg->rfc822size;
-  imes->available_headers = imsg->available_headers;
+  imes->uid           = GUINT32_TO_LE(imsg->uid);
+  imes->flags         = GUINT32_TO_LE(imsg->flags);
+  imes->rfc822size    = GINT32_TO_LE(imsg->rfc822size);
+  imes->internal_date = GINT64_TO_LE(imsg->internal_date);
+  imes->available_headers = GUINT32_TO_LE(imsg->available_headers);
+  imes->reserved      = 0;
 
   ptr = &imes->fetched_headers_first_char;
   for(i=0; i<3; i++) {
@@ -1914,8 +2065,6 @@ imap_message_serialize(ImapMessage *imsg)
   }
   g_free(strings[1]);
   g_free(strings[2]);
-  /* printf("Serialization offset: %d (tot size %d may include alignment)\n",
-     ptr-(gchar*)imes, tot_size); */
   return imes;
 }
 
@@ -1928,11 +2077,11 @@ imap_message_deserialize(void *data)
   ImapMessage* imsg = imap_message_new();
   gchar *ptr;
 
-  imsg->uid = imes->uid;
-  imsg->flags = imes->flags;
-  imsg->internal_date = imes->internal_date; /* delivery date */
-  imsg->rfc822size = imes->rfc822size;
-  imsg->available_headers = imes->available_headers;
+  imsg->uid = GUINT32_FROM_LE(imes->uid);
+  imsg->flags = GUINT32_FROM_LE(imes->flags);
+  imsg->internal_date = GINT64_FROM_LE(imes->internal_date);
+  imsg->rfc822size = GINT32_FROM_LE(imes->rfc822size);
+  imsg->available_headers = GUINT32_FROM_LE(imes->available_headers);
   /* Envelope */
   ptr = &imes->fetched_headers_first_char;
   imsg->fetched_header_fields = *ptr ? g_strdup(ptr) : NULL;
@@ -1948,7 +2097,141 @@ size_t
 imap_serialized_message_size(void *data)
 {
   struct ImapMsgSerialized *imes = (struct ImapMsgSerialized*)data;
-  return imes->total_size;
+  return GUINT32_FROM_LE(imes->total_size);
+}
+
+/** Checks that the len bytes at data hold a whole serialized message:
+    the size it records matches and the three strings end inside it. */
+gboolean
+imap_serialized_message_check(const void *data, size_t len)
+{
+  const struct ImapMsgSerialized *imes = data;
+  size_t offset =
+    G_STRUCT_OFFSET(struct ImapMsgSerialized, fetched_headers_first_char);
+  const gchar *ptr, *end;
+  int i;
+
+  if(len < offset + 3 || GUINT32_FROM_LE(imes->total_size) > len)
+    return FALSE;
+  end = (const gchar*)data + GUINT32_FROM_LE(imes->total_size);
+  for(i=0, ptr = &imes->fetched_headers_first_char; i<3; i++) {
+    if(ptr >= end || !(ptr = memchr(ptr, '\0', end - ptr)))
+      return FALSE;
+    ptr++;
+  }
+  return TRUE;
+}
+
+ImapUID
+imap_serialized_message_uid(void *data)
+{
+  struct ImapMsgSerialized *imes = (struct ImapMsgSerialized*)data;
+  return GUINT32_FROM_LE(imes->uid);
+}
+
+/** Returns the message cache entry for seqno, deserializing it first
+    if it was only registered with imap_mbox_handle_msg_deserialize().
+    Flags known to be current override the cached ones. */
+ImapMessage*
+imap_msg_cache_get(ImapMboxHandle *h, unsigned seqno)
+{
+  ImapMessage *imsg = h->msg_cache[seqno-1];
+
+  if(!imsg && h->msg_serialized && h->msg_serialized[seqno-1]) {
+    ImapFlagCache *flags =
+      &g_array_index(h->flag_cache, ImapFlagCache, seqno-1);
+    imsg = imap_message_deserialize((void*)h->msg_serialized[seqno-1]);
+    h->msg_serialized[seqno-1] = NULL;
+    if(flags->known_flags == (ImapMsgFlag)~0)
+      imsg->flags = flags->flag_values;
+    h->msg_cache[seqno-1] = imsg;
+  }
+  return imsg;
+}
+
+static ImapUID
+imap_msg_cache_uid(ImapMboxHandle *h, unsigned seqno)
+{
+  if(h->msg_cache[seqno-1])
+    return h->msg_cache[seqno-1]->uid;
+  if(h->msg_serialized && h->msg_serialized[seqno-1])
+    return imap_serialized_message_uid((void*)h->msg_serialized[seqno-1]);
+  return 0;
+}
+
+/** Provides serialized data for the msgno entry of the message cache
+    unless the envelope is known already. The data is deserialized
+    only when the message is accessed for the first time, so it must
+    stay valid - see imap_mbox_handle_keep_serialized(). A UID and
+    flags fetched before the cache was loaded take precedence over the
+    cached ones. flags_valid tells that the serialized flags are known
+    to be current, ie. they were resynchronized with the server. */
+void
+imap_mbox_handle_msg_deserialize(ImapMboxHandle *h, unsigned msgno,
+                                 void *data, gboolean flags_valid)
+{
+  struct ImapMsgSerialized *imes = (struct ImapMsgSerialized*)data;
+  ImapMessage *imsg, *fetched;
+  ImapFlagCache *flags;
+
+  if(msgno<1 || msgno>h->exists)
+    return;
+  fetched = h->msg_cache[msgno-1];
+  if(fetched && (fetched->envelope ||
+                 fetched->uid != GUINT32_FROM_LE(imes->uid)))
+    return;
+  flags = &g_array_index(h->flag_cache, ImapFlagCache, msgno-1);
+  if(flags_valid && flags->known_flags != (ImapMsgFlag)~0) {
+    flags->flag_values = GUINT32_FROM_LE(imes->flags);
+    flags->known_flags = ~0;
+  }
+  if(fetched) { /* UID and FLAGS were fetched already. */
+    imsg = imap_message_deserialize(data);
+    if(flags->known_flags == (ImapMsgFlag)~0)
+      imsg->flags = flags->flag_values;
+    imap_message_free(fetched);
+    h->msg_cache[msgno-1] = imsg;
+    return;
+  }
+  if(!h->msg_serialized)
+    h->msg_serialized = g_new0(const void*, h->exists);
+  h->msg_serialized[msgno-1] = data;
+}
+
+/** Makes the handle responsible for the storage of the data passed
+    to imap_mbox_handle_msg_deserialize(): release(owner) is called
+    once the message cache is invalidated. */
+void
+imap_mbox_handle_keep_serialized(ImapMboxHandle *h, gpointer owner,
+                                 GDestroyNotify release)
+{
+  unsigned i;
+
+  if(h->serialized_owner) { /* data of the old owner must go first */
+    for(i=1; i<=h->exists; i++)
+      imap_msg_cache_get(h, i);
+    imap_serialized_release(h);
+  }
+  h->serialized_owner   = owner;
+  h->serialized_release = release;
+}
+
+/** Returns a newly allocated serialized copy of the msgno message,
+    without deserializing it if it was not accessed yet, or NULL if
+    the message envelope is not known. */
+void*
+imap_mbox_handle_msg_serialize(ImapMboxHandle *h, unsigned msgno)
+{
+  void *data;
+
+  if(msgno<1 || msgno>h->exists)
+    return NULL;
+  if(h->msg_cache[msgno-1])
+    return imap_message_serialize(h->msg_cache[msgno-1]);
+  if(!h->msg_serialized || !h->msg_serialized[msgno-1])
+    return NULL;
+  data = (void*)h->msg_serialized[msgno-1];
+  return g_memdup(data, imap_serialized_message_size(data));
 }
 
 /* =================================================================== */
@@ -2180,6 +2463,300 @@ imap_cmd_exec_cmds(ImapMboxHandle* handle, const char** cmds,
   return ret_rc;
 }
 
+/* ===================================================================
+   Command pipelining. The commands of an ImapPipeline are written to
+   the server back-to-back, without waiting for the completion of the
+   previous ones, so a sequence of N independent commands costs one
+   round trip instead of N. The completion callbacks are called in the
+   order in which the commands were added.
+
+   A command is held back until all the previous ones have completed
+   if it is flagged IMPIPE_WAIT or IMPIPE_IF_OK, or if it follows a
+   command that changes the connection state or renumbers the
+   messages (see imap_pipeline_is_barrier()): the sequence numbers in
+   the command text were computed before such a command was sent.
+   Synchronizing literals force a flush and a wait for the server's
+   continuation request; servers that advertise LITERAL+ get
+   non-synchronizing literals instead so that the pipeline is not
+   stalled.
+*/
+
+/** maximum number of commands sent but not completed; bounds the
+    amount of data the server has to buffer for us. */
+#define IMAP_PIPELINE_DEPTH 32
+
+struct ImapPipelineLiteral {
+  char *data;
+  size_t len;
+  char *tail; /**< command text following the literal */
+};
+
+struct ImapPipelineCmd {
+  char *cmd;
+  GSList *literals; /**< list of ImapPipelineLiteral */
+  ImapPipelineFlags flags;
+  ImapPipelineCb cb;
+  void *cb_arg;
+  unsigned cmdno;
+  ImapResponse rc;
+  unsigned sent:1;
+  unsigned done:1;
+};
+
+struct _ImapPipeline {
+  ImapMboxHandle *handle;
+  GPtrArray *cmds;
+};
+
+ImapPipeline*
+imap_pipeline_new(ImapMboxHandle *h)
+{
+  ImapPipeline *p = g_new(ImapPipeline, 1);
+  p->handle = h;
+  p->cmds = g_ptr_array_new();
+  return p;
+}
+
+static void
+imap_pipeline_cmd_free(struct ImapPipelineCmd *c)
+{
+  GSList *l;
+  for(l = c->literals; l; l = l->next) {
+    struct ImapPipelineLiteral *lit = l->data;
+    g_free(lit->data);
+    g_free(lit->tail);
+    g_free(lit);
+  }
+  g_slist_free(c->literals);
+  g_free(c->cmd);
+  g_free(c);
+}
+
+void
+imap_pipeline_free(ImapPipeline *p)
+{
+  g_ptr_array_foreach(p->cmds, (GFunc)imap_pipeline_cmd_free, NULL);
+  g_ptr_array_free(p->cmds, TRUE);
+  g_free(p);
+}
+
+/** imap_pipeline_add() appends a command to the pipeline. cb, if
+    not NULL, will be called with the completion code of the
+    command. Returns the 0-based index of the command. */
+unsigned
+imap_pipeline_add(ImapPipeline *p, const char *cmd, ImapPipelineFlags flags,
+                  ImapPipelineCb cb, void *cb_arg)
+{
+  struct ImapPipelineCmd *c = g_new0(struct ImapPipelineCmd, 1);
+  c->cmd = g_strdup(cmd);
+  c->flags = flags;
+  c->cb = cb;
+  c->cb_arg = cb_arg;
+  g_ptr_array_add(p->cmds, c);
+  return p->cmds->len - 1;
+}
+
+/** imap_pipeline_add_literal() extends the last added command with
+    a literal of given length, followed by the text in tail. */
+void
+imap_pipeline_add_literal(ImapPipeline *p, const char *data, size_t len,
+                          const char *tail)
+{
+  struct ImapPipelineCmd *c;
+  struct ImapPipelineLiteral *lit;
+
+  g_return_if_fail(p->cmds->len > 0);
+  c = g_ptr_array_index(p->cmds, p->cmds->len - 1);
+  lit = g_new(struct ImapPipelineLiteral, 1);
+  lit->data = g_memdup(data, len);
+  lit->len  = len;
+  lit->tail = g_strdup(tail ? tail : "");
+  c->literals = g_slist_append(c->literals, lit);
+}
+
+/** imap_pipeline_is_barrier() checks whether the command changes the
+    state of the connection or the message numbering so that the
+    commands following it must not be sent before it completes. */
+static gboolean
+imap_pipeline_is_barrier(const char *cmd)
+{
+  static const char *barriers[] = {
+    "SELECT", "EXAMINE", "CLOSE", "UNSELECT", "EXPUNGE", "LOGOUT",
+    "LOGIN", "AUTHENTICATE", "STARTTLS", "COMPRESS", "IDLE"
+  };
+  size_t len;
+  unsigned i;
+
+  if(g_ascii_strncasecmp(cmd, "UID ", 4) == 0)
+    cmd += 4;
+  len = strcspn(cmd, " ");
+  for(i=0; i<G_N_ELEMENTS(barriers); i++)
+    if(strlen(barriers[i]) == len &&
+       g_ascii_strncasecmp(cmd, barriers[i], len) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+/** handler of pipelined commands: keeps the completion code of
+    commands completed while we were waiting for another one. */
+static gboolean
+cmdi_keep(ImapMboxHandle *h, void *d)
+{ return FALSE; }
+
+/** imap_pipeline_send() writes the command to the server. Returns
+    FALSE if the command has been completed already - the server
+    rejected it when asked for a synchronizing literal - or the
+    connection was severed. */
+static gboolean
+imap_pipeline_send(ImapMboxHandle *h, struct ImapPipelineCmd *c,
+                   gboolean literal_plus)
+{
+  ImapCmdTag tag;
+  GSList *l;
+
+  if(IMAP_MBOX_IS_DISCONNECTED(h)) {
+    c->rc = IMR_SEVERED;
+    c->done = 1;
+    return FALSE;
+  }
+  c->cmdno = imap_make_tag(tag);
+  cmdi_add_handler(&h->cmd_info, c->cmdno, cmdi_keep, NULL);
+  c->sent = 1;
+  sio_write(h->sio, tag, strlen(tag));
+  sio_write(h->sio, " ", 1);
+  sio_write(h->sio, c->cmd, strlen(c->cmd));
+  for(l = c->literals; l; l = l->next) {
+    struct ImapPipelineLiteral *lit = l->data;
+    if(literal_plus)
+      sio_printf(h->sio, "{%lu+}\r\n", (unsigned long)lit->len);
+    else {
+      ImapResponse rc;
+      int ch;
+      sio_printf(h->sio, "{%lu}\r\n", (unsigned long)lit->len);
+      sio_flush(h->sio);
+      do
+        rc = imap_cmd_step(h, c->cmdno);
+      while(rc == IMR_UNTAGGED);
+      if(rc != IMR_RESPOND) {
+        c->rc = rc;
+        c->done = 1;
+        return FALSE;
+      }
+      /* consume to the end of line */
+      while( (ch=sio_getc(h->sio)) != -1 && ch != '\n')
+        ;
+      if(ch == -1) {
+        imap_handle_disconnect(h);
+        c->rc = IMR_SEVERED;
+        c->done = 1;
+        return FALSE;
+      }
+    }
+    sio_write(h->sio, lit->data, lit->len);
+    sio_write(h->sio, lit->tail, strlen(lit->tail));
+  }
+  sio_write(h->sio, "\r\n", 2);
+  return TRUE;
+}
+
+/** imap_pipeline_collect() waits for the completion of a command
+    that has been sent. */
+static void
+imap_pipeline_collect(ImapMboxHandle *h, struct ImapPipelineCmd *c)
+{
+  struct CmdInfo *ci;
+
+  if(!c->done && h->state == IMHS_DISCONNECTED) {
+    c->rc = IMR_SEVERED;
+    c->done = 1;
+  } else if(!c->done) {
+    ImapResponse rc;
+    do
+      rc = imap_cmd_step(h, c->cmdno);
+    while(rc == IMR_UNTAGGED);
+    c->rc = rc;
+    c->done = 1;
+  }
+  if(c->sent && (ci = cmdi_find_by_no(h->cmd_info, c->cmdno)) != NULL) {
+    h->cmd_info = g_list_remove(h->cmd_info, ci);
+    g_free(ci);
+  }
+}
+
+/** imap_pipeline_run() sends the commands of the pipeline, waits
+    for their completion and calls their callbacks. A command flagged
+    IMPIPE_IF_OK is not sent and completes with IMR_NO if the command
+    preceding it did not succeed. Once the connection is severed, all
+    the remaining commands complete with IMR_SEVERED. Frees the
+    pipeline. Returns the completion code of the last command or the
+    first connection-level failure. */
+ImapResponse
+imap_pipeline_run(ImapPipeline *p)
+{
+  ImapMboxHandle *h = p->handle;
+  ImapResponse rc = IMR_OK;
+  gboolean literal_plus;
+  unsigned sent = 0, collected = 0, n = p->cmds->len;
+
+  if (h->state == IMHS_DISCONNECTED || !imap_handle_idle_disable(h))
+    rc = IMR_SEVERED;
+  /* Ask now: checking a capability may require a command on its own. */
+  literal_plus = rc == IMR_OK && imap_mbox_handle_can_do(h, IMCAP_LITERAL);
+
+  while(collected < n) {
+    struct ImapPipelineCmd *c;
+
+    /* Send as much as the dependencies allow... */
+    while(rc == IMR_OK && sent < n && sent - collected < IMAP_PIPELINE_DEPTH) {
+      c = g_ptr_array_index(p->cmds, sent);
+      if(sent > collected &&
+         ((c->flags & (IMPIPE_WAIT|IMPIPE_IF_OK)) ||
+          imap_pipeline_is_barrier(((struct ImapPipelineCmd*)
+                                    g_ptr_array_index(p->cmds, sent-1))
+                                   ->cmd)))
+        break;
+      if((c->flags & IMPIPE_IF_OK) && sent > 0 &&
+         ((struct ImapPipelineCmd*)g_ptr_array_index(p->cmds, sent-1))
+         ->rc != IMR_OK) {
+        c->rc = IMR_NO;
+        c->done = 1;
+      } else
+        imap_pipeline_send(h, c, literal_plus);
+      sent++;
+    }
+    if(rc == IMR_OK && h->state != IMHS_DISCONNECTED)
+      sio_flush(h->sio);
+    if(h->state == IMHS_DISCONNECTED)
+      rc = IMR_SEVERED;
+
+    /* ... and collect the oldest command. */
+    c = g_ptr_array_index(p->cmds, collected);
+    if(rc != IMR_OK && !c->done) {
+      c->rc = IMR_SEVERED;
+      c->done = 1;
+    }
+    imap_pipeline_collect(h, c);
+    if(c->rc == IMR_RESPOND) {
+      /* We have nothing to send: the stream is out of sync. */
+      imap_handle_disconnect(h);
+      c->rc = IMR_SEVERED;
+    }
+    if(c->rc == IMR_SEVERED || c->rc == IMR_BYE)
+      rc = c->rc;
+    if(c->cb)
+      c->cb(h, c->rc, c->cb_arg);
+    collected++;
+  }
+
+  if(rc == IMR_OK && n > 0)
+    rc = ((struct ImapPipelineCmd*)g_ptr_array_index(p->cmds, n-1))->rc;
+  imap_pipeline_free(p);
+  if(h->state != IMHS_DISCONNECTED)
+    imap_handle_idle_enable(h, IDLE_TIMEOUT);
+
+  return rc;
+}
+
 int
 imap_handle_write(ImapMboxHandle *conn, const char *buf, size_t len)
 {
@@ -2229,33 +2806,71 @@ lbi_strerror(ImapResult rc)
   }
 }
 
+/* Appends the rest of a quoted string, after the opening quote, to
+   res. The string is copied span by span straight from the read
+   buffer: only the closing quote and backslash escapes end a span. */
+static void
+imap_get_quoted(struct siobuf *sio, GString *res)
+{
+  for(;;) {
+    const char *p, *quote, *bs;
+    int avail, n, c;
+
+    if( (p = sio_peek(sio, &avail)) == NULL)
+      return;
+    quote = memchr(p, '"', avail);
+    n = quote ? quote - p : avail;
+    if( (bs = memchr(p, '\\', n)) != NULL) {
+      g_string_append_len(res, p, bs - p);
+      sio_skip(sio, bs - p + 1);
+      if( (c = sio_getc(sio)) == EOF)
+        return;
+      g_string_append_c(res, c);
+      continue;
+    }
+    g_string_append_len(res, p, n);
+    if(quote) {
+      sio_skip(sio, n + 1);
+      return;
+    }
+    sio_skip(sio, n);
+  }
+}
+
+/* Reads the "{length}" CRLF that introduces a literal, c being its
+   first character, and returns the length, or -1 on error. */
+static int
+imap_get_literal_length(struct siobuf *sio, int c)
+{
+  char buf[15];
+  int len;
+
+  if(c=='~') /* BINARY extension literal8 indicator */
+    c = sio_getc(sio);
+  if(c!='{')
+    return -1;
+
+  c = imap_get_atom(sio, buf, sizeof(buf));
+  len = strlen(buf); 
+  if(len==0 || buf[len-1] != '}') return -1;
+  buf[len-1] = '\0';
+  len = strtol(buf, NULL, 10);
+  if( c != 0x0d) { printf("lit1:%d\n",c); return -1;}
+  if( (c=sio_getc(sio)) != 0x0a) { printf("lit1:%d\n",c); return -1;}
+  return len;
+}
+
 static GString*
 imap_get_string_with_lookahead(struct siobuf* sio, int c)
 { /* string */  
   GString *res = NULL;
   if(c=='"') { /* quoted */
     res = g_string_new("");
-    while( (c=sio_getc(sio)) != '"' && c != EOF) {
-      if(c== '\\')
-        c = sio_getc(sio);
-      g_string_append_c(res, c);
-    }
+    imap_get_quoted(sio, res);
   } else { /* this MUST be literal */
-    char buf[15];
-    int len;
-    if(c=='~') /* BINARY extension literal8 indicator */
-      c = sio_getc(sio);
-    if(c!='{') {
+    int len = imap_get_literal_length(sio, c);
+    if(len<0)
       return NULL; /* ERROR */
-    }
-
-    c = imap_get_atom(sio, buf, sizeof(buf));
-    len = strlen(buf); 
-    if(len==0 || buf[len-1] != '}') return NULL;
-    buf[len-1] = '\0';
-    len = strtol(buf, NULL, 10);
-    if( c != 0x0d) { printf("lit1:%d\n",c); return NULL;}
-    if( (c=sio_getc(sio)) != 0x0a) { printf("lit1:%d\n",c); return NULL;}
     res = g_string_sized_new(len+1);
     if(len>0) sio_read(sio, res->str, len);
     res->len = len;
@@ -2294,7 +2909,6 @@ imap_get_nstring(struct siobuf* sio)
 }
 
 /* see the spec for the definition of astring */
-#define IS_ASTRING_CHAR(c) (strchr("(){ %*\"\\", (c))==0&&(c)>0x1F&&(c)!=0x7F)
 static char*
 imap_get_astring(struct siobuf *sio, int* lookahead)
 {
@@ -2303,12 +2917,9 @@ imap_get_astring(struct siobuf *sio, int* lookahead)
 
   if(IS_ASTRING_CHAR(c)) {
     GString *str = g_string_new("");
-    do {
-      g_string_append_c(str, c);
-      c = sio_getc(sio);
-    } while(IS_ASTRING_CHAR(c));
+    g_string_append_c(str, c);
+    *lookahead = imap_get_span(sio, IMAP_CC_ASTRING, NULL, 0, NULL, str);
     res = g_string_free(str, FALSE);
-    *lookahead = c;
   } else {
     res = g_string_free(imap_get_string_with_lookahead(sio, c), FALSE);
     *lookahead = sio_getc(sio);
@@ -2328,6 +2939,48 @@ imap_get_binary_string(struct siobuf *sio)
     return imap_get_string_with_lookahead(sio, c);
 }
 
+/* Passes an nstring or literal8 to body_cb as it arrives: a literal
+   is handed over in the pieces the read buffer holds, without ever
+   being collected in memory, so body_cb is called several times for
+   one string. This is used instead of imap_get_binary_string() when
+   the handle's body_streamed flag says body_cb can cope with that. */
+static ImapResponse
+imap_stream_binary_string(struct siobuf *sio, unsigned seqno,
+                          ImapFetchBodyType body_type,
+                          ImapFetchBodyInternalCb body_cb, void *arg)
+{
+  int c = sio_getc(sio), len;
+
+  if(toupper(c)=='N') { /* nil */
+    sio_getc(sio); sio_getc(sio); /* ignore i and l */
+    body_cb(seqno, body_type, "", 0, arg);
+    return IMR_OK;
+  }
+  if(c=='"') { /* quoted strings are short, pass them in one go */
+    GString *res = g_string_new("");
+    imap_get_quoted(sio, res);
+    body_cb(seqno, body_type, res->str, res->len, arg);
+    g_string_free(res, TRUE);
+    return IMR_OK;
+  }
+
+  if( (len = imap_get_literal_length(sio, c)) < 0)
+    return IMR_PROTOCOL;
+  while(len>0) {
+    int avail;
+    const char *p = sio_peek(sio, &avail);
+
+    if(!p)
+      return IMR_SEVERED;
+    if(avail>len)
+      avail = len;
+    body_cb(seqno, body_type, p, avail, arg);
+    sio_skip(sio, avail);
+    len -= avail;
+  }
+  return IMR_OK;
+}
+
 /* this file contains all the response handlers as defined in
    draft-crspin-imapv-20.txt. 
   
@@ -2369,9 +3022,10 @@ ir_capability_data(ImapMboxHandle *handle)
     "IMAP4", "IMAP4rev1", "STATUS",
     "AUTH=ANONYMOUS", "AUTH=CRAM-MD5", "AUTH=GSSAPI", "AUTH=PLAIN",
     "ACL", "RIGHTS=", "BINARY", "CHILDREN",
-    "COMPRESS=DEFLATE",
-    "ESEARCH", "IDLE", "LITERAL+",
-    "LOGINDISABLED", "MULTIAPPEND", "NAMESPACE", "QUOTA", "SASL-IR",
+    "COMPRESS=DEFLATE", "CONDSTORE",
+    "ESEARCH", "IDLE", "LIST-STATUS", "LITERAL+",
+    "LOGINDISABLED", "MULTIAPPEND", "NAMESPACE", "QRESYNC", "QUOTA",
+    "SASL-IR",
     "SCAN", "STARTTLS",
     "SORT", "THREAD=ORDEREDSUBJECT", "THREAD=REFERENCES",
     "UIDPLUS", "UNSELECT"
@@ -2490,7 +3144,7 @@ ir_resp_text_code(ImapMboxHandle *h)
   static const char* resp_text_code[] = {
     "ALERT", "BADCHARSET", "CAPABILITY","PARSE", "PERMANENTFLAGS",
     "READ-ONLY", "READ-WRITE", "TRYCREATE", "UIDNEXT", "UIDVALIDITY",
-    "UNSEEN", "APPENDUID", "COPYUID"
+    "UNSEEN", "APPENDUID", "COPYUID", "HIGHESTMODSEQ", "NOMODSEQ"
   };
   unsigned o;
   char buf[128];
@@ -2533,6 +3187,13 @@ ir_resp_text_code(ImapMboxHandle *h)
       return rc;
     c = sio_getc(h->sio);
     break;
+  case 13: /* HIGHESTMODSEQ, RFC 7162 */
+    c = imap_get_atom(h->sio, buf, sizeof(buf));
+    h->highestmodseq = g_ascii_strtoull(buf, NULL, 10);
+    break;
+  case 14: /* NOMODSEQ */
+    h->highestmodseq = 0;
+    break;
   default: while( c != ']' && (c=sio_getc(h->sio)) != EOF) ; break;
   }
   if(c != ']')
@@ -2657,6 +3318,21 @@ ir_capability(ImapMboxHandle *handle)
   int c = ir_capability_data(handle);
   return ir_check_crlf(handle, c);
 }
+
+/* RFC 5161: "ENABLED *(SP capability)" */
+static ImapResponse
+ir_enabled(ImapMboxHandle *handle)
+{
+  char atom[LONG_STRING];
+  int c;
+
+  do {
+    c = imap_get_atom(handle->sio, atom, sizeof(atom));
+    if(g_ascii_strcasecmp(atom, "QRESYNC") == 0)
+      handle->qresync_enabled = TRUE;
+  } while(c == ' ');
+  return ir_check_crlf(handle, c);
+}
 /* follow mailbox-list syntax (See rfc) */
 static ImapResponse
 ir_list_lsub(ImapMboxHandle *h, ImapHandleSignal signal)
@@ -2727,38 +3403,53 @@ static ImapResponse
 ir_status(ImapMboxHandle *h)
 {
   int c;
-  char *name;
+  char *name, *mbx;
   struct ImapStatusResult *resp;
+  struct ImapStatusResult items[ELEMENTS(imap_status_item_names)+1];
+  unsigned n = 0;
 
   name = imap_get_astring(h->sio, &c);
-  resp = g_hash_table_lookup(h->status_resps, name);
   if(c                != ' ') {g_free(name); return IMR_PROTOCOL;}
   if(sio_getc(h->sio) != '(') {g_free(name); return IMR_PROTOCOL;}
   do {
-    char item[13], count[13]; /* longest than UIDVALIDITY */
+    char item[15], count[24]; /* longer than HIGHESTMODSEQ */
+    unsigned idx;
     c = imap_get_atom(h->sio, item, sizeof(item));
     if(c == ')') break;
     if(c != ' ') {g_free(name); return IMR_PROTOCOL;}
     c = imap_get_atom(h->sio, count, sizeof(count));
-    /* FIXME: process the response */
-    if(resp) {
-      unsigned idx, i;
-      for(idx=0; idx<ELEMENTS(imap_status_item_names); idx++)
-        if(g_ascii_strcasecmp(item, imap_status_item_names[idx]) == 0)
-          break;
-      for(i= 0; resp[i].item != IMSTAT_NONE; i++) {
-        if(resp[i].item == idx) {
-          if (sscanf(count, "%u", &resp[i].result) != 1) {
-            g_free(name);
-            return IMR_PROTOCOL;
-          }
-          break;
-        }
+    for(idx=0; idx<ELEMENTS(imap_status_item_names); idx++)
+      if(g_ascii_strcasecmp(item, imap_status_item_names[idx]) == 0)
+        break;
+    if(idx<ELEMENTS(imap_status_item_names) &&
+       n<ELEMENTS(imap_status_item_names)) {
+      items[n].item = idx;
+      if (sscanf(count, "%u", &items[n].result) != 1) {
+        g_free(name);
+        return IMR_PROTOCOL;
       }
+      n++;
     }
   } while(c == ' ');
-  g_free(name);
+  items[n].item = IMSTAT_NONE;
+  items[n].result = 0;
   /* g_return_val_if-fail(c == ')', IMR_BAD) */
+
+  /* status_resps is keyed by UTF-8 names, as passed to
+     imap_mbox_status(). */
+  mbx = imap_mailbox_to_utf8(name);
+  g_free(name);
+  resp = g_hash_table_lookup(h->status_resps, mbx);
+  if(resp) {
+    unsigned i, j;
+    for(i= 0; resp[i].item != IMSTAT_NONE; i++)
+      for(j=0; j<n; j++)
+        if(resp[i].item == items[j].item)
+          resp[i].result = items[j].result;
+  }
+  if(h->status_cb)
+    h->status_cb(h, mbx, items, h->status_arg);
+  g_free(mbx);
   return ir_check_crlf(h, sio_getc(h->sio));
 }
 
@@ -2885,22 +3576,88 @@ ir_recent(ImapMboxHandle *h, unsigned seqno)
   return ir_check_crlf(h, sio_getc(h->sio));
 }
 
+/* EXPUNGE and VANISHED responses are collected in h->expunged, as
+   message numbers from before the first of them, and applied in one
+   go when a response other than EXPUNGE comes, tagged or not, or when
+   no more data arrives in async_process_real(). A large expunge then
+   costs one pass over the caches and one expunge-notify signal
+   instead of one of each per message, however the responses are split
+   between reads. */
+
+/* Adds message seqno, numbered as the server numbers it now, to the
+   batch. Its number before the batch is seqno plus the number of
+   batch entries below it; entry i is below it iff entry[i]-i <=
+   seqno, and entry[i]-i grows with i. */
+static void
+imap_expunged_add(ImapMboxHandle *h, unsigned seqno)
+{
+  GArray *set = h->expunged;
+  unsigned lo = 0, hi = set->len, msgno;
+
+  if(seqno == 0 || seqno > h->exists - set->len) {
+    printf("EXPUNGE of nonexistent message %u ignored.\n", seqno);
+    return;
+  }
+  while(lo < hi) {
+    unsigned mid = (lo + hi)/2;
+    if(g_array_index(set, unsigned, mid) - mid <= seqno)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  msgno = seqno + lo;
+  g_array_insert_val(set, lo, msgno);
+}
+
+/* Tells the listeners which messages are gone, then removes them from
+   the caches and the view in a single pass. */
+static void
+imap_expunged_flush(ImapMboxHandle *h)
+{
+  GArray *set = h->expunged;
+  unsigned i, j, k;
+
+  if(set->len == 0)
+    return;
+
+  if(h->msg_serialized) /* the listeners look the messages up */
+    for(k = 0; k < set->len; k++)
+      imap_msg_cache_get(h, g_array_index(set, unsigned, k));
+  g_signal_emit(G_OBJECT(h), imap_mbox_handle_signals[EXPUNGE_NOTIFY],
+		0, set);
+
+  i = j = g_array_index(set, unsigned, 0) - 1;
+  for(k = 0; i < h->exists; i++) {
+    if(k < set->len && g_array_index(set, unsigned, k) == i + 1) {
+      if(h->msg_cache[i] != NULL)
+        imap_message_free(h->msg_cache[i]);
+      k++;
+      continue;
+    }
+    h->msg_cache[j] = h->msg_cache[i];
+    if(h->msg_serialized)
+      h->msg_serialized[j] = h->msg_serialized[i];
+    g_array_index(h->flag_cache, ImapFlagCache, j) =
+      g_array_index(h->flag_cache, ImapFlagCache, i);
+    j++;
+  }
+  for(i = j; i < h->exists; i++) {
+    h->msg_cache[i] = NULL;
+    if(h->msg_serialized)
+      h->msg_serialized[i] = NULL;
+  }
+  g_array_set_size(h->flag_cache, j);
+  h->exists = j;
+  mbox_view_expunge(&h->mbox_view, set);
+  g_array_set_size(set, 0);
+}
+
 static ImapResponse
 ir_expunge(ImapMboxHandle *h, unsigned seqno)
 {
   ImapResponse rc = ir_check_crlf(h, sio_getc(h->sio));
-  g_signal_emit(G_OBJECT(h), imap_mbox_handle_signals[EXPUNGE_NOTIFY],
-		0, seqno);
-  
-  g_array_remove_index(h->flag_cache, seqno-1);
-  if(h->msg_cache[seqno-1] != NULL)
-    imap_message_free(h->msg_cache[seqno-1]);
-  while(seqno<h->exists) {
-    h->msg_cache[seqno-1] = h->msg_cache[seqno];
-    seqno++;
-  }
-  h->exists--;
-  mbox_view_expunge(&h->mbox_view, seqno);
+
+  imap_expunged_add(h, seqno);
   return rc;
 }
 
@@ -2913,7 +3670,7 @@ flags_tasklet(ImapMboxHandle *h, void *data)
 }
 
 #define CREATE_IMSG_IF_NEEDED(h,seqno) \
-  if((h)->msg_cache[seqno-1] == NULL) \
+  if(imap_msg_cache_get((h), (seqno)) == NULL) \
      (h)->msg_cache[(seqno)-1] = imap_message_new();
 
 static ImapResponse
@@ -3031,6 +3788,151 @@ ir_quota(ImapMboxHandle *h)
   return retval;
 }
 
+static void
+vanished_add_range(ImapUidRange *iur, GArray *ranges)
+{
+  g_array_append_val(ranges, *iur);
+}
+
+static gint
+vanished_cmp_range(const ImapUidRange *a, const ImapUidRange *b)
+{
+  return a->lo < b->lo ? -1 : a->lo > b->lo;
+}
+
+/* Counts the vanished UIDs above lo and below hi; overlapping ranges
+   may be counted twice, which only makes the count inconclusive. */
+static unsigned
+vanished_count(GArray *ranges, ImapUID lo, ImapUID hi)
+{
+  unsigned i;
+  guint64 cnt = 0;
+
+  for(i=0; i<ranges->len; i++) {
+    ImapUidRange *r = &g_array_index(ranges, ImapUidRange, i);
+    ImapUID a = MAX(r->lo, lo + 1), b = MIN(r->hi, hi - 1);
+    if(a <= b)
+      cnt += b - a + 1;
+  }
+  return MIN(cnt, G_MAXUINT);
+}
+
+/* Forgets everything about the messages from seqno on, and drops
+   lost of them from the end: which of them vanished cannot be told
+   any more. The listeners see the count go down and fetch the
+   remaining messages again. */
+static void
+vanished_resync(ImapMboxHandle *h, unsigned seqno, unsigned lost)
+{
+  unsigned i;
+
+  printf("VANISHED: %u unknown messages from %u on; resynchronizing.\n",
+         lost, seqno);
+  for(i=seqno-1; i<h->exists; i++) {
+    if(h->msg_cache[i]) {
+      imap_message_free(h->msg_cache[i]);
+      h->msg_cache[i] = NULL;
+    }
+    if(h->msg_serialized)
+      h->msg_serialized[i] = NULL;
+    g_array_index(h->flag_cache, ImapFlagCache, i).known_flags = 0;
+  }
+  imap_mbox_resize_cache(h, h->exists - lost);
+  mbox_view_dispose(&h->mbox_view);
+  g_signal_emit(G_OBJECT(h), imap_mbox_handle_signals[EXISTS_NOTIFY], 0);
+}
+
+/* RFC 5162, sect. 3.6: "VANISHED [(EARLIER)] <known-uids>". The
+   messages are looked up by UID in the message cache and expunged in
+   one batch. Messages whose UIDs we have not fetched are placed by
+   the UIDs around them: a run of them is expunged when all of it
+   vanished, and kept when none did; otherwise we cannot tell which
+   of them went, and everything from that run on is fetched anew.
+   VANISHED (EARLIER) refers to messages removed before the mailbox
+   was selected; it is passed to h->vanished_earlier when somebody
+   resynchronizing a cache asked for it. */
+static ImapResponse
+ir_vanished(ImapMboxHandle *h)
+{
+  GArray *ranges;
+  ImapResponse rc;
+  unsigned i;
+  gboolean earlier = FALSE;
+  int c = sio_getc(h->sio);
+
+  if(c == '(') {
+    char atom[10];
+    if(imap_get_atom(h->sio, atom, sizeof(atom)) != ')' ||
+       sio_getc(h->sio) != ' ')
+      return IMR_PROTOCOL;
+    earlier = g_ascii_strcasecmp(atom, "EARLIER") == 0;
+  } else
+    sio_ungetc(h->sio);
+
+  ranges = earlier && h->vanished_earlier
+    ? h->vanished_earlier : g_array_new(FALSE, FALSE, sizeof(ImapUidRange));
+  rc = imap_get_sequence(h, (ImapUidRangeCb)vanished_add_range, ranges);
+  if(rc == IMR_OK)
+    rc = ir_check_crlf(h, sio_getc(h->sio));
+  if(ranges == h->vanished_earlier)
+    return rc;
+  if(rc == IMR_OK && ranges->len > 0) {
+    /* The current run of unknown UIDs: its first message, length,
+       the known UID before it and the batch size when it started. */
+    unsigned run_start = 0, run_len = 0, run_below = 0;
+    unsigned lost = 0, lost_from = 0;
+    ImapUID run_after = 0;
+
+    g_array_sort(ranges, (GCompareFunc)vanished_cmp_range);
+    imap_expunged_flush(h);
+    for(i=0; i<=h->exists; i++) {
+      ImapUID uid = i < h->exists ? imap_msg_cache_uid(h, i + 1) : 0;
+      unsigned lo = 0, hi = ranges->len;
+
+      if(i < h->exists && !uid) {
+        if(run_len++ == 0) {
+          run_start = i + 1;
+          run_below = h->expunged->len;
+        }
+        continue;
+      }
+      if(run_len > 0) {
+        unsigned cnt = vanished_count(ranges, run_after,
+                                      i < h->exists ? uid : (ImapUID)~0);
+        if(cnt == run_len) {
+          unsigned seqno;
+          for(seqno = run_start; seqno < run_start + run_len; seqno++)
+            g_array_append_val(h->expunged, seqno);
+        } else if(cnt > 0) {
+          if(lost == 0)
+            lost_from = run_start - run_below;
+          lost += MIN(cnt, run_len);
+        }
+        run_len = 0;
+      }
+      if(i == h->exists)
+        break;
+      run_after = uid;
+      while(lo < hi) { /* find the last range starting at or below uid */
+        unsigned mid = (lo + hi)/2;
+        if(g_array_index(ranges, ImapUidRange, mid).lo <= uid)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      if(lo > 0 && uid <= g_array_index(ranges, ImapUidRange, lo-1).hi) {
+        unsigned seqno = i + 1;
+        g_array_append_val(h->expunged, seqno);
+      }
+    }
+    imap_expunged_flush(h);
+    if(lost > 0)
+      vanished_resync(h, lost_from, lost);
+  }
+  g_array_free(ranges, TRUE);
+  return rc;
+}
+
 /** \brief Interpret a RFC 4314 ACL
  *
  * \param h IMAP mailbox handle
@@ -3402,7 +4304,12 @@ ir_msg_att_internaldate(ImapMboxHandle *h, int c, unsigned seqno)
 static ImapResponse
 ir_msg_att_rfc822(ImapMboxHandle *h, int c, unsigned seqno)
 {
-  gchar *str = imap_get_nstring(h->sio);
+  gchar *str;
+
+  if(h->body_streamed && h->body_cb)
+    return imap_stream_binary_string(h->sio, seqno, IMAP_BODY_TYPE_RFC822,
+                                     h->body_cb, h->body_arg);
+  str = imap_get_nstring(h->sio);
   if(str && h->body_cb)
     h->body_cb(seqno, IMAP_BODY_TYPE_RFC822, str, strlen(str), h->body_arg);
   g_free(str);
@@ -4074,12 +4981,13 @@ ir_body (struct siobuf *sio, int c, ImapBody * body,
 
 /* read [section] and following string. FIXME: other kinds of body. */ 
 static ImapResponse
-ir_body_section(struct siobuf *sio, unsigned seqno,
-		ImapFetchBodyType body_type,
-		ImapFetchBodyInternalCb body_cb, void *arg)
+ir_body_section(ImapMboxHandle *h, unsigned seqno,
+		ImapFetchBodyType body_type)
 {
+  struct siobuf *sio = h->sio;
   char buf[80];
   GString *bs;
+  ImapResponse rc = IMR_OK;
   int i, c = imap_get_atom(sio, buf, sizeof(buf));
 
   for(i=0; buf[i] && (isdigit((int)buf[i]) || buf[i] == '.'); i++)
@@ -4089,13 +4997,22 @@ ir_body_section(struct siobuf *sio, unsigned seqno,
 
   if(c != ']') { puts("] expected"); return IMR_PROTOCOL; }
   if(sio_getc(sio) != ' ') { puts("space expected"); return IMR_PROTOCOL;}
-  bs = imap_get_binary_string(sio);
-  if(bs) {
-    if(bs->str && body_cb)
-      body_cb(seqno, body_type, bs->str, bs->len, arg);
-    g_string_free(bs, TRUE);
+  /* body_cb may need to know which of several requested sections
+     the data belongs to. */
+  h->body_section = buf;
+  if(h->body_streamed && h->body_cb)
+    rc = imap_stream_binary_string(sio, seqno, body_type,
+                                   h->body_cb, h->body_arg);
+  else {
+    bs = imap_get_binary_string(sio);
+    if(bs) {
+      if(bs->str && h->body_cb)
+        h->body_cb(seqno, body_type, bs->str, bs->len, h->body_arg);
+      g_string_free(bs, TRUE);
+    }
   }
-  return IMR_OK;
+  h->body_section = NULL;
+  return rc;
 }
 
 static ImapResponse
@@ -4143,8 +5060,7 @@ ir_msg_att_body(ImapMboxHandle *h, int c, unsigned seqno)
     c = sio_getc (h->sio);
     sio_ungetc (h->sio);
     if(isdigit (c)) {
-      rc = ir_body_section(h->sio, seqno, IMAP_BODY_TYPE_BODY,
-			   h->body_cb, h->body_arg);
+      rc = ir_body_section(h, seqno, IMAP_BODY_TYPE_BODY);
       break;
     }
     c = imap_get_atom(h->sio, buf, sizeof buf);
@@ -4155,7 +5071,7 @@ ir_msg_att_body(ImapMboxHandle *h, int c, unsigned seqno)
 	(g_ascii_strcasecmp(buf, "TEXT") == 0)
 	? IMAP_BODY_TYPE_TEXT : IMAP_BODY_TYPE_HEADER;
       sio_ungetc (h->sio); /* put the ']' back */
-      rc = ir_body_section(h->sio, seqno, body_type, h->body_cb, h->body_arg);
+      rc = ir_body_section(h, seqno, body_type);
     } else {
       if (c == ' ' && 
           (g_ascii_strcasecmp(buf, "HEADER.FIELDS") == 0 ||
@@ -4208,6 +5124,20 @@ ir_msg_att_uid(ImapMboxHandle *h, int c, unsigned seqno)
   return IMR_OK;
 }
 
+/* RFC 7162, sect. 3.1.4: "MODSEQ (<mod-sequence-value>)". We do not
+   keep per-message mod-sequences; the cache is resynchronized against
+   the HIGHESTMODSEQ of the mailbox. */
+static ImapResponse
+ir_msg_att_modseq(ImapMboxHandle *h, int c, unsigned seqno)
+{
+  char buf[24];
+
+  if(sio_getc(h->sio) != '(')
+    return IMR_PROTOCOL;
+  c = imap_get_atom(h->sio, buf, sizeof(buf));
+  return c == ')' ? IMR_OK : IMR_PROTOCOL;
+}
+
 static ImapResponse
 ir_fetch_seq(ImapMboxHandle *h, unsigned seqno)
 {
@@ -4225,7 +5155,8 @@ ir_fetch_seq(ImapMboxHandle *h, unsigned seqno)
     { "BINARY",        ir_msg_att_body }, 
     { "BODY",          ir_msg_att_body }, 
     { "BODYSTRUCTURE", ir_msg_att_bodystructure }, 
-    { "UID",           ir_msg_att_uid }
+    { "UID",           ir_msg_att_uid },
+    { "MODSEQ",        ir_msg_att_modseq }
   };
   char atom[LONG_STRING]; /* make sure LONG_STRING is longer than all */
                           /* strings above */
@@ -4378,7 +5309,9 @@ static const struct {
   { "MYRIGHTS",   8, ir_myrights },
   { "ACL",        3, ir_getacl },
   { "QUOTAROOT",  9, ir_quotaroot },
-  { "QUOTA",      5, ir_quota }
+  { "QUOTA",      5, ir_quota },
+  { "VANISHED",   8, ir_vanished },
+  { "ENABLED",    7, ir_enabled }
 };
 static const struct {
   const gchar *response;
@@ -4408,6 +5341,8 @@ ir_handle_response(ImapMboxHandle *h)
     c = imap_get_atom(h->sio, atom, sizeof(atom));
     if (c == 0x0d)
       sio_ungetc(h->sio);
+    if(g_ascii_strncasecmp(atom, "EXPUNGE", 7) != 0)
+      imap_expunged_flush(h);
     for(i=0; i<ELEMENTS(NumHandlers); i++) {
       if(g_ascii_strncasecmp(atom, NumHandlers[i].response, 
                              NumHandlers[i].keyword_len) == 0) {
@@ -4418,6 +5353,7 @@ ir_handle_response(ImapMboxHandle *h)
   } else {
     if (c == 0x0d)
       sio_ungetc(h->sio);
+    imap_expunged_flush(h);
     for(i=0; i<ELEMENTS(ResponseHandlers); i++) {
       if(g_ascii_strncasecmp(atom, ResponseHandlers[i].response, 
                              ResponseHandlers[i].keyword_len) == 0) {
@@ -4551,17 +5487,30 @@ mbox_view_resize(MboxView *mv, unsigned old_exists, unsigned new_exists)
   }
 }
 
+/* mbox_view_expunge:
+   Drops the expunged messages, given as a sorted array of message
+   numbers, from the view and renumbers the ones that follow them.
+*/
 void
-mbox_view_expunge(MboxView *mv, unsigned seqno)
+mbox_view_expunge(MboxView *mv, GArray *seqnos)
 {
-  unsigned i;
+  unsigned src, dest;
 
   if( !MBOX_VIEW_IS_ACTIVE(mv) ) return;
-  for(i=0; i<mv->entries && mv->arr[i] != seqno; i++)
-    ;
-  for(; i<mv->entries-1; i++)
-    mv->arr[i] = mv->arr[i+1];
-  mv->entries = i;
+  for(dest=src=0; src<mv->entries; src++) {
+    unsigned seqno = mv->arr[src], lo = 0, hi = seqnos->len;
+    while(lo < hi) { /* count the expunged messages up to seqno */
+      unsigned mid = (lo + hi)/2;
+      if(g_array_index(seqnos, unsigned, mid) <= seqno)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if(lo > 0 && g_array_index(seqnos, unsigned, lo-1) == seqno)
+      continue;
+    mv->arr[dest++] = seqno - lo;
+  }
+  mv->entries = dest;
 }
 
 void
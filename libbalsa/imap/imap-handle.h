@@ -65,12 +65,15 @@ typedef enum
   IMCAP_BINARY,                 /* RFC 3516 */
   IMCAP_CHILDREN,               /* RFC 3348 */
   IMCAP_COMPRESS_DEFLATE,       /* RFC 4978 */
+  IMCAP_CONDSTORE,              /* RFC 7162 */
   IMCAP_ESEARCH,                /* RFC 4731 */
   IMCAP_IDLE,                   /* RFC 2177 */
+  IMCAP_LIST_STATUS,            /* RFC 5819 */
   IMCAP_LITERAL,                /* RFC 2088 */
   IMCAP_LOGINDISABLED,		/* RFC 2595 */
   IMCAP_MULTIAPPEND,            /* RFC 3502 */
   IMCAP_NAMESPACE,              /* RFC 2342: IMAP4 Namespace */
+  IMCAP_QRESYNC,                /* RFC 7162 */
   IMCAP_QUOTA,                  /* RFC 2087 */
   IMCAP_SASLIR,                 /* RFC 4959 */
   IMCAP_SCAN,                   /* FIXME: RFC? */
@@ -142,6 +145,8 @@ int      imap_mbox_handle_can_do(ImapMboxHandle* handle, ImapCapability cap);
 unsigned imap_mbox_handle_get_exists(ImapMboxHandle* handle);
 unsigned imap_mbox_handle_get_validity(ImapMboxHandle* handle);
 unsigned imap_mbox_handle_get_uidnext(ImapMboxHandle* handle);
+guint64  imap_mbox_handle_get_highestmodseq(ImapMboxHandle* handle);
+gboolean imap_mbox_handle_qresync_enabled(ImapMboxHandle* handle);
 int      imap_mbox_handle_get_delim(ImapMboxHandle* handle,
                                     const char *namespace);
 char* imap_mbox_handle_get_last_msg(ImapMboxHandle *handle);
@@ -211,7 +216,7 @@ void imap_sequence_release(ImapSequence *i_seq);
 typedef struct _MboxView MboxView;
 void mbox_view_init(MboxView *mv);
 void mbox_view_resize(MboxView *mv, unsigned old_sz, unsigned new_sz);
-void mbox_view_expunge(MboxView *mv, unsigned seqno);
+void mbox_view_expunge(MboxView *mv, GArray *seqnos);
 void mbox_view_dispose(MboxView *mv);
 gboolean mbox_view_is_active(MboxView *mv);
 unsigned mbox_view_cnt(MboxView *mv);
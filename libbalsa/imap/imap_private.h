@@ -77,10 +77,20 @@ struct _ImapMboxHandle {
   unsigned unseen; /* msgno of first unseen message */
   ImapUID  uidnext;
   ImapUID  uidval;
+  guint64  highestmodseq; /* RFC 7162; 0 if NOMODSEQ or unsupported */
   gchar *last_msg; /* last server message; for error reporting purposes */
 
   ImapMessage **msg_cache;
+  const void  **msg_serialized; /* msg_cache entries still to be
+                                 * deserialized, see
+                                 * imap_msg_cache_get() */
+  gpointer      serialized_owner; /* keeps msg_serialized data alive */
+  GDestroyNotify serialized_release;
   GArray       *flag_cache;
+  GArray       *expunged; /* batch of EXPUNGEd msgnos not yet removed
+                           * from the caches */
+  GArray       *vanished_earlier; /* if set, collects the ImapUidRanges
+                                   * of VANISHED (EARLIER) responses */
   MboxView mbox_view;
   /** cmd_info is a list of commands that serves two-fold purpose. It
       can contain task to execute when certain command completes. It
@@ -112,6 +122,8 @@ struct _ImapMboxHandle {
   void *flags_arg;
   ImapFetchBodyInternalCb body_cb;
   void *body_arg;
+  gboolean body_streamed; /* body_cb accepts literals in pieces */
+  const char *body_section; /* section of the data passed to body_cb */
 
   ImapMonitorCb monitor_cb;
   void *monitor_arg;
@@ -120,6 +132,8 @@ struct _ImapMboxHandle {
   void *search_arg;
 
   GHashTable *status_resps; /* A hash of STATUS responses that we wait for */
+  ImapStatusCb status_cb;   /* called for every STATUS response */
+  void *status_arg;
 
   GIOChannel *iochannel; /* IO channel used for monitoring the connection */
 #if defined(BALSA_USE_THREADS)
@@ -142,6 +156,7 @@ struct _ImapMboxHandle {
   unsigned enable_compress:1; /**< enable compress extension */
   unsigned enable_idle:1;     /**< use IDLE - no problem with firewalls */
   unsigned has_rights:1;      /**< whether rights are up-to-date. */
+  unsigned qresync_enabled:1; /**< ENABLE QRESYNC succeeded (RFC 7162) */
 
   ImapAclType rights;         /**< my rights (RFC 4314) */
   GList *acls;                /**< acl's (RFC 4314) */
@@ -194,6 +209,7 @@ ImapResponse imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
 ImapResponse imap_mbox_fetch_my_rights_unlocked(ImapMboxHandle* handle);
 
 void imap_mbox_resize_cache(ImapMboxHandle *h, unsigned new_size);
+ImapMessage *imap_msg_cache_get(ImapMboxHandle *h, unsigned seqno);
 
 ImapResponse imap_cmd_exec_cmdno(ImapMboxHandle* handle, const char* cmd,
 				 unsigned *cmdno);
@@ -203,6 +219,24 @@ ImapResponse imap_cmd_exec_cmds(ImapMboxHandle* handle, const char** cmds,
 				unsigned rc_to_return);
 
 ImapResponse imap_cmd_issue(ImapMboxHandle* handle, const char* cmd);
+
+typedef struct _ImapPipeline ImapPipeline;
+typedef void (*ImapPipelineCb)(ImapMboxHandle *h, ImapResponse rc,
+                               void *arg);
+typedef enum {
+  IMPIPE_NONE  = 0,
+  IMPIPE_WAIT  = 1<<0, /* send only after the previous commands completed */
+  IMPIPE_IF_OK = 1<<1  /* as IMPIPE_WAIT; skip if the previous one failed */
+} ImapPipelineFlags;
+
+ImapPipeline* imap_pipeline_new(ImapMboxHandle *h);
+unsigned imap_pipeline_add(ImapPipeline *p, const char *cmd,
+                           ImapPipelineFlags flags,
+                           ImapPipelineCb cb, void *cb_arg);
+void imap_pipeline_add_literal(ImapPipeline *p, const char *data,
+                               size_t len, const char *tail);
+ImapResponse imap_pipeline_run(ImapPipeline *p);
+void imap_pipeline_free(ImapPipeline *p);
 char* imap_mbox_gets(ImapMboxHandle *h, char* buf, size_t sz);
 
 ImapResponse imap_write_key(ImapMboxHandle *handle, ImapSearchKey *s,
@@ -232,6 +266,7 @@ gchar* imap_coalesce_seq_range(int lo, int hi,
 			       ImapCoalesceFunc fun, void *data);
 unsigned imap_coalesce_func_simple(int i, unsigned msgno[]);
 gchar *imap_coalesce_set(int cnt, unsigned *seqnos);
+gchar *imap_fetch_cmd_new(const gchar *seq, const gchar* headers[]);
 
 /* even more private functions */
 int imap_cmd_start(ImapMboxHandle* handle, const char* cmd, unsigned* cmdno);
@@ -33,6 +33,8 @@
 #include "libimap.h"
 #include "imap-handle.h"
 #include "imap-commands.h"
+#include "imap_private.h"
+#include "siobuf.h"
 #include "util.h"
 
 struct {
@@ -579,6 +581,134 @@ test_mbox_delete(int argc, char *argv[])
   return rc == IMR_OK ? 0 : 1;
 }
 
+/** Benchmarks the response parser: replays a captured server
+    response stream through a handle in the selected state and
+    reports how long it took to parse. The capture should start after
+    the SELECT command, with the "* N EXISTS" response, and may be
+    created e.g. by logging the "S" lines of the -m monitor output
+    of a FETCH (ENVELOPE BODYSTRUCTURE) of a large mailbox. */
+static int
+test_replay(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  ImapResponse rc;
+  GTimer *timer;
+  unsigned responses = 0;
+  int fd;
+
+  if(argc<1) {
+    fprintf(stderr, "replay FILE\n");
+    return 1;
+  }
+
+  fd = open(argv[0], O_RDONLY);
+  if(fd<0) {
+    perror(argv[0]);
+    return 1;
+  }
+
+  h = imap_mbox_handle_new();
+  h->host = g_strdup(argv[0]);
+  h->sd = fd;
+  h->sio = sio_attach(fd, fd, 8192);
+  h->state = IMHS_SELECTED;
+
+  timer = g_timer_new();
+  while( (rc = imap_cmd_step(h, 0)) == IMR_UNTAGGED)
+    ++responses;
+  g_timer_stop(timer);
+
+  printf("%u responses, %u messages in %.3f s\n", responses,
+         imap_mbox_handle_get_exists(h), g_timer_elapsed(timer, NULL));
+  g_timer_destroy(timer);
+  g_object_unref(h);
+
+  return rc == IMR_SEVERED ? 0 : 1;
+}
+
+static void
+print_status_cb(ImapMboxHandle *h, const char *mbox,
+                const struct ImapStatusResult *res, void *arg)
+{
+  unsigned i;
+
+  printf("%s:", mbox);
+  for(i=0; res[i].item != IMSTAT_NONE; i++)
+    if(res[i].item == IMSTAT_UNSEEN)
+      printf(" %u unseen", res[i].result);
+  printf("\n");
+}
+
+/** Measures the latency win of command pipelining: times COUNT NOOP
+    commands executed one by one and then the same commands sent
+    through an ImapPipeline. If mailboxes are given, their STATUS is
+    timed one by one and through imap_mbox_status_bulk(). Best run against a local test server, with
+    network latency added e.g. by netem, to see the round trip cost. */
+static int
+test_pipeline(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  ImapPipeline *pipeline;
+  ImapResponse rc = IMR_OK;
+  GTimer *timer;
+  double serial, pipelined;
+  unsigned count, i;
+
+  if(argc<1) {
+    fprintf(stderr, "pipeline HOST [COUNT [MAILBOX...]]\n");
+    return 1;
+  }
+  count = argc>1 ? strtoul(argv[1], NULL, 10) : 100;
+
+  h = get_handle(argv[0]);
+  if(!h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+
+  timer = g_timer_new();
+  for(i=0; i<count && rc == IMR_OK; i++)
+    rc = imap_cmd_exec(h, "NOOP");
+  serial = g_timer_elapsed(timer, NULL);
+
+  g_timer_start(timer);
+  pipeline = imap_pipeline_new(h);
+  for(i=0; i<count; i++)
+    imap_pipeline_add(pipeline, "NOOP", IMPIPE_NONE, NULL, NULL);
+  if(rc == IMR_OK)
+    rc = imap_pipeline_run(pipeline);
+  else
+    imap_pipeline_free(pipeline);
+  pipelined = g_timer_elapsed(timer, NULL);
+  printf("%u NOOP: serial %.3f s, pipelined %.3f s\n",
+         count, serial, pipelined);
+
+  if(argc>2 && rc == IMR_OK) {
+    unsigned cnt = argc-2;
+    struct ImapStatusResult res[] = {
+      { IMSTAT_MESSAGES, 0 }, { IMSTAT_UNSEEN, 0 }, { IMSTAT_UIDNEXT, 0 },
+      { IMSTAT_NONE, 0 }
+    };
+
+    g_timer_start(timer);
+    for(i=0; i<cnt && rc == IMR_OK; i++)
+      rc = imap_mbox_status(h, argv[i+2], res);
+    serial = g_timer_elapsed(timer, NULL);
+
+    g_timer_start(timer);
+    if(rc == IMR_OK)
+      rc = imap_mbox_status_bulk(h, cnt, (const char**)argv+2,
+                                 print_status_cb, NULL);
+    pipelined = g_timer_elapsed(timer, NULL);
+    printf("%u STATUS: serial %.3f s, pipelined %.3f s\n",
+           cnt, serial, pipelined);
+  }
+  g_timer_destroy(timer);
+  g_object_unref(h);
+
+  return rc == IMR_OK ? 0 : 1;
+}
+
 /** test mailbox name quoting. */
 static int
 test_mailbox_name_quoting()
@@ -659,7 +789,10 @@ main(int argc, char *argv[]) {
       { test_mbox_dumpdir, "dumpdir", "HOST MAILBOX DST_DIRECTORY" },
       { test_mbox_append, "append", "HOST MAILBOX SRC_DIRECTORY" },
       { test_mbox_append_multi, "multi", "HOST MAILBOX SRC_DIRECTORY" },
-      { test_mbox_delete, "delete", "HOST MAILBOX" }
+      { test_mbox_delete, "delete", "HOST MAILBOX" },
+      { test_replay, "replay", "FILE (times parsing of server responses)" },
+      { test_pipeline, "pipeline",
+        "HOST [COUNT [MAILBOX...]] (times pipelined commands)" }
     };
     unsigned i;
     int first_arg = process_options(argc, argv);
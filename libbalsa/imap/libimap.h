@@ -268,10 +268,19 @@ typedef void (*ImapUserCb)(ImapUserEventType ue, void *arg, ...);
 ImapMessage *imap_message_new(void);
 void imap_message_free(ImapMessage *);
 void imap_mbox_handle_msg_deserialize(ImapMboxHandle *h, unsigned msgno,
-                                      void *data);
+                                      void *data, gboolean flags_valid);
+void imap_mbox_handle_keep_serialized(ImapMboxHandle *h, gpointer owner,
+                                      GDestroyNotify release);
+void*        imap_mbox_handle_msg_serialize(ImapMboxHandle *h,
+                                            unsigned msgno);
+/* The serialized messages are portable; the version changes with
+   their layout. */
+#define IMAP_MSG_SERIALIZED_VERSION 1
 void*        imap_message_serialize(ImapMessage *);
 ImapMessage* imap_message_deserialize(void *data);
 size_t imap_serialized_message_size(void *data);
+gboolean imap_serialized_message_check(const void *data, size_t len);
+ImapUID imap_serialized_message_uid(void *data);
 
 const char *lbi_strerror(ImapResult rc);
 
@@ -53,6 +53,8 @@ static int sio_sslpoll (struct siobuf *sio, int ret);
 /* Socket I/O buffering */
 struct siobuf
   {
+    struct sio_readbuf rb;	/* unread part of the read buffer; must
+				   stay first, see siobuf.h */
     int sdr;			/* Socket descriptor being buffered. */
     int sdw;			/* Socket descriptor being buffered. */
 
@@ -62,8 +64,6 @@ struct siobuf
     char *read_buffer;		/* client read buffer */
     const char *read_buffer_start; /* client read buffer start, for
                                       ungetc error checking. */
-    char *read_position;	/* client read buffer pointer */
-    int read_unread;		/* number of bytes unread in buffer */
 
     char *write_buffer;		/* client write buffer */
     char *write_position;	/* client write buffer pointer */
@@ -109,8 +109,8 @@ sio_attach (int sdr, int sdw, int buffer_size)
 
   /* Allocate the buffer for reading. */
   sio->buffer_size = buffer_size;
-  sio->read_position = sio->read_buffer = malloc (sio->buffer_size);
-  sio->read_unread = 0;
+  sio->rb.position = sio->read_buffer = malloc (sio->buffer_size);
+  sio->rb.unread = 0;
   if (sio->read_buffer == NULL)
     {
       free (sio);
@@ -273,7 +273,7 @@ sio_poll (struct siobuf *sio, int want_read, int want_write, int fast)
 
   assert (sio != NULL);
 
-  if (want_read && sio->read_unread > 0)
+  if (want_read && sio->rb.unread > 0)
     return SIO_READ;
 #ifdef USE_TLS
   /* SSL_read() returns data a record at a time, however it is possible
@@ -606,28 +606,28 @@ sio_fill (struct siobuf *sio)
        return nonzero.
        length value 0 means error.
     */
-    while ((*sio->decode_cb) (&sio->read_position, &sio->read_unread,
-                               sio->read_buffer, sio->read_unread,
+    while ((*sio->decode_cb) (&sio->rb.position, &sio->rb.unread,
+                               sio->read_buffer, sio->rb.unread,
                                sio->secarg) == 0) {
-      sio->read_unread = raw_read (sio, sio->read_buffer, sio->buffer_size);
-      if (sio->read_unread <= 0)
+      sio->rb.unread = raw_read (sio, sio->read_buffer, sio->buffer_size);
+      if (sio->rb.unread <= 0)
         break;
     }
-    sio->read_buffer_start = sio->read_position;
-    if (sio->read_unread <= 0)
+    sio->read_buffer_start = sio->rb.position;
+    if (sio->rb.unread <= 0)
       return 0;
   } else {
-    sio->read_unread = raw_read (sio, sio->read_buffer, sio->buffer_size);
-    if (sio->read_unread <= 0)
+    sio->rb.unread = raw_read (sio, sio->read_buffer, sio->buffer_size);
+    if (sio->rb.unread <= 0)
       return 0;
-    sio->read_position = sio->read_buffer;
-    sio->read_buffer_start = sio->read_position;
+    sio->rb.position = sio->read_buffer;
+    sio->read_buffer_start = sio->rb.position;
  }
 
-  if (sio->monitor_cb != NULL && sio->read_unread > 0)
-    (*sio->monitor_cb) (sio->read_position, sio->read_unread,
+  if (sio->monitor_cb != NULL && sio->rb.unread > 0)
+    (*sio->monitor_cb) (sio->rb.position, sio->rb.unread,
 			0, sio->cbarg);
-  return sio->read_unread > 0;
+  return sio->rb.unread > 0;
 }
 
 int
@@ -638,18 +638,18 @@ sio_read (struct siobuf *sio, void *bufp, int buflen)
 
   assert (sio != NULL && buf != NULL && buflen > 0);
 
-  if (sio->read_unread <= 0 && !sio_fill (sio))
+  if (sio->rb.unread <= 0 && !sio_fill (sio))
     return -1;
 
   total = 0;
   do
-    while (sio->read_unread > 0)
+    while (sio->rb.unread > 0)
       {
-        if ((count = sio->read_unread) > buflen)
+        if ((count = sio->rb.unread) > buflen)
           count = buflen;
-        memcpy (buf, sio->read_position, count);
-        sio->read_position += count;
-        sio->read_unread -= count;
+        memcpy (buf, sio->rb.position, count);
+        sio->rb.position += count;
+        sio->rb.unread -= count;
 
         total += count;
         if ((buflen -= count) <= 0)
@@ -660,18 +660,48 @@ sio_read (struct siobuf *sio, void *bufp, int buflen)
   return total;
 }
 
+/* Slow path of sio_getc(): called only when the read buffer is
+   empty. */
 int
-sio_getc(struct siobuf *sio)
+sio_getc_refill(struct siobuf *sio)
 {
   char ch;
   return sio_read(sio, &ch, 1) == 1 ? ch : -1;
 }
+
+/* Return the unread part of the read buffer, refilling it first if
+   it is empty, and store its length in *len.  The bytes stay in the
+   buffer until they are consumed with sio_skip(), so a tokenizer can
+   scan them in place.  Returns NULL on EOF or error. */
+const char *
+sio_peek(struct siobuf *sio, int *len)
+{
+  assert (sio != NULL && len != NULL);
+
+  if (sio->rb.unread <= 0 && !sio_fill (sio))
+    {
+      *len = 0;
+      return NULL;
+    }
+  *len = sio->rb.unread;
+  return sio->rb.position;
+}
+
+/* Consume len bytes returned by sio_peek(). */
+void
+sio_skip(struct siobuf *sio, int len)
+{
+  assert (sio != NULL && len >= 0 && len <= sio->rb.unread);
+
+  sio->rb.position += len;
+  sio->rb.unread -= len;
+}
 int
 sio_ungetc(struct siobuf *sio)
 {
-  if(sio->read_position>sio->read_buffer_start) {
-    sio->read_position--;
-    sio->read_unread++;
+  if(sio->rb.position>sio->read_buffer_start) {
+    sio->rb.position--;
+    sio->rb.unread++;
     return 0;
   } else return -1;
 }
@@ -684,15 +714,15 @@ sio_gets (struct siobuf *sio, char buf[], int buflen)
 
   assert (sio != NULL && buf != NULL && buflen > 0);
 
-  if (sio->read_unread <= 0 && !sio_fill (sio))
+  if (sio->rb.unread <= 0 && !sio_fill (sio))
     return NULL;
 
   p = buf;
   do
-    while (sio->read_unread > 0)
+    while (sio->rb.unread > 0)
       {
-	c = *sio->read_position++;
-	sio->read_unread--;
+	c = *sio->rb.position++;
+	sio->rb.unread--;
 	*p++ = c;
 	buflen--;
 	if (c == '\n' || buflen <= 1)
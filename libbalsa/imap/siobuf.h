@@ -24,6 +24,15 @@
 
 typedef struct siobuf *siobuf_t;
 
+/* The unread part of the read buffer.  It is the first member of
+   struct siobuf so that sio_getc() can be expanded inline: tokenizers
+   read every byte of a server response through it. */
+struct sio_readbuf
+  {
+    char *position;		/* client read buffer pointer */
+    int unread;			/* number of bytes unread in buffer */
+  };
+
 #define SIO_BUFSIZE	2048 /* arbitrary, not too short, not too long */
 #define SIO_READ	1
 #define SIO_WRITE	2
@@ -47,8 +56,10 @@ typedef int (*timeoutcb_t) (void *arg);
 #define sio_mark bnio_mark
 #define sio_fill bnio_fill
 #define sio_read bnio_read
-#define sio_getc bnio_getc
+#define sio_getc_refill bnio_getc_refill
 #define sio_ungetc bnio_ungetc
+#define sio_peek bnio_peek
+#define sio_skip bnio_skip
 
 #define sio_gets bnio_gets
 #define sio_printf bnio_printf
@@ -72,8 +83,17 @@ void sio_flush(struct siobuf *sio);
 void sio_mark(struct siobuf *sio);
 int sio_fill(struct siobuf *sio);
 int sio_read(struct siobuf *sio, void *bufp, int buflen);
-int sio_getc(struct siobuf *sio);
+int sio_getc_refill(struct siobuf *sio);
 int sio_ungetc(struct siobuf *sio);
+const char *sio_peek(struct siobuf *sio, int *len);
+void sio_skip(struct siobuf *sio, int len);
+
+/* Like getc(3), sio_getc() may evaluate its argument more than once. */
+#define SIO_RB(sio) ((struct sio_readbuf *) (sio))
+#define sio_getc(sio)							\
+  (SIO_RB(sio)->unread > 0						\
+   ? (SIO_RB(sio)->unread--, (int) *SIO_RB(sio)->position++)		\
+   : sio_getc_refill(sio))
 
 char *sio_gets(struct siobuf *sio, char buf[], int buflen);
 int sio_printf(struct siobuf *sio, const char *format, ...)
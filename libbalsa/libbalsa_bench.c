@@ -0,0 +1,371 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2013 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * libbalsa_bench.c
+ *
+ * Timings of libbalsa code on large generated input.  It is not built
+ * by default; run "make libbalsa_bench" in this directory.
+ *
+ *   libbalsa_bench search [MB]
+ *       Case-insensitive substring search of a body of MB megabytes
+ *       (default 8) with a LibBalsaUtf8Needle, against the character
+ *       by character search of libbalsa_utf8_strstr().  Both must give
+ *       the same result for every needle.
+ *
+ *   libbalsa_bench index [N]
+ *       Opens a temporary mbox of N generated messages (default 50000),
+ *       sorts it on each column and reports the time of each sort and
+ *       the memory taken by the message index; then expunges every
+ *       other message and reports the index again.
+ */
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbalsa.h"
+#include "libbalsa_private.h"
+#include "misc.h"
+
+#define BENCH_RUNS 5
+
+/* A body of about size bytes of mail-like lines, the same on every
+ * run; with non_ascii, some of the words are not ASCII. */
+static gchar *
+bench_make_body(gsize size, gboolean non_ascii)
+{
+    static const gchar *const words[] = {
+        "the", "message", "Re:", "meeting", "tomorrow", "please",
+        "find", "attached", "report", "Subject:", "From:", "regards",
+        "quarterly", "numbers", "server", "mailbox", "thread", "and",
+        "with", "for", "Balsa", "filter", "inbox", "archive"
+    };
+    static const gchar *const utf8_words[] = {
+        "caf\xc3\xa9", "na\xc3\xafve", "Gr\xc3\xbc\xc3\x9f" "e",
+        "\xc3\x85ngstr\xc3\xb6m", "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0"
+        "\xb5\xd1\x82"
+    };
+    GString *body = g_string_sized_new(size + 80);
+    GRand *rand = g_rand_new_with_seed(42);
+    gsize line_start = 0;
+
+    while (body->len < size) {
+        const gchar *word;
+
+        if (non_ascii && g_rand_int_range(rand, 0, 8) == 0)
+            word = utf8_words[g_rand_int_range(rand, 0,
+                                               G_N_ELEMENTS(utf8_words))];
+        else
+            word = words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))];
+        g_string_append(body, word);
+        if (body->len - line_start > 72) {
+            g_string_append_c(body, '\n');
+            line_start = body->len;
+        } else
+            g_string_append_c(body, ' ');
+    }
+    g_rand_free(rand);
+
+    return g_string_free(body, FALSE);
+}
+
+/* Best of BENCH_RUNS, in milliseconds. */
+static gdouble
+bench_time_naive(const gchar * body, const gchar * str, gboolean * found)
+{
+    GTimer *timer = g_timer_new();
+    gdouble best = G_MAXDOUBLE;
+    guint i;
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        g_timer_start(timer);
+        *found = libbalsa_utf8_strstr(body, str);
+        g_timer_stop(timer);
+        best = MIN(best, g_timer_elapsed(timer, NULL) * 1000);
+    }
+    g_timer_destroy(timer);
+
+    return best;
+}
+
+static gdouble
+bench_time_needle(const gchar * body, const gchar * str, gboolean * found)
+{
+    GTimer *timer = g_timer_new();
+    LibBalsaUtf8Needle *needle = libbalsa_utf8_needle_new(str);
+    gdouble best = G_MAXDOUBLE;
+    guint i;
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        g_timer_start(timer);
+        *found = libbalsa_utf8_needle_find(needle, body);
+        g_timer_stop(timer);
+        best = MIN(best, g_timer_elapsed(timer, NULL) * 1000);
+    }
+    libbalsa_utf8_needle_free(needle);
+    g_timer_destroy(timer);
+
+    return best;
+}
+
+static gboolean
+bench_search(gint argc, gchar ** argv)
+{
+    static const gchar *const needles[] = {
+        "zebra crossing",       /* ASCII, absent */
+        "subject: MISSING",     /* ASCII, absent, mixed case */
+        "x",                    /* one byte, absent */
+        "ARCHIVE inbox",        /* ASCII, likely present */
+        "NA\xc3\x8fVE CAF\xc3\x89 zebra" /* non-ASCII, absent */
+    };
+    gsize size = (argc > 2 ? atoi(argv[2]) : 8) * 1024 * 1024;
+    gboolean ok = TRUE;
+    guint pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        gboolean non_ascii = pass > 0;
+        gchar *body = bench_make_body(size, non_ascii);
+        guint i;
+
+        g_print("%s body, %lu bytes, best of %d runs:\n",
+                non_ascii ? "Mixed" : "ASCII", (gulong) strlen(body),
+                BENCH_RUNS);
+        for (i = 0; i < G_N_ELEMENTS(needles); i++) {
+            gboolean found_naive, found_needle;
+            gdouble naive =
+                bench_time_naive(body, needles[i], &found_naive);
+            gdouble needle =
+                bench_time_needle(body, needles[i], &found_needle);
+
+            g_print("  %-24s %10.2f ms %10.2f ms  %s%s\n", needles[i],
+                    naive, needle, found_needle ? "found" : "absent",
+                    found_naive == found_needle ? "" : "  MISMATCH");
+            if (found_naive != found_needle)
+                ok = FALSE;
+        }
+        g_free(body);
+    }
+
+    return ok;
+}
+
+static void
+bench_information(GtkWindow * parent, LibBalsaInformationType type,
+                  const gchar * msg)
+{
+    g_printerr("%s\n", msg);
+}
+
+/* An mbox of n messages from a few hundred senders, with subjects made
+ * of random words, some of them replies, and bodies of random size. */
+static gchar *
+bench_make_mbox(guint n)
+{
+    static const gchar *const words[] = {
+        "meeting", "tomorrow", "report", "quarterly", "numbers",
+        "server", "outage", "release", "notes", "lunch", "budget",
+        "review", "patch", "build", "broken", "question", "about",
+        "the", "new", "old", "draft", "minutes", "agenda", "Balsa"
+    };
+    GString *mbox = g_string_sized_new(n * 600);
+    GRand *rand = g_rand_new_with_seed(42);
+    gchar *filename;
+    guint i;
+    gint fd;
+
+    for (i = 0; i < n; i++) {
+        time_t date = 1000000000 + g_rand_int_range(rand, 0, 300000000);
+        guint sender = g_rand_int_range(rand, 0, 500);
+        guint n_words = g_rand_int_range(rand, 3, 9);
+        guint n_lines = g_rand_int_range(rand, 1, 40);
+        gchar buf[64];
+        guint j;
+
+        strftime(buf, sizeof buf, "%a, %d %b %Y %H:%M:%S +0000",
+                 gmtime(&date));
+        g_string_append_printf(mbox,
+                               "From user%u@example.com Sat Jan  1 "
+                               "00:00:00 2000\n"
+                               "From: User %u <user%u@example.com>\n"
+                               "To: bench@example.com\n"
+                               "Date: %s\n"
+                               "Message-ID: <%u.bench@example.com>\n"
+                               "Subject:%s", sender, sender, sender,
+                               buf, i, g_rand_int_range(rand, 0, 3) == 0
+                               ? " Re:" : "");
+        for (j = 0; j < n_words; j++)
+            g_string_append_printf(mbox, " %s",
+                                   words[g_rand_int_range
+                                         (rand, 0, G_N_ELEMENTS(words))]);
+        g_string_append(mbox, "\n\n");
+        for (j = 0; j < n_lines; j++)
+            g_string_append(mbox, "The quick brown fox jumps over the "
+                            "lazy dog, again and again.\n");
+        g_string_append_c(mbox, '\n');
+    }
+    g_rand_free(rand);
+
+    fd = g_file_open_tmp("balsa-bench-XXXXXX", &filename, NULL);
+    if (fd < 0 || write(fd, mbox->str, mbox->len) != (ssize_t) mbox->len) {
+        g_printerr("Could not write a temporary mbox\n");
+        if (fd >= 0) {
+            close(fd);
+            unlink(filename);
+        }
+        g_free(filename);
+        filename = NULL;
+    } else
+        close(fd);
+    g_string_free(mbox, TRUE);
+
+    return filename;
+}
+
+static void
+bench_index_report(LibBalsaMailbox * mailbox)
+{
+    LibBalsaMailboxIndex *index = mailbox->mindex;
+
+    g_print("  %u entries; records %lu bytes in %u blocks, "
+            "unshared strings %lu bytes, %lu of them dead\n", index->len,
+            (gulong) (index->blocks->len *
+                      sizeof(LibBalsaMailboxIndexBlock)),
+            index->blocks->len, (gulong) index->string_bytes,
+            (gulong) index->dead_bytes);
+}
+
+static void
+bench_sort_columns(LibBalsaMailbox * mailbox)
+{
+    static const struct {
+        gint column;
+        const gchar *name;
+    } columns[] = {
+        { LB_MBOX_FROM_COL,    "sender" },
+        { LB_MBOX_SUBJECT_COL, "subject" },
+        { LB_MBOX_DATE_COL,    "date" },
+        { LB_MBOX_SIZE_COL,    "size" },
+        { LB_MBOX_MSGNO_COL,   "number" }
+    };
+    GTimer *timer = g_timer_new();
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(columns); i++) {
+        gdouble asc, desc;
+
+        g_timer_start(timer);
+        gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(mailbox),
+                                             columns[i].column,
+                                             GTK_SORT_ASCENDING);
+        asc = g_timer_elapsed(timer, NULL) * 1000;
+        g_timer_start(timer);
+        gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(mailbox),
+                                             columns[i].column,
+                                             GTK_SORT_DESCENDING);
+        desc = g_timer_elapsed(timer, NULL) * 1000;
+        g_print("  sort by %-8s %10.2f ms ascending %10.2f ms "
+                "descending\n", columns[i].name, asc, desc);
+    }
+    g_timer_destroy(timer);
+}
+
+static gboolean
+bench_index(gint argc, gchar ** argv)
+{
+    guint n = argc > 2 ? atoi(argv[2]) : 50000;
+    gchar *filename;
+    LibBalsaMailbox *mailbox;
+    GTimer *timer;
+    GError *err = NULL;
+    GArray *msgnos;
+    guint msgno;
+
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    libbalsa_init(bench_information);
+    libbalsa_mailbox_view_table =
+        g_hash_table_new_full(g_str_hash, g_str_equal,
+                              (GDestroyNotify) g_free,
+                              (GDestroyNotify) libbalsa_mailbox_view_free);
+
+    if (!(filename = bench_make_mbox(n)))
+        return FALSE;
+    mailbox = (LibBalsaMailbox *) libbalsa_mailbox_mbox_new(filename, FALSE);
+    g_free(filename);
+    if (!mailbox)
+        return FALSE;
+    libbalsa_mailbox_set_threading_type(mailbox, LB_MAILBOX_THREADING_FLAT);
+
+    timer = g_timer_new();
+    if (!libbalsa_mailbox_open(mailbox, &err)) {
+        g_printerr("Could not open the mbox: %s\n",
+                   err ? err->message : "unknown error");
+        g_clear_error(&err);
+        libbalsa_mailbox_local_remove_files(LIBBALSA_MAILBOX_LOCAL(mailbox));
+        g_object_unref(mailbox);
+        g_timer_destroy(timer);
+        return FALSE;
+    }
+    libbalsa_mailbox_set_threading(mailbox, LB_MAILBOX_THREADING_FLAT);
+    g_print("%u messages opened and threaded in %.2f ms:\n", n,
+            g_timer_elapsed(timer, NULL) * 1000);
+    g_timer_destroy(timer);
+    bench_index_report(mailbox);
+    bench_sort_columns(mailbox);
+
+    msgnos = g_array_new(FALSE, FALSE, sizeof(guint));
+    n = libbalsa_mailbox_total_messages(mailbox);
+    for (msgno = 1; msgno <= n; msgno += 2)
+        g_array_append_val(msgnos, msgno);
+    libbalsa_mailbox_messages_change_flags(mailbox, msgnos,
+                                           LIBBALSA_MESSAGE_FLAG_DELETED,
+                                           0);
+    g_array_free(msgnos, TRUE);
+    libbalsa_mailbox_sync_storage(mailbox, TRUE);
+    g_print("After expunging every other message:\n");
+    bench_index_report(mailbox);
+    bench_sort_columns(mailbox);
+
+    libbalsa_mailbox_close(mailbox, FALSE);
+    libbalsa_mailbox_local_remove_files(LIBBALSA_MAILBOX_LOCAL(mailbox));
+    g_object_unref(mailbox);
+
+    return TRUE;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "search") == 0)
+        return bench_search(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (argc > 1 && strcmp(argv[1], "index") == 0)
+        return bench_index(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    g_printerr("Usage: %s search [MB]\n"
+               "       %s index [N]\n", argv[0], argv[0]);
+
+    return EXIT_FAILURE;
+}
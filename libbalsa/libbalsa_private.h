@@ -31,15 +31,15 @@
  * index caching.  Mailbox index entry used for caching (almost) all
  * columns provided by GtkTreeModel interface. Size matters. */
 struct LibBalsaMailboxIndexEntry_ {
-    gchar *from;
-    gchar *subject;
-    time_t msg_date;
-    time_t internal_date;
+    const gchar *from;          /* the strings belong to the index */
+    const gchar *subject;
+    const gchar *foreground;
+    const gchar *background;
+    const gchar *from_key;      /* collation keys for sorting */
+    const gchar *subject_key;
     unsigned short status_icon;
     unsigned short attach_icon;
-    unsigned long size;
-    gchar *foreground;
-    gchar *background;
+    unsigned present:1;         /* the entry has been populated */
     unsigned foreground_set:1;
     unsigned background_set:1;
     unsigned unseen:1;
@@ -48,6 +48,39 @@ struct LibBalsaMailboxIndexEntry_ {
 #endif                          /* BALSA_USE_THREADS */
 } ;
 
+/* The index itself: entries are allocated LB_MAILBOX_INDEX_BLOCK at a
+ * time, so they do not move when the index grows, and the date and
+ * size sort keys are in columns of their own next to them. All strings
+ * are in one string chunk, which is rebuilt when most of it belongs to
+ * expunged entries, and freed with the index. */
+#define LB_MAILBOX_INDEX_BLOCK 512
+
+typedef struct {
+    LibBalsaMailboxIndexEntry entry[LB_MAILBOX_INDEX_BLOCK];
+    time_t msg_date[LB_MAILBOX_INDEX_BLOCK];
+    gulong size[LB_MAILBOX_INDEX_BLOCK];
+} LibBalsaMailboxIndexBlock;
+
+struct LibBalsaMailboxIndex_ {
+    guint len;                  /* highest msgno with an entry */
+    GPtrArray *blocks;
+    GStringChunk *strings;
+    gsize string_bytes;         /* of unshared strings in strings */
+    gsize dead_bytes;           /* of those, no longer used */
+    guint stamp;                /* changed with any entry */
+    /* Rank of each msgno in the sort on a string field, 0 if it had no
+     * entry; valid while sort_ranks_stamp matches stamp. */
+    GArray *sort_ranks[LB_MAILBOX_SORT_THREAD];
+    guint sort_ranks_stamp[LB_MAILBOX_SORT_THREAD];
+};
+
+/* Populated entry for msgno, or NULL. */
+LibBalsaMailboxIndexEntry *libbalsa_mailbox_index_get(LibBalsaMailbox *
+                                                      mailbox,
+                                                      guint msgno);
+time_t libbalsa_mailbox_index_get_date(LibBalsaMailbox * mailbox,
+                                       guint msgno);
+
 #ifdef BALSA_USE_THREADS
 #include <pthread.h>
 void libbalsa_lock_mailbox(LibBalsaMailbox * mailbox);
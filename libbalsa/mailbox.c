@@ -50,6 +50,10 @@ static gboolean
 libbalsa_mailbox_real_messages_copy(LibBalsaMailbox * mailbox,
                                     GArray * msgnos,
                                     LibBalsaMailbox * dest, GError **err);
+static gboolean
+libbalsa_mailbox_real_messages_move(LibBalsaMailbox * mailbox,
+                                    GArray * msgnos,
+                                    LibBalsaMailbox * dest, GError **err);
 static gboolean libbalsa_mailbox_real_can_do(LibBalsaMailbox* mbox,
                                              enum LibBalsaMailboxCapability c);
 static void libbalsa_mailbox_real_sort(LibBalsaMailbox* mbox,
@@ -219,8 +223,10 @@ libbalsa_mailbox_class_init(LibBalsaMailboxClass * klass)
     klass->get_message_stream = NULL;
     klass->messages_change_flags = NULL;
     klass->messages_copy  = libbalsa_mailbox_real_messages_copy;
+    klass->messages_move  = libbalsa_mailbox_real_messages_move;
     klass->can_do = libbalsa_mailbox_real_can_do;
     klass->set_threading = NULL;
+    klass->update_threading = NULL;
     klass->update_view_filter = NULL;
     klass->sort = libbalsa_mailbox_real_sort;
     klass->check = NULL;
@@ -343,59 +349,280 @@ get_from_field(LibBalsaMessage *message)
     return from;
 }
 
+/* The message index. */
+#define LBM_INDEX_BLOCK(index, msgno)                                   \
+    ((LibBalsaMailboxIndexBlock *)                                      \
+     g_ptr_array_index((index)->blocks,                                 \
+                       ((msgno) - 1) / LB_MAILBOX_INDEX_BLOCK))
+#define LBM_INDEX_SLOT(msgno) (((msgno) - 1) % LB_MAILBOX_INDEX_BLOCK)
+
+static LibBalsaMailboxIndex *
+lbm_index_new(void)
+{
+    LibBalsaMailboxIndex *index = g_new(LibBalsaMailboxIndex, 1);
+
+    index->len = 0;
+    index->blocks = g_ptr_array_new();
+    index->strings = g_string_chunk_new(16 * 1024);
+    index->string_bytes = 0;
+    index->dead_bytes = 0;
+    index->stamp = 1;
+    memset(index->sort_ranks, 0, sizeof index->sort_ranks);
+    memset(index->sort_ranks_stamp, 0, sizeof index->sort_ranks_stamp);
+
+    return index;
+}
+
 static void
-lbm_index_entry_populate_from_msg(LibBalsaMailboxIndexEntry * entry,
-                                  LibBalsaMessage * msg)
+lbm_index_free(LibBalsaMailboxIndex * index)
 {
-    entry->from          = get_from_field(msg);
-    entry->subject       = g_strdup(LIBBALSA_MESSAGE_GET_SUBJECT(msg));
-    entry->msg_date      = msg->headers->date;
-    entry->internal_date = 0; /* FIXME */
-    entry->status_icon   = libbalsa_get_icon_from_flags(msg->flags);
-    entry->attach_icon   = libbalsa_message_get_attach_icon(msg);
-    entry->size          = msg->length;
-    entry->foreground     = NULL;
-    entry->background     = NULL;
-    entry->foreground_set = 0;
-    entry->background_set = 0;
-    entry->unseen        = LIBBALSA_MESSAGE_IS_UNREAD(msg);
-#ifdef BALSA_USE_THREADS
-    entry->idle_pending  = 0;
-#endif                          /*BALSA_USE_THREADS */
-    libbalsa_mailbox_msgno_changed(msg->mailbox, msg->msgno);
+    guint i;
+
+    for (i = 0; i < index->blocks->len; i++)
+        g_free(g_ptr_array_index(index->blocks, i));
+    g_ptr_array_free(index->blocks, TRUE);
+    g_string_chunk_free(index->strings);
+    for (i = 0; i < G_N_ELEMENTS(index->sort_ranks); i++)
+        if (index->sort_ranks[i])
+            g_array_free(index->sort_ranks[i], TRUE);
+    g_free(index);
 }
 
-LibBalsaMailboxIndexEntry*
-libbalsa_mailbox_index_entry_new_from_msg(LibBalsaMessage *msg)
+/* Grow or shrink the index to len entries; new entries are zeroed,
+ * that is, not present. */
+static void
+lbm_index_set_size(LibBalsaMailboxIndex * index, guint len)
 {
-    LibBalsaMailboxIndexEntry *entry = g_new(LibBalsaMailboxIndexEntry,1);
-    lbm_index_entry_populate_from_msg(entry, msg);
-    return entry;
+    guint n_blocks =
+        (len + LB_MAILBOX_INDEX_BLOCK - 1) / LB_MAILBOX_INDEX_BLOCK;
+
+    while (index->blocks->len < n_blocks)
+        g_ptr_array_add(index->blocks,
+                        g_new0(LibBalsaMailboxIndexBlock, 1));
+    while (index->blocks->len > n_blocks)
+        g_free(g_ptr_array_remove_index(index->blocks,
+                                        index->blocks->len - 1));
+
+    index->len = len;
 }
 
-#ifdef BALSA_USE_THREADS
-static LibBalsaMailboxIndexEntry*
-lbm_index_entry_new_pending(void)
+/* The record for msgno, present or not. */
+static LibBalsaMailboxIndexEntry *
+lbm_index_record(LibBalsaMailboxIndex * index, guint msgno)
 {
-    LibBalsaMailboxIndexEntry *entry = g_new(LibBalsaMailboxIndexEntry,1);
-    entry->idle_pending = 1;
-    return entry;
+    if (index->len < msgno)
+        lbm_index_set_size(index, msgno);
+
+    return &LBM_INDEX_BLOCK(index, msgno)->entry[LBM_INDEX_SLOT(msgno)];
+}
+
+/* Strings are never freed one by one: those of cleared and expunged
+ * entries stay in the chunk until lbm_index_collect_strings() copies
+ * the live ones to a new chunk. Senders and colors repeat a lot and are
+ * stored once; as they can still be in use by other entries, and there
+ * are few of them, only the unshared strings are counted. */
+static const gchar *
+lbm_index_strdup(LibBalsaMailboxIndex * index, const gchar * str,
+                 gboolean shared)
+{
+    if (!str)
+        return NULL;
+
+    if (shared)
+        return g_string_chunk_insert_const(index->strings, str);
+
+    index->string_bytes += strlen(str) + 1;
+    return g_string_chunk_insert(index->strings, str);
 }
-#endif                          /*BALSA_USE_THREADS */
+
+/* The bytes of the unshared strings of entry. */
+static gsize
+lbm_index_entry_bytes(LibBalsaMailboxIndexEntry * entry)
+{
+    return (entry->subject ? strlen(entry->subject) + 1 : 0)
+        + (entry->subject_key ? strlen(entry->subject_key) + 1 : 0);
+}
+
+/* Once at least LBM_INDEX_DEAD_MIN bytes, and half of the unshared
+ * strings, are dead, copy the live strings to a new chunk; the copy
+ * then costs no more than the expunges that made the garbage. */
+#define LBM_INDEX_DEAD_MIN (256 * 1024)
 
 static void
-lbm_index_entry_free(LibBalsaMailboxIndexEntry *entry)
+lbm_index_collect_strings(LibBalsaMailboxIndex * index)
 {
-    if(entry) {
-#ifdef BALSA_USE_THREADS
-        if (!entry->idle_pending)
-#endif                          /*BALSA_USE_THREADS */
-        {
-            g_free(entry->from);
-            g_free(entry->subject);
+    GStringChunk *old_strings;
+    guint msgno;
+
+    if (index->dead_bytes < LBM_INDEX_DEAD_MIN
+        || index->dead_bytes < index->string_bytes / 2)
+        return;
+
+    old_strings = index->strings;
+    index->strings = g_string_chunk_new(16 * 1024);
+    index->string_bytes = 0;
+    index->dead_bytes = 0;
+
+    for (msgno = 1; msgno <= index->len; msgno++) {
+        LibBalsaMailboxIndexEntry *entry =
+            &LBM_INDEX_BLOCK(index, msgno)->entry[LBM_INDEX_SLOT(msgno)];
+
+        entry->from       = lbm_index_strdup(index, entry->from, TRUE);
+        entry->subject    = lbm_index_strdup(index, entry->subject, FALSE);
+        entry->foreground =
+            lbm_index_strdup(index, entry->foreground, TRUE);
+        entry->background =
+            lbm_index_strdup(index, entry->background, TRUE);
+        entry->from_key   = lbm_index_strdup(index, entry->from_key, TRUE);
+        entry->subject_key =
+            lbm_index_strdup(index, entry->subject_key, FALSE);
+    }
+
+    g_string_chunk_free(old_strings);
+}
+
+/* Sort keys: subjects are compared without their Re: and Fwd:
+ * prefixes, and both subjects and senders are compared as casefolded
+ * collation keys, so that a sort is a strcmp of the keys. */
+static const gchar *
+lbm_subject_sort_base(const gchar * subject)
+{
+    static const gchar *prefixes[] = { "re:", "aw:", "fw:", "fwd:" };
+    const gchar *p = subject;
+
+    if (!p)
+        return NULL;
+
+    while (*p) {
+        guint i;
+        gsize len = 0;
+
+        while (g_ascii_isspace(*p))
+            p++;
+
+        for (i = 0; i < G_N_ELEMENTS(prefixes) && !len; i++)
+            if (g_ascii_strncasecmp(p, prefixes[i],
+                                    strlen(prefixes[i])) == 0)
+                len = strlen(prefixes[i]);
+        if (!len && g_ascii_strncasecmp(p, _("Re:"), strlen(_("Re:"))) == 0)
+            len = strlen(_("Re:"));
+        if (!len && g_ascii_strncasecmp(p, _("Fwd:"), strlen(_("Fwd:"))) == 0)
+            len = strlen(_("Fwd:"));
+        if (!len)
+            break;
+        p += len;
+    }
+
+    return p;
+}
+
+static const gchar *
+lbm_index_collate_key(LibBalsaMailboxIndex * index, const gchar * str,
+                      gboolean shared)
+{
+    gchar *folded;
+    gchar *key;
+    const gchar *retval;
+
+    if (!str || !g_utf8_validate(str, -1, NULL))
+        return lbm_index_strdup(index, str, shared);
+
+    folded = g_utf8_casefold(str, -1);
+    key = g_utf8_collate_key(folded, -1);
+    retval = lbm_index_strdup(index, key, shared);
+    g_free(key);
+    g_free(folded);
+
+    return retval;
+}
+
+static const gchar *
+lbm_index_sort_key(LibBalsaMailboxIndexEntry * entry,
+                   LibBalsaMailboxSortFields field)
+{
+    const gchar *key = field == LB_MAILBOX_SORT_SENDER ?
+        entry->from_key : entry->subject_key;
+
+    return key ? key : "";
+}
+
+/* Remove the expunged entries, given as ascending seqnos, moving the
+ * others down, and drop their strings if enough of them are dead. */
+static void
+lbm_index_compact(LibBalsaMailboxIndex * index, GArray * seqnos)
+{
+    guint i, j, k;
+
+    for (i = j = 1, k = 0; i <= index->len; i++) {
+        LibBalsaMailboxIndexBlock *src, *dst;
+
+        while (k < seqnos->len && g_array_index(seqnos, guint, k) < i)
+            k++;
+        if (k < seqnos->len && g_array_index(seqnos, guint, k) == i) {
+            index->dead_bytes +=
+                lbm_index_entry_bytes(&LBM_INDEX_BLOCK(index, i)->
+                                      entry[LBM_INDEX_SLOT(i)]);
+            continue;
         }
-        g_free(entry);
+
+        if (i != j) {
+            src = LBM_INDEX_BLOCK(index, i);
+            dst = LBM_INDEX_BLOCK(index, j);
+            dst->entry[LBM_INDEX_SLOT(j)] = src->entry[LBM_INDEX_SLOT(i)];
+            dst->msg_date[LBM_INDEX_SLOT(j)] =
+                src->msg_date[LBM_INDEX_SLOT(i)];
+            dst->size[LBM_INDEX_SLOT(j)] = src->size[LBM_INDEX_SLOT(i)];
+        }
+        j++;
+    }
+
+    /* Zero what is left of the last block, so that the entries are
+     * not present when the index grows again. */
+    for (i = j; i <= index->len && LBM_INDEX_SLOT(i) > 0; i++) {
+        LibBalsaMailboxIndexBlock *block = LBM_INDEX_BLOCK(index, i);
+
+        memset(&block->entry[LBM_INDEX_SLOT(i)], 0,
+               sizeof block->entry[0]);
+        block->msg_date[LBM_INDEX_SLOT(i)] = 0;
+        block->size[LBM_INDEX_SLOT(i)] = 0;
     }
+
+    lbm_index_set_size(index, j - 1);
+    index->stamp++;
+
+    lbm_index_collect_strings(index);
+}
+
+static void
+lbm_index_entry_populate_from_msg(LibBalsaMailbox * mailbox, guint msgno,
+                                  LibBalsaMessage * msg)
+{
+    LibBalsaMailboxIndex *index = mailbox->mindex;
+    LibBalsaMailboxIndexEntry *entry = lbm_index_record(index, msgno);
+    LibBalsaMailboxIndexBlock *block = LBM_INDEX_BLOCK(index, msgno);
+    gchar *from;
+
+    from = get_from_field(msg);
+    entry->from          = lbm_index_strdup(index, from, TRUE);
+    g_free(from);
+    entry->subject       =
+        lbm_index_strdup(index, LIBBALSA_MESSAGE_GET_SUBJECT(msg), FALSE);
+    entry->from_key      = lbm_index_collate_key(index, entry->from, TRUE);
+    entry->subject_key   =
+        lbm_index_collate_key(index, lbm_subject_sort_base(entry->subject),
+                              FALSE);
+    entry->status_icon   = libbalsa_get_icon_from_flags(msg->flags);
+    entry->attach_icon   = libbalsa_message_get_attach_icon(msg);
+    /* Colors may have been set before the entry was populated. */
+    entry->unseen        = LIBBALSA_MESSAGE_IS_UNREAD(msg);
+#ifdef BALSA_USE_THREADS
+    entry->idle_pending  = 0;
+#endif                          /*BALSA_USE_THREADS */
+    block->msg_date[LBM_INDEX_SLOT(msgno)] = msg->headers->date;
+    block->size[LBM_INDEX_SLOT(msgno)]     = msg->length;
+    entry->present       = 1;
+    index->stamp++;
+    libbalsa_mailbox_msgno_changed(mailbox, msgno);
 }
 
 void
@@ -405,10 +632,16 @@ libbalsa_mailbox_index_entry_clear(LibBalsaMailbox * mailbox, guint msgno)
     g_return_if_fail(msgno > 0);
 
     if (msgno <= mailbox->mindex->len) {
-        LibBalsaMailboxIndexEntry **entry = (LibBalsaMailboxIndexEntry **)
-            & g_ptr_array_index(mailbox->mindex, msgno - 1);
-        lbm_index_entry_free(*entry);
-        *entry = NULL;
+        LibBalsaMailboxIndexEntry *entry =
+            lbm_index_record(mailbox->mindex, msgno);
+        LibBalsaMailboxIndexBlock *block =
+            LBM_INDEX_BLOCK(mailbox->mindex, msgno);
+
+        mailbox->mindex->dead_bytes += lbm_index_entry_bytes(entry);
+        memset(entry, 0, sizeof *entry);
+        block->msg_date[LBM_INDEX_SLOT(msgno)] = 0;
+        block->size[LBM_INDEX_SLOT(msgno)] = 0;
+        mailbox->mindex->stamp++;
 
         libbalsa_mailbox_msgno_changed(mailbox, msgno);
     }
@@ -416,22 +649,106 @@ libbalsa_mailbox_index_entry_clear(LibBalsaMailbox * mailbox, guint msgno)
 
 #ifdef BALSA_USE_THREADS
 #  define VALID_ENTRY(entry) \
-    ((entry) && !((LibBalsaMailboxIndexEntry *) (entry))->idle_pending)
+    ((entry)->present && !(entry)->idle_pending)
 #else                           /*BALSA_USE_THREADS */
-#  define VALID_ENTRY(entry) ((entry) != NULL)
+#  define VALID_ENTRY(entry) ((entry)->present)
 #endif                          /*BALSA_USE_THREADS */
 
+LibBalsaMailboxIndexEntry *
+libbalsa_mailbox_index_get(LibBalsaMailbox * mailbox, guint msgno)
+{
+    LibBalsaMailboxIndexEntry *entry;
+
+    if (!mailbox->mindex || msgno == 0 || msgno > mailbox->mindex->len)
+        return NULL;
+
+    entry = lbm_index_record(mailbox->mindex, msgno);
+
+    return VALID_ENTRY(entry) ? entry : NULL;
+}
+
+time_t
+libbalsa_mailbox_index_get_date(LibBalsaMailbox * mailbox, guint msgno)
+{
+    if (!libbalsa_mailbox_index_get(mailbox, msgno))
+        return 0;
+
+    return LBM_INDEX_BLOCK(mailbox->mindex, msgno)->
+        msg_date[LBM_INDEX_SLOT(msgno)];
+}
+
+/* Ranks of the entries in the sort on a string field, cached like the
+ * server-side ranks of LibBalsaMailboxImap: they are recomputed when
+ * the whole tree is sorted and an entry has changed since, and then a
+ * sort on that field compares integers. Equal keys get equal ranks.
+ * Sorting the few children of one node compares the keys instead, as
+ * ranking the whole index would cost more than it saves. */
+typedef struct {
+    guint msgno;
+    const gchar *key;
+} LbmSortKey;
+
+static gint
+lbm_sort_key_compare(gconstpointer a, gconstpointer b)
+{
+    return strcmp(((const LbmSortKey *) a)->key,
+                  ((const LbmSortKey *) b)->key);
+}
+
+static void
+lbm_index_update_ranks(LibBalsaMailbox * mailbox,
+                       LibBalsaMailboxSortFields field)
+{
+    LibBalsaMailboxIndex *index = mailbox->mindex;
+    guint stamp = index->stamp;
+    GArray *keys;
+    GArray *ranks;
+    guint msgno, i, rank;
+
+    if ((field != LB_MAILBOX_SORT_SENDER && field != LB_MAILBOX_SORT_SUBJECT)
+        || index->sort_ranks_stamp[field] == stamp)
+        return;
+
+    keys = g_array_new(FALSE, FALSE, sizeof(LbmSortKey));
+    for (msgno = 1; msgno <= index->len; msgno++) {
+        LibBalsaMailboxIndexEntry *entry =
+            libbalsa_mailbox_index_get(mailbox, msgno);
+        LbmSortKey sort_key;
+
+        if (!entry)
+            continue;
+        sort_key.msgno = msgno;
+        sort_key.key = lbm_index_sort_key(entry, field);
+        g_array_append_val(keys, sort_key);
+    }
+    g_array_sort(keys, lbm_sort_key_compare);
+
+    if (!(ranks = index->sort_ranks[field]))
+        ranks = index->sort_ranks[field] =
+            g_array_new(FALSE, FALSE, sizeof(guint));
+    g_array_set_size(ranks, index->len);
+    if (ranks->len > 0)
+        memset(ranks->data, 0, ranks->len * sizeof(guint));
+
+    for (i = rank = 0; i < keys->len; i++) {
+        LbmSortKey *sort_key = &g_array_index(keys, LbmSortKey, i);
+
+        if (i == 0 || strcmp(sort_key->key, sort_key[-1].key) != 0)
+            rank++;
+        g_array_index(ranks, guint, sort_key->msgno - 1) = rank;
+    }
+    g_array_free(keys, TRUE);
+
+    index->sort_ranks_stamp[field] = stamp;
+}
+
 void
 libbalsa_mailbox_index_set_flags(LibBalsaMailbox *mailbox,
                                  unsigned msgno, LibBalsaMessageFlag f)
 {
     LibBalsaMailboxIndexEntry *entry;
 
-    if (msgno > mailbox->mindex->len)
-        return;
-
-    entry = g_ptr_array_index(mailbox->mindex, msgno-1);
-    if (VALID_ENTRY(entry)) {
+    if ((entry = libbalsa_mailbox_index_get(mailbox, msgno))) {
         entry->status_icon = 
             libbalsa_get_icon_from_flags(f);
         entry->unseen = f & LIBBALSA_MESSAGE_FLAG_NEW;
@@ -450,6 +767,9 @@ static void lbm_get_index_entry_expunged_cb(LibBalsaMailbox * mailbox,
                                             guint seqno);
 #endif
 
+static void lbm_msgno_2_msg_tree_free(LibBalsaMailbox * mailbox);
+static void lbm_msg_tree_top_free(LibBalsaMailbox * mailbox);
+
 static void
 libbalsa_mailbox_finalize(GObject * object)
 {
@@ -497,6 +817,9 @@ libbalsa_mailbox_finalize(GObject * object)
     }
 #endif                          /*BALSA_USE_THREADS */
 
+    lbm_msgno_2_msg_tree_free(mailbox);
+    lbm_msg_tree_top_free(mailbox);
+
     /* The LibBalsaMailboxView is owned by balsa_app.mailbox_views. */
     mailbox->view = NULL;
 
@@ -561,18 +884,251 @@ static void
 libbalsa_mailbox_free_mindex(LibBalsaMailbox *mailbox)
 {
     if(mailbox->mindex) {
-        unsigned i;
-        /* we could have used g_ptr_array_foreach but it is >=2.4.0 */
-        for(i=0; i<mailbox->mindex->len; i++)
-            lbm_index_entry_free(g_ptr_array_index(mailbox->mindex, i));
-        g_ptr_array_free(mailbox->mindex, TRUE);
+        lbm_index_free(mailbox->mindex);
         mailbox->mindex = NULL;
     }
 }
 
+/* Helpers for the msgno-to-node lookup table; the gdk lock must be
+ * held, as for any other access to msg_tree. */
+static void
+lbm_msgno_2_msg_tree_set(LibBalsaMailbox * mailbox, guint msgno,
+                         GNode * node)
+{
+    if (msgno == 0)
+        return;
+
+    if (!mailbox->msgno_2_msg_tree)
+        mailbox->msgno_2_msg_tree = g_ptr_array_new();
+    if (mailbox->msgno_2_msg_tree->len < msgno) {
+        if (!node)
+            return;
+        g_ptr_array_set_size(mailbox->msgno_2_msg_tree, msgno);
+    }
+
+    g_ptr_array_index(mailbox->msgno_2_msg_tree, msgno - 1) = node;
+}
+
+static gboolean
+lbm_msgno_2_msg_tree_populate(GNode * node, LibBalsaMailbox * mailbox)
+{
+    lbm_msgno_2_msg_tree_set(mailbox, GPOINTER_TO_UINT(node->data), node);
+
+    return FALSE;
+}
+
+static gboolean
+lbm_msgno_2_msg_tree_clear(GNode * node, LibBalsaMailbox * mailbox)
+{
+    lbm_msgno_2_msg_tree_set(mailbox, GPOINTER_TO_UINT(node->data), NULL);
+
+    return FALSE;
+}
+
+/* Rebuild the whole table from msg_tree. */
+static void
+lbm_msgno_2_msg_tree_rebuild(LibBalsaMailbox * mailbox)
+{
+    if (mailbox->msgno_2_msg_tree)
+        g_ptr_array_set_size(mailbox->msgno_2_msg_tree, 0);
+
+    if (mailbox->msg_tree)
+        g_node_traverse(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+                        (GNodeTraverseFunc) lbm_msgno_2_msg_tree_populate,
+                        mailbox);
+}
+
+static void
+lbm_msgno_2_msg_tree_free(LibBalsaMailbox * mailbox)
+{
+    if (mailbox->msgno_2_msg_tree) {
+        g_ptr_array_free(mailbox->msgno_2_msg_tree, TRUE);
+        mailbox->msgno_2_msg_tree = NULL;
+    }
+}
+
+/* Find the node for msgno in msg_tree, or NULL if it is not in the
+ * view; replaces a g_node_find traverse of the whole tree. */
+static GNode *
+lbm_node_find(LibBalsaMailbox * mailbox, guint msgno)
+{
+    GNode *node;
+
+    if (!mailbox->msg_tree || !mailbox->msgno_2_msg_tree
+        || msgno == 0 || msgno > mailbox->msgno_2_msg_tree->len)
+        return NULL;
+
+    node = g_ptr_array_index(mailbox->msgno_2_msg_tree, msgno - 1);
+#ifdef SANITY_CHECK
+    g_return_val_if_fail(!node
+                         || GPOINTER_TO_UINT(node->data) == msgno, NULL);
+#endif
+
+    return node;
+}
+
+/* Position cache for the top level of msg_tree.  In a flat view the
+ * root has one child per message, so g_node_child_position and
+ * g_node_nth_child would scan all of them for every row the tree-view
+ * asks about.  Every function here that changes the top level
+ * invalidates the cache, and the next lookup rebuilds it.  Each lookup
+ * also checks that the node it returns still has the parent and
+ * siblings that the cache says, and rebuilds the cache if not. */
+static void
+lbm_msg_tree_top_invalidate(LibBalsaMailbox * mailbox)
+{
+    mailbox->msg_tree_top_valid = FALSE;
+}
+
+static void
+lbm_msg_tree_top_free(LibBalsaMailbox * mailbox)
+{
+    if (mailbox->msg_tree_top) {
+        g_ptr_array_free(mailbox->msg_tree_top, TRUE);
+        mailbox->msg_tree_top = NULL;
+    }
+    if (mailbox->msg_tree_top_pos) {
+        g_array_free(mailbox->msg_tree_top_pos, TRUE);
+        mailbox->msg_tree_top_pos = NULL;
+    }
+    lbm_msg_tree_top_invalidate(mailbox);
+}
+
+static gboolean
+lbm_msg_tree_top_validate(LibBalsaMailbox * mailbox)
+{
+    GNode *node;
+    guint pos;
+
+    if (mailbox->msg_tree_top_valid)
+        return TRUE;
+
+    if (!mailbox->msg_tree)
+        return FALSE;
+
+    if (!mailbox->msg_tree_top) {
+        mailbox->msg_tree_top = g_ptr_array_new();
+        mailbox->msg_tree_top_pos =
+            g_array_new(FALSE, FALSE, sizeof(guint));
+    }
+    g_ptr_array_set_size(mailbox->msg_tree_top, 0);
+
+    for (node = mailbox->msg_tree->children, pos = 0; node;
+         node = node->next, pos++) {
+        guint msgno = GPOINTER_TO_UINT(node->data);
+
+        g_ptr_array_add(mailbox->msg_tree_top, node);
+        if (msgno == 0)
+            continue;
+        if (mailbox->msg_tree_top_pos->len < msgno)
+            g_array_set_size(mailbox->msg_tree_top_pos, msgno);
+        g_array_index(mailbox->msg_tree_top_pos, guint, msgno - 1) = pos;
+    }
+
+    mailbox->msg_tree_top_valid = TRUE;
+
+    return TRUE;
+}
+
+/* A new last child of the root keeps the cache valid. */
+static void
+lbm_msg_tree_top_append(LibBalsaMailbox * mailbox, GNode * node)
+{
+    guint msgno = GPOINTER_TO_UINT(node->data);
+
+    if (!mailbox->msg_tree_top_valid)
+        return;
+
+    if (node->next || msgno == 0) {
+        lbm_msg_tree_top_invalidate(mailbox);
+        return;
+    }
+
+    if (mailbox->msg_tree_top_pos->len < msgno)
+        g_array_set_size(mailbox->msg_tree_top_pos, msgno);
+    g_array_index(mailbox->msg_tree_top_pos, guint, msgno - 1) =
+        mailbox->msg_tree_top->len;
+    g_ptr_array_add(mailbox->msg_tree_top, node);
+}
+
+/* Whether the cached node at pos is where the cache says: a child of
+ * the root between the cached nodes at pos - 1 and pos + 1. */
+static gboolean
+lbm_msg_tree_top_check(LibBalsaMailbox * mailbox, guint pos)
+{
+    GPtrArray *top = mailbox->msg_tree_top;
+    GNode *node = g_ptr_array_index(top, pos);
+
+    return node->parent == mailbox->msg_tree
+        && node->prev == (pos > 0 ? g_ptr_array_index(top, pos - 1) : NULL)
+        && node->next == (pos + 1 < top->len ?
+                          g_ptr_array_index(top, pos + 1) : NULL);
+}
+
+/* Replacements for g_node_child_position and g_node_nth_child that use
+ * the cache for children of the root. */
+static gint
+lbm_child_position(LibBalsaMailbox * mailbox, GNode * parent,
+                   GNode * node)
+{
+    guint msgno = GPOINTER_TO_UINT(node->data);
+
+    if (parent == mailbox->msg_tree && msgno > 0
+        && lbm_msg_tree_top_validate(mailbox)
+        && msgno <= mailbox->msg_tree_top_pos->len) {
+        guint pos =
+            g_array_index(mailbox->msg_tree_top_pos, guint, msgno - 1);
+
+        if (pos < mailbox->msg_tree_top->len
+            && g_ptr_array_index(mailbox->msg_tree_top, pos) == node) {
+            if (lbm_msg_tree_top_check(mailbox, pos))
+                return pos;
+            g_warning("%s: stale top level cache", __func__);
+            lbm_msg_tree_top_invalidate(mailbox);
+        }
+    }
+
+    return g_node_child_position(parent, node);
+}
+
+static GNode *
+lbm_nth_child(LibBalsaMailbox * mailbox, GNode * parent, gint n)
+{
+    if (parent == mailbox->msg_tree && n >= 0
+        && lbm_msg_tree_top_validate(mailbox)) {
+        if ((guint) n >= mailbox->msg_tree_top->len)
+            return NULL;
+        if (lbm_msg_tree_top_check(mailbox, n))
+            return g_ptr_array_index(mailbox->msg_tree_top, n);
+        g_warning("%s: stale top level cache", __func__);
+        lbm_msg_tree_top_invalidate(mailbox);
+    }
+
+    return g_node_nth_child(parent, n);
+}
+
+/* Number of children of the root, from the cache when its ends check. */
+static guint
+lbm_n_top_children(LibBalsaMailbox * mailbox)
+{
+    if (lbm_msg_tree_top_validate(mailbox)) {
+        GPtrArray *top = mailbox->msg_tree_top;
+
+        if (top->len == 0 ? mailbox->msg_tree->children == NULL
+            : g_ptr_array_index(top, 0) == mailbox->msg_tree->children
+            && lbm_msg_tree_top_check(mailbox, top->len - 1))
+            return top->len;
+        g_warning("%s: stale top level cache", __func__);
+        lbm_msg_tree_top_invalidate(mailbox);
+    }
+
+    return g_node_n_children(mailbox->msg_tree);
+}
+
 static gboolean lbm_set_threading(LibBalsaMailbox * mailbox,
                                   LibBalsaMailboxThreadingType
                                   thread_type);
+static gboolean lbm_update_threading(LibBalsaMailbox * mailbox);
 gboolean
 libbalsa_mailbox_open(LibBalsaMailbox * mailbox, GError **err)
 {
@@ -592,7 +1148,8 @@ libbalsa_mailbox_open(LibBalsaMailbox * mailbox, GError **err)
 
         mailbox->stamp++;
         if(mailbox->mindex) g_warning("mindex set - I leak memory");
-        mailbox->mindex = g_ptr_array_new();
+        mailbox->mindex = lbm_index_new();
+        mailbox->msgnos_filtered = 0;
 
 	saved_state = mailbox->state;
 	mailbox->state = LB_MAILBOX_STATE_OPENING;
@@ -654,8 +1211,11 @@ libbalsa_mailbox_close(LibBalsaMailbox * mailbox, gboolean expunge)
             g_node_destroy(mailbox->msg_tree);
             mailbox->msg_tree = NULL;
         }
+        lbm_msgno_2_msg_tree_free(mailbox);
+        lbm_msg_tree_top_free(mailbox);
         gdk_threads_leave();
         libbalsa_mailbox_free_mindex(mailbox);
+        mailbox->visible_first = mailbox->visible_last = 0;
         mailbox->stamp++;
 	mailbox->state = LB_MAILBOX_STATE_CLOSED;
     }
@@ -720,7 +1280,8 @@ libbalsa_mailbox_check(LibBalsaMailbox * mailbox)
     g_object_set_data(G_OBJECT(mailbox), LIBBALSA_MAILBOX_UNTHREADED,
                       unthreaded);
     if (unthreaded) {
-        lbm_set_threading(mailbox, mailbox->view->threading_type);
+        if (!lbm_update_threading(mailbox))
+            lbm_set_threading(mailbox, mailbox->view->threading_type);
         g_slist_free(unthreaded);
         g_object_set_data(G_OBJECT(mailbox), LIBBALSA_MAILBOX_UNTHREADED,
                           NULL);
@@ -817,18 +1378,26 @@ libbalsa_mailbox_can_match(LibBalsaMailbox * mailbox,
                                                           condition);
 }
 
-/* Helper function to run the "on reception" filters on a mailbox */
+/* Helper function to run the "on reception" filters on a mailbox.
+ * Only the messages that arrived since the last run are scanned, each
+ * of them just once against all the filters; the messages matched by
+ * each filter are then handed to its action in one batch. */
 
 void
 libbalsa_mailbox_run_filters_on_reception(LibBalsaMailbox * mailbox)
 {
     GSList *filters;
-    guint progress_count;
     GSList *lst;
     static LibBalsaCondition *recent_undeleted;
+    LibBalsaCondition *any_filter;
+    LibBalsaCondition *cond;
+    LibBalsaMailboxSearchIter *any_iter;
+    LibBalsaMailboxSearchIter **search_iters;
+    GArray **msgnos;
     gchar *text;
-    guint total;
-    guint progress_total;
+    guint first, total;
+    guint n_filters, i;
+    guint msgno;
     LibBalsaProgress progress;
 
     g_return_if_fail(LIBBALSA_IS_MAILBOX(mailbox));
@@ -848,17 +1417,16 @@ libbalsa_mailbox_run_filters_on_reception(LibBalsaMailbox * mailbox)
         return;
     }
 
-    progress_count = 0;
-    for (lst = filters; lst; lst = lst->next) {
-        LibBalsaFilter *filter = lst->data;
-
-        if (filter->condition
-            && !libbalsa_condition_is_flag_only(filter->condition, NULL, 0,
-                                                NULL))
-            ++progress_count;
+    libbalsa_lock_mailbox(mailbox);
+    total = libbalsa_mailbox_total_messages(mailbox);
+    first = MIN(mailbox->msgnos_filtered, total) + 1;
+    mailbox->msgnos_filtered = total;
+    if (first > total) {
+        libbalsa_unlock_mailbox(mailbox);
+        g_slist_free(filters);
+        return;
     }
 
-    libbalsa_lock_mailbox(mailbox);
     if (!recent_undeleted)
         recent_undeleted =
             libbalsa_condition_new_bool_ptr(FALSE, CONDITION_AND,
@@ -869,50 +1437,82 @@ libbalsa_mailbox_run_filters_on_reception(LibBalsaMailbox * mailbox)
                                             (TRUE,
                                              LIBBALSA_MESSAGE_FLAG_DELETED));
 
-    text = g_strdup_printf(_("Applying filter rules to %s"), mailbox->name);
-    total = libbalsa_mailbox_total_messages(mailbox);
-    progress_total = progress_count * total;
-        libbalsa_progress_set_text(&progress, text, progress_total);
-    g_free(text);
-
-    progress_count = 0;
-    for (lst = filters; lst; lst = lst->next) {
+    /* All the filters are also ORed into one condition, so that a new
+     * message that no filter wants, as most are, is rejected by a
+     * single match, which gets each field it tests only once. Only
+     * the messages that it accepts are matched against each filter. */
+    n_filters = g_slist_length(filters);
+    search_iters = g_new0(LibBalsaMailboxSearchIter *, n_filters);
+    msgnos = g_new0(GArray *, n_filters);
+    any_filter = NULL;
+    for (lst = filters, i = 0; lst; lst = lst->next, i++) {
         LibBalsaFilter *filter = lst->data;
-        gboolean use_progress;
-        LibBalsaCondition *cond;
-        LibBalsaMailboxSearchIter *search_iter;
-        guint msgno;
-        GArray *msgnos;
 
         if (!filter->condition)
             continue;
+        search_iters[i] = libbalsa_mailbox_search_iter_new(filter->condition);
+        msgnos[i] = g_array_new(FALSE, FALSE, sizeof(guint));
 
-        use_progress = !libbalsa_condition_is_flag_only(filter->condition,
-                                                        NULL, 0, NULL);
-
-        cond = libbalsa_condition_new_bool_ptr(FALSE, CONDITION_AND,
-                                               recent_undeleted,
+        cond = libbalsa_condition_new_bool_ptr(FALSE, CONDITION_OR,
+                                               any_filter,
                                                filter->condition);
-        search_iter = libbalsa_mailbox_search_iter_new(cond);
-        libbalsa_condition_unref(cond);
-
-        msgnos = g_array_new(FALSE, FALSE, sizeof(guint));
-        for (msgno = 1; msgno <= total; msgno++) {
-            if (libbalsa_mailbox_message_match(mailbox, msgno, search_iter))
-                g_array_append_val(msgnos, msgno);
-            if (use_progress)
-                libbalsa_progress_set_fraction(&progress,
-                                               ((gdouble) ++progress_count)
-                                               /
-                                               ((gdouble) progress_total));
-        }
-        libbalsa_mailbox_search_iter_free(search_iter);
+        if (any_filter)
+            libbalsa_condition_unref(any_filter);
+        any_filter = cond;
+    }
+    cond = libbalsa_condition_new_bool_ptr(FALSE, CONDITION_AND,
+                                           recent_undeleted, any_filter);
+    if (any_filter)
+        libbalsa_condition_unref(any_filter);
+    any_iter = libbalsa_mailbox_search_iter_new(cond);
+    libbalsa_condition_unref(cond);
+
+    text = g_strdup_printf(_("Applying filter rules to %s"), mailbox->name);
+    libbalsa_progress_set_text(&progress, text, total - first + 1);
+    g_free(text);
 
-        libbalsa_mailbox_register_msgnos(mailbox, msgnos);
-        libbalsa_filter_mailbox_messages(filter, mailbox, msgnos);
-        libbalsa_mailbox_unregister_msgnos(mailbox, msgnos);
-        g_array_free(msgnos, TRUE);
+    for (msgno = first; msgno <= total; msgno++) {
+        if (libbalsa_mailbox_message_match(mailbox, msgno, any_iter)) {
+            for (lst = filters, i = 0; lst; lst = lst->next, i++) {
+                LibBalsaFilter *filter = lst->data;
+
+                if (!search_iters[i]
+                    || !libbalsa_mailbox_message_match(mailbox, msgno,
+                                                       search_iters[i]))
+                    continue;
+                g_array_append_val(msgnos[i], msgno);
+                if (filter->action == FILTER_MOVE
+                    || filter->action == FILTER_TRASH)
+                    /* The action will mark the message as deleted, so
+                     * the following filters would not see it. */
+                    break;
+            }
+        }
+        libbalsa_progress_set_fraction(&progress,
+                                       ((gdouble) (msgno - first + 1))
+                                       / ((gdouble) (total - first + 1)));
+    }
+    libbalsa_mailbox_search_iter_free(any_iter);
+
+    /* An action may expunge messages, so all the arrays must follow
+     * the renumbering until the last action has run. */
+    for (i = 0; i < n_filters; i++)
+        if (msgnos[i])
+            libbalsa_mailbox_register_msgnos(mailbox, msgnos[i]);
+    for (lst = filters, i = 0; lst; lst = lst->next, i++) {
+        if (!search_iters[i])
+            continue;
+        libbalsa_mailbox_search_iter_free(search_iters[i]);
+        libbalsa_filter_mailbox_messages(lst->data, mailbox, msgnos[i]);
     }
+    for (i = 0; i < n_filters; i++)
+        if (msgnos[i]) {
+            libbalsa_mailbox_unregister_msgnos(mailbox, msgnos[i]);
+            g_array_free(msgnos[i], TRUE);
+        }
+    g_free(search_iters);
+    g_free(msgnos);
+
     libbalsa_progress_set_text(&progress, NULL, 0);
     libbalsa_unlock_mailbox(mailbox);
 
@@ -1235,9 +1835,7 @@ lbm_msgnos_changed_idle_cb(LibBalsaMailbox * mailbox)
 #endif
         pthread_mutex_unlock(&msgnos_changed_lock);
         gdk_threads_enter();
-        iter.user_data =
-            g_node_find(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL,
-                        GUINT_TO_POINTER(msgno));
+        iter.user_data = lbm_node_find(mailbox, msgno);
         if (iter.user_data) {
             GtkTreePath *path;
 
@@ -1300,9 +1898,7 @@ lbm_msgno_changed(LibBalsaMailbox * mailbox, guint seqno,
         return;
 
     if (iter->user_data == NULL)
-        iter->user_data =
-            g_node_find(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL,
-                        GUINT_TO_POINTER(seqno));
+        iter->user_data = lbm_node_find(mailbox, seqno);
     /* trying to modify seqno that is not in the tree?  Possible for
      * filtered views... Perhaps there is nothing to worry about.
      */
@@ -1369,6 +1965,9 @@ libbalsa_mailbox_msgno_inserted(LibBalsaMailbox *mailbox, guint seqno,
     iter.user_data = g_node_new(GUINT_TO_POINTER(seqno));
     iter.stamp = mailbox->stamp;
     *sibling = g_node_insert_after(parent, *sibling, iter.user_data);
+    lbm_msgno_2_msg_tree_set(mailbox, seqno, iter.user_data);
+    if (parent == mailbox->msg_tree)
+        lbm_msg_tree_top_append(mailbox, iter.user_data);
 
     if (g_signal_has_handler_pending(mailbox,
                                      libbalsa_mbox_model_signals
@@ -1404,6 +2003,8 @@ libbalsa_mailbox_msgno_filt_in(LibBalsaMailbox *mailbox, guint seqno)
     iter.user_data = g_node_new(GUINT_TO_POINTER(seqno));
     iter.stamp = mailbox->stamp;
     g_node_prepend(mailbox->msg_tree, iter.user_data);
+    lbm_msgno_2_msg_tree_set(mailbox, seqno, iter.user_data);
+    lbm_msg_tree_top_invalidate(mailbox);
 
     path = gtk_tree_model_get_path(GTK_TREE_MODEL(mailbox), &iter);
     g_signal_emit(mailbox, libbalsa_mbox_model_signals[ROW_INSERTED], 0,
@@ -1416,77 +2017,106 @@ libbalsa_mailbox_msgno_filt_in(LibBalsaMailbox *mailbox, guint seqno)
     gdk_threads_leave();
 }
 
-struct remove_data {LibBalsaMailbox *mailbox; unsigned seqno; GNode *node; };
+/* Binary search in the ascending array of expunged seqnos; returns
+ * TRUE if msgno is one of them, and stores in *below how many of them
+ * are smaller than msgno, i.e. how far msgno has to be shifted down. */
 static gboolean
-decrease_post(GNode *node, gpointer data)
-{
-    struct remove_data *dt = (struct remove_data*)data;
-    unsigned seqno = GPOINTER_TO_UINT(node->data);
-    if(seqno == dt->seqno) 
-        dt->node = node;
-    else if(seqno>dt->seqno) {
-        GtkTreeIter iter; 
-        node->data = GUINT_TO_POINTER(seqno-1);
-        iter.user_data = node;
-        lbm_msgno_changed(dt->mailbox, seqno, &iter);
+lbm_seqnos_lookup(GArray * seqnos, guint msgno, guint * below)
+{
+    guint lo = 0, hi = seqnos->len;
+
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+
+        if (g_array_index(seqnos, guint, mid) < msgno)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return FALSE;
+    *below = lo;
+
+    return lo < seqnos->len && g_array_index(seqnos, guint, lo) == msgno;
 }
 
-void
-libbalsa_mailbox_msgno_removed(LibBalsaMailbox * mailbox, guint seqno)
+/* Drop the entries of a msgno-indexed array that belong to the
+ * expunged seqnos, moving the rest down in a single pass. */
+static void
+lbm_ptr_array_compact(GPtrArray * array, GArray * seqnos,
+                      GDestroyNotify free_func)
 {
-    GtkTreeIter iter;
-    GtkTreePath *path;
-    struct remove_data dt;
-    GNode *child;
-    GNode *parent;
+    guint i, j, k;
 
-    g_signal_emit(mailbox, libbalsa_mailbox_signals[MESSAGE_EXPUNGED],
-                  0, seqno);
+    for (i = j = k = 0; i < array->len; i++) {
+        gpointer entry = g_ptr_array_index(array, i);
 
-    gdk_threads_enter();
-    if (!mailbox->msg_tree) {
-        gdk_threads_leave();
-        return;
+        while (k < seqnos->len && g_array_index(seqnos, guint, k) < i + 1)
+            k++;
+        if (k < seqnos->len && g_array_index(seqnos, guint, k) == i + 1) {
+            if (free_func)
+                free_func(entry);
+        } else
+            g_ptr_array_index(array, j++) = entry;
     }
+    g_ptr_array_set_size(array, j);
+}
 
-    dt.mailbox = mailbox;
-    dt.seqno = seqno;
-    dt.node = NULL;
+struct remove_data {
+    GArray *seqnos;
+    GPtrArray *nodes;           /* expunged nodes, in pre-order */
+    GPtrArray *paths;           /* their paths before the expunge */
+};
 
-    g_node_traverse(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-                    decrease_post, &dt);
+/* Walk the tree once, renumbering the surviving nodes and collecting
+ * the expunged ones together with their paths. */
+static void
+lbm_msgnos_removed_scan(GNode * parent, GtkTreePath * path,
+                        struct remove_data *dt)
+{
+    GNode *node;
 
-    if (seqno <= mailbox->mindex->len) {
-        lbm_index_entry_free(g_ptr_array_index(mailbox->mindex,
-                                               seqno - 1));
-        g_ptr_array_remove_index(mailbox->mindex, seqno - 1);
-    }
+    gtk_tree_path_down(path);
+    for (node = parent->children; node; node = node->next) {
+        guint seqno = GPOINTER_TO_UINT(node->data);
+        guint below;
 
-    mailbox->msg_tree_changed = TRUE;
+        if (lbm_seqnos_lookup(dt->seqnos, seqno, &below)) {
+            g_ptr_array_add(dt->nodes, node);
+            g_ptr_array_add(dt->paths, gtk_tree_path_copy(path));
+        } else if (below > 0)
+            node->data = GUINT_TO_POINTER(seqno - below);
 
-    if (!dt.node) {
-        /* It's ok, apparently the view did not include this message */
-        gdk_threads_leave();
-        return;
+        if (node->children)
+            lbm_msgnos_removed_scan(node, path, dt);
+        gtk_tree_path_next(path);
     }
+    gtk_tree_path_up(path);
+}
+
+/* Remove one expunged node at the given path from the tree, promoting
+ * its children to its parent, and tell the tree-view about it. */
+static void
+lbm_node_removed(LibBalsaMailbox * mailbox, GNode * node,
+                 GtkTreePath * path)
+{
+    GtkTreeIter iter;
+    GNode *child;
+    GNode *parent;
 
-    iter.user_data = dt.node;
     iter.stamp = mailbox->stamp;
-    path = gtk_tree_model_get_path(GTK_TREE_MODEL(mailbox), &iter);
 
     /* First promote any children to the node's parent; we'll insert
      * them all before the current node, to keep the path calculation
      * simple. */
-    parent = dt.node->parent;
-    while ((child = dt.node->children)) {
+    parent = node->parent;
+    while ((child = node->children)) {
         GSList **unthreaded;
         /* No need to notify the tree-view about unlinking the child--it
          * will assume we already did that when we notify it about
          * destroying the parent. */
         g_node_unlink(child);
-        g_node_insert_before(parent, dt.node, child);
+        g_node_insert_before(parent, node, child);
+        if (parent == mailbox->msg_tree)
+            lbm_msg_tree_top_invalidate(mailbox);
 
         /* Notify the tree-view about the new location of the child. */
         iter.user_data = child;
@@ -1505,7 +2135,8 @@ libbalsa_mailbox_msgno_removed(LibBalsaMailbox * mailbox, guint seqno)
     }
 
     /* Now it's safe to destroy the node. */
-    g_node_destroy(dt.node);
+    g_node_destroy(node);
+    lbm_msg_tree_top_invalidate(mailbox);
     g_signal_emit(mailbox, libbalsa_mbox_model_signals[ROW_DELETED], 0, path);
 
     if (parent->parent && !parent->children) {
@@ -1515,13 +2146,98 @@ libbalsa_mailbox_msgno_removed(LibBalsaMailbox * mailbox, guint seqno)
                       libbalsa_mbox_model_signals[ROW_HAS_CHILD_TOGGLED], 0,
                       path, &iter);
     }
-    
+}
+
+/* Expunge a batch of messages: seqnos holds their msgnos in ascending
+ * order, numbered as before the expunge.  The tree is renumbered and
+ * the msgno-indexed arrays are compacted in one pass each, and the
+ * tree-view gets one row-deleted per expunged row, followed by one
+ * row-changed per renumbered row. */
+void
+libbalsa_mailbox_msgnos_removed(LibBalsaMailbox * mailbox, GArray * seqnos)
+{
+    struct remove_data dt;
+    GtkTreePath *path;
+    guint i;
+
+    if (seqnos->len == 0)
+        return;
+
+    /* Highest first, so that each handler sees the numbering it
+     * expects after the previous ones. */
+    for (i = seqnos->len; i > 0; i--)
+        g_signal_emit(mailbox, libbalsa_mailbox_signals[MESSAGE_EXPUNGED],
+                      0, g_array_index(seqnos, guint, i - 1));
+
+    /* Messages that have been through the incoming filters are
+     * renumbered along with the rest. */
+    if (mailbox->msgnos_filtered > 0) {
+        guint below;
+
+        lbm_seqnos_lookup(seqnos, mailbox->msgnos_filtered + 1, &below);
+        mailbox->msgnos_filtered -= below;
+    }
+
+    gdk_threads_enter();
+    if (!mailbox->msg_tree) {
+        gdk_threads_leave();
+        return;
+    }
+
+    dt.seqnos = seqnos;
+    dt.nodes = g_ptr_array_new();
+    dt.paths = g_ptr_array_new();
+    path = gtk_tree_path_new();
+    lbm_msgnos_removed_scan(mailbox->msg_tree, path, &dt);
     gtk_tree_path_free(path);
-    mailbox->stamp++;
+
+    lbm_index_compact(mailbox->mindex, seqnos);
+    if (mailbox->msgno_2_msg_tree)
+        lbm_ptr_array_compact(mailbox->msgno_2_msg_tree, seqnos, NULL);
+    lbm_msg_tree_top_invalidate(mailbox);
+
+    mailbox->msg_tree_changed = TRUE;
+
+    /* Removing a node changes only the paths of nodes that follow it
+     * in pre-order, so working backwards keeps the saved paths valid. */
+    for (i = dt.nodes->len; i > 0; i--) {
+        path = g_ptr_array_index(dt.paths, i - 1);
+        lbm_node_removed(mailbox, g_ptr_array_index(dt.nodes, i - 1), path);
+        gtk_tree_path_free(path);
+    }
+
+    if (dt.nodes->len > 0)
+        mailbox->stamp++;
+    g_ptr_array_free(dt.nodes, TRUE);
+    g_ptr_array_free(dt.paths, TRUE);
+
+    /* Every message after the first expunged one has a new msgno, so
+     * the tree-view must redraw its row. */
+    if (mailbox->msgno_2_msg_tree) {
+        guint msgno;
+
+        for (msgno = g_array_index(seqnos, guint, 0);
+             msgno <= mailbox->msgno_2_msg_tree->len; msgno++) {
+            GtkTreeIter iter;
+
+            iter.user_data = NULL;
+            lbm_msgno_changed(mailbox, msgno, &iter);
+        }
+    }
 
     gdk_threads_leave();
 }
 
+void
+libbalsa_mailbox_msgno_removed(LibBalsaMailbox * mailbox, guint seqno)
+{
+    GArray *seqnos = g_array_sized_new(FALSE, FALSE, sizeof(guint), 1);
+
+    g_array_append_val(seqnos, seqno);
+    libbalsa_mailbox_msgnos_removed(mailbox, seqnos);
+    g_array_free(seqnos, TRUE);
+}
+
 void
 libbalsa_mailbox_msgno_filt_out(LibBalsaMailbox * mailbox, guint seqno)
 {
@@ -1535,8 +2251,7 @@ libbalsa_mailbox_msgno_filt_out(LibBalsaMailbox * mailbox, guint seqno)
         return;
     }
 
-    node = g_node_find(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL, 
-                       GUINT_TO_POINTER(seqno));
+    node = lbm_node_find(mailbox, seqno);
     if (!node) {
         g_warning("filt_out: msgno %d not found", seqno);
         gdk_threads_leave();
@@ -1557,6 +2272,8 @@ libbalsa_mailbox_msgno_filt_out(LibBalsaMailbox * mailbox, guint seqno)
          * destroying the parent. */
         g_node_unlink(child);
         g_node_insert_before(parent, node, child);
+        if (parent == mailbox->msg_tree)
+            lbm_msg_tree_top_invalidate(mailbox);
 
         /* Notify the tree-view about the new location of the child. */
         iter.user_data = child;
@@ -1570,7 +2287,9 @@ libbalsa_mailbox_msgno_filt_out(LibBalsaMailbox * mailbox, guint seqno)
     }
 
     /* Now it's safe to destroy the node. */
+    lbm_msgno_2_msg_tree_set(mailbox, seqno, NULL);
     g_node_destroy(node);
+    lbm_msg_tree_top_invalidate(mailbox);
     g_signal_emit(mailbox, libbalsa_mbox_model_signals[ROW_DELETED], 0, path);
 
     if (parent->parent && !parent->children) {
@@ -1615,8 +2334,7 @@ libbalsa_mailbox_msgno_filt_check(LibBalsaMailbox * mailbox, guint seqno,
 
     match = search_iter ?
         libbalsa_mailbox_message_match(mailbox, seqno, search_iter) : TRUE;
-    if (g_node_find(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL,
-                    GUINT_TO_POINTER(seqno))) {
+    if (lbm_node_find(mailbox, seqno)) {
         if (!match) {
             gboolean filt_out = hold_selected ?
                 libbalsa_mailbox_msgno_has_flags(mailbox, seqno, 0,
@@ -1748,9 +2466,7 @@ libbalsa_mailbox_msgno_find(LibBalsaMailbox * mailbox, guint seqno,
     g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), FALSE);
     g_return_val_if_fail(seqno > 0, FALSE);
 
-    if (!mailbox->msg_tree || !(tmp_iter.user_data =
-        g_node_find(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL,
-                    GINT_TO_POINTER(seqno))))
+    if (!(tmp_iter.user_data = lbm_node_find(mailbox, seqno)))
         return FALSE;
 
     tmp_iter.stamp = mailbox->stamp;
@@ -1764,6 +2480,80 @@ libbalsa_mailbox_msgno_find(LibBalsaMailbox * mailbox, guint seqno,
     return TRUE;
 }
 
+/* Record the first and last rows shown by the view; backends that fetch
+ * message data in chunks use them to choose what to fetch. */
+void
+libbalsa_mailbox_set_visible_range(LibBalsaMailbox * mailbox,
+                                   guint first_msgno, guint last_msgno)
+{
+    g_return_if_fail(LIBBALSA_IS_MAILBOX(mailbox));
+
+    libbalsa_lock_mailbox(mailbox);
+    mailbox->visible_first = first_msgno;
+    mailbox->visible_last = last_msgno;
+    libbalsa_unlock_mailbox(mailbox);
+}
+
+/* Messages to fetch along with msgno, in the order of the view.  If
+ * msgno is shown, that is the visible rows followed by the next rows,
+ * at least n and at most 4 * n in all; otherwise up to n rows around
+ * msgno, mostly after it, as the view is usually scrolled down.  Walks
+ * only the rows it returns.  Returns NULL if msgno is not in the
+ * view. */
+GArray *
+libbalsa_mailbox_get_prefetch_msgnos(LibBalsaMailbox * mailbox,
+                                     guint msgno, guint n)
+{
+    GArray *msgnos;
+    GNode *node;
+    guint visible_first, visible_last;
+    guint i;
+
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), NULL);
+
+    if (!lbm_node_find(mailbox, msgno))
+        return NULL;
+
+    libbalsa_lock_mailbox(mailbox);
+    visible_first = mailbox->visible_first;
+    visible_last = mailbox->visible_last;
+    libbalsa_unlock_mailbox(mailbox);
+
+    msgnos = g_array_sized_new(FALSE, FALSE, sizeof(guint), n);
+
+    if ((node = lbm_node_find(mailbox, visible_first))) {
+        gboolean past_last = FALSE;
+
+        do {
+            guint row = GPOINTER_TO_UINT(node->data);
+
+            g_array_append_val(msgnos, row);
+            if (row == visible_last)
+                past_last = TRUE;
+        } while ((msgnos->len < n || (!past_last && msgnos->len < 4 * n))
+                 && !G_NODE_IS_ROOT(node = lbm_next(node)));
+
+        for (i = 0; i < msgnos->len; i++)
+            if (g_array_index(msgnos, guint, i) == msgno)
+                return msgnos;
+        g_array_set_size(msgnos, 0);
+    }
+
+    node = lbm_node_find(mailbox, msgno);
+    for (i = 0; i < n / 4; i++) {
+        GNode *prev = lbm_prev(node);
+        if (G_NODE_IS_ROOT(prev))
+            break;
+        node = prev;
+    }
+    do {
+        guint row = GPOINTER_TO_UINT(node->data);
+        g_array_append_val(msgnos, row);
+    } while (msgnos->len < n && !G_NODE_IS_ROOT(node = lbm_next(node)));
+
+    return msgnos;
+}
+
 struct AddMessageData {
     GMimeStream *stream;
     LibBalsaMessageFlag flags;
@@ -1904,20 +2694,12 @@ static void
 lbm_cache_message(LibBalsaMailbox * mailbox, guint msgno,
                   LibBalsaMessage * message)
 {
-    LibBalsaMailboxIndexEntry *entry;
-
-    if (mailbox->mindex->len < msgno)
-        g_ptr_array_set_size(mailbox->mindex, msgno);
-
-    entry = g_ptr_array_index(mailbox->mindex, msgno - 1);
+    LibBalsaMailboxIndexEntry *entry =
+        lbm_index_record(mailbox->mindex, msgno);
 
-    if (!entry)
-        g_ptr_array_index(mailbox->mindex, msgno - 1) =
-            libbalsa_mailbox_index_entry_new_from_msg(message);
-#if BALSA_USE_THREADS
-    else if (entry->idle_pending)
-        lbm_index_entry_populate_from_msg(entry, message);
-#endif                          /* BALSA_USE_THREADS */
+    /* A pending entry is not present yet. */
+    if (!entry->present)
+        lbm_index_entry_populate_from_msg(mailbox, msgno, message);
 }
 
 LibBalsaMessage *
@@ -2037,6 +2819,25 @@ libbalsa_mailbox_get_message_stream(LibBalsaMailbox * mailbox, guint msgno,
 								   peek);
 }
 
+/* Check the messages whose flags have changed against the view
+ * filter. */
+static void
+lbm_msgnos_filt_check(LibBalsaMailbox * mailbox, GArray * msgnos)
+{
+    LibBalsaMailboxSearchIter *iter_view;
+    guint i;
+
+    if (!mailbox->mindex || !mailbox->view_filter)
+        return;
+
+    iter_view = libbalsa_mailbox_search_iter_view(mailbox);
+    for (i = 0; i < msgnos->len; i++) {
+        guint msgno = g_array_index(msgnos, guint, i);
+        libbalsa_mailbox_msgno_filt_check(mailbox, msgno, iter_view, TRUE);
+    }
+    libbalsa_mailbox_search_iter_free(iter_view);
+}
+
 /* libbalsa_mailbox_change_msgs_flags() changes stored message flags
    and is to be used only internally by libbalsa.
 */
@@ -2047,7 +2848,6 @@ libbalsa_mailbox_messages_change_flags(LibBalsaMailbox * mailbox,
                                        LibBalsaMessageFlag clear)
 {
     gboolean retval;
-    guint i;
     gboolean real_flag;
 
     g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), FALSE);
@@ -2064,16 +2864,8 @@ libbalsa_mailbox_messages_change_flags(LibBalsaMailbox * mailbox,
     retval = LIBBALSA_MAILBOX_GET_CLASS(mailbox)->
 	messages_change_flags(mailbox, msgnos, set, clear);
 
-    if (retval && mailbox->mindex && mailbox->view_filter) {
-        LibBalsaMailboxSearchIter *iter_view =
-            libbalsa_mailbox_search_iter_view(mailbox);
-        for (i = 0; i < msgnos->len; i++) {
-            guint msgno = g_array_index(msgnos, guint, i);
-            libbalsa_mailbox_msgno_filt_check(mailbox, msgno, iter_view,
-                                              TRUE);
-        }
-        libbalsa_mailbox_search_iter_free(iter_view);
-    }
+    if (retval)
+        lbm_msgnos_filt_check(mailbox, msgnos);
 
     if (real_flag)
 	libbalsa_unlock_mailbox(mailbox);
@@ -2122,6 +2914,31 @@ libbalsa_mailbox_messages_copy(LibBalsaMailbox * mailbox, GArray * msgnos,
     return retval;
 }
 
+/* Default method: copy the messages and flag them as deleted; imap
+ * backend replaces it with a server-side move where it can. */
+static gboolean
+libbalsa_mailbox_real_messages_move(LibBalsaMailbox * mailbox,
+                                    GArray * msgnos,
+                                    LibBalsaMailbox * dest, GError ** err)
+{
+    LibBalsaMailboxClass *klass = LIBBALSA_MAILBOX_GET_CLASS(mailbox);
+
+    if (!klass->messages_copy(mailbox, msgnos, dest, err))
+        return FALSE;
+
+    if (mailbox->readonly
+        || !klass->messages_change_flags(mailbox, msgnos,
+                                         LIBBALSA_MESSAGE_FLAG_DELETED,
+                                         (LibBalsaMessageFlag) 0)) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_COPY_ERROR,
+                    _("Removing messages from source mailbox failed"));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /* Move messages with msgnos in the list from mailbox to dest. */
 gboolean
 libbalsa_mailbox_messages_move(LibBalsaMailbox * mailbox,
@@ -2134,18 +2951,15 @@ libbalsa_mailbox_messages_move(LibBalsaMailbox * mailbox,
     g_return_val_if_fail(msgnos->len > 0, TRUE);
 
     libbalsa_lock_mailbox(mailbox);
-    if (libbalsa_mailbox_messages_copy(mailbox, msgnos, dest, err)) {
-        retval = libbalsa_mailbox_messages_change_flags
-            (mailbox, msgnos, LIBBALSA_MESSAGE_FLAG_DELETED,
-             (LibBalsaMessageFlag) 0);
-	if(!retval)
-	    g_set_error(err,LIBBALSA_MAILBOX_ERROR,
-                        LIBBALSA_MAILBOX_COPY_ERROR,
-			_("Removing messages from source mailbox failed"));
-    } else
-        retval = FALSE;
+    retval = LIBBALSA_MAILBOX_GET_CLASS(mailbox)->
+        messages_move(mailbox, msgnos, dest, err);
+    if (retval)
+        lbm_msgnos_filt_check(mailbox, msgnos);
     libbalsa_unlock_mailbox(mailbox);
 
+    if (retval)
+        libbalsa_mailbox_changed(mailbox);
+
     return retval;
 }
 
@@ -2230,7 +3044,9 @@ libbalsa_mailbox_can_do(LibBalsaMailbox *mailbox,
 }
 
 
-static void lbm_sort(LibBalsaMailbox * mbox, GNode * parent);
+static void lbm_sort(LibBalsaMailbox * mbox, GNode * parent,
+                     gboolean recurse);
+static void lbm_sort_all(LibBalsaMailbox * mbox);
 static gboolean
 lbm_set_threading(LibBalsaMailbox * mailbox,
                   LibBalsaMailboxThreadingType thread_type)
@@ -2242,7 +3058,7 @@ lbm_set_threading(LibBalsaMailbox * mailbox,
                                                        thread_type);
     gdk_threads_enter();
     if (mailbox->msg_tree)
-        lbm_sort(mailbox, mailbox->msg_tree);
+        lbm_sort_all(mailbox);
 
     libbalsa_mailbox_changed(mailbox);
     gdk_threads_leave();
@@ -2250,6 +3066,27 @@ lbm_set_threading(LibBalsaMailbox * mailbox,
     return TRUE;
 }
 
+/* Thread only the messages that were added since the tree was last
+ * threaded, if the backend knows how; returns FALSE if the whole tree
+ * must be threaded again. */
+static gboolean
+lbm_update_threading(LibBalsaMailbox * mailbox)
+{
+    gboolean retval;
+
+    if (!MAILBOX_OPEN(mailbox) || !mailbox->msg_tree
+        || !LIBBALSA_MAILBOX_GET_CLASS(mailbox)->update_threading)
+        return FALSE;
+
+    gdk_threads_enter();
+    retval = LIBBALSA_MAILBOX_GET_CLASS(mailbox)->update_threading(mailbox);
+    if (retval)
+        libbalsa_mailbox_changed(mailbox);
+    gdk_threads_leave();
+
+    return retval;
+}
+
 void
 libbalsa_mailbox_set_threading(LibBalsaMailbox *mailbox,
                                LibBalsaMailboxThreadingType thread_type)
@@ -2262,6 +3099,31 @@ libbalsa_mailbox_set_threading(LibBalsaMailbox *mailbox,
     libbalsa_unlock_mailbox(mailbox);
 }
 
+gboolean
+libbalsa_mailbox_update_threading(LibBalsaMailbox * mailbox)
+{
+    gboolean retval;
+
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), FALSE);
+
+    libbalsa_lock_mailbox(mailbox);
+    retval = lbm_update_threading(mailbox);
+    libbalsa_unlock_mailbox(mailbox);
+
+    return retval;
+}
+
+/* Sort the children of parent, but not their subtrees; for the
+ * update-threading method, after it has moved nodes to parent. The
+ * gdk lock must be held. */
+void
+libbalsa_mailbox_sort_children(LibBalsaMailbox * mailbox, GNode * parent)
+{
+    g_return_if_fail(LIBBALSA_IS_MAILBOX(mailbox));
+
+    lbm_sort(mailbox, parent, FALSE);
+}
+
 /* =================================================================== *
  * Mailbox view methods                                                *
  * =================================================================== */
@@ -2812,12 +3674,12 @@ mbox_model_get_iter(GtkTreeModel *tree_model,
 }
 
 static GtkTreePath *
-mbox_model_get_path_helper(GNode * node, GNode * msg_tree)
+mbox_model_get_path_helper(LibBalsaMailbox * mailbox, GNode * node)
 {
     GtkTreePath *path = gtk_tree_path_new();
 
     while (node->parent) {
-	gint i = g_node_child_position(node->parent, node);
+	gint i = lbm_child_position(mailbox, node->parent, node);
 	if (i < 0) {
 	    gtk_tree_path_free(path);
 	    return NULL;
@@ -2826,7 +3688,7 @@ mbox_model_get_path_helper(GNode * node, GNode * msg_tree)
 	node = node->parent;
     }
 
-    if (node == msg_tree)
+    if (node == mailbox->msg_tree)
 	return path;
     gtk_tree_path_free(path);
     return NULL;
@@ -2853,9 +3715,7 @@ mbox_model_get_path(GtkTreeModel * tree_model, GtkTreeIter * iter)
 
     g_return_val_if_fail(node->parent != NULL, NULL);
 
-    return mbox_model_get_path_helper(node,
-                                      LIBBALSA_MAILBOX(tree_model)->
-                                      msg_tree);
+    return mbox_model_get_path_helper(LIBBALSA_MAILBOX(tree_model), node);
 }
 
 /* mbox_model_get_value: 
@@ -2928,13 +3788,10 @@ lbm_get_index_entry(LibBalsaMailbox * lmm, GNode * node)
     if (!lmm->mindex)
         return NULL;
 
-    if (lmm->mindex->len < msgno )
-        g_ptr_array_set_size(lmm->mindex, msgno);
-
-    entry = g_ptr_array_index(lmm->mindex, msgno - 1);
+    entry = lbm_index_record(lmm->mindex, msgno);
 #ifdef BALSA_USE_THREADS
-    if (entry)
-        return entry->idle_pending ? NULL : entry;
+    if (entry->present || entry->idle_pending)
+        return VALID_ENTRY(entry) ? entry : NULL;
 
     pthread_mutex_lock(&get_index_entry_lock);
     if (!lmm->msgnos_pending) {
@@ -2955,23 +3812,22 @@ lbm_get_index_entry(LibBalsaMailbox * lmm, GNode * node)
     g_array_append_val(lmm->msgnos_pending, msgno);
     /* Make sure we have a "pending" index entry before releasing the
      * lock. */
-    g_ptr_array_index(lmm->mindex, msgno - 1) =
-        lbm_index_entry_new_pending();
+    entry->idle_pending = 1;
     pthread_mutex_unlock(&get_index_entry_lock);
+
+    return NULL;
 #else                           /*BALSA_USE_THREADS */
-    if (!entry) {
+    if (!entry->present) {
         LibBalsaMessage *message =
             libbalsa_mailbox_get_message(lmm, msgno);
-        if (message) {
+        if (message)
             /* get-message has cached the message info, so we just unref
              * message. */
             g_object_unref(message);
-            entry = g_ptr_array_index(lmm->mindex, msgno - 1);
-        }
     }
-#endif                          /*BALSA_USE_THREADS */
 
-    return entry;
+    return libbalsa_mailbox_index_get(lmm, msgno);
+#endif                          /*BALSA_USE_THREADS */
 }
 
 gchar *libbalsa_mailbox_date_format;
@@ -3023,14 +3879,17 @@ mbox_model_get_value(GtkTreeModel *tree_model,
         break;
     case LB_MBOX_DATE_COL:
         if(msg) {
-            tmp = libbalsa_date_to_utf8(&msg->msg_date,
+            time_t msg_date = libbalsa_mailbox_index_get_date(lmm, msgno);
+
+            tmp = libbalsa_date_to_utf8(&msg_date,
 		                        libbalsa_mailbox_date_format);
             g_value_take_string(value, tmp);
         }
         break;
     case LB_MBOX_SIZE_COL:
         if(msg) {
-            tmp = libbalsa_size_to_gchar(msg->size);
+            tmp = libbalsa_size_to_gchar(LBM_INDEX_BLOCK(lmm->mindex, msgno)->
+                                         size[LBM_INDEX_SLOT(msgno)]);
             g_value_take_string(value, tmp);
         }
         else g_value_set_static_string(value, "          ");
@@ -3131,6 +3990,9 @@ mbox_model_iter_n_children(GtkTreeModel      *tree_model,
     node = iter ? iter->user_data
                 : LIBBALSA_MAILBOX(tree_model)->msg_tree;
 
+    if (node && !iter)
+        return lbm_n_top_children(LIBBALSA_MAILBOX(tree_model));
+
     return node ? g_node_n_children(node) : 0;
 }
 
@@ -3158,7 +4020,7 @@ mbox_model_iter_nth_child(GtkTreeModel  * tree_model,
                * only if mailbox is closed but a view is still active. 
                */
         return FALSE;
-    node = g_node_nth_child(node, n);
+    node = lbm_nth_child(LIBBALSA_MAILBOX(tree_model), node, n);
 
     if (node) {
         iter->user_data = node;
@@ -3351,32 +4213,62 @@ mbox_sortable_init(GtkTreeSortableIface * iface)
     iface->has_default_sort_func = mbox_has_default_sort_func;
 }
 
+/* Sender and subject compare their ranks if those are up to date, and
+ * their collation keys otherwise; both give the same order. */
 static gint
-mbox_compare_from(LibBalsaMailboxIndexEntry * message_a,
-                  LibBalsaMailboxIndexEntry * message_b)
+mbox_compare_ranked(LibBalsaMailboxIndex * index,
+                    LibBalsaMailboxSortFields field,
+                    guint msgno_a, LibBalsaMailboxIndexEntry * message_a,
+                    guint msgno_b, LibBalsaMailboxIndexEntry * message_b)
 {
-    return g_ascii_strcasecmp(message_a->from, message_b->from);
+    GArray *ranks = index->sort_ranks[field];
+
+    if (ranks && index->sort_ranks_stamp[field] == index->stamp
+        && msgno_a <= ranks->len && msgno_b <= ranks->len) {
+        guint rank_a = g_array_index(ranks, guint, msgno_a - 1);
+        guint rank_b = g_array_index(ranks, guint, msgno_b - 1);
+
+        if (rank_a > 0 && rank_b > 0)
+            return (gint) rank_a - (gint) rank_b;
+    }
+
+    return strcmp(lbm_index_sort_key(message_a, field),
+                  lbm_index_sort_key(message_b, field));
+}
+
+static gint
+mbox_compare_from(LibBalsaMailboxIndex * index,
+                  guint msgno_a, LibBalsaMailboxIndexEntry * message_a,
+                  guint msgno_b, LibBalsaMailboxIndexEntry * message_b)
+{
+    return mbox_compare_ranked(index, LB_MAILBOX_SORT_SENDER,
+                               msgno_a, message_a, msgno_b, message_b);
 }
 
 static gint
-mbox_compare_subject(LibBalsaMailboxIndexEntry * message_a,
-                     LibBalsaMailboxIndexEntry * message_b)
+mbox_compare_subject(LibBalsaMailboxIndex * index,
+                     guint msgno_a, LibBalsaMailboxIndexEntry * message_a,
+                     guint msgno_b, LibBalsaMailboxIndexEntry * message_b)
 {
-    return g_ascii_strcasecmp(message_a->subject, message_b->subject);
+    return mbox_compare_ranked(index, LB_MAILBOX_SORT_SUBJECT,
+                               msgno_a, message_a, msgno_b, message_b);
 }
 
+/* Date and size are read from their own columns. */
 static gint
-mbox_compare_date(LibBalsaMailboxIndexEntry * message_a,
-                  LibBalsaMailboxIndexEntry * message_b)
+mbox_compare_date(LibBalsaMailboxIndex * index,
+                  guint msgno_a, guint msgno_b)
 {
-    return message_a->msg_date - message_b->msg_date;
+    return LBM_INDEX_BLOCK(index, msgno_a)->msg_date[LBM_INDEX_SLOT(msgno_a)]
+        - LBM_INDEX_BLOCK(index, msgno_b)->msg_date[LBM_INDEX_SLOT(msgno_b)];
 }
 
 static gint
-mbox_compare_size(LibBalsaMailboxIndexEntry * message_a,
-                  LibBalsaMailboxIndexEntry * message_b)
+mbox_compare_size(LibBalsaMailboxIndex * index,
+                  guint msgno_a, guint msgno_b)
 {
-    return message_a->size - message_b->size;
+    return LBM_INDEX_BLOCK(index, msgno_a)->size[LBM_INDEX_SLOT(msgno_a)]
+        - LBM_INDEX_BLOCK(index, msgno_b)->size[LBM_INDEX_SLOT(msgno_b)];
 }
 
 static gint
@@ -3396,24 +4288,26 @@ mbox_compare_func(const SortTuple * a,
 	LibBalsaMailboxIndexEntry *message_a;
 	LibBalsaMailboxIndexEntry *message_b;
 
-	message_a = g_ptr_array_index(mbox->mindex, msgno_a - 1);
-	message_b = g_ptr_array_index(mbox->mindex, msgno_b - 1);
+	message_a = libbalsa_mailbox_index_get(mbox, msgno_a);
+	message_b = libbalsa_mailbox_index_get(mbox, msgno_b);
 
-	if (!(VALID_ENTRY(message_a) && VALID_ENTRY(message_b)))
+	if (!(message_a && message_b))
 	    return 0;
 
 	switch (mbox->view->sort_field) {
 	case LB_MAILBOX_SORT_SENDER:
-	    retval = mbox_compare_from(message_a, message_b);
+	    retval = mbox_compare_from(mbox->mindex, msgno_a, message_a,
+                                       msgno_b, message_b);
 	    break;
 	case LB_MAILBOX_SORT_SUBJECT:
-	    retval = mbox_compare_subject(message_a, message_b);
+	    retval = mbox_compare_subject(mbox->mindex, msgno_a, message_a,
+                                          msgno_b, message_b);
 	    break;
 	case LB_MAILBOX_SORT_DATE:
-	    retval = mbox_compare_date(message_a, message_b);
+	    retval = mbox_compare_date(mbox->mindex, msgno_a, msgno_b);
 	    break;
 	case LB_MAILBOX_SORT_SIZE:
-	    retval = mbox_compare_size(message_a, message_b);
+	    retval = mbox_compare_size(mbox->mindex, msgno_a, msgno_b);
 	    break;
 	default:
 	    retval = 0;
@@ -3424,16 +4318,20 @@ mbox_compare_func(const SortTuple * a,
             /* resolve ties using previous sort column */
             switch (mbox->view->sort_field_prev) {
             case LB_MAILBOX_SORT_SENDER:
-                retval = mbox_compare_from(message_a, message_b);
+                retval = mbox_compare_from(mbox->mindex, msgno_a, message_a,
+                                           msgno_b, message_b);
                 break;
             case LB_MAILBOX_SORT_SUBJECT:
-                retval = mbox_compare_subject(message_a, message_b);
+                retval = mbox_compare_subject(mbox->mindex, msgno_a, message_a,
+                                              msgno_b, message_b);
                 break;
             case LB_MAILBOX_SORT_DATE:
-                retval = mbox_compare_date(message_a, message_b);
+                retval = mbox_compare_date(mbox->mindex, msgno_a,
+                                          msgno_b);
                 break;
             case LB_MAILBOX_SORT_SIZE:
-                retval = mbox_compare_size(message_a, message_b);
+                retval = mbox_compare_size(mbox->mindex, msgno_a,
+                                          msgno_b);
                 break;
             default:
                 retval = 0;
@@ -3458,18 +4356,11 @@ mbox_compare_func(const SortTuple * a,
 static gboolean
 lbm_has_valid_index_entry(LibBalsaMailbox * mailbox, guint msgno)
 {
-    LibBalsaMailboxIndexEntry *entry;
-
-    if (msgno > mailbox->mindex->len)
-        return FALSE;
-
-    entry = g_ptr_array_index(mailbox->mindex, msgno - 1);
-
-    return VALID_ENTRY(entry);
+    return libbalsa_mailbox_index_get(mailbox, msgno) != NULL;
 }
 
 static void
-lbm_sort(LibBalsaMailbox * mbox, GNode * parent)
+lbm_sort(LibBalsaMailbox * mbox, GNode * parent, gboolean recurse)
 {
     GtkTreeIter iter;
     GArray *sort_array;
@@ -3489,7 +4380,8 @@ lbm_sort(LibBalsaMailbox * mbox, GNode * parent)
         return;
 
     if (node->next == NULL) {
-        lbm_sort(mbox, node);
+        if (recurse)
+            lbm_sort(mbox, node, TRUE);
         return;
     }
 
@@ -3511,7 +4403,8 @@ lbm_sort(LibBalsaMailbox * mbox, GNode * parent)
     if (sort_array->len <= 1) {
         g_array_free(sort_array, TRUE);
         g_ptr_array_free(node_array, TRUE);
-        lbm_sort(mbox, node);
+        if (recurse)
+            lbm_sort(mbox, node, TRUE);
         return;
     }
     LIBBALSA_MAILBOX_GET_CLASS(mbox)->sort(mbox, sort_array);
@@ -3537,6 +4430,8 @@ lbm_sort(LibBalsaMailbox * mbox, GNode * parent)
                 node = parent->children = tmp_node;
             tmp_node->prev = prev;
             mbox->msg_tree_changed = TRUE;
+            if (parent == mbox->msg_tree)
+                lbm_msg_tree_top_invalidate(mbox);
         } else
             g_assert(prev == NULL || prev->next == tmp_node);
         prev = tmp_node;
@@ -3565,8 +4460,21 @@ lbm_sort(LibBalsaMailbox * mbox, GNode * parent)
     g_array_free(sort_array, TRUE);
     g_ptr_array_free(node_array, TRUE);
 
-    for (tmp_node = node; tmp_node; tmp_node = tmp_node->next)
-        lbm_sort(mbox, tmp_node);
+    if (recurse)
+        for (tmp_node = node; tmp_node; tmp_node = tmp_node->next)
+            lbm_sort(mbox, tmp_node, TRUE);
+}
+
+/* Sort the whole tree; the string sort fields are ranked first, see
+ * lbm_index_update_ranks(). */
+static void
+lbm_sort_all(LibBalsaMailbox * mbox)
+{
+    if (mbox->mindex) {
+        lbm_index_update_ranks(mbox, mbox->view->sort_field);
+        lbm_index_update_ranks(mbox, mbox->view->sort_field_prev);
+    }
+    lbm_sort(mbox, mbox->msg_tree, TRUE);
 }
 
 /* called from gtk-tree-view-column */
@@ -3669,7 +4577,7 @@ mbox_set_sort_column_id(GtkTreeSortable * sortable,
             return;
     }
     libbalsa_lock_mailbox(mbox);
-    lbm_sort(mbox, mbox->msg_tree);
+    lbm_sort_all(mbox);
     libbalsa_unlock_mailbox(mbox);
 
     libbalsa_mailbox_changed(mbox);
@@ -3718,9 +4626,11 @@ libbalsa_mailbox_unlink_and_prepend(LibBalsaMailbox * mailbox,
 
     iter.stamp = mailbox->stamp;
 
-    path = mbox_model_get_path_helper(node, mailbox->msg_tree);
+    path = mbox_model_get_path_helper(mailbox, node);
     current_parent = node->parent;
     g_node_unlink(node);
+    if (current_parent == mailbox->msg_tree)
+        lbm_msg_tree_top_invalidate(mailbox);
     if (path) {
         /* The node was in mailbox->msg_tree. */
         g_signal_emit(mailbox,
@@ -3737,12 +4647,17 @@ libbalsa_mailbox_unlink_and_prepend(LibBalsaMailbox * mailbox,
     }
 
     if (!parent) {
+        g_node_traverse(node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+                        (GNodeTraverseFunc) lbm_msgno_2_msg_tree_clear,
+                        mailbox);
         g_node_destroy(node);
         return;
     }
 
     g_node_prepend(parent, node);
-    path = mbox_model_get_path_helper(parent, mailbox->msg_tree);
+    if (parent == mailbox->msg_tree)
+        lbm_msg_tree_top_invalidate(mailbox);
+    path = mbox_model_get_path_helper(mailbox, parent);
     if (path) {
         /* The parent is in mailbox->msg_tree. */
         if (!node->next) {
@@ -3835,8 +4750,10 @@ lbm_update_msg_tree_move(GNode * new_node,
         return FALSE;
 
     node = mti->nodes[msgno];
-    if (!node)
+    if (!node) {
         mti->nodes[msgno] = node = g_node_new(new_node->data);
+        lbm_msgno_2_msg_tree_set(mti->mailbox, msgno, node);
+    }
 
     msgno = GPOINTER_TO_UINT(new_node->parent->data);
     if (msgno >= mti->total)
@@ -3917,6 +4834,8 @@ libbalsa_mailbox_set_msg_tree(LibBalsaMailbox * mailbox, GNode * new_tree)
 {
     gdk_threads_enter();
 
+    lbm_msg_tree_top_invalidate(mailbox);
+
     if (mailbox->msg_tree && mailbox->msg_tree->children) {
         lbm_update_msg_tree(mailbox, new_tree);
         g_node_destroy(new_tree);
@@ -3924,6 +4843,7 @@ libbalsa_mailbox_set_msg_tree(LibBalsaMailbox * mailbox, GNode * new_tree)
         if (mailbox->msg_tree)
             g_node_destroy(mailbox->msg_tree);
         mailbox->msg_tree = new_tree;
+        lbm_msgno_2_msg_tree_rebuild(mailbox);
         lbm_set_msg_tree(mailbox);
     }
 
@@ -4185,8 +5105,8 @@ LibBalsaMessageStatus
 libbalsa_mailbox_msgno_get_status(LibBalsaMailbox * mailbox, guint msgno)
 {
     LibBalsaMailboxIndexEntry *entry =
-        g_ptr_array_index(mailbox->mindex, msgno - 1);
-    return VALID_ENTRY(entry) ?
+        libbalsa_mailbox_index_get(mailbox, msgno);
+    return entry ?
         entry->status_icon : LIBBALSA_MESSAGE_STATUS_ICONS_NUM;
 }
 
@@ -4194,8 +5114,8 @@ const gchar *
 libbalsa_mailbox_msgno_get_subject(LibBalsaMailbox * mailbox, guint msgno)
 {
     LibBalsaMailboxIndexEntry *entry =
-        g_ptr_array_index(mailbox->mindex, msgno - 1);
-    return VALID_ENTRY(entry) ? entry->subject : NULL;
+        libbalsa_mailbox_index_get(mailbox, msgno);
+    return entry ? entry->subject : NULL;
 }
 
 /* Update icons, but only if entry has been allocated. */
@@ -4206,11 +5126,7 @@ libbalsa_mailbox_msgno_update_attach(LibBalsaMailbox * mailbox,
     LibBalsaMailboxIndexEntry *entry;
     LibBalsaMessageAttach attach_icon;
 
-    if (!mailbox || !mailbox->mindex || mailbox->mindex->len < msgno)
-	return;
-
-    entry = g_ptr_array_index(mailbox->mindex, msgno - 1);
-    if (!VALID_ENTRY(entry))
+    if (!mailbox || !(entry = libbalsa_mailbox_index_get(mailbox, msgno)))
 	return;
 
     attach_icon = libbalsa_message_get_attach_icon(message);
@@ -4267,6 +5183,16 @@ lbm_queue_check(LibBalsaMailbox * mailbox)
                       GUINT_TO_POINTER(id));
 }
 
+/* Check the mailbox from an idle callback; must be called from the
+ * main thread. */
+void
+libbalsa_mailbox_queue_check(LibBalsaMailbox * mailbox)
+{
+    g_return_if_fail(LIBBALSA_IS_MAILBOX(mailbox));
+
+    lbm_queue_check(mailbox);
+}
+
 /* Search mailbox for a message matching the condition in search_iter,
  * starting at iter, either forward or backward, and abandoning the
  * search if message stop_msgno is reached; return value indicates
@@ -4408,18 +5334,14 @@ lbm_set_color(LibBalsaMailbox * mailbox, GArray * msgnos,
         if (msgno > mailbox->mindex->len)
             return;
 
-        entry = g_ptr_array_index(mailbox->mindex, msgno - 1);
-        if (!entry)
-            entry = g_ptr_array_index(mailbox->mindex, msgno - 1) =
-                g_new0(LibBalsaMailboxIndexEntry, 1);
-
+        entry = lbm_index_record(mailbox->mindex, msgno);
         if (foreground) {
-            g_free(entry->foreground);
-            entry->foreground = g_strdup(color);
+            entry->foreground =
+                lbm_index_strdup(mailbox->mindex, color, TRUE);
             entry->foreground_set = TRUE;
         } else {
-            g_free(entry->background);
-            entry->background = g_strdup(color);
+            entry->background =
+                lbm_index_strdup(mailbox->mindex, color, TRUE);
             entry->background_set = TRUE;
         }
     }
@@ -218,11 +218,22 @@ struct _LibBalsaMailbox {
     gboolean readonly;
     gboolean disconnected;
 
-    GPtrArray *mindex;  /* the basic message index used for index
+    struct LibBalsaMailboxIndex_ *mindex;
+                        /* the basic message index used for index
                          * displaying/columns of GtkTreeModel interface
                          * and NOTHING else. */
     GNode *msg_tree; /* the possibly filtered tree of messages;
                       * gdk lock MUST BE HELD when accessing. */
+    GPtrArray *msgno_2_msg_tree; /* msgno -> GNode in msg_tree lookup
+                                  * table, NULL where the message is not
+                                  * in the view; same locking rules as
+                                  * msg_tree. */
+    /* Position cache for the top level of msg_tree, which is the whole
+     * view when it is not threaded; rebuilt on demand after the top
+     * level has been changed. */
+    GPtrArray *msg_tree_top;     /* position -> GNode */
+    GArray *msg_tree_top_pos;    /* msgno -> position */
+    gboolean msg_tree_top_valid;
     LibBalsaCondition *view_filter; /* to choose a subset of messages
                                      * to be displayed, e.g., only
                                      * undeleted. */
@@ -242,6 +253,9 @@ struct _LibBalsaMailbox {
     /* Associated filters (struct mailbox_filter) */
     GSList * filters;
     gboolean filters_loaded;
+    /* Messages 1..msgnos_filtered have been through the incoming
+     * filters since the mailbox was opened. */
+    guint msgnos_filtered;
 
     LibBalsaMailboxView *view;
     LibBalsaMailboxState state;
@@ -252,6 +266,11 @@ struct _LibBalsaMailbox {
     /* Whether the tree has been changed since some event. */
     gboolean msg_tree_changed;
 
+    /* The first and last rows shown by the view, if any; guarded by
+     * the mailbox lock, and cleared when the mailbox is closed. */
+    guint visible_first;
+    guint visible_last;
+
 #ifdef BALSA_USE_THREADS
     /* Array of msgnos that need to be displayed. */
     GArray *msgnos_pending;
@@ -322,6 +341,8 @@ struct _LibBalsaMailboxClass {
 				       LibBalsaMessageFlag clear);
     gboolean (*messages_copy) (LibBalsaMailbox * mailbox, GArray *msgnos,
 			       LibBalsaMailbox * dest, GError **err);
+    gboolean (*messages_move) (LibBalsaMailbox * mailbox, GArray *msgnos,
+			       LibBalsaMailbox * dest, GError **err);
     /* Test message flags */
     gboolean(*msgno_has_flags) (LibBalsaMailbox * mailbox, guint msgno,
                                 LibBalsaMessageFlag set,
@@ -331,6 +352,7 @@ struct _LibBalsaMailboxClass {
                         enum LibBalsaMailboxCapability cap);
     void (*set_threading) (LibBalsaMailbox * mailbox,
 			   LibBalsaMailboxThreadingType thread_type);
+    gboolean (*update_threading) (LibBalsaMailbox * mailbox);
     void (*update_view_filter) (LibBalsaMailbox * mailbox,
                                 LibBalsaCondition *view_filter);
     void (*sort) (LibBalsaMailbox * mailbox, GArray *sort_array);
@@ -356,6 +378,7 @@ gboolean libbalsa_mailbox_is_open(LibBalsaMailbox *mailbox);
 void libbalsa_mailbox_close(LibBalsaMailbox * mailbox, gboolean expunge);
 
 void libbalsa_mailbox_check(LibBalsaMailbox * mailbox);
+void libbalsa_mailbox_queue_check(LibBalsaMailbox * mailbox);
 void libbalsa_mailbox_changed(LibBalsaMailbox * mailbox);
 void libbalsa_mailbox_set_unread_messages_flag(LibBalsaMailbox * mailbox,
 					       gboolean has_unread);
@@ -500,10 +523,7 @@ gint libbalsa_mailbox_move_duplicates(LibBalsaMailbox * mailbox,
  * Mailbox views-related functions.
  */
 typedef struct LibBalsaMailboxIndexEntry_ LibBalsaMailboxIndexEntry;
-LibBalsaMailboxIndexEntry* libbalsa_mailbox_index_entry_new_from_msg
-                           (LibBalsaMessage *msg);
-void libbalsa_mailbox_index_entry_set_no(LibBalsaMailboxIndexEntry *entry,
-                                         unsigned no);
+typedef struct LibBalsaMailboxIndex_ LibBalsaMailboxIndex;
 void libbalsa_mailbox_index_entry_clear(LibBalsaMailbox * mailbox,
                                         guint msgno);
 void libbalsa_mailbox_index_set_flags(LibBalsaMailbox *mailbox,
@@ -527,6 +547,14 @@ gboolean libbalsa_mailbox_can_do(LibBalsaMailbox *mailbox,
 */
 void libbalsa_mailbox_set_threading(LibBalsaMailbox *mailbox,
 				    LibBalsaMailboxThreadingType thread_type);
+/** libbalsa_mailbox_update_threading() threads only the messages added
+    since the last libbalsa_mailbox_set_threading(), when the backend
+    supports it; it returns FALSE when the mailbox must be threaded
+    from scratch instead.
+*/
+gboolean libbalsa_mailbox_update_threading(LibBalsaMailbox * mailbox);
+void libbalsa_mailbox_sort_children(LibBalsaMailbox * mailbox,
+                                    GNode * parent);
 void libbalsa_mailbox_set_msg_tree(LibBalsaMailbox * mailbox,
 				   GNode * msg_tree);
 void libbalsa_mailbox_unlink_and_prepend(LibBalsaMailbox * mailbox,
@@ -593,6 +621,8 @@ void libbalsa_mailbox_msgno_inserted(LibBalsaMailbox * mailbox,
                                      guint seqno, GNode * parent,
                                      GNode ** sibling);
 void libbalsa_mailbox_msgno_removed(LibBalsaMailbox  *mailbox, guint seqno);
+void libbalsa_mailbox_msgnos_removed(LibBalsaMailbox * mailbox,
+                                     GArray * seqnos);
 void libbalsa_mailbox_msgno_filt_in(LibBalsaMailbox * mailbox, guint seqno);
 void libbalsa_mailbox_msgno_filt_out(LibBalsaMailbox * mailbox, guint seqno);
 void libbalsa_mailbox_msgno_filt_check(LibBalsaMailbox * mailbox,
@@ -606,6 +636,12 @@ gboolean libbalsa_mailbox_msgno_find(LibBalsaMailbox * mailbox,
 				     guint seqno,
 				     GtkTreePath ** path,
 				     GtkTreeIter * iter);
+/* Prefetching */
+void libbalsa_mailbox_set_visible_range(LibBalsaMailbox * mailbox,
+                                        guint first_msgno,
+                                        guint last_msgno);
+GArray *libbalsa_mailbox_get_prefetch_msgnos(LibBalsaMailbox * mailbox,
+                                             guint msgno, guint n);
 /* Manage message flags */
 gboolean libbalsa_mailbox_msgno_change_flags(LibBalsaMailbox * mailbox,
                                              guint msgno,
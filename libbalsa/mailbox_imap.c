@@ -32,7 +32,6 @@
 
 
 #include <stdlib.h>
-#include <dirent.h>
 #include <string.h>
 
 /* for open() */
@@ -80,6 +79,7 @@ struct _LibBalsaMailboxImap {
     guint unread_update_id;
     LibBalsaMailboxSortFields sort_field;
     unsigned opened:1;
+    guint prefetch_chunk;   /* messages per envelope FETCH */
 
     ImapAclType rights;     /* RFC 4314 'myrights' */
     GList *acls;            /* RFC 4314 acl's */
@@ -100,6 +100,12 @@ static off_t ImapCacheSize = 30*1024*1024; /* 30MB */
 
  /* issue message if downloaded part has more than this size */
 static unsigned SizeMsgThreshold = 50*1024;
+
+/* Envelope prefetch, see mi_get_imsg(). */
+#define LBM_IMAP_CHUNK_MIN       20
+#define LBM_IMAP_CHUNK_MAX       500
+#define LBM_IMAP_PREFETCH_SLICES 4
+#define LBM_IMAP_PREFETCH_TIME   0.2
 static void libbalsa_mailbox_imap_finalize(GObject * object);
 static void libbalsa_mailbox_imap_class_init(LibBalsaMailboxImapClass *
 					     klass);
@@ -182,6 +188,12 @@ static gboolean libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox *
 						    LibBalsaMailbox *
 						    dest,
                                                     GError **err);
+static gboolean libbalsa_mailbox_imap_messages_move(LibBalsaMailbox *
+						    mailbox,
+						    GArray * msgnos,
+						    LibBalsaMailbox *
+						    dest,
+                                                    GError **err);
 
 static void server_host_settings_changed_cb(LibBalsaServer * server,
 					    LibBalsaMailbox * mailbox);
@@ -293,6 +305,8 @@ libbalsa_mailbox_imap_class_init(LibBalsaMailboxImapClass * klass)
 	libbalsa_mailbox_imap_total_messages;
     libbalsa_mailbox_class->messages_copy =
 	libbalsa_mailbox_imap_messages_copy;
+    libbalsa_mailbox_class->messages_move =
+	libbalsa_mailbox_imap_messages_move;
 }
 
 static void
@@ -303,6 +317,7 @@ libbalsa_mailbox_imap_init(LibBalsaMailboxImap * mailbox)
     mailbox->handle_refs = 0;
     mailbox->sort_ranks = g_array_new(FALSE, FALSE, sizeof(guint));
     mailbox->sort_field = -1;	/* Initially invalid. */
+    mailbox->prefetch_chunk = LBM_IMAP_CHUNK_MIN;
 }
 
 /* libbalsa_mailbox_imap_finalize:
@@ -482,98 +497,547 @@ get_header_cache_path(LibBalsaMailboxImap *mimap)
     return header_file;
 }
 
-static gchar**
-get_cache_name_pair(LibBalsaMailboxImap* mailbox, const gchar *type,
-                    ImapUID uid)
+/* get_cache_name:
+   returns the name of the body cache entry of given type for given
+   message, relative to the server cache directory.
+*/
+static gchar*
+get_cache_name(LibBalsaMailboxImap* mailbox, const gchar *type,
+               ImapUID uid)
 {
-    LibBalsaServer *s      = LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
-    LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
-    gboolean is_persistent = libbalsa_imap_server_has_persistent_cache(is);
-    gchar **res = g_malloc(3*sizeof(gchar*));
-    ImapUID uid_validity = LIBBALSA_MAILBOX_IMAP(mailbox)->uid_validity;
-    gchar *fname;
+    gchar *fname, *res;
 
-    res[0] = get_cache_dir(is_persistent);
-    fname = g_strdup_printf("%s@%s-%s-%u-%u-%s",
-                            s->user, s->host,
+    fname = g_strdup_printf("%s-%u-%u-%s",
                             (mailbox->path ? mailbox->path : "INBOX"),
-                            uid_validity, uid, type);
-    res[1] = libbalsa_urlencode(fname);
+                            mailbox->uid_validity, uid, type);
+    res = libbalsa_urlencode(fname);
     g_free(fname);
-    res[2] = NULL;
 
     return res;
 }
 
-/* clean_cache:
-   removes unused entries from the cache file.
+/* ===================================================================
+   Body and part cache.  Every server has its own directory below
+   get_cache_dir(), and the entries are spread over IBC_SHARDS
+   subdirectories of it, by the FNV-1a hash of their names, so that
+   no directory grows too big.
+
+   The server directory also contains an append-only journal,
+   IBC_INDEX_NAME, recording the size of each entry and the order in
+   which the entries were used: "+<size> <name>" is written when an
+   entry is added or used, "-<name>" when it is removed.  Replaying
+   it on first use gives the entries in LRU order, so eviction just
+   pops entries off the tail of the list until the cache is within
+   its quota - it never scans the directory and does not depend on
+   atime.  The journal is rewritten once it grows much longer than
+   the number of live entries.  It is flushed IBC_FLUSH_DELAY seconds
+   after a write and when a mailbox is closed, not on every cache hit;
+   a crash may lose the last moves in the LRU order, and entries it
+   loses are adopted again when they are used.
+
+   Caches with an IBC_OLD_INDEX_NAME journal had their entries
+   sharded by g_str_hash(), which is not a stable hash; they are
+   moved to their new shards when the cache is first used.
 */
-struct file_info {
-    char  *name;
+#define IBC_INDEX_NAME     "journal"
+#define IBC_OLD_INDEX_NAME "index"
+#define IBC_SHARDS         256
+#define IBC_FLUSH_DELAY    5
+
+struct ibc_entry {
+    gchar *name;
     off_t  size;
-    time_t time;
+    GList  link;   /* in ImapBodyCache::lru; link.data points to us */
 };
-static gint
-cmp_by_time (gconstpointer  a, gconstpointer  b)
+
+struct ImapBodyCache {
+    gchar      *dir;
+    GHashTable *entries;   /* name -> struct ibc_entry */
+    GQueue      lru;       /* most recently used entry first */
+    off_t       size;      /* total size of entries */
+    FILE       *journal;
+    unsigned    journal_lines;
+    guint       flush_id;  /* pending ibc_flush_timeout() */
+};
+
+#if defined(BALSA_USE_THREADS)
+static pthread_mutex_t body_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_BODY_CACHES()   pthread_mutex_lock(&body_caches_lock)
+#define UNLOCK_BODY_CACHES() pthread_mutex_unlock(&body_caches_lock)
+#else
+#define LOCK_BODY_CACHES()
+#define UNLOCK_BODY_CACHES()
+#endif
+static GHashTable *body_caches = NULL; /* dir -> struct ImapBodyCache */
+
+static void
+ibc_entry_free(struct ibc_entry *e)
 {
-    return ((const struct file_info*)b)->time
-        -((const struct file_info*)a)->time;
+    g_free(e->name);
+    g_free(e);
 }
 
+/* The 32-bit FNV-1a hash of the name; the shards must not change
+   between releases or platforms. */
+static guint32
+ibc_hash(const gchar *name)
+{
+    guint32 hash = 2166136261U;
+
+    for(; *name; name++) {
+        hash ^= (guchar) *name;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static gchar*
+ibc_shard_path(struct ImapBodyCache *ibc, guint32 hash, const gchar *name)
+{
+    gchar shard[3];
+
+    g_snprintf(shard, sizeof(shard), "%02x", hash % IBC_SHARDS);
+    return g_build_filename(ibc->dir, shard, name, NULL);
+}
+
+static gchar*
+ibc_entry_path(struct ImapBodyCache *ibc, const gchar *name)
+{
+    return ibc_shard_path(ibc, ibc_hash(name), name);
+}
+
+/* ibc_insert:
+   adds entry or updates its size, and makes it the most recently
+   used one. Does not touch the journal. */
+static struct ibc_entry*
+ibc_insert(struct ImapBodyCache *ibc, const gchar *name, off_t size)
+{
+    struct ibc_entry *e = g_hash_table_lookup(ibc->entries, name);
+
+    if(e) {
+        g_queue_unlink(&ibc->lru, &e->link);
+        ibc->size -= e->size;
+    } else {
+        e = g_new0(struct ibc_entry, 1);
+        e->name = g_strdup(name);
+        e->link.data = e;
+        g_hash_table_insert(ibc->entries, e->name, e);
+    }
+    e->size = size;
+    ibc->size += size;
+    g_queue_push_head_link(&ibc->lru, &e->link);
+
+    return e;
+}
+
+static void
+ibc_drop(struct ImapBodyCache *ibc, struct ibc_entry *e)
+{
+    g_queue_unlink(&ibc->lru, &e->link);
+    ibc->size -= e->size;
+    g_hash_table_remove(ibc->entries, e->name); /* frees e */
+}
+
+/* ibc_flush:
+   writes out what has been journaled. Called with body_caches_lock
+   held. */
 static void
-clean_dir(const char *dir_name, off_t cache_size)
+ibc_flush(struct ImapBodyCache *ibc)
 {
-    DIR* dir;
-    struct dirent* key;
-    GList *list, *lst;
-    off_t sz;
-    dir = opendir(dir_name);
+    if(ibc->flush_id) {
+        g_source_remove(ibc->flush_id);
+        ibc->flush_id = 0;
+    }
+    if(ibc->journal)
+        fflush(ibc->journal);
+}
+
+static gboolean
+ibc_flush_timeout(gpointer data)
+{
+    struct ImapBodyCache *ibc = data;
+
+    LOCK_BODY_CACHES();
+    ibc->flush_id = 0;
+    if(ibc->journal)
+        fflush(ibc->journal);
+    UNLOCK_BODY_CACHES();
+
+    return FALSE;
+}
+
+static void
+ibc_journal(struct ImapBodyCache *ibc, const struct ibc_entry *e,
+            gboolean add)
+{
+    if(!ibc->journal)
+        return;
+    if(add)
+        fprintf(ibc->journal, "+%lu %s\n",
+                (unsigned long)e->size, e->name);
+    else
+        fprintf(ibc->journal, "-%s\n", e->name);
+    ibc->journal_lines++;
+    if(!ibc->flush_id)
+        ibc->flush_id =
+            g_timeout_add_seconds(IBC_FLUSH_DELAY, ibc_flush_timeout, ibc);
+}
+
+static void
+ibc_replay(struct ImapBodyCache *ibc, const gchar *index)
+{
+    gchar *contents, *line, *eol;
+
+    if(!g_file_get_contents(index, &contents, NULL, NULL))
+        return;
+
+    /* An incomplete last line is what remains of an interrupted
+       write; ignore it. */
+    for(line = contents; (eol = strchr(line, '\n')) != NULL;
+        line = eol + 1) {
+        *eol = '\0';
+        if(*line == '+') {
+            gchar *name;
+            unsigned long size = strtoul(line + 1, &name, 10);
+            if(*name == ' ' && name[1])
+                ibc_insert(ibc, name + 1, size);
+        } else if(*line == '-') {
+            struct ibc_entry *e =
+                g_hash_table_lookup(ibc->entries, line + 1);
+            if(e)
+                ibc_drop(ibc, e);
+        }
+        ibc->journal_lines++;
+    }
+    g_free(contents);
+}
+
+/* ibc_import_legacy:
+   moves the files of the old flat cache layout that belong to the
+   server into the shards. Their names started with the encoded
+   user@host prefix, which we strip. Header caches stay where they
+   are. */
+static void
+ibc_import_legacy(struct ImapBodyCache *ibc, const gchar *root,
+                  const gchar *prefix)
+{
+    GDir *dir = g_dir_open(root, 0, NULL);
+    size_t prefix_length = strlen(prefix);
+    const gchar *filename;
+
     if(!dir)
         return;
 
-    list = NULL;
-    while ( (key=readdir(dir)) != NULL) {
+    while ((filename = g_dir_read_name(dir)) != NULL) {
+        gchar *src, *dst, *shard;
+        const gchar *name = filename + prefix_length;
         struct stat st;
-        struct file_info *fi;
-        gchar *fname = g_build_filename(dir_name, key->d_name, NULL);
-        if(stat(fname, &st) == -1 || !S_ISREG(st.st_mode)) {
-	    g_free(fname);
+
+        if(strncmp(filename, prefix, prefix_length) != 0 || !*name
+           || g_str_has_suffix(filename, "-headers2"))
             continue;
-	}
-        fi = g_new(struct file_info,1);
-        fi->name = fname;
-        fi->size = st.st_size;
-        fi->time = st.st_atime;
-        list = g_list_prepend(list, fi);
-    }
-    closedir(dir);
-
-    list = g_list_sort(list, cmp_by_time);
-    sz = 0;
-    for(lst = list; lst; lst = lst->next) {
-        struct file_info *fi = (struct file_info*)(lst->data);
-        sz += fi->size;
-        if(sz>cache_size) {
-            /* printf("removing %s\n", fi->name); */
-            unlink(fi->name);
+        src = g_build_filename(root, filename, NULL);
+        dst = ibc_entry_path(ibc, name);
+        shard = g_path_get_dirname(dst);
+        g_mkdir_with_parents(shard, S_IRUSR|S_IWUSR|S_IXUSR);
+        if(stat(src, &st) == 0 && S_ISREG(st.st_mode)
+           && rename(src, dst) == 0)
+            ibc_journal(ibc, ibc_insert(ibc, name, st.st_size), TRUE);
+        g_free(shard);
+        g_free(dst);
+        g_free(src);
+    }
+    g_dir_close(dir);
+}
+
+static void ibc_compact(struct ImapBodyCache *ibc);
+
+/* ibc_import_old_shards:
+   moves the entries listed in an old journal from their g_str_hash()
+   shards to their current ones; the entries that are in neither are
+   forgotten. The new journal is written by the caller. */
+static void
+ibc_import_old_shards(struct ImapBodyCache *ibc, const gchar *old_index)
+{
+    GList *l, *next;
+
+    ibc_replay(ibc, old_index);
+    for(l = ibc->lru.head; l; l = next) {
+        struct ibc_entry *e = l->data;
+        gchar *src = ibc_shard_path(ibc, g_str_hash(e->name), e->name);
+        gchar *dst = ibc_entry_path(ibc, e->name);
+        gchar *shard = g_path_get_dirname(dst);
+
+        next = l->next;
+        g_mkdir_with_parents(shard, S_IRUSR|S_IWUSR|S_IXUSR);
+        if(strcmp(src, dst) != 0 && rename(src, dst) != 0
+           && !g_file_test(dst, G_FILE_TEST_EXISTS))
+            ibc_drop(ibc, e);
+        g_free(shard);
+        g_free(dst);
+        g_free(src);
+    }
+}
+
+/* ibc_lookup:
+   returns the cache kept in dir, loading its index on first use.
+   Files of the old layout are imported from root if prefix is not
+   NULL and the cache has no index yet.
+   Called with body_caches_lock held. */
+static struct ImapBodyCache*
+ibc_lookup(const gchar *dir, const gchar *root, const gchar *prefix)
+{
+    struct ImapBodyCache *ibc;
+    gchar *index, *old_index;
+    gboolean has_index;
+
+    if(!body_caches)
+        body_caches = g_hash_table_new(g_str_hash, g_str_equal);
+    else if((ibc = g_hash_table_lookup(body_caches, dir)) != NULL)
+        return ibc;
+
+    ibc = g_new0(struct ImapBodyCache, 1);
+    ibc->dir = g_strdup(dir);
+    ibc->entries =
+        g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                              (GDestroyNotify) ibc_entry_free);
+    g_queue_init(&ibc->lru);
+    g_hash_table_insert(body_caches, ibc->dir, ibc);
+
+    g_mkdir_with_parents(dir, S_IRUSR|S_IWUSR|S_IXUSR);
+    index = g_build_filename(dir, IBC_INDEX_NAME, NULL);
+    old_index = g_build_filename(dir, IBC_OLD_INDEX_NAME, NULL);
+    has_index = g_file_test(index, G_FILE_TEST_EXISTS);
+    if(has_index)
+        ibc_replay(ibc, index);
+    else if(g_file_test(old_index, G_FILE_TEST_EXISTS)) {
+        ibc_import_old_shards(ibc, old_index);
+        ibc_compact(ibc);
+        if(ibc->journal) /* the new one has been written */
+            unlink(old_index);
+        has_index = TRUE;
+    }
+    if(!ibc->journal)
+        ibc->journal = fopen(index, "a");
+    g_free(old_index);
+    g_free(index);
+    if(!has_index && prefix)
+        ibc_import_legacy(ibc, root, prefix);
+
+    return ibc;
+}
+
+/* ibc_get:
+   returns the cache of given server. Called with body_caches_lock
+   held. */
+static struct ImapBodyCache*
+ibc_get(LibBalsaImapServer *is)
+{
+    LibBalsaServer *s = LIBBALSA_SERVER(is);
+    gchar *root =
+        get_cache_dir(libbalsa_imap_server_has_persistent_cache(is));
+    gchar *id = g_strdup_printf("%s@%s", s->user, s->host);
+    gchar *encoded = libbalsa_urlencode(id);
+    gchar *dir = g_build_filename(root, encoded, NULL);
+    gchar *prefix = g_strconcat(encoded, "-", NULL);
+    struct ImapBodyCache *ibc = ibc_lookup(dir, root, prefix);
+
+    g_free(prefix);
+    g_free(dir);
+    g_free(encoded);
+    g_free(id);
+    g_free(root);
+
+    return ibc;
+}
+
+static off_t
+ibc_quota(LibBalsaImapServer *is)
+{
+    off_t quota = libbalsa_imap_server_get_cache_size(is);
+    return quota > 0 ? quota : ImapCacheSize;
+}
+
+/* ibc_evict:
+   removes least recently used entries until the cache fits in
+   quota; keep, if not NULL, is never removed. */
+static void
+ibc_evict(struct ImapBodyCache *ibc, off_t quota,
+          const struct ibc_entry *keep)
+{
+    GList *l;
+
+    while(ibc->size > quota && (l = ibc->lru.tail) != NULL
+          && l->data != keep) {
+        struct ibc_entry *e = l->data;
+        gchar *path = ibc_entry_path(ibc, e->name);
+        unlink(path);
+        g_free(path);
+        ibc_journal(ibc, e, FALSE);
+        ibc_drop(ibc, e);
+    }
+}
+
+/* ibc_compact:
+   rewrites the journal so that it lists just the live entries,
+   oldest first. */
+static void
+ibc_compact(struct ImapBodyCache *ibc)
+{
+    gchar *index = g_build_filename(ibc->dir, IBC_INDEX_NAME, NULL);
+    gchar *tmp_name = g_strconcat(index, ".tmp", NULL);
+    FILE *f = fopen(tmp_name, "w");
+
+    if(f) {
+        GList *l;
+        gboolean err;
+
+        for(l = ibc->lru.tail; l; l = l->prev) {
+            struct ibc_entry *e = l->data;
+            fprintf(f, "+%lu %s\n", (unsigned long)e->size, e->name);
         }
-        g_free(fi->name);
-        g_free(fi);
+        err = ferror(f) != 0;
+        err = fclose(f) != 0 || err;
+        if(!err && rename(tmp_name, index) == 0) {
+            if(ibc->journal)
+                fclose(ibc->journal);
+            ibc->journal = fopen(index, "a");
+            ibc->journal_lines = g_hash_table_size(ibc->entries);
+        } else
+            unlink(tmp_name);
+    }
+    g_free(tmp_name);
+    g_free(index);
+}
+
+/* ibc_path:
+   returns the file name of the cache entry name, creating its shard
+   directory if create is set. */
+static gchar*
+ibc_path(LibBalsaImapServer *is, const gchar *name, gboolean create)
+{
+    gchar *path;
+
+    LOCK_BODY_CACHES();
+    path = ibc_entry_path(ibc_get(is), name);
+    UNLOCK_BODY_CACHES();
+    if(create) {
+        gchar *shard = g_path_get_dirname(path);
+        g_mkdir_with_parents(shard, S_IRUSR|S_IWUSR|S_IXUSR);
+        g_free(shard);
+    }
+
+    return path;
+}
+
+/* ibc_touch:
+   records a cache hit. A file not in the index (written before a
+   crash, for instance) is adopted. */
+static void
+ibc_touch(LibBalsaImapServer *is, const gchar *name)
+{
+    struct ImapBodyCache *ibc;
+    struct ibc_entry *e;
+
+    LOCK_BODY_CACHES();
+    ibc = ibc_get(is);
+    if((e = g_hash_table_lookup(ibc->entries, name)) != NULL)
+        ibc_journal(ibc, ibc_insert(ibc, name, e->size), TRUE);
+    else {
+        gchar *path = ibc_entry_path(ibc, name);
+        struct stat st;
+        if(stat(path, &st) == 0)
+            ibc_journal(ibc, ibc_insert(ibc, name, st.st_size), TRUE);
+        g_free(path);
+    }
+    UNLOCK_BODY_CACHES();
+}
+
+/* ibc_add:
+   records a newly written cache file and evicts old entries if the
+   server cache grows over its quota. */
+static void
+ibc_add(LibBalsaImapServer *is, const gchar *name)
+{
+    struct ImapBodyCache *ibc;
+    gchar *path;
+    struct stat st;
+
+    LOCK_BODY_CACHES();
+    ibc = ibc_get(is);
+    path = ibc_entry_path(ibc, name);
+    if(stat(path, &st) == 0) {
+        struct ibc_entry *e = ibc_insert(ibc, name, st.st_size);
+        ibc_journal(ibc, e, TRUE);
+        ibc_evict(ibc, ibc_quota(is), e);
+    }
+    g_free(path);
+    UNLOCK_BODY_CACHES();
+}
+
+/* ibc_remove:
+   removes the cache entry and its file, if any. */
+static void
+ibc_remove(LibBalsaImapServer *is, const gchar *name)
+{
+    struct ImapBodyCache *ibc;
+    struct ibc_entry *e;
+    gchar *path;
+
+    LOCK_BODY_CACHES();
+    ibc = ibc_get(is);
+    path = ibc_entry_path(ibc, name);
+    unlink(path); /* ignore error; perhaps it was not in the cache. */
+    g_free(path);
+    if((e = g_hash_table_lookup(ibc->entries, name)) != NULL) {
+        ibc_journal(ibc, e, FALSE);
+        ibc_drop(ibc, e);
     }
-    g_list_free(list);
+    UNLOCK_BODY_CACHES();
 }
 
+/* ibc_list:
+   returns a list of names of the server cache entries that start
+   with prefix. */
+static GSList*
+ibc_list(LibBalsaImapServer *is, const gchar *prefix)
+{
+    struct ImapBodyCache *ibc;
+    GSList *res = NULL;
+    GList *l;
+
+    LOCK_BODY_CACHES();
+    ibc = ibc_get(is);
+    for(l = ibc->lru.head; l; l = l->next) {
+        struct ibc_entry *e = l->data;
+        if(g_str_has_prefix(e->name, prefix))
+            res = g_slist_prepend(res, g_strdup(e->name));
+    }
+    UNLOCK_BODY_CACHES();
+
+    return res;
+}
+
+/* clean_cache:
+   enforces the quota, which may have been lowered since the last
+   entry was added, compacts the index when it has grown too long,
+   and flushes it.
+*/
 static gboolean
 clean_cache(LibBalsaMailbox* mailbox)
 {
-    LibBalsaServer *s= LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox);
-    gboolean is_persistent =
-        libbalsa_imap_server_has_persistent_cache(LIBBALSA_IMAP_SERVER(s));
-    gchar* dir;
-
-    dir = get_cache_dir(is_persistent);
-    clean_dir(dir, ImapCacheSize);
-    g_free(dir);
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox));
+    struct ImapBodyCache *ibc;
+
+    LOCK_BODY_CACHES();
+    ibc = ibc_get(is);
+    ibc_evict(ibc, ibc_quota(is), NULL);
+    if(ibc->journal_lines > 2 * g_hash_table_size(ibc->entries) + 1024)
+        ibc_compact(ibc);
+    ibc_flush(ibc);
+    UNLOCK_BODY_CACHES();
  
     return TRUE;
 }
@@ -596,7 +1060,7 @@ mi_reconnect(ImapMboxHandle *h)
 
     r = imap_mbox_handle_reconnect(h, NULL);
     if(r==IMAP_SUCCESS) icm_restore_from_cache(h, icm);
-    imap_cache_manager_free(icm);
+    else if(icm) imap_cache_manager_free(icm);
     if(imap_mbox_handle_get_exists(h) != old_cnt ||
        imap_mbox_handle_get_uidnext(h) != old_next)
 	g_signal_emit_by_name(h, "exists-notify", 0);
@@ -679,31 +1143,33 @@ lbimap_update_flags(LibBalsaMessage *message, ImapMessage *imsg)
 /* mi_get_imsg is a thin wrapper around imap_mbox_handle_get_msg().
    We wrap around imap_mbox_handle_get_msg() in case the libimap data
    was invalidated by eg. disconnect.
-*/
-struct collect_seq_data {
-    unsigned *msgno_arr;
-    unsigned cnt;
-    unsigned needed_msgno;
-    unsigned has_it;
-};
 
-static const unsigned MAX_CHUNK_LENGTH = 20; 
-static gboolean
-collect_seq_cb(GNode *node, gpointer data)
+   We prefetch envelopes to save on RTTs: the rows the view shows and
+   the ones below them, or the neighbours of the message if it is not
+   shown.  The window is sent as LBM_IMAP_PREFETCH_SLICES pipelined
+   FETCH commands of prefetch_chunk messages each, and prefetch_chunk
+   follows the measured throughput so that a window takes about
+   LBM_IMAP_PREFETCH_TIME seconds: large on fast links with long
+   round trips, small on slow ones.
+*/
+static void
+lbm_imap_prefetch_adapt(LibBalsaMailboxImap *mimap, unsigned fetched,
+                        gdouble elapsed)
 {
-    /* We prefetch envelopes in chunks to save on RTTs.
-     * Try to get the messages both before and after the message. */
-    struct collect_seq_data *csd = (struct collect_seq_data*)data;
-    unsigned msgno = GPOINTER_TO_UINT(node->data);
-    if(msgno==0) /* root node */
-        return FALSE;
-    csd->msgno_arr[(csd->cnt++) % MAX_CHUNK_LENGTH] = msgno;
-    if(csd->has_it>0) csd->has_it++;
-    if(csd->needed_msgno == msgno)
-        csd->has_it = 1;
-    /* quit if we have enough messages and at least half of them are
-     * after message in question. */
-    return csd->cnt >= MAX_CHUNK_LENGTH && csd->has_it*2>MAX_CHUNK_LENGTH;
+    unsigned window = mimap->prefetch_chunk * LBM_IMAP_PREFETCH_SLICES;
+    gdouble chunk;
+
+    /* A fetch of a few stragglers tells us about the round trip, not
+     * the throughput. */
+    if (fetched < window / 2 || elapsed <= 0)
+        return;
+
+    chunk = fetched / elapsed * LBM_IMAP_PREFETCH_TIME
+        / LBM_IMAP_PREFETCH_SLICES;
+    /* Move halfway, so that one slow round trip does not undo it. */
+    chunk = (mimap->prefetch_chunk + chunk) / 2;
+    mimap->prefetch_chunk =
+        CLAMP(chunk, LBM_IMAP_CHUNK_MIN, LBM_IMAP_CHUNK_MAX);
 }
 
 static int
@@ -716,7 +1182,10 @@ static ImapMessage*
 mi_get_imsg(LibBalsaMailboxImap *mimap, unsigned msgno)
 {
     ImapMessage* imsg;
-    struct collect_seq_data csd;
+    unsigned window = mimap->prefetch_chunk * LBM_IMAP_PREFETCH_SLICES;
+    GArray *msgnos = NULL;
+    unsigned i, cnt;
+    GTimer *timer;
     ImapResponse rc;
 
     /* This test too weak: I can imagine unsolicited ENVELOPE
@@ -724,37 +1193,51 @@ mi_get_imsg(LibBalsaMailboxImap *mimap, unsigned msgno)
      * structure but message size or UID etc will not be available. */
     if( (imsg = imap_mbox_handle_get_msg(mimap->handle, msgno)) 
         != NULL && imsg->envelope) return imsg;
-    csd.needed_msgno = msgno;
-    csd.msgno_arr    = g_malloc(MAX_CHUNK_LENGTH*sizeof(csd.msgno_arr[0]));
-    csd.cnt          = 0;
-    csd.has_it       = 0;
-    if(LIBBALSA_MAILBOX(mimap)->msg_tree) {
-        g_node_traverse(LIBBALSA_MAILBOX(mimap)->msg_tree,
-                        G_PRE_ORDER, G_TRAVERSE_ALL, -1, collect_seq_cb,
-                        &csd);
-        if(csd.cnt>MAX_CHUNK_LENGTH) csd.cnt = MAX_CHUNK_LENGTH;
-        qsort(csd.msgno_arr, csd.cnt, sizeof(csd.msgno_arr[0]), cmp_msgno);
-    } else {
+    if(LIBBALSA_MAILBOX(mimap)->msg_tree)
+        msgnos = libbalsa_mailbox_get_prefetch_msgnos(LIBBALSA_MAILBOX(mimap),
+                                                      msgno, window);
+    if(!msgnos) {
         /* It may happen that we want to perform an automatic
            operation on a mailbox without view (like filtering on
            reception). The searching will be done server side but
            current eg. _copy() instructions will require that
            LibBalsaMessage object are present, and these require that
            some basic information is fetched from the server.  */
-        unsigned i, total_msgs = mimap->messages_info->len;
-        csd.cnt = msgno+MAX_CHUNK_LENGTH>total_msgs
-            ? total_msgs-msgno+1 : MAX_CHUNK_LENGTH;
-        for(i=0; i<csd.cnt; i++) csd.msgno_arr[i] = msgno+i;
+        unsigned total_msgs = mimap->messages_info->len;
+        cnt = msgno+window>total_msgs ? total_msgs-msgno+1 : window;
+        msgnos = g_array_sized_new(FALSE, FALSE, sizeof(unsigned), cnt);
+        for(i=0; i<cnt; i++) {
+            unsigned m = msgno + i;
+            g_array_append_val(msgnos, m);
+        }
     }
+
+    /* Keep only the messages we have to fetch, so that the throughput
+     * we measure is real. */
+    for(i=cnt=0; i<msgnos->len; i++) {
+        unsigned m = g_array_index(msgnos, unsigned, i);
+        if(m == msgno
+           || !(imsg = imap_mbox_handle_get_msg(mimap->handle, m))
+           || !imsg->envelope)
+            g_array_index(msgnos, unsigned, cnt++) = m;
+    }
+    qsort(msgnos->data, cnt, sizeof(unsigned), cmp_msgno);
+
+    timer = g_timer_new();
     II(rc,mimap->handle,
-       imap_mbox_handle_fetch_set(mimap->handle, csd.msgno_arr,
-                                  csd.cnt,
-                                  IMFETCH_FLAGS |
-                                  IMFETCH_UID |
-                                  IMFETCH_ENV |
-                                  IMFETCH_RFC822SIZE |
-                                  IMFETCH_CONTENT_TYPE));
-    g_free(csd.msgno_arr);
+       imap_mbox_handle_fetch_set_pipelined(mimap->handle,
+                                            (unsigned *) msgnos->data, cnt,
+                                            IMFETCH_FLAGS |
+                                            IMFETCH_UID |
+                                            IMFETCH_ENV |
+                                            IMFETCH_RFC822SIZE |
+                                            IMFETCH_CONTENT_TYPE,
+                                            mimap->prefetch_chunk));
+    if (rc == IMR_OK)
+        lbm_imap_prefetch_adapt(mimap, cnt,
+                                g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+    g_array_free(msgnos, TRUE);
     if (rc != IMR_OK)
         return FALSE;
     return imap_mbox_handle_get_msg(mimap->handle, msgno);
@@ -843,6 +1326,7 @@ imap_exists_idle(gpointer data)
         GNode *sibling = NULL;
 
         if(cnt<mimap->messages_info->len) {
+            GArray *seqnos;
             /* remove messages; we probably missed some EXPUNGE responses
                - the only sensible scenario is that the connection was
                severed. Still, we need to recover from this somehow... -
@@ -866,11 +1350,13 @@ imap_exists_idle(gpointer data)
                 }
                 libbalsa_mailbox_index_entry_clear(mailbox, i + 1);
             }
-            for(i=mimap->messages_info->len; i>cnt; i--) {
-                g_array_remove_index(mimap->messages_info, i-1);
-                g_ptr_array_remove_index(mimap->msgids, i-1);
-                libbalsa_mailbox_msgno_removed(mailbox, i);
-            }
+            seqnos = g_array_new(FALSE, FALSE, sizeof(guint));
+            for(i=cnt+1; i<=mimap->messages_info->len; i++)
+                g_array_append_val(seqnos, i);
+            g_array_set_size(mimap->messages_info, cnt);
+            g_ptr_array_set_size(mimap->msgids, cnt);
+            libbalsa_mailbox_msgnos_removed(mailbox, seqnos);
+            g_array_free(seqnos, TRUE);
         } 
 
         if (mailbox->msg_tree)
@@ -901,55 +1387,71 @@ imap_exists_cb(ImapMboxHandle *handle, LibBalsaMailboxImap *mimap)
     g_idle_add(imap_exists_idle, mimap);
 }
 
+/* seqnos is the sorted set of expunged messages, numbered as they
+   were before any of them was removed. */
 static void
-imap_expunge_cb(ImapMboxHandle *handle, unsigned seqno,
+imap_expunge_cb(ImapMboxHandle *handle, GArray *seqnos,
                 LibBalsaMailboxImap *mimap)
 {
-    ImapMessage *imsg;
-    guint i;
+    guint i, j, k;
 
     LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
-    struct message_info *msg_info;
 
     libbalsa_lock_mailbox(mailbox);
 
-    libbalsa_mailbox_msgno_removed(mailbox, seqno);
+    libbalsa_mailbox_msgnos_removed(mailbox, seqnos);
     ++mimap->search_stamp;
     mimap->sort_field = -1;	/* Invalidate. */
 
-    /* Use imap_mbox_handle_get_msg(mimap->handle, seqno)->uid, not
-     * IMAP_MESSAGE_UID(msg_info->message), as the latter may try to
-     * fetch the message from the server. */
-    if ((imsg = imap_mbox_handle_get_msg(mimap->handle, seqno))) {
-	gchar **pair = get_cache_name_pair(mimap, "body", imsg->uid);
-        gchar *fn = g_build_filename(pair[0], pair[1], NULL);
-        unlink(fn); /* ignore error; perhaps the message 
-                     * was not in the cache.  */
-        g_free(fn);
-        g_strfreev(pair);
+    for (k = 0; k < seqnos->len; k++) {
+        guint seqno = g_array_index(seqnos, guint, k);
+        ImapMessage *imsg;
+
+        /* Use imap_mbox_handle_get_msg(mimap->handle, seqno)->uid, not
+         * IMAP_MESSAGE_UID(msg_info->message), as the latter may try to
+         * fetch the message from the server. */
+        if ((imsg = imap_mbox_handle_get_msg(mimap->handle, seqno))) {
+            gchar *name = get_cache_name(mimap, "body", imsg->uid);
+            ibc_remove(LIBBALSA_IMAP_SERVER
+                       (LIBBALSA_MAILBOX_REMOTE_SERVER(mimap)), name);
+            g_free(name);
+        }
     }
 
-    msg_info = message_info_from_msgno(mimap, seqno);
-    if (msg_info) {
+    /* Close the gaps in one pass, renumbering the messages that
+     * move down. */
+    i = j = g_array_index(seqnos, guint, 0) - 1;
+    for (k = 0; i < mimap->messages_info->len; i++) {
+        struct message_info *msg_info =
+            &g_array_index(mimap->messages_info, struct message_info, i);
+
+        if (k < seqnos->len && g_array_index(seqnos, guint, k) == i + 1) {
+            if (msg_info->message)
+                g_object_unref(msg_info->message);
+            k++;
+            continue;
+        }
         if (msg_info->message)
-            g_object_unref(msg_info->message);
-        g_array_remove_index(mimap->messages_info, seqno-1);
+            msg_info->message->msgno = j + 1;
+        g_array_index(mimap->messages_info, struct message_info, j++) =
+            *msg_info;
     }
+    if (j < mimap->messages_info->len)
+        g_array_set_size(mimap->messages_info, j);
 
-    if (seqno <= mimap->msgids->len) {
-        gchar *msgid;
+    i = j = g_array_index(seqnos, guint, 0) - 1;
+    for (k = 0; i < mimap->msgids->len; i++) {
+        gchar *msgid = g_ptr_array_index(mimap->msgids, i);
 
-        msgid = g_ptr_array_index(mimap->msgids, seqno - 1);
-        g_free(msgid);
-        g_ptr_array_remove_index(mimap->msgids, seqno - 1);
-    }
-
-    for (i = seqno - 1; i < mimap->messages_info->len; i++) {
-	struct message_info *msg_info =
-	    &g_array_index(mimap->messages_info, struct message_info, i);
-	if (msg_info->message)
-	    msg_info->message->msgno = i + 1;
+        if (k < seqnos->len && g_array_index(seqnos, guint, k) == i + 1) {
+            g_free(msgid);
+            k++;
+            continue;
+        }
+        g_ptr_array_index(mimap->msgids, j++) = msgid;
     }
+    if (j < mimap->msgids->len)
+        g_ptr_array_set_size(mimap->msgids, j);
 
     libbalsa_unlock_mailbox(mailbox);
 }
@@ -1074,7 +1576,6 @@ libbalsa_mailbox_imap_open(LibBalsaMailbox * mailbox, GError **err)
     unsigned i;
     guint total_messages;
     struct ImapCacheManager *icm;
-    gboolean from_file = FALSE;
 
     g_return_val_if_fail(LIBBALSA_IS_MAILBOX_IMAP(mailbox), FALSE);
 
@@ -1099,20 +1600,13 @@ libbalsa_mailbox_imap_open(LibBalsaMailbox * mailbox, GError **err)
 	g_array_append_val(mimap->messages_info, a);
 	g_ptr_array_add(mimap->msgids, NULL);
     }
-    icm = g_object_get_data(G_OBJECT(mailbox), "cache-manager");
+    icm = g_object_steal_data(G_OBJECT(mailbox), "cache-manager");
     if(!icm) { /* Try restoring from file... */
 	gchar *header_cache_path = get_header_cache_path(mimap);
 	icm = imap_cache_manager_new_from_file(header_cache_path);
 	g_free(header_cache_path);
-        from_file = TRUE;
-    }
-    if (icm) {
-        icm_restore_from_cache(mimap->handle, icm);
-        if (from_file)
-            imap_cache_manager_free(icm);
-        else
-            g_object_set_data(G_OBJECT(mailbox), "cache-manager", NULL);
     }
+    icm_restore_from_cache(mimap->handle, icm);
 
     mailbox->first_unread = imap_mbox_handle_first_unseen(mimap->handle);
     libbalsa_mailbox_run_filters_on_reception(mailbox);
@@ -1197,16 +1691,21 @@ static FILE*
 get_cache_stream(LibBalsaMailboxImap *mimap, guint uid, gboolean peek)
 {
     FILE *stream;
-    gchar **pair, *path;
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+    gchar *name, *path;
 
-    pair = get_cache_name_pair(mimap, "body", uid);
-    path = g_build_filename(pair[0], pair[1], NULL);
+    name = get_cache_name(mimap, "body", uid);
+    path = ibc_path(is, name, FALSE);
     stream = fopen(path, "rb");
-    if(!stream) {
+    if(stream)
+        ibc_touch(is, name);
+    else {
         FILE *cache;
 	ImapResponse rc;
 
-        g_mkdir_with_parents(pair[0], S_IRUSR|S_IWUSR|S_IXUSR);
+        g_free(path);
+        path = ibc_path(is, name, TRUE);
 #if 0
         if(msg->length>(signed)SizeMsgThreshold)
             libbalsa_information(LIBBALSA_INFORMATION_MESSAGE, 
@@ -1224,12 +1723,13 @@ get_cache_stream(LibBalsaMailboxImap *mimap, guint uid, gboolean peek)
 	    if(ferr || rc != IMR_OK) {
 		printf("Error fetching RFC822 message, removing cache.\n");
 		unlink(path);
-	    }
+	    } else
+                ibc_add(is, name);
         }
 	stream = fopen(path,"rb");
     }
     g_free(path); 
-    g_strfreev(pair);
+    g_free(name);
     return stream;
 }
 
@@ -1346,6 +1846,26 @@ libbalsa_mailbox_imap_check(LibBalsaMailbox * mailbox)
 
 static ImapSearchKey *lbmi_build_imap_query(const LibBalsaCondition * cond,
 					    ImapSearchKey * last);
+static ImapSearchKey *lbmi_build_imap_prefilter(LibBalsaCondition * cond);
+
+/* Matches a condition that the server cannot search for against the
+ * message; only its envelope is fetched, and the body only if the
+ * condition looks at it. */
+static gboolean
+lbmi_match_envelope(LibBalsaMailbox * mailbox, guint msgno,
+                    LibBalsaCondition * cond)
+{
+    LibBalsaMessage *message = libbalsa_mailbox_get_message(mailbox, msgno);
+    gboolean retval;
+
+    if (!message)
+        return FALSE;
+    retval = libbalsa_condition_matches(cond, message);
+    g_object_unref(message);
+
+    return retval;
+}
+
 static gboolean
 libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
 				    LibBalsaMailboxSearchIter * search_iter)
@@ -1353,6 +1873,7 @@ libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
     LibBalsaMailboxImap *mimap;
     struct message_info *msg_info;
     GHashTable *matchings;
+    gboolean has_regex;
 
     mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
     msg_info = message_info_from_msgno(mimap, msgno);
@@ -1378,7 +1899,10 @@ libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
         g_object_unref(msg_info->message);
     }
 
-    if (search_iter->stamp != mimap->search_stamp && search_iter->mailbox
+    has_regex = libbalsa_condition_has_regex(search_iter->condition);
+
+    if ((search_iter->stamp != mimap->search_stamp
+         || search_iter->mailbox != mailbox) && search_iter->mailbox
 	&& LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
 	search_iter_free)
 	LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
@@ -1389,8 +1913,16 @@ libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
 	ImapSearchKey* query;
 	ImapResponse rc;
 
+	if (has_regex) {
+            /* The server cannot search for regular expressions; it
+             * finds the candidates, which we match here. */
+            query = lbmi_build_imap_prefilter(search_iter->condition);
+            if (!query)
+                return lbmi_match_envelope(mailbox, msgno,
+                                           search_iter->condition);
+        } else
+            query = lbmi_build_imap_query(search_iter->condition, NULL);
 	matchings = g_hash_table_new(NULL, NULL);
-	query = lbmi_build_imap_query(search_iter->condition, NULL);
 	II(rc,mimap->handle,
            imap_mbox_filter_msgnos(mimap->handle, query, matchings));
 	imap_search_key_free(query);
@@ -1403,7 +1935,11 @@ libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
 	search_iter->stamp = mimap->search_stamp;
     }
 
-    return g_hash_table_lookup(matchings, GUINT_TO_POINTER(msgno)) != NULL;
+    if (!g_hash_table_lookup(matchings, GUINT_TO_POINTER(msgno)))
+        return FALSE;
+
+    return !has_regex
+        || lbmi_match_envelope(mailbox, msgno, search_iter->condition);
 }
 
 static void
@@ -1546,6 +2082,120 @@ lbmi_build_imap_query(const LibBalsaCondition* cond,
     return query;
 }
 
+/* The longest run of a regex literal that a server search can look
+ * for: white space, quotes, brackets and commas depend on how the
+ * header or the text is laid out and encoded, so they are left out.
+ * Returns NULL if nothing is left. */
+static gchar *
+lbmi_regex_search_word(const gchar * literal)
+{
+    const gchar *p, *start = NULL, *best = NULL;
+    gsize best_len = 0;
+
+    for (p = literal; ; p++) {
+        if (*p && !g_ascii_isspace(*p) && !strchr("\"<>,()", *p)) {
+            if (!start)
+                start = p;
+            continue;
+        }
+        if (start && (gsize) (p - start) > best_len) {
+            best = start;
+            best_len = p - start;
+        }
+        start = NULL;
+        if (!*p)
+            break;
+    }
+
+    return best ? g_strndup(best, best_len) : NULL;
+}
+
+/* Adds to query the search for word in the fields of a regex leaf. */
+static ImapSearchKey *
+lbmi_add_regex_word(ImapSearchKey * query, unsigned fields,
+                    const gchar * word)
+{
+    static const struct {
+        unsigned field;
+        ImapSearchHeader header;
+    } headers[] = {
+        { CONDITION_MATCH_TO,      IMSE_S_TO },
+        { CONDITION_MATCH_FROM,    IMSE_S_FROM },
+        { CONDITION_MATCH_SUBJECT, IMSE_S_SUBJECT },
+        { CONDITION_MATCH_CC,      IMSE_S_CC },
+        { CONDITION_MATCH_BODY,    IMSE_S_BODY }
+    };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(headers); i++)
+        if (fields & headers[i].field)
+            query = add_or_query
+                (query, FALSE, imap_search_key_new_string
+                 (FALSE, headers[i].header, word, NULL));
+
+    return query;
+}
+
+/* lbmi_build_imap_prefilter() builds a query for the messages that
+   may match a condition with regular expressions, which the server
+   cannot search for: each regex is replaced by a search for a word
+   that all its matches contain, and whatever matches the condition
+   matches the query.  The result is NULL when the messages cannot be
+   narrowed down that way, for instance when a regex is negated. */
+static ImapSearchKey*
+lbmi_build_imap_prefilter(LibBalsaCondition * cond)
+{
+    ImapSearchKey *query = NULL, *right;
+    GSList *l;
+
+    if (!libbalsa_condition_has_regex(cond))
+        return lbmi_build_imap_query(cond, NULL);
+    if (cond->negate)
+        /* The complement of more is less. */
+        return NULL;
+
+    switch (cond->type) {
+    case CONDITION_REGEX:
+        for (l = cond->match.regex.regexs; l; l = l->next) {
+            const gchar *literal =
+                libbalsa_condition_regex_get_literal(l->data);
+            gchar *word;
+
+            if (!literal || !(word = lbmi_regex_search_word(literal))) {
+                imap_search_key_free(query);
+                return NULL;
+            }
+            query = lbmi_add_regex_word(query, cond->match.regex.fields,
+                                        word);
+            g_free(word);
+        }
+        break;
+    case CONDITION_AND:
+        query = lbmi_build_imap_prefilter(cond->match.andor.left);
+        right = lbmi_build_imap_prefilter(cond->match.andor.right);
+        if (!query)
+            return right;
+        if (right) {
+            /* The left query may be a list already. */
+            query = imap_search_key_new_not(FALSE, query);
+            imap_search_key_set_next(query, right);
+        }
+        break;
+    case CONDITION_OR:
+        query = lbmi_build_imap_prefilter(cond->match.andor.left);
+        right = lbmi_build_imap_prefilter(cond->match.andor.right);
+        if (query && right)
+            return imap_search_key_new_or(FALSE, query, right);
+        imap_search_key_free(query);
+        imap_search_key_free(right);
+        return NULL;
+    default:
+        break;
+    }
+
+    return query;
+}
+
 typedef struct {
     GHashTable * uids;
     GHashTable * res;
@@ -1624,15 +2274,7 @@ GHashTable * libbalsa_mailbox_imap_get_matchings(LibBalsaMailboxImap* mbox,
 gboolean libbalsa_mailbox_imap_can_match(LibBalsaMailbox  *mailbox,
 					 LibBalsaCondition *condition)
 {
-#if 0
-    GSList *cnds;
-    for (cnds =  conditions->cond_list; cnds; cnds = g_slist_next(cnds)) {
-	LibBalsaCondition * cnd = cnds->data;
-	
-	if (cnd->type==CONDITION_REGEX) return FALSE;
-    }
-#endif
-    return TRUE;
+    return !libbalsa_condition_has_regex(condition);
 }
 
 static void
@@ -2163,7 +2805,8 @@ get_struct_from_cache(LibBalsaMailbox *mailbox, LibBalsaMessage *message,
                       LibBalsaFetchFlag flags)
 {
     if (!message->mime_msg) {
-        gchar **pair, *filename;
+        LibBalsaImapServer *is;
+        gchar *name, *filename;
         int fd;
         GMimeStream *stream, *fstream;
         GMimeFilter *filter;
@@ -2174,12 +2817,14 @@ get_struct_from_cache(LibBalsaMailbox *mailbox, LibBalsaMessage *message,
 	if (!imsg)
 	    return FALSE;
 
-        pair = get_cache_name_pair(mimap, "body", imsg->uid);
-
-        filename = g_build_filename(pair[0], pair[1], NULL);
-        g_strfreev(pair);
+        is = LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+        name = get_cache_name(mimap, "body", imsg->uid);
+        filename = ibc_path(is, name, FALSE);
         fd = open(filename, O_RDONLY);
         g_free(filename);
+        if (fd != -1)
+            ibc_touch(is, name);
+        g_free(name);
         if (fd == -1)
             return FALSE;
 
@@ -2382,21 +3027,18 @@ get_section_for(LibBalsaMessage *msg, LibBalsaMessageBody *part)
 #endif
     return g_string_free(section, FALSE);
 }
-struct part_data { char *block; unsigned pos; ImapBody *body; };
+/* The part is written to its cache file piece by piece as it arrives
+   from the server. */
+struct part_data { FILE *fp; gboolean error; };
 static void
 append_str(unsigned seqno, const char *buf, size_t buflen, void *arg)
 {
     struct part_data *dt = (struct part_data*)arg;
 
-    if(dt->pos + buflen > dt->body->octets) {
-        /* 
-        fprintf(stderr, "IMAP server sends too much data but we just "
-                "reallocate the block.\n"); */
-	dt->body->octets = dt->pos + buflen;
-	dt->block = g_realloc(dt->block, dt->body->octets);
-    }
-    memcpy(dt->block + dt->pos, buf, buflen);
-    dt->pos += buflen;
+    if(dt->error)
+        return;
+    if(fwrite(buf, 1, buflen, dt->fp) != buflen)
+        dt->error = TRUE;
 }
 
 static const char*
@@ -2426,6 +3068,165 @@ get_parent(LibBalsaMessageBody *root, LibBalsaMessageBody *part,
     }
     return NULL;
 }
+/* Imap_mbox_handle_fetch_body fetches the MIME headers of the
+ * section, followed by the text. We write this unfiltered to the
+ * cache. The probably only exception is the main body which has no
+ * headers. In this case, we have to fake them. We could and probably
+ * should dump there first the headers that we have already fetched...
+ * Returns the options to fetch the part with. */
+static ImapFetchBodyOptions
+lbm_imap_part_options(LibBalsaMessage * msg, LibBalsaMessageBody * part,
+                      ImapBody * body, FILE * fp)
+{
+    ImapFetchBodyOptions ifbo;
+    LibBalsaMessageBody *parent;
+
+    parent = get_parent(msg->body_list, part, NULL);
+    if(parent == NULL)
+        ifbo = IMFB_NONE;
+    else {
+        if(parent->body_type == LIBBALSA_MESSAGE_BODY_TYPE_MESSAGE)
+            ifbo = IMFB_HEADER;
+        else
+            ifbo = IMFB_MIME;
+    }
+    if(ifbo == IMFB_NONE || body->octets == 0) {
+        fprintf(fp,"MIME-version: 1.0\r\ncontent-type: %s\r\n"
+                "Content-Transfer-Encoding: %s\r\n\r\n",
+                part->content_type ? part->content_type : "text/plain",
+                encoding_names(body->encoding));
+    }
+    return ifbo;
+}
+
+/* A part fetched by lbm_imap_prefetch_parts. */
+struct part_fetch {
+    gchar *name;                /* of the cache entry */
+    gchar *path;
+    struct part_data dt;
+};
+
+/* Collects the parts below part that are neither created nor cached
+ * yet, opening their cache files. Large parts are left to
+ * lbm_imap_get_msg_part_from_cache, which tells the user about the
+ * download. */
+static void
+lbm_imap_collect_parts(LibBalsaMessage * msg, LibBalsaMessageBody * part,
+                       ImapMessage * imsg, GArray * fetches,
+                       GArray * requests)
+{
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(msg->mailbox);
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+
+    for (; part; part = part->next) {
+        ImapFetchBodyRequest req;
+        struct part_fetch pf;
+        ImapBody *body;
+        gchar *section, *part_name;
+        FILE *fp;
+
+        if (libbalsa_message_body_is_multipart(part)) {
+            lbm_imap_collect_parts(msg, part->parts, imsg, fetches,
+                                   requests);
+            continue;
+        }
+        if (part->mime_part)
+            continue;
+
+        section = get_section_for(msg, part);
+        body = imap_message_get_body_from_section(imsg, section);
+        if (!body || body->octets == 0 || body->octets > SizeMsgThreshold) {
+            g_free(section);
+            continue;
+        }
+        part_name = get_cache_name(mimap, "part", imsg->uid);
+        pf.name = g_strconcat(part_name, "-", section, NULL);
+        g_free(part_name);
+        pf.path = ibc_path(is, pf.name, FALSE);
+        if (g_file_test(pf.path, G_FILE_TEST_EXISTS)) {
+            g_free(pf.path);
+            g_free(pf.name);
+            g_free(section);
+            continue;
+        }
+        g_free(pf.path);
+        pf.path = ibc_path(is, pf.name, TRUE);
+        if (!(fp = fopen(pf.path, "wb+"))) {
+            g_free(pf.path);
+            g_free(pf.name);
+            g_free(section);
+            continue;
+        }
+        pf.dt.fp = fp;
+        pf.dt.error = FALSE;
+        req.section = section;
+        req.options = lbm_imap_part_options(msg, part, body, fp);
+        req.body_handler = append_str;
+        req.arg = NULL;
+        req.rc = IMR_NO;
+        g_array_append_val(fetches, pf);
+        g_array_append_val(requests, req);
+    }
+}
+
+/* Fetches the parts below part that lbm_imap_get_msg_part is going to
+ * need into the cache with pipelined commands, so that the parts of a
+ * multipart/signed or multipart/encrypted part cost one round trip
+ * instead of one each. Failures are left for
+ * lbm_imap_get_msg_part_from_cache to report. */
+static void
+lbm_imap_prefetch_parts(LibBalsaMessage * msg, LibBalsaMessageBody * part)
+{
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(msg->mailbox);
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+    ImapMessage *imsg;
+    GArray *fetches, *requests;
+    guint i;
+
+    if (imap_mbox_is_disconnected(mimap->handle)
+        || !(imsg = mi_get_imsg(mimap, msg->msgno)))
+        return;
+
+    fetches = g_array_new(FALSE, FALSE, sizeof(struct part_fetch));
+    requests = g_array_new(FALSE, FALSE, sizeof(ImapFetchBodyRequest));
+    lbm_imap_collect_parts(msg, part, imsg, fetches, requests);
+    if (requests->len > 0) {
+        /* The array does not move any more. */
+        for (i = 0; i < requests->len; i++)
+            g_array_index(requests, ImapFetchBodyRequest, i).arg =
+                &g_array_index(fetches, struct part_fetch, i).dt;
+        libbalsa_lock_mailbox(msg->mailbox);
+        imap_mbox_handle_fetch_bodies(mimap->handle, msg->msgno, FALSE,
+                                      requests->len,
+                                      (ImapFetchBodyRequest *)
+                                      requests->data);
+        libbalsa_unlock_mailbox(msg->mailbox);
+    }
+
+    for (i = 0; i < requests->len; i++) {
+        ImapFetchBodyRequest *req =
+            &g_array_index(requests, ImapFetchBodyRequest, i);
+        struct part_fetch *pf =
+            &g_array_index(fetches, struct part_fetch, i);
+
+        if (req->rc == IMR_OK && !pf->dt.error && fflush(pf->dt.fp) == 0) {
+            fclose(pf->dt.fp);
+            ibc_add(is, pf->name);
+        } else {
+            /* we do not want to have an incomplete part in the cache */
+            fclose(pf->dt.fp);
+            unlink(pf->path);
+        }
+        g_free((gchar *) req->section);
+        g_free(pf->name);
+        g_free(pf->path);
+    }
+    g_array_free(fetches, TRUE);
+    g_array_free(requests, TRUE);
+}
+
 static gboolean
 lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
                                  LibBalsaMessageBody * part,
@@ -2433,11 +3234,13 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
 {
     GMimeStream *partstream = NULL;
 
-    gchar **pair,  *part_name;
+    gchar *name, *part_name;
     LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(msg->mailbox);
     FILE *fp;
     gchar *section;
     ImapMessage *imsg = mi_get_imsg(mimap, msg->msgno);
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
 
     if (!imsg) {
 	g_set_error(err,
@@ -2449,22 +3252,25 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
 
    /* look for a part cache */
     section = get_section_for(msg, part);
-    pair = get_cache_name_pair(mimap, "part", imsg->uid);
-    part_name   = g_strconcat(pair[0], G_DIR_SEPARATOR_S,
-                              pair[1], "-", section, NULL);
+    part_name = get_cache_name(mimap, "part", imsg->uid);
+    name = g_strconcat(part_name, "-", section, NULL);
+    g_free(part_name);
+    part_name = ibc_path(is, name, FALSE);
     fp = fopen(part_name,"rb+");
     
-    if(!fp) { /* no cache element */
+    if(fp)
+        ibc_touch(is, name);
+    else { /* no cache element */
         struct part_data dt;
+        ImapBody *body;
         ImapFetchBodyOptions ifbo;
         ImapResponse rc;
-        LibBalsaMessageBody *parent;
 
         libbalsa_lock_mailbox(msg->mailbox);
         mimap = LIBBALSA_MAILBOX_IMAP(msg->mailbox);
         
-        dt.body  = imap_message_get_body_from_section(imsg, section);
-        if(!dt.body) {
+        body = imap_message_get_body_from_section(imsg, section);
+        if(!body) {
             /* This may happen if we reconnect the data dropping the
                body structures but still try refetching the
                message. This can be simulated by randomly
@@ -2472,29 +3278,28 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
             fprintf(stderr, "Cannot find data for section %s\n", section);
             return FALSE;
         }
-        dt.block = g_malloc(dt.body->octets+1);
-        dt.pos   = 0;
-        if(dt.body->octets>SizeMsgThreshold)
+        if(body->octets>SizeMsgThreshold)
             libbalsa_information(LIBBALSA_INFORMATION_MESSAGE, 
                                  _("Downloading %u kB"),
-                                 dt.body->octets/1024);
-	/* Imap_mbox_handle_fetch_body fetches the MIME headers of the
-         * section, followed by the text. We write this unfiltered to
-         * the cache. The probably only exception is the main body
-         * which has no headers. In this case, we have to fake them.
-         * We could and probably should dump there first the headers 
-         * that we have already fetched... */
-        parent = get_parent(msg->body_list, part, NULL);
-        if(parent == NULL)
-            ifbo = IMFB_NONE;
-        else {
-            if(parent->body_type == LIBBALSA_MESSAGE_BODY_TYPE_MESSAGE)
-                ifbo = IMFB_HEADER;
-            else
-                ifbo = IMFB_MIME;
+                                 body->octets/1024);
+        g_free(part_name);
+        part_name = ibc_path(is, name, TRUE);
+        fp = fopen(part_name, "wb+");
+        if(!fp) {
+            libbalsa_unlock_mailbox(msg->mailbox);
+            g_free(section); 
+            g_free(name);
+            g_free(part_name);
+            g_set_error(err,
+                        LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
+                        _("Cannot create temporary file"));
+            return FALSE;
         }
+        ifbo = lbm_imap_part_options(msg, part, body, fp);
+        dt.fp    = fp;
+        dt.error = FALSE;
         rc = IMR_OK;
-        if (dt.body->octets > 0)
+        if (body->octets > 0)
         II(rc,mimap->handle,
            imap_mbox_handle_fetch_body(mimap->handle, msg->msgno,
                                        section, FALSE, ifbo, append_str, &dt));
@@ -2502,9 +3307,11 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
         if(rc != IMR_OK) {
             fprintf(stderr, "Error fetching imap message no %lu section %s\n",
                     msg->msgno, section);
-            g_free(dt.block);
+            /* we do not want to have an incomplete part in the cache */
+            fclose(fp);
+            unlink(part_name);
             g_free(section); 
-            g_strfreev(pair);
+            g_free(name);
             g_free(part_name);
             g_set_error(err,
                         LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
@@ -2512,27 +3319,7 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
                         imap_mbox_handle_get_last_msg(mimap->handle));
             return FALSE;
         }
-        g_mkdir_with_parents(pair[0], S_IRUSR|S_IWUSR|S_IXUSR);
-        fp = fopen(part_name, "wb+");
-        if(!fp) {
-            g_free(section); 
-            g_strfreev(pair);
-            g_free(part_name);
-            g_set_error(err,
-                        LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
-                        _("Cannot create temporary file"));
-            return FALSE;
-        }
-        if(ifbo == IMFB_NONE || dt.body->octets == 0) {
-            fprintf(fp,"MIME-version: 1.0\r\ncontent-type: %s\r\n"
-                    "Content-Transfer-Encoding: %s\r\n\r\n",
-                    part->content_type ? part->content_type : "text/plain",
-                    encoding_names(dt.body->encoding));
-        }
-        /* Carefully save number of bytes actually read from the file. */
-	if (dt.pos) {
-            if(fwrite(dt.block, 1, dt.pos, fp) != dt.pos
-               || fflush(fp) != 0) {
+        if(dt.error || fflush(fp) != 0) {
             fclose(fp);
             /* we do not want to have an incomplete part in the cache
                so that the user still can try again later when the
@@ -2542,13 +3329,11 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
                         LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
                         _("Cannot write to temporary file %s"), part_name);
             g_free(section); 
-            g_strfreev(pair);
+            g_free(name);
             g_free(part_name);
-            g_free(dt.block);
             return FALSE; /* something better ? */
-            }
         }
-        g_free(dt.block);
+        ibc_add(is, name);
 	fseek(fp, 0, SEEK_SET);
     }
     partstream = g_mime_stream_file_new (fp);
@@ -2561,7 +3346,7 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
     }
     g_object_unref (partstream);
     g_free(section); 
-    g_strfreev(pair);
+    g_free(name);
     g_free(part_name);
 
     return TRUE;
@@ -2606,9 +3391,13 @@ lbm_imap_get_msg_part(LibBalsaMessage * msg, LibBalsaMessageBody * part,
 			     part->mime_part);
     }
 
-    if (GMIME_IS_MULTIPART_SIGNED(part->mime_part)
-        || GMIME_IS_MULTIPART_ENCRYPTED(part->mime_part))
+    if (!need_children
+        && (GMIME_IS_MULTIPART_SIGNED(part->mime_part)
+            || GMIME_IS_MULTIPART_ENCRYPTED(part->mime_part))) {
+        /* All parts below are needed. */
+        lbm_imap_prefetch_parts(msg, part->parts);
         need_children = TRUE;
+    }
 
     if (need_children) {
 	/* Get the children, if any,... */
@@ -2904,17 +3693,24 @@ multi_append_cb(char * buf, size_t buflen,
 }
 
 struct append_to_cache_data {
-    const gchar *user, *host, *path, *cache_dir;
+    LibBalsaImapServer *server;
+    const gchar *path;
     GList *curr_name;
     unsigned uid_validity;
 };
 
+/* create_cache_copy:
+   stores a copy of src in the cache of given server under name.
+   name is not encoded yet. */
 static void
-create_cache_copy(const gchar *src, const gchar *cache_dir, const gchar *name)
+create_cache_copy(LibBalsaImapServer *is, const gchar *src,
+                  const gchar *name)
 {
     gchar *fname = libbalsa_urlencode(name);
-    gchar *dst = g_build_filename(cache_dir, fname, NULL);
-    if(link(src, dst) != 0) {
+    gchar *dst = ibc_path(is, fname, TRUE);
+    gboolean ok = link(src, dst) == 0;
+
+    if(!ok) {
 	/* Link failed possibly because the two caches reside on
 	   different file systems. We attempt to copy the cache instead. */
 	FILE *in  = fopen(src, "r");
@@ -2932,10 +3728,14 @@ create_cache_copy(const gchar *src, const gchar *cache_dir, const gchar *name)
 		fclose(out);
 		if(err)
 		    unlink(dst);
+                else
+                    ok = TRUE;
 	    }
 	    fclose(in);
 	}
     }
+    if(ok)
+        ibc_add(is, fname);
     g_free(fname);
     g_free(dst);
 }
@@ -2944,9 +3744,8 @@ static void
 append_to_cache(unsigned uid, void *arg)
 {
     struct append_to_cache_data *atcd = (struct append_to_cache_data*)arg;
-    gchar *name = g_strdup_printf("%s@%s-%s-%u-%u-%s",
-				  atcd->user, atcd->host, atcd->path,
-				  atcd->uid_validity,
+    gchar *name = g_strdup_printf("%s-%u-%u-%s",
+				  atcd->path, atcd->uid_validity,
 				  uid, "body");
     gchar *msg = atcd->curr_name->data;
 
@@ -2954,7 +3753,7 @@ append_to_cache(unsigned uid, void *arg)
 
     g_return_if_fail(msg);
 
-    create_cache_copy(msg, atcd->cache_dir, name);
+    create_cache_copy(atcd->server, msg, name);
     g_free(name);
 }
 
@@ -2993,21 +3792,15 @@ libbalsa_mailbox_imap_add_messages(LibBalsaMailbox * mailbox,
 	/* Hurray, server returned UID data on appended messages! */
 	LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
 	LibBalsaServer *s      = LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
-	LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
-	gboolean is_persistent = libbalsa_imap_server_has_persistent_cache(is);
 	struct append_to_cache_data atcd;
-	gchar *cache_dir;
 
-	atcd.user = s->user;
-	atcd.host = s->host;
+	atcd.server = LIBBALSA_IMAP_SERVER(s);
 	atcd.path = mimap->path ? mimap->path : "INBOX";
-	atcd.cache_dir = cache_dir = get_cache_dir(is_persistent);
 	atcd.curr_name = macd.outfiles;
 	atcd.uid_validity = uid_sequence.uid_validity;
 
 	imap_sequence_foreach(&uid_sequence, append_to_cache, &atcd);
 	imap_sequence_release(&uid_sequence);
-	g_free(cache_dir);
     }
 
     macd_destroy(&macd);
@@ -3298,6 +4091,94 @@ libbalsa_mailbox_imap_total_messages(LibBalsaMailbox * mailbox)
     return cnt;
 }
 
+/* Server-side copy or, if move is set, move of the messages in the
+ * list to dest, which is on the same server as mailbox.
+ */
+static gboolean
+lbmi_server_copy(LibBalsaMailbox * mailbox, GArray * msgnos,
+                 LibBalsaMailbox * dest, gboolean move, GError **err)
+{
+    gboolean ret;
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
+    ImapMboxHandle *handle = LIBBALSA_MAILBOX_IMAP(mailbox)->handle;
+    ImapSequence uid_sequence;
+    unsigned *seqno = (unsigned*)msgnos->data, *uids;
+    unsigned im;
+    g_return_val_if_fail(handle, FALSE);
+
+    imap_sequence_init(&uid_sequence);
+    /* User server-side copy. */
+    g_array_sort(msgnos, cmp_msgno);
+    uids = g_new(unsigned, msgnos->len);
+    for(im=0; im<msgnos->len; im++) {
+	ImapMessage * imsg = imap_mbox_handle_get_msg(handle, seqno[im]);
+	uids[im] = imsg ? imsg->uid : 0;
+    }
+
+    ret = (move ? imap_mbox_handle_move : imap_mbox_handle_copy)
+	(handle, msgnos->len, (guint *) msgnos->data,
+	 LIBBALSA_MAILBOX_IMAP(dest)->path, &uid_sequence) == IMR_OK;
+    if(!ret) {
+	gchar *msg = imap_mbox_handle_get_last_msg(handle);
+	g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+		    LIBBALSA_MAILBOX_COPY_ERROR,
+		    "%s", msg);
+	g_free(msg);
+    } else if(!imap_sequence_empty(&uid_sequence)) {
+	/* Copy cache files. */
+	LibBalsaServer *s      = LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
+	LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
+	LibBalsaMailboxImap *dst_imap = LIBBALSA_MAILBOX_IMAP(dest);
+	gchar *src_prefix = g_strdup_printf("%s-%u-",
+					    (mimap->path 
+					     ? mimap->path : "INBOX"),
+					    mimap->uid_validity);
+	gchar *encoded_path = libbalsa_urlencode(src_prefix);
+	size_t prefix_length = strlen(encoded_path);
+	GSList *names, *l;
+	unsigned nth;
+
+	g_free(src_prefix);
+	names = ibc_list(is, encoded_path);
+	for(l = names; l; l = l->next) {
+	    const gchar *filename = l->data;
+	    unsigned msg_uid;
+	    gchar *tail;
+	    msg_uid = strtol(filename + prefix_length, &tail, 10);
+	    for(im = 0; im<msgnos->len; im++) {
+		if(uids[im]>msg_uid) break;
+		else if(uids[im]==msg_uid &&
+			(nth = imap_sequence_nth(&uid_sequence, im))
+			) {
+		    gchar *src = ibc_path(is, filename, FALSE);
+		    gchar *dst_prefix =
+			g_strdup_printf("%s-%u-%u%s",
+					(dst_imap->path 
+					 ? dst_imap->path : "INBOX"),
+					uid_sequence.uid_validity,
+					nth, tail);
+
+		    create_cache_copy(is, src, dst_prefix);
+		    g_free(dst_prefix);
+		    g_free(src);
+		    break;
+		}
+	    }
+	}
+	g_slist_foreach(names, (GFunc) g_free, NULL);
+	g_slist_free(names);
+	g_free(encoded_path);
+    }
+    g_free(uids);
+    imap_sequence_release(&uid_sequence);
+    return ret;
+}
+
+#define LBMI_SAME_SERVER(mailbox, dest) \
+    (LIBBALSA_IS_MAILBOX_IMAP(dest) && \
+     LIBBALSA_MAILBOX_REMOTE(dest)->server == \
+     LIBBALSA_MAILBOX_REMOTE(mailbox)->server)
+
 /* Copy messages in the list to dest; use server-side copy if mailbox
  * and dest are on the same server, fall back to parent method
  * otherwise.
@@ -3307,98 +4188,27 @@ libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox * mailbox,
 				    GArray * msgnos,
 				    LibBalsaMailbox * dest, GError **err)
 {
-    if (LIBBALSA_IS_MAILBOX_IMAP(dest) &&
-	LIBBALSA_MAILBOX_REMOTE(dest)->server ==
-	LIBBALSA_MAILBOX_REMOTE(mailbox)->server) {
-        gboolean ret;
-	LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
-	ImapMboxHandle *handle = LIBBALSA_MAILBOX_IMAP(mailbox)->handle;
-	ImapSequence uid_sequence;
-	unsigned *seqno = (unsigned*)msgnos->data, *uids;
-	unsigned im;
-	g_return_val_if_fail(handle, FALSE);
-	
-	imap_sequence_init(&uid_sequence);
-	/* User server-side copy. */
-	g_array_sort(msgnos, cmp_msgno);
-	uids = g_new(unsigned, msgnos->len);
-	for(im=0; im<msgnos->len; im++) {
-	    ImapMessage * imsg = imap_mbox_handle_get_msg(handle, seqno[im]);
-	    uids[im] = imsg ? imsg->uid : 0;
-	}
-	    
-	ret = imap_mbox_handle_copy(handle, msgnos->len,
-                                    (guint *) msgnos->data,
-                                    LIBBALSA_MAILBOX_IMAP(dest)->path,
-				    &uid_sequence)
-	    == IMR_OK;
-        if(!ret) {
-            gchar *msg = imap_mbox_handle_get_last_msg(handle);
-            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
-                        LIBBALSA_MAILBOX_COPY_ERROR,
-                        "%s", msg);
-            g_free(msg);
-        } else if(!imap_sequence_empty(&uid_sequence)) {
-	    /* Copy cache files. */
-	    GDir *dir;
-	    LibBalsaServer *s      = LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
-	    LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
-	    LibBalsaMailboxImap *dst_imap = LIBBALSA_MAILBOX_IMAP(dest);
-	    gboolean is_persistent =
-		libbalsa_imap_server_has_persistent_cache(is);
-	    gchar *dir_name = get_cache_dir(is_persistent);
-	    gchar *src_prefix = g_strdup_printf("%s@%s-%s-%u-",
-						s->user, s->host,
-						(mimap->path 
-						 ? mimap->path : "INBOX"),
-						mimap->uid_validity);
-	    gchar *encoded_path = libbalsa_urlencode(src_prefix);
-	    g_free(src_prefix);
-	    dir = g_dir_open(dir_name, 0, NULL);
-	    if(dir) {
-		const gchar *filename;
-		size_t prefix_length = strlen(encoded_path);
-		unsigned nth;
-		while ((filename = g_dir_read_name(dir)) != NULL) {
-		    unsigned msg_uid;
-		    gchar *tail;
-		    if(strncmp(encoded_path, filename, prefix_length))
-			continue;
-		    msg_uid = strtol(filename + prefix_length, &tail, 10);
-		    for(im = 0; im<msgnos->len; im++) {
-			if(uids[im]>msg_uid) break;
-			else if(uids[im]==msg_uid &&
-				(nth = imap_sequence_nth(&uid_sequence, im))
-				 ) {
-			    gchar *src =
-				g_build_filename(dir_name, filename, NULL);
-			    gchar *dst_prefix =
-				g_strdup_printf("%s@%s-%s-%u-%u%s",
-						s->user, s->host,
-						(dst_imap->path 
-						 ? dst_imap->path : "INBOX"),
-						uid_sequence.uid_validity,
-						nth, tail);
-
-			    create_cache_copy(src, dir_name, dst_prefix);
-			    g_free(dst_prefix);
-			    break;
-			}
-		    }
-		}
-		g_dir_close(dir);
-	    }
-	    g_free(dir_name);
-	}
-	g_free(uids);
-	imap_sequence_release(&uid_sequence);
-        return ret;
-    }
+    if (LBMI_SAME_SERVER(mailbox, dest))
+        return lbmi_server_copy(mailbox, msgnos, dest, FALSE, err);
 
     /* Couldn't use server-side copy, fall back to default method. */
     return parent_class->messages_copy(mailbox, msgnos, dest, err);
 }
 
+/* Move messages in the list to dest; on the same server, the STORE
+ * of the \Deleted flag is pipelined behind the COPY.
+ */
+static gboolean
+libbalsa_mailbox_imap_messages_move(LibBalsaMailbox * mailbox,
+				    GArray * msgnos,
+				    LibBalsaMailbox * dest, GError **err)
+{
+    if (LBMI_SAME_SERVER(mailbox, dest) && !mailbox->readonly)
+        return lbmi_server_copy(mailbox, msgnos, dest, TRUE, err);
+
+    return parent_class->messages_move(mailbox, msgnos, dest, err);
+}
+
 void
 libbalsa_imap_set_cache_size(off_t cache_size)
 {
@@ -3406,12 +4216,33 @@ libbalsa_imap_set_cache_size(off_t cache_size)
 }
 
 /** Purges the temporary directory used for non-persistent message
-   caching. */
+   caching: trims the cache of each server to cache_size. Files left
+   there in the old flat layout are simply removed. */
 void
 libbalsa_imap_purge_temp_dir(off_t cache_size)
 {
     gchar *dir_name = get_cache_dir(FALSE);
-    clean_dir(dir_name, cache_size);
+    GDir *dir = g_dir_open(dir_name, 0, NULL);
+    const gchar *filename;
+
+    if(!dir) {
+        g_free(dir_name);
+        return;
+    }
+
+    LOCK_BODY_CACHES();
+    while ((filename = g_dir_read_name(dir)) != NULL) {
+        gchar *fname = g_build_filename(dir_name, filename, NULL);
+        if(g_file_test(fname, G_FILE_TEST_IS_DIR)) {
+            struct ImapBodyCache *ibc = ibc_lookup(fname, NULL, NULL);
+            ibc_evict(ibc, cache_size, NULL);
+            ibc_compact(ibc);
+        } else if(g_file_test(fname, G_FILE_TEST_IS_REGULAR))
+            unlink(fname);
+        g_free(fname);
+    }
+    UNLOCK_BODY_CACHES();
+    g_dir_close(dir);
     g_free(dir_name);
 }
 
@@ -3441,13 +4272,53 @@ libbalsa_imap_purge_temp_dir(off_t cache_size)
      Current implementation stores the information in memory but an
      implementation storing data on disk is possible, too.
 
+   When the server supports CONDSTORE (RFC 7162), ICM remembers the
+   HIGHESTMODSEQ of the mailbox as well so that on the next select
+   only the flags changed since then need to be fetched; with QRESYNC
+   the server reports also the UIDs expunged in the meantime.
  */
 struct ImapCacheManager {
-    GHashTable *headers;
+    GHashTable *headers;        /* uid -> serialized message */
     GArray     *uidmap;
     uint32_t    uidvalidity;
     uint32_t    uidnext;
     uint32_t    exists;
+    uint64_t    modseq;
+    /* A cache loaded from an ICM_FILE_MAGIC file is not copied to
+       headers; the serialized messages are used in place. */
+    GMappedFile *map;
+    const struct icm_record *records;
+    uint32_t    n_records;
+    const gchar *blob;
+    gsize       blob_len;
+};
+
+/* Header cache file layout: struct icm_file_header, the uidmap
+   (uint32_t per message, padded to 8 bytes), a table of icm_records
+   sorted by UID and the serialized messages, each starting at an
+   8-byte boundary of the blob so that they can be used in place. All
+   the numbers are little-endian, so that the file can be used on any
+   machine. Files with another magic or version, including those of
+   older releases, are ignored, and the cache is built anew. */
+#define ICM_FILE_MAGIC   0x434d4349 /* "ICMC" */
+#define ICM_FILE_VERSION 1
+#define ICM_ALIGN(n) (((n) + 7) & ~(gsize) 7)
+
+struct icm_file_header {
+    uint32_t magic;
+    uint32_t version;           /* ICM_FILE_VERSION */
+    uint32_t msg_version;       /* IMAP_MSG_SERIALIZED_VERSION */
+    uint32_t uidmap_len;
+    uint32_t uidvalidity;
+    uint32_t uidnext;
+    uint32_t exists;
+    uint32_t n_records;
+    uint64_t modseq;
+};
+
+struct icm_record {
+    uint32_t uid;
+    uint32_t offset;            /* in the blob */
 };
 
 static struct ImapCacheManager*
@@ -3461,50 +4332,74 @@ imap_cache_manager_new(guint cnt)
     return icm;
 }
 
+static void
+icm_unmap(GMappedFile *map)
+{
+#if GLIB_CHECK_VERSION(2,22,0)
+    g_mapped_file_unref(map);
+#else                           /* GLIB_CHECK_VERSION(2,22,0) */
+    g_mapped_file_free(map);
+#endif                          /* GLIB_CHECK_VERSION(2,22,0) */
+}
+
+/* Maps a cache file in the current format. Only the uidmap is copied;
+   the records are looked up with icm_lookup(). */
+static struct ImapCacheManager*
+icm_new_from_map(GMappedFile *map)
+{
+    const gchar *contents = g_mapped_file_get_contents(map);
+    gsize length = g_mapped_file_get_length(map);
+    const struct icm_file_header *header =
+        (const struct icm_file_header *) contents;
+    struct ImapCacheManager *icm;
+    uint32_t uidmap_len, n_records, i;
+    gsize records;
+
+    if(length < sizeof *header ||
+       GUINT32_FROM_LE(header->magic) != ICM_FILE_MAGIC ||
+       GUINT32_FROM_LE(header->version) != ICM_FILE_VERSION ||
+       GUINT32_FROM_LE(header->msg_version) != IMAP_MSG_SERIALIZED_VERSION)
+        return NULL;
+    uidmap_len = GUINT32_FROM_LE(header->uidmap_len);
+    n_records  = GUINT32_FROM_LE(header->n_records);
+    if((length - sizeof *header) / sizeof(uint32_t) < uidmap_len)
+        return NULL;
+    records = ICM_ALIGN(sizeof *header + (gsize) uidmap_len * sizeof(uint32_t));
+    if(records > length ||
+       (length - records) / sizeof(struct icm_record) < n_records)
+        return NULL;
+
+    icm = imap_cache_manager_new(uidmap_len);
+    icm->uidvalidity = GUINT32_FROM_LE(header->uidvalidity);
+    icm->uidnext     = GUINT32_FROM_LE(header->uidnext);
+    icm->exists      = GUINT32_FROM_LE(header->exists);
+    icm->modseq      = GUINT64_FROM_LE(header->modseq);
+    g_array_append_vals(icm->uidmap, header + 1, uidmap_len);
+    for(i=0; i<uidmap_len; i++)
+        g_array_index(icm->uidmap, uint32_t, i) =
+            GUINT32_FROM_LE(g_array_index(icm->uidmap, uint32_t, i));
+
+    icm->map       = map;
+    icm->records   = (const struct icm_record *) (contents + records);
+    icm->n_records = n_records;
+    icm->blob      = (const gchar *) (icm->records + icm->n_records);
+    icm->blob_len  = contents + length - icm->blob;
+    return icm;
+}
+
 static struct ImapCacheManager*
 imap_cache_manager_new_from_file(const char *header_cache_path)
 {
-    /* The cache data should be transferable between 32- and 64-bit
-       systems. */
-    uint32_t i;
-    ImapUID uid;
     struct ImapCacheManager *icm;
-    FILE *f = fopen(header_cache_path, "rb");
-    if(!f) {
-	return NULL;
-    }
-    if(fread(&i, sizeof(i), 1, f) != 1) {
-	printf("Could not read cache table size.\n");
-	return NULL;
-    }
-    
-    icm = imap_cache_manager_new(i);
-    if(fread(&icm->uidvalidity, sizeof(uint32_t), 1, f) != 1 ||
-       fread(&icm->uidnext,     sizeof(uint32_t), 1, f) != 1 ||
-       fread(&icm->exists,      sizeof(uint32_t), 1, f) != 1) {
-	imap_cache_manager_free(icm);
-	printf("Couldn't read cache - aborting...\n");
-	return NULL;
-    }
+    GMappedFile *map;
 
-    i = 0;
-    while(fread(&uid, sizeof(uid), 1, f) == 1) {
-	if(uid) {
-	    uint32_t slen; /* Architecture-independent size */
-	    gchar *s;
-	    if(fread(&slen, sizeof(slen), 1, f) != 1)
-		break;
-	    s = g_malloc(slen+1); /* slen would be sufficient? */
-	    if(fread(s, 1, slen, f) != slen)
-                break;
-	    s[slen] = '\0'; /* Unneeded? */
-	    g_hash_table_insert(icm->headers, GUINT_TO_POINTER(uid), s);
-	}
-        g_array_append_val(icm->uidmap, uid);
-	i++;
+    map = g_mapped_file_new(header_cache_path, FALSE, NULL);
+    if(!map)
+        return NULL;
+    if(!(icm = icm_new_from_map(map))) {
+        printf("Couldn't read cache - aborting...\n");
+        icm_unmap(map);
     }
-    fclose(f);
-
     return icm;
 }
 
@@ -3513,15 +4408,54 @@ imap_cache_manager_free(struct ImapCacheManager *icm)
 {
     g_hash_table_destroy(icm->headers);
     g_array_free(icm->uidmap, TRUE);
+    if(icm->map)
+        icm_unmap(icm->map);
     g_free(icm);
 }
 
+static gint
+icm_cmp_record(const void *key, const void *record)
+{
+    uint32_t uid = *(const uint32_t *) key;
+    uint32_t ruid =
+        GUINT32_FROM_LE(((const struct icm_record *) record)->uid);
+    return uid < ruid ? -1 : uid > ruid;
+}
+
+/* Returns the serialized message with given uid, or NULL. */
+static void*
+icm_lookup(struct ImapCacheManager *icm, uint32_t uid)
+{
+    const struct icm_record *record;
+    gsize offset;
+
+    if(!icm->map)
+        return g_hash_table_lookup(icm->headers, GUINT_TO_POINTER(uid));
+
+    record = bsearch(&uid, icm->records, icm->n_records,
+                     sizeof *record, icm_cmp_record);
+    if(!record)
+        return NULL;
+    offset = GUINT32_FROM_LE(record->offset);
+    if(offset % 8 != 0 || offset > icm->blob_len ||
+       !imap_serialized_message_check(icm->blob + offset,
+                                      icm->blob_len - offset))
+        return NULL;
+    return (void *) (icm->blob + offset);
+}
+
 /* icm_init_on_select_() preloads header cache of the ImapMboxHandle object.
    It currently handles following cases:
    a). uidvalidity different - entire cache has to be invalidated.
    b). cache->exists == h->exists && cache->uidnext == h->uidnext:
    nothing has changed - feed entire cache.
+   c). QRESYNC: the server told us which of the cached UIDs vanished.
    else fetch the message numbers for the UIDs in cache.
+   If the server keeps mod-sequences, the flags of the cached messages
+   changed since the cache was stored are fetched first.
+   The messages are only registered with the handle, which takes over
+   icm and deserializes them on first access; icm is freed if it
+   cannot be used.
 */
 static void
 set_uid(ImapMboxHandle *handle, unsigned seqno, void *arg)
@@ -3530,27 +4464,106 @@ set_uid(ImapMboxHandle *handle, unsigned seqno, void *arg)
     g_array_append_val(a, seqno);
 }
 
+static gint
+icm_cmp_range(const ImapUidRange *a, const ImapUidRange *b)
+{
+    return a->lo < b->lo ? -1 : a->lo > b->lo;
+}
+
+/* Removes the vanished UIDs from the uidmap. Succeeds only if all the
+   UIDs in the map are known and the result is consistent with the
+   current message count; the uidmap is left intact otherwise. */
+static gboolean
+icm_remove_vanished(struct ImapCacheManager *icm, GArray *vanished,
+                    unsigned exists, unsigned uidnext)
+{
+    GArray *uidmap;
+    unsigned i, r = 0;
+
+    for(i=0; i<icm->uidmap->len; i++)
+        if(g_array_index(icm->uidmap, uint32_t, i) == 0)
+            return FALSE;
+
+    g_array_sort(vanished, (GCompareFunc)icm_cmp_range);
+    uidmap = g_array_sized_new(FALSE, TRUE, sizeof(uint32_t),
+                               icm->uidmap->len);
+    /* Both the map and the ranges are ordered by UID. */
+    for(i=0; i<icm->uidmap->len; i++) {
+        uint32_t uid = g_array_index(icm->uidmap, uint32_t, i);
+        while(r < vanished->len &&
+              g_array_index(vanished, ImapUidRange, r).hi < uid)
+            r++;
+        if(r < vanished->len &&
+           g_array_index(vanished, ImapUidRange, r).lo <= uid)
+            continue;
+        g_array_append_val(uidmap, uid);
+    }
+
+    if(uidmap->len > exists ||
+       exists - uidmap->len > uidnext - icm->uidnext) {
+        g_array_free(uidmap, TRUE);
+        return FALSE;
+    }
+    g_array_free(icm->uidmap, TRUE); icm->uidmap = uidmap;
+    return TRUE;
+}
+
 static void
 icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
 {
     unsigned exists, uidvalidity, uidnext;
-    unsigned i;
+    guint64 modseq;
+    gboolean uidmap_synced, flags_valid = FALSE;
+    unsigned i, cnt;
 
-    if(!icm || ! h)
+    if(!icm)
+        return;
+    if(!h) {
+        imap_cache_manager_free(icm);
         return;
+    }
     uidvalidity = imap_mbox_handle_get_validity(h);
     exists  = imap_mbox_handle_get_exists(h);
     uidnext = imap_mbox_handle_get_uidnext(h);
     if(icm->uidvalidity != uidvalidity) {
         printf("Different validities old: %u new: %u - cache invalidated\n",
                icm->uidvalidity, uidvalidity);
+        imap_cache_manager_free(icm);
         return;
     }
+    uidmap_synced = exists - icm->exists == uidnext - icm->uidnext;
+
+    /* Bring the cached flags up to date. A cache stored without a
+     * modseq gets all its flags refreshed once. */
+    modseq = imap_mbox_handle_get_highestmodseq(h);
+    if(modseq && modseq == icm->modseq)
+        flags_valid = TRUE;
+    else if(modseq) {
+        GArray *vanished = NULL;
+        ImapResponse rc;
+
+        if(!uidmap_synced && icm->modseq &&
+           imap_mbox_handle_qresync_enabled(h))
+            vanished = g_array_new(FALSE, FALSE, sizeof(ImapUidRange));
+        rc = imap_mbox_resync_flags(h, icm->uidnext ? icm->uidnext-1 : 0,
+                                    icm->modseq, vanished);
+        if(rc == IMR_OK && vanished)
+            uidmap_synced =
+                icm_remove_vanished(icm, vanished, exists, uidnext);
+        if(vanished)
+            g_array_free(vanished, TRUE);
+        /* Stale flags must not be stored again with a new modseq. */
+        if(rc != IMR_OK) {
+            imap_cache_manager_free(icm);
+            return;
+        }
+        flags_valid = TRUE;
+    }
 
     /* There were some modifications to the mailbox but the situation
      * is not hopeless, we just need to get the seqnos of messages in
      * the cache. */
-    if(exists - icm->exists !=  uidnext - icm->uidnext) {
+    if(!uidmap_synced) {
         ImapResponse rc;
         GArray *uidmap = g_array_sized_new(FALSE, TRUE,
                                            sizeof(uint32_t), icm->exists);
@@ -3573,6 +4586,7 @@ icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
         } else rc = IMR_NO;
         if(rc != IMR_OK) {
             g_array_free(uidmap, TRUE);
+            imap_cache_manager_free(icm);
             return;
         }
         g_array_free(icm->uidmap, TRUE); icm->uidmap = uidmap;
@@ -3581,13 +4595,16 @@ icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
     /* One way or another, we have a valid uid->seqno map now;
      * The mailbox data can be resynced easily. */
 
-    for(i=1; i<=icm->exists; i++) {
+    cnt = MIN(icm->uidmap->len, exists);
+    for(i=1; i<=cnt; i++) {
         uint32_t uid = g_array_index(icm->uidmap, uint32_t, i-1);
-        void *data = g_hash_table_lookup(icm->headers,
-                                         GUINT_TO_POINTER(uid));
+        void *data = icm_lookup(icm, uid);
         if(data) /* if uid known */
-            imap_mbox_handle_msg_deserialize(h, i, data);
+            imap_mbox_handle_msg_deserialize(h, i, data, flags_valid);
     }
+    /* The messages are deserialized when first accessed. */
+    imap_mbox_handle_keep_serialized(h, icm,
+                                     (GDestroyNotify) imap_cache_manager_free);
 }
 
 /** Stores (possibly persistently) data associated with given handle.
@@ -3606,61 +4623,103 @@ icm_store_cached_data(ImapMboxHandle *handle)
     icm = imap_cache_manager_new(cnt);
     icm->uidvalidity = imap_mbox_handle_get_validity(handle);
     icm->uidnext     = imap_mbox_handle_get_uidnext(handle);
+    /* The modseq of the select is older than any flag change the
+       server notified us about since, so it is a safe lower bound. */
+    icm->modseq      = imap_mbox_handle_get_highestmodseq(handle);
 
     for(i=0; i<cnt; i++) {
-        void *ptr;
-        ImapMessage *imsg = imap_mbox_handle_get_msg(handle, i+1);
+        /* Messages not accessed in this session are copied without
+           being deserialized. */
+        void *ptr = imap_mbox_handle_msg_serialize(handle, i+1);
         unsigned uid;
-        if(imsg && (ptr = imap_message_serialize(imsg)) != NULL) {
-            g_hash_table_insert(icm->headers,
-                                GUINT_TO_POINTER(imsg->uid), ptr);
-            uid = imsg->uid;
+        if(ptr) {
+            uid = imap_serialized_message_uid(ptr);
+            g_hash_table_insert(icm->headers, GUINT_TO_POINTER(uid), ptr);
         } else uid = 0;
         g_array_append_val(icm->uidmap, uid);
     }
     return icm;
 }
 
-static gboolean
-icm_save_header(uint32_t uid, gpointer value, FILE *f)
+static gint
+icm_cmp_uid(const uint32_t *a, const uint32_t *b)
 {
-    if(fwrite(&uid, sizeof(uid), 1, f) != 1) return FALSE;
-    if(uid) {
-	uint32_t slen = imap_serialized_message_size(value);
-	if(fwrite(&slen, sizeof(slen), 1, f) != 1 ||
-           fwrite(value, 1, slen, f) != slen)
-            return FALSE;
-    }
-    return TRUE;
+    return *a < *b ? -1 : *a > *b;
 }
 
-
+/* Writes the cache in the format read by icm_new_from_map(). The file
+   is replaced atomically as the old one may still be mapped. */
 static gboolean
 icm_save_to_file(struct ImapCacheManager *icm, const gchar *file_name)
 {
+    static const gchar padding[8];
+    struct icm_file_header header;
+    GArray *uids;
+    uint32_t *uidmap;
+    gchar *tmp_name;
     gboolean success;
-    FILE *f = fopen(file_name, "wb");
+    FILE *f;
+    gsize offset, len;
+    uint32_t i;
 
+    uids = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t),
+                             icm->uidmap->len);
+    for(i = 0; i<icm->uidmap->len; i++) {
+        uint32_t uid = g_array_index(icm->uidmap, uint32_t, i);
+        if(uid && icm_lookup(icm, uid))
+            g_array_append_val(uids, uid);
+    }
+    g_array_sort(uids, (GCompareFunc) icm_cmp_uid);
+
+    header.magic       = GUINT32_TO_LE(ICM_FILE_MAGIC);
+    header.version     = GUINT32_TO_LE(ICM_FILE_VERSION);
+    header.msg_version = GUINT32_TO_LE(IMAP_MSG_SERIALIZED_VERSION);
+    header.uidmap_len  = GUINT32_TO_LE(icm->uidmap->len);
+    header.uidvalidity = GUINT32_TO_LE(icm->uidvalidity);
+    header.uidnext     = GUINT32_TO_LE(icm->uidnext);
+    header.exists      = GUINT32_TO_LE(icm->exists);
+    header.n_records   = GUINT32_TO_LE(uids->len);
+    header.modseq      = GUINT64_TO_LE(icm->modseq);
+
+    uidmap = g_new(uint32_t, icm->uidmap->len);
+    for(i = 0; i<icm->uidmap->len; i++)
+        uidmap[i] = GUINT32_TO_LE(g_array_index(icm->uidmap, uint32_t, i));
+
+    tmp_name = g_strconcat(file_name, ".tmp", NULL);
+    f = fopen(tmp_name, "wb");
     success = f != NULL;
     if(success) {
-	uint32_t i = icm->uidmap->len;
-	if(fwrite(&i, sizeof(i), 1, f) != 1                       ||
-           fwrite(&icm->uidvalidity, sizeof(uint32_t), 1, f) != 1 ||
-           fwrite(&icm->uidnext,     sizeof(uint32_t), 1, f) != 1 ||
-           fwrite(&icm->exists,      sizeof(uint32_t), 1, f) != 1) {
-            success = FALSE;
-        } else {
-            for(i = 0; i<icm->uidmap->len; i++) {
-                uint32_t uid = g_array_index(icm->uidmap, uint32_t, i);
-                gpointer value = g_hash_table_lookup(icm->headers,
-                                                     GUINT_TO_POINTER(uid));
-                if(!icm_save_header(uid, value, f)) {
-                    success = FALSE;
-                    break;
-                }
-            }
+        len = icm->uidmap->len * sizeof(uint32_t);
+        success = fwrite(&header, sizeof header, 1, f) == 1 &&
+            fwrite(uidmap, 1, len, f) == len &&
+            fwrite(padding, 1, ICM_ALIGN(len) - len, f) ==
+            ICM_ALIGN(len) - len;
+        for(i = 0, offset = 0; success && i < uids->len; i++) {
+            uint32_t uid = g_array_index(uids, uint32_t, i);
+            struct icm_record record;
+            record.uid    = GUINT32_TO_LE(uid);
+            record.offset = GUINT32_TO_LE(offset);
+            success = offset <= G_MAXUINT32 &&
+                fwrite(&record, sizeof record, 1, f) == 1;
+            len = imap_serialized_message_size(icm_lookup(icm, uid));
+            offset += ICM_ALIGN(len);
+        }
+        for(i = 0; success && i < uids->len; i++) {
+            void *value = icm_lookup(icm, g_array_index(uids, uint32_t, i));
+            len = imap_serialized_message_size(value);
+            success = fwrite(value, 1, len, f) == len &&
+                fwrite(padding, 1, ICM_ALIGN(len) - len, f) ==
+                ICM_ALIGN(len) - len;
         }
-	fclose(f);
+	if(fclose(f) != 0)
+            success = FALSE;
+        if(success)
+            success = rename(tmp_name, file_name) == 0;
+        if(!success)
+            unlink(tmp_name);
     }
+    g_free(tmp_name);
+    g_free(uidmap);
+    g_array_free(uids, TRUE);
     return success;
 }
@@ -27,6 +27,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif                          /* HAVE_SYS_INOTIFY_H */
 
 #include "libbalsa.h"
 #include "libbalsa_private.h"
@@ -34,6 +38,7 @@
 #include "filter-funcs.h"
 #include "mailbox-filter.h"
 #include "misc.h"
+#include "text-index.h"
 #include <glib/gi18n.h>
 
 
@@ -57,10 +62,17 @@ static gboolean libbalsa_mailbox_local_message_match(LibBalsaMailbox *
 						     mailbox, guint msgno,
 						     LibBalsaMailboxSearchIter
 						     * iter);
+static void
+libbalsa_mailbox_local_search_iter_free(LibBalsaMailboxSearchIter * iter);
 
 static void libbalsa_mailbox_local_set_threading(LibBalsaMailbox *mailbox,
 						 LibBalsaMailboxThreadingType
 						 thread_type);
+static gboolean libbalsa_mailbox_local_update_threading(LibBalsaMailbox *
+                                                        mailbox);
+static void lbml_threading_free(LibBalsaMailboxLocal * local);
+static void lbml_threading_info_cached(LibBalsaMailboxLocal * local,
+                                       guint msgno);
 static void lbm_local_update_view_filter(LibBalsaMailbox * mailbox,
                                          LibBalsaCondition *view_filter);
 
@@ -149,10 +161,14 @@ libbalsa_mailbox_local_class_init(LibBalsaMailboxLocalClass * klass)
 	libbalsa_mailbox_local_close_mailbox;
     libbalsa_mailbox_class->get_message =
 	libbalsa_mailbox_local_get_message;
+    libbalsa_mailbox_class->search_iter_free =
+        libbalsa_mailbox_local_search_iter_free;
     libbalsa_mailbox_class->message_match = 
         libbalsa_mailbox_local_message_match;
     libbalsa_mailbox_class->set_threading =
 	libbalsa_mailbox_local_set_threading;
+    libbalsa_mailbox_class->update_threading =
+        libbalsa_mailbox_local_update_threading;
     libbalsa_mailbox_class->update_view_filter =
         lbm_local_update_view_filter;
     libbalsa_mailbox_class->prepare_threading =
@@ -183,6 +199,13 @@ libbalsa_mailbox_local_init(LibBalsaMailboxLocal * mailbox)
     mailbox->sync_cnt  = 0;
     mailbox->thread_id = 0;
     mailbox->save_tree_id = 0;
+    mailbox->jwz_info = NULL;
+    mailbox->id_chunk = NULL;
+    mailbox->id_atoms = NULL;
+    mailbox->ref_atoms = NULL;
+    mailbox->text_index = NULL;
+    mailbox->index_bodies_id = 0;
+    mailbox->index_bodies_from = 0;
 }
 
 GObject *
@@ -302,13 +325,12 @@ lbm_local_get_message_with_msg_info(LibBalsaMailboxLocal * local,
     lbml_add_message_to_pool(local, message);
 }
 
-static gboolean message_match_real(LibBalsaMailbox * mailbox, guint msgno,
-                                   LibBalsaCondition * cond);
 static void
 libbalsa_mailbox_local_load_message(LibBalsaMailboxLocal * local,
                                     GNode ** sibling, guint msgno,
                                     LibBalsaMailboxLocalMessageInfo *
-                                    msg_info)
+                                    msg_info,
+                                    LibBalsaMailboxSearchIter * iter_view)
 {
     LibBalsaMailbox *mbx = LIBBALSA_MAILBOX(local);
     gboolean match;
@@ -332,36 +354,82 @@ libbalsa_mailbox_local_load_message(LibBalsaMailboxLocal * local,
         }
     }
 
-    if (!mbx->view_filter)
+    if (!iter_view)
         match = TRUE;
-    else if (!libbalsa_condition_is_flag_only(mbx->view_filter,
+    else if (!libbalsa_condition_is_flag_only(iter_view->condition,
                                               mbx, msgno, &match))
-        match = message_match_real(mbx, msgno, mbx->view_filter);
+        match = libbalsa_mailbox_local_message_match(mbx, msgno, iter_view);
 
     if (match)
         libbalsa_mailbox_msgno_inserted(mbx, msgno, mbx->msg_tree,
                                         sibling);
 }
 
-/* Threading info. */
+/* Threading info; the message-id and References are atoms from the
+ * mailbox's pool, and the strings belong to the pool too. */
 typedef struct {
-    gchar *message_id;
-    GList *refs_for_threading;
-    gchar *sender;
+    guint message_id;           /* 0 if the message has none */
+    guint refs;                 /* offset of References in ref_atoms */
+    guint n_refs;
+    const gchar *sender;
 } LibBalsaMailboxLocalInfo;
 
+#define LBM_LOCAL_INFO_REFS(local, info) \
+    (&g_array_index((local)->ref_atoms, guint, (info)->refs))
+
 static void
 lbm_local_free_info(LibBalsaMailboxLocalInfo * info)
 {
-    if (info) {
-        g_free(info->message_id);
-        g_list_foreach(info->refs_for_threading, (GFunc) g_free, NULL);
-        g_list_free(info->refs_for_threading);
-        g_free(info->sender);
-        g_free(info);
+    if (info)
+        g_slice_free(LibBalsaMailboxLocalInfo, info);
+}
+
+/* The pool is created on first use and lives until the mailbox is
+ * closed; the References of expunged messages stay in ref_atoms until
+ * then. */
+static void
+lbm_local_init_pool(LibBalsaMailboxLocal * local)
+{
+    if (!local->id_chunk) {
+        local->id_chunk = g_string_chunk_new(4096);
+        local->id_atoms = g_hash_table_new(g_str_hash, g_str_equal);
+        local->ref_atoms = g_array_new(FALSE, FALSE, sizeof(guint));
     }
 }
 
+static void
+lbm_local_free_pool(LibBalsaMailboxLocal * local)
+{
+    if (local->id_chunk) {
+        g_hash_table_destroy(local->id_atoms);
+        g_string_chunk_free(local->id_chunk);
+        g_array_free(local->ref_atoms, TRUE);
+        local->id_atoms = NULL;
+        local->id_chunk = NULL;
+        local->ref_atoms = NULL;
+    }
+}
+
+/* Atoms are numbered from 1, in the order the ids were first seen. */
+static guint
+lbm_local_intern(LibBalsaMailboxLocal * local, const gchar * id)
+{
+    gpointer atom;
+    gchar *str;
+
+    if (!id)
+        return 0;
+
+    atom = g_hash_table_lookup(local->id_atoms, id);
+    if (!atom) {
+        str = g_string_chunk_insert(local->id_chunk, id);
+        atom = GUINT_TO_POINTER(g_hash_table_size(local->id_atoms) + 1);
+        g_hash_table_insert(local->id_atoms, str, atom);
+    }
+
+    return GPOINTER_TO_UINT(atom);
+}
+
 static void
 libbalsa_mailbox_local_finalize(GObject * object)
 {
@@ -391,6 +459,11 @@ libbalsa_mailbox_local_finalize(GObject * object)
 	g_ptr_array_free(ml->threading_info, TRUE);
 	ml->threading_info = NULL;
     }
+    lbm_local_free_pool(ml);
+    libbalsa_mailbox_local_unwatch(ml);
+
+    libbalsa_text_index_free(ml->text_index);
+    ml->text_index = NULL;
 
     if (G_OBJECT_CLASS(parent_class)->finalize)
 	G_OBJECT_CLASS(parent_class)->finalize(object);
@@ -711,6 +784,187 @@ lbm_local_queue_save_tree(LibBalsaMailboxLocal * local)
  * End of save and restore the message tree.
  */
 
+/*
+ * The full-text index, saved next to the tree.
+ */
+
+static gchar *
+lbm_local_get_index_filename(LibBalsaMailboxLocal * local)
+{
+    gchar *filename = lbm_local_get_cache_filename(local);
+    gchar *index_filename = g_strconcat(filename, ".index", NULL);
+
+    g_free(filename);
+
+    return index_filename;
+}
+
+static LibBalsaTextIndex *
+lbm_local_get_text_index(LibBalsaMailboxLocal * local)
+{
+    gchar *filename;
+
+    if (local->text_index)
+        return local->text_index;
+
+    /* The saved index is keyed by message, so it is still good after
+     * mail was added or removed; msgnos are bound to it as the
+     * messages are indexed. */
+    filename = lbm_local_get_index_filename(local);
+    local->text_index = libbalsa_text_index_load(filename, NULL);
+    if (!local->text_index)
+        local->text_index = libbalsa_text_index_new();
+    g_free(filename);
+
+    return local->text_index;
+}
+
+static void
+lbm_local_save_text_index(LibBalsaMailboxLocal * local)
+{
+    gchar *filename;
+    GError *err = NULL;
+
+    if (!local->text_index
+        || !libbalsa_text_index_is_dirty(local->text_index))
+        return;
+
+    filename = lbm_local_get_index_filename(local);
+    if (!libbalsa_text_index_save(local->text_index, filename,
+                                  libbalsa_mailbox_total_messages
+                                  (LIBBALSA_MAILBOX(local)), &err)) {
+        libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                             _("Failed to save cache file \"%s\": %s."),
+                             filename, err->message);
+        g_error_free(err);
+    }
+    g_free(filename);
+}
+
+/* A message is indexed under its Message-ID and date, which stay the
+ * same when other messages come and go; one without a Message-ID is
+ * not indexed. */
+static gchar *
+lbm_local_index_key(LibBalsaMessage * message)
+{
+    return message->message_id ?
+        g_strdup_printf("%s %ld", message->message_id,
+                        (long) message->headers->date) : NULL;
+}
+
+/* Index the From, Subject and body text that the search code uses;
+ * the message has been cached. */
+static void
+lbm_local_index_message(LibBalsaMailboxLocal * local, guint msgno,
+                        LibBalsaMessage * message)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(local);
+    LibBalsaTextIndex *index = lbm_local_get_text_index(local);
+    LibBalsaMailboxIndexEntry *entry;
+    LibBalsaMailboxLocalInfo *info;
+    gchar *key;
+    GString *body;
+
+    key = lbm_local_index_key(message);
+    libbalsa_text_index_bind(index, msgno, key);
+    g_free(key);
+
+    if ((entry = libbalsa_mailbox_index_get(mailbox, msgno)))
+        libbalsa_text_index_add(index, msgno, CONDITION_MATCH_SUBJECT,
+                                entry->subject);
+
+    info = local->threading_info && msgno <= local->threading_info->len ?
+        g_ptr_array_index(local->threading_info, msgno - 1) : NULL;
+    if (info)
+        libbalsa_text_index_add(index, msgno, CONDITION_MATCH_FROM,
+                                info->sender);
+
+    if (libbalsa_text_index_has(index, msgno, CONDITION_MATCH_BODY)
+        || !libbalsa_message_body_ref(message, FALSE, FALSE))
+        return;
+
+    body = content2reply(message->body_list, NULL, 0, FALSE, FALSE);
+    libbalsa_text_index_add(index, msgno, CONDITION_MATCH_BODY,
+                            body ? body->str : NULL);
+    if (body)
+        g_string_free(body, TRUE);
+    libbalsa_message_body_unref(message);
+}
+
+/* Messages are indexed in a thread, one at a time under the mailbox
+ * lock, starting from the first message that the loader queued, so
+ * that opening a mailbox or loading new mail does not wait for the
+ * text.  Each message is loaded once per session to find its key;
+ * those that were indexed in an earlier session are not read again. */
+static void
+lbm_local_index_bodies_real(LibBalsaMailboxLocal * local)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(local);
+
+    for (;;) {
+        guint msgno;
+        LibBalsaMessage *message;
+
+        libbalsa_lock_mailbox(mailbox);
+        msgno = local->index_bodies_from;
+        if (!MAILBOX_OPEN(mailbox) || msgno == 0
+            || msgno > libbalsa_mailbox_total_messages(mailbox)) {
+            local->index_bodies_from = 0;
+            libbalsa_unlock_mailbox(mailbox);
+            break;
+        }
+        local->index_bodies_from++;
+
+        if (!libbalsa_text_index_has(lbm_local_get_text_index(local),
+                                     msgno, CONDITION_MATCH_BODY)
+            && (message = libbalsa_mailbox_get_message(mailbox, msgno))) {
+            libbalsa_mailbox_local_cache_message(local, msgno, message);
+            lbm_local_index_message(local, msgno, message);
+            g_object_unref(message);
+        }
+        libbalsa_unlock_mailbox(mailbox);
+    }
+
+    g_object_unref(local);
+}
+
+static gboolean
+lbm_local_index_bodies_idle(LibBalsaMailboxLocal * local)
+{
+#ifdef BALSA_USE_THREADS
+    pthread_t index_thread;
+#endif                          /* BALSA_USE_THREADS */
+
+    local->index_bodies_id = 0;
+#ifdef BALSA_USE_THREADS
+    pthread_create(&index_thread, NULL,
+                   (void *) lbm_local_index_bodies_real, local);
+    pthread_detach(index_thread);
+#else                           /* BALSA_USE_THREADS */
+    lbm_local_index_bodies_real(local);
+#endif                          /* BALSA_USE_THREADS */
+
+    return FALSE;
+}
+
+static void
+lbm_local_queue_index(LibBalsaMailboxLocal * local, guint msgno)
+{
+    if (!local->index_bodies_from || msgno < local->index_bodies_from)
+        local->index_bodies_from = msgno;
+    if (!local->index_bodies_id) {
+        g_object_ref(local);
+        local->index_bodies_id =
+            g_idle_add_full(G_PRIORITY_LOW,
+                            (GSourceFunc) lbm_local_index_bodies_idle,
+                            local, NULL);
+    }
+}
+
+/*
+ * End of the full-text index.
+ */
+
 static void
 libbalsa_mailbox_local_close_mailbox(LibBalsaMailbox * mailbox,
                                      gboolean expunge)
@@ -724,6 +978,8 @@ libbalsa_mailbox_local_close_mailbox(LibBalsaMailbox * mailbox,
         local->sync_id = 0;
     }
 
+    libbalsa_mailbox_local_unwatch(local);
+
     /* Restore the persistent view before saving the tree. */
     libbalsa_mailbox_set_view_filter(mailbox,
                                      mailbox->persistent_view_filter, TRUE);
@@ -744,6 +1000,15 @@ libbalsa_mailbox_local_close_mailbox(LibBalsaMailbox * mailbox,
     }
     lbm_local_save_tree(local);
 
+    if (local->index_bodies_id) {
+        /* Messages that were not indexed will be on the next open. */
+        g_source_remove(local->index_bodies_id);
+        local->index_bodies_id = 0;
+        g_object_unref(local);
+    }
+    local->index_bodies_from = 0;
+
+    lbml_threading_free(local);
     if (local->threading_info) {
 	/* Free the memory owned by local->threading_info, but neither
 	 * free nor truncate the array. */
@@ -754,6 +1019,7 @@ libbalsa_mailbox_local_close_mailbox(LibBalsaMailbox * mailbox,
             *entry = NULL;
         }
     }
+    lbm_local_free_pool(local);
 
     for (item = &local->message_pool[0];
          item < &local->message_pool[LBML_POOL_SIZE]; item++) {
@@ -768,6 +1034,11 @@ libbalsa_mailbox_local_close_mailbox(LibBalsaMailbox * mailbox,
     if (LIBBALSA_MAILBOX_CLASS(parent_class)->close_mailbox)
         LIBBALSA_MAILBOX_CLASS(parent_class)->close_mailbox(mailbox,
                                                             expunge);
+
+    /* Save the index after any expunge on closing has renumbered it. */
+    lbm_local_save_text_index(local);
+    libbalsa_text_index_free(local->text_index);
+    local->text_index = NULL;
 }
 
 /* LibBalsaMailbox get_message class method */
@@ -796,16 +1067,17 @@ libbalsa_mailbox_local_get_message(LibBalsaMailbox * mailbox, guint msgno)
 
 static gboolean
 message_match_real(LibBalsaMailbox *mailbox, guint msgno,
-                   LibBalsaCondition *cond)
+                   LibBalsaConditionProgram *program)
 {
     LibBalsaMailboxLocal *local = (LibBalsaMailboxLocal *) mailbox;
+    LibBalsaConditionMatchData md = { NULL };
+    LibBalsaMailboxIndexEntry *entry;
+    LibBalsaMailboxLocalInfo *info;
     LibBalsaMessage *message = NULL;
-    gboolean match = FALSE;
-    gboolean is_refed = FALSE;
-    LibBalsaMailboxIndexEntry *entry =
-        g_ptr_array_index(mailbox->mindex, msgno-1);
-    LibBalsaMailboxLocalInfo *info =
-        msgno <= local->threading_info->len ?
+    gboolean match;
+
+    entry = libbalsa_mailbox_index_get(mailbox, msgno);
+    info = msgno <= local->threading_info->len ?
         g_ptr_array_index(local->threading_info, msgno - 1) : NULL;
 
     /* We may be able to match the msgno from info cached in entry or
@@ -816,149 +1088,94 @@ message_match_real(LibBalsaMailbox *mailbox, guint msgno,
         if (!message)
             return FALSE;
         libbalsa_mailbox_local_cache_message(local, msgno, message);
-        entry = g_ptr_array_index(mailbox->mindex, msgno-1);
+        entry = libbalsa_mailbox_index_get(mailbox, msgno);
         info  = g_ptr_array_index(local->threading_info, msgno - 1);
     }
 
-#if defined(BALSA_USE_THREADS)
-    if (entry->idle_pending)
-        return FALSE;   /* Can't match. */
-#endif                  /* defined(BALSA_USE_THREADS) */
-
-    switch (cond->type) {
-    case CONDITION_STRING:
-        if (CONDITION_CHKMATCH(cond, (CONDITION_MATCH_TO |
-                                      CONDITION_MATCH_CC |
-                                      CONDITION_MATCH_BODY))) {
-            if (!message)
-                message = libbalsa_mailbox_get_message(mailbox, msgno);
-            if (!message)
-                return FALSE;
-            is_refed = libbalsa_message_body_ref(message, FALSE, FALSE);
-            if (!is_refed) {
-                libbalsa_information(LIBBALSA_INFORMATION_ERROR,
-                                     _("Unable to load message body to "
-                                       "match filter"));
-                g_object_unref(message);
-                return FALSE;   /* We don't want to match if an error occurred */
-            }
-        }
-
-        /* do the work */
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_TO)) {
-            g_assert(is_refed);
-            if (message->headers->to_list) {
-                gchar *str =
-                    internet_address_list_to_string(message->headers->
-                                                    to_list, FALSE);
-                match =
-                    libbalsa_utf8_strstr(str, cond->match.string.string);
-                g_free(str);
-                if (match)
-                    break;
-            }
-	}
-        if (CONDITION_CHKMATCH(cond, CONDITION_MATCH_FROM)) {
-	    if (libbalsa_utf8_strstr(info->sender,
-                                     cond->match.string.string)) { 
-                match = TRUE;
-                break;
-            }
-        }
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_SUBJECT)) {
-	    if (libbalsa_utf8_strstr(entry->subject,
-                                     cond->match.string.string)) { 
-                match = TRUE;
-                break;
-            }
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_CC)) {
-            g_assert(is_refed);
-            if (message->headers->cc_list) {
-                gchar *str =
-                    internet_address_list_to_string(message->headers->
-                                                    cc_list, FALSE);
-                match =
-                    libbalsa_utf8_strstr(str, cond->match.string.string);
-                g_free(str);
-                if (match)
-                    break;
-            }
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_US_HEAD)) {
-            if (cond->match.string.user_header) {
-                const gchar *header;
-
-                if (!message)
-                    message = libbalsa_mailbox_get_message(mailbox, msgno);
-                if (!message)
-                    return FALSE;
-                header =
-                    libbalsa_message_get_user_header(message,
-                                                     cond->match.string.
-                                                     user_header);
-                if (libbalsa_utf8_strstr(header,
-                                         cond->match.string.string)) {
-                    match = TRUE;
-                    break;
-                }
-            }
-	}
-	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_BODY)) {
-            GString *body;
-            g_assert(is_refed);
-	    if (!message->mailbox) {
-                /* No need to body-unref */
-                g_object_unref(message);
-		return FALSE; /* We don't want to match if an error occurred */
-            }
-            body = content2reply(message->body_list, NULL, 0, FALSE, FALSE);
-	    if (body) {
-		if (body->str)
-                    match = libbalsa_utf8_strstr(body->str,
-                                                 cond->match.string.string);
-		g_string_free(body,TRUE);
-	    }
-	}
-	break;
-    case CONDITION_REGEX:
-        break;
-    case CONDITION_DATE:
-        match = 
-            entry->msg_date >= cond->match.date.date_low &&
-            (cond->match.date.date_high==0 || 
-             entry->msg_date<=cond->match.date.date_high);
-        break;
-    case CONDITION_FLAG:
-        match = libbalsa_mailbox_msgno_has_flags(mailbox, msgno,
-                                                 cond->match.flags, 0);
-        break;
-    case CONDITION_AND:
-        match =
-            message_match_real(mailbox, msgno, cond->match.andor.left) &&
-            message_match_real(mailbox, msgno, cond->match.andor.right);
-        break;
-    case CONDITION_OR:
-        match =
-            message_match_real(mailbox, msgno, cond->match.andor.left) ||
-            message_match_real(mailbox, msgno, cond->match.andor.right);
-        break;
-    /* To avoid warnings */
-    case CONDITION_NONE:
-        break;
+    if (!entry)
+        match = FALSE;   /* Can't match. */
+    else {
+        md.message = message;
+        md.mailbox = mailbox;
+        md.msgno = msgno;
+        md.subject = entry->subject;
+        md.sender = info ? info->sender : NULL;
+        match = libbalsa_condition_program_run(program, &md);
+        libbalsa_condition_match_data_clear(&md);
     }
-    if(message) {
-        if(is_refed) libbalsa_message_body_unref(message);
+
+    if (message)
         g_object_unref(message);
-    }
-    return cond->negate ? !match : match;
+
+    return match;
 }
+/* The condition is compiled the first time the iter is used with a
+ * local mailbox; the program is kept in iter->user_data, with the
+ * messages that the full-text index says may match. */
+typedef struct {
+    LibBalsaConditionProgram *program;
+    guint8 *candidates;         /* NULL if all messages may match */
+    guint n_candidates;
+    guint index_stamp;
+} LbmlSearchData;
+
 static gboolean
 libbalsa_mailbox_local_message_match(LibBalsaMailbox * mailbox,
 				     guint msgno,
 				     LibBalsaMailboxSearchIter * iter)
 {
-    return message_match_real(mailbox, msgno, iter->condition);
+    LibBalsaMailboxLocal *local = (LibBalsaMailboxLocal *) mailbox;
+    LibBalsaTextIndex *index;
+    LbmlSearchData *data;
+
+    if (iter->mailbox != mailbox) {
+        if (iter->mailbox
+            && LIBBALSA_MAILBOX_GET_CLASS(iter->mailbox)->search_iter_free)
+            LIBBALSA_MAILBOX_GET_CLASS(iter->mailbox)->
+                search_iter_free(iter);
+        iter->mailbox = mailbox;
+    }
+
+    index = lbm_local_get_text_index(local);
+    data = iter->user_data;
+    if (!data) {
+        iter->user_data = data = g_new0(LbmlSearchData, 1);
+        data->program = libbalsa_condition_compile(iter->condition);
+    } else if (data->index_stamp != libbalsa_text_index_get_stamp(index)) {
+        /* Messages were expunged and renumbered. */
+        g_free(data->candidates);
+        data->candidates = NULL;
+        data->n_candidates = 0;
+    }
+    if (!data->candidates && data->n_candidates == 0) {
+        data->n_candidates = libbalsa_mailbox_total_messages(mailbox);
+        data->candidates =
+            libbalsa_text_index_candidates(index, iter->condition,
+                                           data->n_candidates);
+        data->index_stamp = libbalsa_text_index_get_stamp(index);
+    }
+
+    /* Messages that arrived later were not indexed, so they are always
+     * candidates. */
+    if (data->candidates && msgno <= data->n_candidates
+        && !data->candidates[msgno - 1])
+        return FALSE;
+
+    return message_match_real(mailbox, msgno, data->program);
+}
+
+static void
+libbalsa_mailbox_local_search_iter_free(LibBalsaMailboxSearchIter * iter)
+{
+    LbmlSearchData *data = iter->user_data;
+
+    if (data) {
+        libbalsa_condition_program_free(data->program);
+        g_free(data->candidates);
+        g_free(data);
+        iter->user_data = NULL;
+    }
+    /* iter->condition and iter are freed in the LibBalsaMailbox method. */
 }
 
 /*
@@ -978,6 +1195,8 @@ libbalsa_mailbox_local_cache_message(LibBalsaMailboxLocal * local,
 {
     gpointer *entry;
     LibBalsaMailboxLocalInfo *info;
+    GList *refs, *l;
+    gchar *sender;
 
     if (!message)
         return;
@@ -995,17 +1214,29 @@ libbalsa_mailbox_local_cache_message(LibBalsaMailboxLocal * local,
     if (*entry)
         return;
 
-    *entry = info = g_new(LibBalsaMailboxLocalInfo, 1);
-    info->message_id = g_strdup(message->message_id);
-    info->refs_for_threading =
-        libbalsa_message_refs_for_threading(message);
+    lbm_local_init_pool(local);
+    *entry = info = g_slice_new(LibBalsaMailboxLocalInfo);
+    info->message_id = lbm_local_intern(local, message->message_id);
+
+    refs = libbalsa_message_refs_for_threading(message);
+    info->refs = local->ref_atoms->len;
+    info->n_refs = 0;
+    for (l = refs; l; l = l->next) {
+        guint atom = lbm_local_intern(local, l->data);
+        g_array_append_val(local->ref_atoms, atom);
+        info->n_refs++;
+        g_free(l->data);
+    }
+    g_list_free(refs);
+
+    sender = message->headers->from ?
+        internet_address_list_to_string(message->headers->from, FALSE) :
+        NULL;
+    info->sender =
+        g_string_chunk_insert_const(local->id_chunk, sender ? sender : "");
+    g_free(sender);
 
-    info->sender = NULL;
-    if (message->headers->from)
-        info->sender =
-            internet_address_list_to_string(message->headers->from, FALSE);
-    if (!info->sender)
-        info->sender = g_strdup("");
+    lbml_threading_info_cached(local, msgno);
 }
 
 void
@@ -1018,6 +1249,7 @@ libbalsa_mailbox_local_load_messages(LibBalsaMailbox *mailbox,
     GNode *lastn;
     LibBalsaMailboxLocalMessageInfo *(*get_info) (LibBalsaMailboxLocal *,
                                                   guint);
+    LibBalsaMailboxSearchIter *iter_view;
 
     g_return_if_fail(LIBBALSA_IS_MAILBOX_LOCAL(mailbox));
 
@@ -1034,15 +1266,22 @@ libbalsa_mailbox_local_load_messages(LibBalsaMailbox *mailbox,
     new_messages = lastno - msgno;
     lastn = g_node_last_child(mailbox->msg_tree);
     get_info = LIBBALSA_MAILBOX_LOCAL_GET_CLASS(local)->get_info;
+    /* The view filter is compiled once for the whole batch. */
+    iter_view = libbalsa_mailbox_search_iter_view(mailbox);
     while (++msgno <= lastno){
         LibBalsaMailboxLocalMessageInfo *msg_info = get_info(local, msgno);
 
-	libbalsa_mailbox_local_load_message(local, &lastn, msgno, msg_info);
+	libbalsa_mailbox_local_load_message(local, &lastn, msgno, msg_info,
+                                            iter_view);
 
 	if (msg_info->message)
             libbalsa_mailbox_local_cache_message(local, msgno,
                                                  msg_info->message);
     }
+    /* The new messages are indexed in the background. */
+    if (new_messages > 0)
+        lbm_local_queue_index(local, lastno - new_messages + 1);
+    libbalsa_mailbox_search_iter_free(iter_view);
 
     gdk_threads_leave();
 
@@ -1059,6 +1298,7 @@ libbalsa_mailbox_local_load_messages(LibBalsaMailbox *mailbox,
  */
 
 static void lbml_threading_jwz(LibBalsaMailbox * mailbox);
+static gboolean lbml_threading_jwz_update(LibBalsaMailbox * mailbox);
 static void lbml_threading_simple(LibBalsaMailbox * mailbox,
 				  LibBalsaMailboxThreadingType th_type);
 
@@ -1093,6 +1333,10 @@ libbalsa_mailbox_local_set_threading(LibBalsaMailbox * mailbox,
             total = 0;
         }
         mailbox->msg_tree_changed = FALSE;
+        /* Messages restored from the cache were not loaded, so they
+         * are indexed in the background too. */
+        if (total > 0)
+            lbm_local_queue_index(local, 1);
 
         if (total < libbalsa_mailbox_total_messages(mailbox)) {
             if (!natural)
@@ -1118,6 +1362,7 @@ libbalsa_mailbox_local_set_threading(LibBalsaMailbox * mailbox,
         break;
     case LB_MAILBOX_THREADING_FLAT:
     case LB_MAILBOX_THREADING_SIMPLE:
+        lbml_threading_free(local);
         lbml_threading_simple(mailbox, thread_type);
         break;
     }
@@ -1129,21 +1374,69 @@ libbalsa_mailbox_local_set_threading(LibBalsaMailbox * mailbox,
     lbm_local_queue_save_tree(local);
 }
 
+/* The update-threading method: only JWZ threading keeps the tables it
+ * needs to thread new messages without starting over. The gdk lock is
+ * held. */
+static gboolean
+libbalsa_mailbox_local_update_threading(LibBalsaMailbox * mailbox)
+{
+    if (libbalsa_mailbox_get_threading_type(mailbox) !=
+        LB_MAILBOX_THREADING_JWZ
+        || !lbml_threading_jwz_update(mailbox))
+        return FALSE;
+
+    lbm_local_queue_save_tree(LIBBALSA_MAILBOX_LOCAL(mailbox));
+
+    return TRUE;
+}
+
+/* seqnos holds the expunged msgnos in ascending order. */
 void
-libbalsa_mailbox_local_msgno_removed(LibBalsaMailbox * mailbox,
-				     guint msgno)
+libbalsa_mailbox_local_msgnos_removed(LibBalsaMailbox * mailbox,
+                                      GArray * seqnos)
 {
     LibBalsaMailboxLocal *local = LIBBALSA_MAILBOX_LOCAL(mailbox);
 
+    /* The msgnos in the JWZ tables are now stale. */
+    lbml_threading_free(local);
+
     /* local might not have a threading-info array, and even if it does,
-     * it might not be populated; we check both. */
-    if (local->threading_info && msgno <= local->threading_info->len) {
-	lbm_local_free_info(g_ptr_array_index(local->threading_info,
-			                      msgno - 1));
-	g_ptr_array_remove_index(local->threading_info, msgno - 1);
+     * it might not be populated; only the entries it has are dropped,
+     * and the rest are moved down in one pass. */
+    if (local->threading_info) {
+        GPtrArray *info = local->threading_info;
+        guint i, j, k;
+
+        for (i = j = k = 0; i < info->len; i++) {
+            while (k < seqnos->len
+                   && g_array_index(seqnos, guint, k) < i + 1)
+                k++;
+            if (k < seqnos->len && g_array_index(seqnos, guint, k) == i + 1)
+                lbm_local_free_info(g_ptr_array_index(info, i));
+            else
+                g_ptr_array_index(info, j++) = g_ptr_array_index(info, i);
+        }
+        g_ptr_array_set_size(info, j);
     }
 
-    libbalsa_mailbox_msgno_removed(mailbox, msgno);
+    if (local->text_index)
+        libbalsa_text_index_msgnos_removed(local->text_index, seqnos);
+    /* Indexing goes on from the first renumbered message. */
+    if (local->index_bodies_from > g_array_index(seqnos, guint, 0))
+        local->index_bodies_from = g_array_index(seqnos, guint, 0);
+
+    libbalsa_mailbox_msgnos_removed(mailbox, seqnos);
+}
+
+void
+libbalsa_mailbox_local_msgno_removed(LibBalsaMailbox * mailbox,
+				     guint msgno)
+{
+    GArray *seqnos = g_array_sized_new(FALSE, FALSE, sizeof(guint), 1);
+
+    g_array_append_val(seqnos, msgno);
+    libbalsa_mailbox_local_msgnos_removed(mailbox, seqnos);
+    g_array_free(seqnos, TRUE);
 }
 
 static void
@@ -1223,7 +1516,8 @@ lbm_local_thread_idle(LibBalsaMailboxLocal * local)
         LibBalsaMailboxThreadingType cur_type =
             libbalsa_mailbox_get_threading_type(mailbox);
 
-        libbalsa_mailbox_set_threading(mailbox, cur_type);
+        if (!libbalsa_mailbox_update_threading(mailbox))
+            libbalsa_mailbox_set_threading(mailbox, cur_type);
     }
     local->thread_id = 0;
 
@@ -1367,9 +1661,16 @@ struct _ThreadingInfo {
     GHashTable *subject_table;
     GSList *unthreaded;
     LibBalsaMailboxThreadingType type;
+    guint threaded;             /* JWZ: msgnos up to this one are in the
+                                 * tables */
 };
 typedef struct _ThreadingInfo ThreadingInfo;
 
+/* Value in the kept JWZ id_table for a message-id that threaded
+ * messages refer to, but that has no message. */
+static gchar lbml_missing;
+#define LBML_MISSING ((GNode *) &lbml_missing)
+
 static gboolean lbml_set_parent(GNode * node, ThreadingInfo * ti);
 static GNode *lbml_insert_node(GNode * node,
                                LibBalsaMailboxLocalInfo * info,
@@ -1389,9 +1690,10 @@ static void
 lbml_info_setup(LibBalsaMailbox * mailbox, ThreadingInfo * ti)
 {
     ti->mailbox = mailbox;
-    ti->root = g_node_new(mailbox->msg_tree);
-    ti->id_table = g_hash_table_new(g_str_hash, g_str_equal);
+    ti->root = g_node_new(NULL);
+    ti->id_table = g_hash_table_new(NULL, NULL);
     ti->subject_table = NULL;
+    ti->threaded = 0;
     ti->unthreaded =
         g_object_get_data(G_OBJECT(mailbox), LIBBALSA_MAILBOX_UNTHREADED);
 }
@@ -1405,44 +1707,121 @@ lbml_info_free(ThreadingInfo * ti)
     g_node_destroy(ti->root);
 }
 
+static void
+lbml_threading_free(LibBalsaMailboxLocal * local)
+{
+    if (local->jwz_info) {
+        lbml_info_free(local->jwz_info);
+        g_free(local->jwz_info);
+        local->jwz_info = NULL;
+    }
+}
+
+/* The JWZ run skipped messages without threading info; when one that
+ * it should have seen gets its info, the kept tables are incomplete,
+ * and the next threading must be a full one. */
+static void
+lbml_threading_info_cached(LibBalsaMailboxLocal * local, guint msgno)
+{
+    if (local->jwz_info && msgno <= local->jwz_info->threaded)
+        lbml_threading_free(local);
+}
+
+#ifndef MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT
+static void
+lbml_collect_missing(gpointer id, GNode * node, GSList ** missing)
+{
+    if (!node->data)
+        *missing = g_slist_prepend(*missing, id);
+}
+
+/* Prune will destroy the empty containers, but we keep their ids. */
+static void
+lbml_mark_missing(ThreadingInfo * ti)
+{
+    GSList *missing = NULL, *l;
+
+    g_hash_table_foreach(ti->id_table, (GHFunc) lbml_collect_missing,
+                         &missing);
+    for (l = missing; l; l = l->next)
+        g_hash_table_insert(ti->id_table, l->data, LBML_MISSING);
+    g_slist_free(missing);
+}
+#endif				/* MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT */
+
 static void
 lbml_threading_jwz(LibBalsaMailbox * mailbox)
 {
     /* This implementation of JWZ's algorithm uses a second tree, rooted
-     * at ti.root, for the message IDs.  Each node in the second tree
-     * that corresponds to a real message has a pointer to the
-     * corresponding msg_tree node in its data field.  Nodes in the
-     * mailbox's msg_tree have names beginning with msg_; all other
-     * GNodes are in the second tree.  The ti.id_table maps message-id
-     * to a node in the second tree. */
-    ThreadingInfo ti;
+     * at ti->root, for the message IDs.  Each node in the second tree
+     * that corresponds to a real message has its msgno in its data
+     * field.  Nodes in the mailbox's msg_tree have names beginning with
+     * msg_; all other GNodes are in the second tree.  The ti->id_table
+     * maps message-id to a node in the second tree.
+     *
+     * The second tree and its tables are kept in local->jwz_info, so
+     * that lbml_threading_jwz_update can thread new messages without
+     * starting over. */
+    LibBalsaMailboxLocal *local = LIBBALSA_MAILBOX_LOCAL(mailbox);
+    ThreadingInfo *ti;
 
-    lbml_info_setup(mailbox, &ti);
+    lbml_threading_free(local);
+    ti = g_new(ThreadingInfo, 1);
+    lbml_info_setup(mailbox, ti);
 
     /* Traverse the mailbox's msg_tree, to build the second tree. */
     g_node_traverse(mailbox->msg_tree, G_POST_ORDER, G_TRAVERSE_ALL, -1,
-		    (GNodeTraverseFunc) lbml_set_parent, &ti);
+		    (GNodeTraverseFunc) lbml_set_parent, ti);
+#ifndef MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT
+    lbml_mark_missing(ti);
+#endif				/* MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT */
     /* Prune the second tree. */
-    g_node_traverse(ti.root, G_POST_ORDER, G_TRAVERSE_ALL, -1,
-		    (GNodeTraverseFunc) lbml_prune, &ti);
+    g_node_traverse(ti->root, G_POST_ORDER, G_TRAVERSE_ALL, -1,
+		    (GNodeTraverseFunc) lbml_prune, ti);
 
     /* Do the evil subject gather and merge on the second tree. */
-    ti.subject_table = g_hash_table_new(g_str_hash, g_str_equal);
-    g_node_children_foreach(ti.root, G_TRAVERSE_ALL,
-			    (GNodeForeachFunc) lbml_subject_gather, &ti);
-    g_node_children_foreach(ti.root, G_TRAVERSE_ALL,
-			    (GNodeForeachFunc) lbml_subject_merge, &ti);
+    ti->subject_table =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_node_children_foreach(ti->root, G_TRAVERSE_ALL,
+			    (GNodeForeachFunc) lbml_subject_gather, ti);
+    g_node_children_foreach(ti->root, G_TRAVERSE_ALL,
+			    (GNodeForeachFunc) lbml_subject_merge, ti);
 
     /* Traverse the second tree and reparent corresponding nodes in the
      * mailbox's msg_tree. */
-    g_node_traverse(ti.root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-                    (GNodeTraverseFunc) lbml_construct, &ti);
+    g_node_traverse(ti->root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+                    (GNodeTraverseFunc) lbml_construct, ti);
 
 #ifdef MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT
-    lbml_clear_empty(ti.root);
+    lbml_clear_empty(ti->root);
+    lbml_info_free(ti);
+    g_free(ti);
+#else				/* MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT */
+    /* The merge moved some of the nodes in the subject table, so gather
+     * the root set once more for the new messages. */
+    g_hash_table_remove_all(ti->subject_table);
+    g_node_children_foreach(ti->root, G_TRAVERSE_ALL,
+			    (GNodeForeachFunc) lbml_subject_gather, ti);
+    ti->threaded = libbalsa_mailbox_total_messages(mailbox);
+    local->jwz_info = ti;
 #endif				/* MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT */
+}
 
-    lbml_info_free(&ti);
+/* Find the msg_tree node for a node in the second tree. */
+static GNode *
+lbml_msg_node(GNode * node, ThreadingInfo * ti)
+{
+    GPtrArray *msgno_2_msg_tree = ti->mailbox->msgno_2_msg_tree;
+    guint msgno;
+
+    if (node == ti->root)
+        return ti->mailbox->msg_tree;
+
+    msgno = GPOINTER_TO_UINT(node->data);
+    if (msgno == 0 || !msgno_2_msg_tree || msgno > msgno_2_msg_tree->len)
+        return NULL;
+
+    return g_ptr_array_index(msgno_2_msg_tree, msgno - 1);
 }
 
 static LibBalsaMailboxLocalInfo *
@@ -1561,12 +1940,13 @@ lbml_find_parent(LibBalsaMailboxLocalInfo * info, ThreadingInfo * ti)
 
     /* The root of the mailbox tree is the default parent. */
     GNode *parent = ti->root;
-    GList *reference;
+    LibBalsaMailboxLocal *local = LIBBALSA_MAILBOX_LOCAL(ti->mailbox);
+    guint *refs = LBM_LOCAL_INFO_REFS(local, info);
+    guint i;
     GHashTable *id_table = ti->id_table;
 
-    for (reference = info->refs_for_threading; reference;
-	 reference = reference->next) {
-	gchar *id = reference->data;
+    for (i = 0; i < info->n_refs; i++) {
+	gpointer id = GUINT_TO_POINTER(refs[i]);
 	GNode *foo = g_hash_table_lookup(id_table, id);
 
 	if (foo == NULL) {
@@ -1606,29 +1986,30 @@ lbml_insert_node(GNode * msg_node, LibBalsaMailboxLocalInfo * info,
     /* We'll make sure that we thread off a replied-to message, if there
      * is one. */
     GNode *node = NULL;
-    gchar *id = info->message_id;
+    gpointer id = GUINT_TO_POINTER(info->message_id);
     GHashTable *id_table = ti->id_table;
+    gpointer data = msg_node->data;
 
     if (id)
 	node = g_hash_table_lookup(id_table, id);
 
     if (node) {
-	GNode *prev_msg_node = node->data;
+	gpointer prev_data = node->data;
 	/* If this message has not been replied to, or if the container
 	 * is empty, store it in the container. If there was a message
 	 * in the container already, swap it with this one, otherwise
 	 * set the current one to NULL. */
-	if (!lbml_is_replied(msg_node, ti) || !prev_msg_node) {
-	    node->data = msg_node;
-	    msg_node = prev_msg_node;
+	if (!lbml_is_replied(msg_node, ti) || !prev_data) {
+	    node->data = data;
+	    data = prev_data;
 	}
     }
     /* If we already stored the message in a previously empty container,
-     * msg_node is NULL. If either the previous message or the current
-     * one has been replied to, msg_node now points to a replied-to
+     * data is NULL. If either the previous message or the current
+     * one has been replied to, data is now the msgno of a replied-to
      * message. */
-    if (msg_node)
-	node = g_node_new(msg_node);
+    if (data)
+	node = g_node_new(data);
 
     if (id)
 	g_hash_table_insert(id_table, id, node);
@@ -1672,7 +2053,7 @@ lbml_prune(GNode * node, ThreadingInfo * ti)
 static const gchar *
 lbml_get_subject(GNode * node, ThreadingInfo * ti)
 {
-    guint msgno = GPOINTER_TO_UINT(((GNode *) node->data)->data);
+    guint msgno = GPOINTER_TO_UINT(node->data);
     return libbalsa_mailbox_msgno_get_subject(ti->mailbox, msgno);
 }
 
@@ -1766,7 +2147,7 @@ lbml_subject_gather(GNode * node, ThreadingInfo * ti)
 #else				/* MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT */
     if (old == NULL) {
 #endif				/* MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT */
-	g_hash_table_insert(subject_table, (char *) chopped_subject,
+	g_hash_table_insert(subject_table, g_strdup(chopped_subject),
 			    node);
 	return;
     }
@@ -1775,7 +2156,7 @@ lbml_subject_gather(GNode * node, ThreadingInfo * ti)
 
     if (old_subject != lbml_chop_re(old_subject)
 	&& subject == chopped_subject)
-	g_hash_table_insert(subject_table, (gchar *) chopped_subject,
+	g_hash_table_insert(subject_table, g_strdup(chopped_subject),
 			    node);
 }
 
@@ -1891,8 +2272,8 @@ lbml_construct(GNode * node, ThreadingInfo * ti)
 {
     GNode *msg_node;
 
-    if (node->parent && (msg_node = node->data)) {
-        GNode *msg_parent = node->parent->data;
+    if (node->parent && (msg_node = lbml_msg_node(node, ti))) {
+        GNode *msg_parent = lbml_msg_node(node->parent, ti);
 
         if (msg_parent && msg_node->parent != msg_parent
             && !g_node_is_ancestor(msg_node, msg_parent))
@@ -1903,6 +2284,161 @@ lbml_construct(GNode * node, ThreadingInfo * ti)
     return FALSE;
 }
 
+/* Reparent the msg_tree node for node in the second tree, and remember
+ * its new parent for sorting. */
+static void
+lbml_update_place(GNode * node, ThreadingInfo * ti, GHashTable * parents)
+{
+    GNode *msg_node = lbml_msg_node(node, ti);
+    GNode *msg_parent = lbml_msg_node(node->parent, ti);
+
+    if (!msg_node || !msg_parent)
+        return;
+
+    if (msg_node->parent != msg_parent
+        && !g_node_is_ancestor(msg_node, msg_parent))
+        libbalsa_mailbox_unlink_and_prepend(ti->mailbox, msg_node,
+                                            msg_parent);
+    g_hash_table_insert(parents, msg_node->parent, msg_node->parent);
+}
+
+/* Subject gather and merge for a new message in the root set, as
+ * lbml_subject_gather and lbml_subject_merge do for the whole set. */
+static void
+lbml_update_subject(GNode * node, ThreadingInfo * ti, GHashTable * parents)
+{
+    const gchar *subject, *chopped_subject;
+    const gchar *subject2, *chopped_subject2;
+    GNode *node2;
+
+    subject = lbml_get_subject(node, ti);
+    if (subject == NULL)
+        return;
+    chopped_subject = lbml_chop_re(subject);
+    if (!strcmp(chopped_subject, _("(No subject)")))
+        return;
+
+    node2 = g_hash_table_lookup(ti->subject_table, chopped_subject);
+    if (node2 == NULL || node2->parent != ti->root) {
+        /* First one, or the old one is not in the root set any more. */
+        g_hash_table_insert(ti->subject_table, g_strdup(chopped_subject),
+                            node);
+        return;
+    }
+
+    subject2 = lbml_get_subject(node2, ti);
+    if (subject2 == NULL)
+        return;
+    chopped_subject2 = lbml_chop_re(subject2);
+
+    if (subject2 == chopped_subject2 && subject != chopped_subject)
+        /* Make node a child of node2. */
+        lbml_unlink_and_prepend(node, node2);
+    else if (subject2 != chopped_subject2 && subject == chopped_subject) {
+        /* Make node2 a child of node, which takes its place in the
+         * table. */
+        lbml_unlink_and_prepend(node2, node);
+        g_hash_table_insert(ti->subject_table, g_strdup(chopped_subject),
+                            node);
+        lbml_update_place(node2, ti, parents);
+    }
+}
+
+/* Thread the messages after ti->threaded into the kept tables; returns
+ * FALSE if the whole mailbox must be threaded again. A message that is
+ * not in the view, one that was expected by messages already threaded,
+ * and one with a message-id that we have already seen are all left to
+ * the full algorithm. */
+static gboolean
+lbml_threading_jwz_update(LibBalsaMailbox * mailbox)
+{
+    LibBalsaMailboxLocal *local = LIBBALSA_MAILBOX_LOCAL(mailbox);
+    ThreadingInfo *ti = local->jwz_info;
+    GHashTable *parents;
+    GSList *l;
+    guint total, msgno;
+    gboolean retval = TRUE;
+
+    if (!ti)
+        return FALSE;
+
+    total = libbalsa_mailbox_total_messages(mailbox);
+    if (total < ti->threaded)
+        return FALSE;
+
+    /* Messages that came back into the view need the full treatment. */
+    for (l = g_object_get_data(G_OBJECT(mailbox),
+                               LIBBALSA_MAILBOX_UNTHREADED); l; l = l->next)
+        if (GPOINTER_TO_UINT(l->data) <= ti->threaded)
+            return FALSE;
+
+    parents = g_hash_table_new(NULL, NULL);
+    for (msgno = ti->threaded + 1; msgno <= total; msgno++) {
+        GNode *node, *parent;
+        LibBalsaMailboxLocalInfo *info;
+        gpointer id;
+        guint *refs, i;
+
+        node = g_node_new(GUINT_TO_POINTER(msgno));
+        if (!lbml_msg_node(node, ti)) {
+            g_node_destroy(node);
+            retval = FALSE;
+            break;
+        }
+        info = lbml_get_info(node, ti);
+        if (!info) {
+            /* No headers yet: the message stays in the root set until
+             * the prepare-threading idle handler gets here. */
+            g_node_destroy(node);
+            g_hash_table_insert(parents, mailbox->msg_tree,
+                                mailbox->msg_tree);
+            break;
+        }
+        id = GUINT_TO_POINTER(info->message_id);
+        if (id && g_hash_table_lookup(ti->id_table, id)) {
+            g_node_destroy(node);
+            retval = FALSE;
+            break;
+        }
+        if (id)
+            g_hash_table_insert(ti->id_table, id, node);
+
+        /* The parent is the last message in References that we have;
+         * the ids that we do not have are remembered as missing. */
+        parent = ti->root;
+        refs = LBM_LOCAL_INFO_REFS(local, info);
+        for (i = info->n_refs; i > 0; i--) {
+            gpointer ref = GUINT_TO_POINTER(refs[i - 1]);
+            GNode *foo = g_hash_table_lookup(ti->id_table, ref);
+
+            if (!foo)
+                g_hash_table_insert(ti->id_table, ref, LBML_MISSING);
+            else if (foo != LBML_MISSING && foo != node
+                     && lbml_msg_node(foo, ti)) {
+                parent = foo;
+                break;
+            }
+        }
+        g_node_prepend(parent, node);
+
+        if (parent == ti->root)
+            lbml_update_subject(node, ti, parents);
+        lbml_update_place(node, ti, parents);
+        ti->threaded = msgno;
+    }
+
+    if (retval) {
+        GList *list = g_hash_table_get_keys(parents), *p;
+
+        for (p = list; p; p = p->next)
+            libbalsa_mailbox_sort_children(mailbox, p->data);
+        g_list_free(list);
+    }
+    g_hash_table_destroy(parents);
+
+    return retval;
+}
+
 
 #ifdef MAKE_EMPTY_CONTAINER_FOR_MISSING_PARENT
 static void
@@ -1960,7 +2496,8 @@ lbml_insert_message(GNode * node, ThreadingInfo * ti)
 	return FALSE;
 
     if (info->message_id)
-	g_hash_table_insert(ti->id_table, info->message_id, node);
+	g_hash_table_insert(ti->id_table,
+                            GUINT_TO_POINTER(info->message_id), node);
 
     return FALSE;
 }
@@ -1977,17 +2514,21 @@ lbml_thread_message(GNode * node, ThreadingInfo * ti)
                                                 ti->mailbox->msg_tree);
     } else {
         LibBalsaMailboxLocalInfo *info;
-        GList *refs;
         GNode *parent = NULL;
 
         info = lbml_get_info(node, ti);
         if (!info)
             return FALSE;
 
-        refs = info->refs_for_threading;
-        if (refs)
+        if (info->n_refs > 0) {
+            LibBalsaMailboxLocal *local =
+                LIBBALSA_MAILBOX_LOCAL(ti->mailbox);
+            guint *refs = LBM_LOCAL_INFO_REFS(local, info);
+
             parent = g_hash_table_lookup(ti->id_table,
-                                         g_list_last(refs)->data);
+                                         GUINT_TO_POINTER
+                                         (refs[info->n_refs - 1]));
+        }
 
         if (!parent)
             parent = ti->mailbox->msg_tree;
@@ -2002,6 +2543,252 @@ lbml_thread_message(GNode * node, ThreadingInfo * ti)
 /*  End of threading functions  */
 /*------------------------------*/
 
+/* Change notification for maildir and mh.
+ *
+ * While such a mailbox is open, its message directories are watched
+ * with inotify. The main loop reads the events as they come and queues
+ * a check; the backend's check method then takes them and applies them
+ * to its message list, instead of rescanning the directories. Without
+ * inotify, or when events were lost, the backend rescans as before.
+ *
+ * The check runs in a thread of its own, so the watch is never freed
+ * there: unwatching detaches it from the mailbox, and an idle callback
+ * frees it in the main thread, where its io callback runs.
+ */
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define LBM_LOCAL_WATCH_MASK \
+    (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE \
+     | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct _LibBalsaMailboxLocalWatch {
+    LibBalsaMailboxLocal *local; /* NULL once detached */
+    int fd;
+    guint source_id;
+    GArray *wds;                /* watch descriptors, in order of dirs */
+    GByteArray *events;         /* read but not yet handled */
+    gboolean broken;            /* a directory went away: poll */
+#ifdef BALSA_USE_THREADS
+    pthread_mutex_t lock;       /* events is filled in the main thread
+                                 * and taken by the check */
+#endif                          /* BALSA_USE_THREADS */
+};
+
+#ifdef BALSA_USE_THREADS
+#define LBM_LOCAL_WATCH_LOCK(watch)   pthread_mutex_lock(&(watch)->lock)
+#define LBM_LOCAL_WATCH_UNLOCK(watch) pthread_mutex_unlock(&(watch)->lock)
+#else                           /* BALSA_USE_THREADS */
+#define LBM_LOCAL_WATCH_LOCK(watch)
+#define LBM_LOCAL_WATCH_UNLOCK(watch)
+#endif                          /* BALSA_USE_THREADS */
+
+/* Read what the kernel has queued; called with the watch locked. */
+static void
+lbm_local_watch_read(struct _LibBalsaMailboxLocalWatch *watch)
+{
+    union {
+        struct inotify_event event;
+        gchar buf[4096];
+    } u;
+    ssize_t n;
+
+    while ((n = read(watch->fd, &u, sizeof u)) > 0)
+        g_byte_array_append(watch->events, (guint8 *) & u, n);
+
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
+        watch->broken = TRUE;
+}
+
+static gboolean
+lbm_local_watch_cb(GIOChannel * channel, GIOCondition condition,
+                   struct _LibBalsaMailboxLocalWatch *watch)
+{
+    gboolean retval;
+
+    LBM_LOCAL_WATCH_LOCK(watch);
+    if (watch->local) {
+        lbm_local_watch_read(watch);
+        if (condition & (G_IO_HUP | G_IO_ERR))
+            watch->broken = TRUE;
+        /* Holding the lock keeps the mailbox from detaching us. */
+        libbalsa_mailbox_queue_check(LIBBALSA_MAILBOX(watch->local));
+    }
+    if (!(retval = watch->local && !watch->broken))
+        watch->source_id = 0;
+    LBM_LOCAL_WATCH_UNLOCK(watch);
+
+    return retval;
+}
+
+static void
+lbm_local_watch_free(struct _LibBalsaMailboxLocalWatch *watch)
+{
+    if (watch->source_id)
+        g_source_remove(watch->source_id);
+    close(watch->fd);
+    g_array_free(watch->wds, TRUE);
+    g_byte_array_free(watch->events, TRUE);
+#ifdef BALSA_USE_THREADS
+    pthread_mutex_destroy(&watch->lock);
+#endif                          /* BALSA_USE_THREADS */
+    g_free(watch);
+}
+
+static gboolean
+lbm_local_watch_free_idle(struct _LibBalsaMailboxLocalWatch *watch)
+{
+    lbm_local_watch_free(watch);
+
+    return FALSE;
+}
+#endif                          /* HAVE_SYS_INOTIFY_H */
+
+/* Start watching the NULL-terminated list of directories; returns
+ * FALSE if that is not possible, and the mailbox must be polled. */
+gboolean
+libbalsa_mailbox_local_watch(LibBalsaMailboxLocal * local,
+                             const gchar ** dirs)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    struct _LibBalsaMailboxLocalWatch *watch;
+    GIOChannel *channel;
+    int fd;
+
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX_LOCAL(local), FALSE);
+
+    libbalsa_mailbox_local_unwatch(local);
+
+    if ((fd = inotify_init()) < 0)
+        return FALSE;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    watch = g_new0(struct _LibBalsaMailboxLocalWatch, 1);
+    watch->local = local;
+    watch->fd = fd;
+    watch->wds = g_array_new(FALSE, FALSE, sizeof(int));
+    watch->events = g_byte_array_new();
+#ifdef BALSA_USE_THREADS
+    pthread_mutex_init(&watch->lock, NULL);
+#endif                          /* BALSA_USE_THREADS */
+
+    for (; *dirs; dirs++) {
+        int wd = inotify_add_watch(fd, *dirs, LBM_LOCAL_WATCH_MASK);
+
+        if (wd < 0) {
+            lbm_local_watch_free(watch);
+            return FALSE;
+        }
+        g_array_append_val(watch->wds, wd);
+    }
+
+    channel = g_io_channel_unix_new(fd);
+    watch->source_id =
+        g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                       (GIOFunc) lbm_local_watch_cb, watch);
+    g_io_channel_unref(channel);
+
+    local->watch = watch;
+
+    return TRUE;
+#else                           /* HAVE_SYS_INOTIFY_H */
+    return FALSE;
+#endif                          /* HAVE_SYS_INOTIFY_H */
+}
+
+/* May be called from any thread; the watch is freed in the main
+ * thread. */
+void
+libbalsa_mailbox_local_unwatch(LibBalsaMailboxLocal * local)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    struct _LibBalsaMailboxLocalWatch *watch = local->watch;
+
+    if (!watch)
+        return;
+
+    local->watch = NULL;
+    LBM_LOCAL_WATCH_LOCK(watch);
+    watch->local = NULL;
+    LBM_LOCAL_WATCH_UNLOCK(watch);
+    g_idle_add((GSourceFunc) lbm_local_watch_free_idle, watch);
+#endif                          /* HAVE_SYS_INOTIFY_H */
+}
+
+/* Pass the events since the last call to func, in the order they
+ * happened. Returns FALSE if the mailbox is not watched or events were
+ * lost; the caller must then rescan the mailbox. A watch that has
+ * broken down is detached, so the mailbox will be polled from now on.
+ * Called with the mailbox locked. */
+gboolean
+libbalsa_mailbox_local_watch_events(LibBalsaMailboxLocal * local,
+                                    LibBalsaMailboxLocalWatchFunc func,
+                                    gpointer data)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    struct _LibBalsaMailboxLocalWatch *watch = local->watch;
+    GByteArray *events;
+    gboolean retval;
+    gboolean broken;
+    gsize offset;
+    struct inotify_event *event;
+
+    if (!watch)
+        return FALSE;
+
+    LBM_LOCAL_WATCH_LOCK(watch);
+    lbm_local_watch_read(watch);
+    events = watch->events;
+    watch->events = g_byte_array_new();
+
+    /* First look for lost events and for directories that went away. */
+    retval = TRUE;
+    for (offset = 0; offset + sizeof *event <= events->len;
+         offset += sizeof *event + event->len) {
+        event = (struct inotify_event *) (events->data + offset);
+        if (event->mask & IN_Q_OVERFLOW)
+            retval = FALSE;
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT
+                           | IN_IGNORED))
+            watch->broken = TRUE;
+    }
+    if ((broken = watch->broken))
+        retval = FALSE;
+    LBM_LOCAL_WATCH_UNLOCK(watch);
+
+    if (broken)
+        /* Only detached here; freed in the main thread. */
+        libbalsa_mailbox_local_unwatch(local);
+
+    for (offset = 0; retval && offset + sizeof *event <= events->len;
+         offset += sizeof *event + event->len) {
+        guint dir;
+
+        event = (struct inotify_event *) (events->data + offset);
+        if ((event->mask & IN_ISDIR) || event->len == 0)
+            continue;
+
+        for (dir = 0; dir < watch->wds->len; dir++)
+            if (g_array_index(watch->wds, int, dir) == event->wd)
+                break;
+        if (dir < watch->wds->len)
+            func(local, dir, event->name,
+                 event->mask & (IN_DELETE | IN_MOVED_FROM) ?
+                 LB_MAILBOX_WATCH_REMOVED :
+                 event->mask & IN_CREATE ?
+                 LB_MAILBOX_WATCH_CREATED : LB_MAILBOX_WATCH_WRITTEN,
+                 data);
+    }
+    g_byte_array_free(events, TRUE);
+
+    return retval;
+#else                           /* HAVE_SYS_INOTIFY_H */
+    return FALSE;
+#endif                          /* HAVE_SYS_INOTIFY_H */
+}
+
+/*------------------------------*/
+
 /* Helper for maildir and mh. */
 GMimeMessage *
 libbalsa_mailbox_local_get_mime_message(LibBalsaMailbox * mailbox,
@@ -2210,7 +2997,7 @@ libbalsa_mailbox_local_duplicate_msgnos(LibBalsaMailbox * mailbox)
     if (!libbalsa_mailbox_prepare_threading(mailbox, 0))
         return NULL;
 
-    table = g_hash_table_new(g_str_hash, g_str_equal);
+    table = g_hash_table_new(NULL, NULL);
     msgnos = g_array_new(FALSE, FALSE, sizeof(guint));
 
     for (i = 0; i < local->threading_info->len; i++) {
@@ -2226,13 +3013,14 @@ libbalsa_mailbox_local_duplicate_msgnos(LibBalsaMailbox * mailbox)
         if (!info || !info->message_id)
             continue;
 
-        tmp = g_hash_table_lookup(table, info->message_id);
+        tmp = g_hash_table_lookup(table,
+                                  GUINT_TO_POINTER(info->message_id));
         master = tmp ? GPOINTER_TO_UINT(tmp) : 0;
         if (!master ||
             libbalsa_mailbox_msgno_has_flags(mailbox, msgno,
                                              LIBBALSA_MESSAGE_FLAG_REPLIED,
                                              0)) {
-            g_hash_table_insert(table, info->message_id,
+            g_hash_table_insert(table, GUINT_TO_POINTER(info->message_id),
                                 GUINT_TO_POINTER(msgno));
             msgno = master;
         }
@@ -2252,4 +3040,8 @@ lbm_local_real_remove_files(LibBalsaMailboxLocal * local)
     gchar *filename = lbm_local_get_cache_filename(local);
     unlink(filename);
     g_free(filename);
+
+    filename = lbm_local_get_index_filename(local);
+    unlink(filename);
+    g_free(filename);
 }
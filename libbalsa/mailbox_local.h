@@ -69,8 +69,21 @@ struct _LibBalsaMailboxLocal {
     guint thread_id;    /* id of the idle mailbox thread job */
     guint save_tree_id; /* id of the idle mailbox save-tree job */
     GPtrArray *threading_info;
+    struct _ThreadingInfo *jwz_info; /* JWZ tables kept for threading
+                                      * new messages incrementally */
+    /* Pool for threading_info: message-ids are interned as atoms,
+     * References are packed in ref_atoms, senders are in id_chunk. */
+    GStringChunk *id_chunk;
+    GHashTable *id_atoms;       /* id string -> atom */
+    GArray *ref_atoms;
     LibBalsaMailboxLocalPool message_pool[LBML_POOL_SIZE];
     guint pool_seqno;
+    LibBalsaTextIndex *text_index; /* loaded on first use */
+    guint index_bodies_id;      /* id of the idle indexing job */
+    guint index_bodies_from;    /* first msgno it looks at, or 0 */
+    struct _LibBalsaMailboxLocalWatch *watch; /* inotify on the message
+                                               * directories, while
+                                               * open */
 };
 
 struct _LibBalsaMailboxLocalClass {
@@ -100,8 +113,32 @@ void libbalsa_mailbox_local_cache_message(LibBalsaMailboxLocal * local,
                                           LibBalsaMessage * message);
 void libbalsa_mailbox_local_msgno_removed(LibBalsaMailbox * mailbox,
 					  guint msgno);
+void libbalsa_mailbox_local_msgnos_removed(LibBalsaMailbox * mailbox,
+                                           GArray * seqnos);
 void libbalsa_mailbox_local_remove_files(LibBalsaMailboxLocal *mailbox);
 
+/* Change notification for maildir and mh: dir is the index of the
+ * directory in the array passed to libbalsa_mailbox_local_watch. A
+ * created file may still be being written; it is reported as written
+ * when it is closed after writing, or when it is moved in. */
+typedef enum {
+    LB_MAILBOX_WATCH_CREATED,
+    LB_MAILBOX_WATCH_WRITTEN,
+    LB_MAILBOX_WATCH_REMOVED    /* deleted or moved away */
+} LibBalsaMailboxWatchEvent;
+
+typedef void (*LibBalsaMailboxLocalWatchFunc) (LibBalsaMailboxLocal *
+                                               local, guint dir,
+                                               const gchar * name,
+                                               LibBalsaMailboxWatchEvent
+                                               what, gpointer data);
+gboolean libbalsa_mailbox_local_watch(LibBalsaMailboxLocal * local,
+                                      const gchar ** dirs);
+void libbalsa_mailbox_local_unwatch(LibBalsaMailboxLocal * local);
+gboolean libbalsa_mailbox_local_watch_events(LibBalsaMailboxLocal * local,
+                                             LibBalsaMailboxLocalWatchFunc
+                                             func, gpointer data);
+
 /* Helpers for maildir and mh. */
 GMimeMessage *libbalsa_mailbox_local_get_mime_message(LibBalsaMailbox *
 						      mailbox,
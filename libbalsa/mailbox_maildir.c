@@ -471,6 +471,20 @@ lbm_maildir_parse_subdirs(LibBalsaMailboxMaildir * mdir)
     lbm_maildir_parse(mdir, "new", &filenum);
 }
 
+/* The watched subdirectories, in this order. */
+static const gchar *lbm_maildir_subdirs[] = { "cur", "new" };
+
+static void
+lbm_maildir_watch(LibBalsaMailboxMaildir * mdir)
+{
+    const gchar *dirs[3];
+
+    dirs[0] = mdir->curdir;
+    dirs[1] = mdir->newdir;
+    dirs[2] = NULL;
+    libbalsa_mailbox_local_watch(LIBBALSA_MAILBOX_LOCAL(mdir), dirs);
+}
+
 static gboolean
 libbalsa_mailbox_maildir_open(LibBalsaMailbox * mailbox, GError **err)
 {
@@ -493,6 +507,9 @@ libbalsa_mailbox_maildir_open(LibBalsaMailbox * mailbox, GError **err)
 				  NULL, (GDestroyNotify)free_message_info);
     mdir->msgno_2_msg_info = g_ptr_array_new();
 
+    /* Watch before parsing, so that no change is missed. */
+    lbm_maildir_watch(mdir);
+
     if (stat(mdir->tmpdir, &st) != -1)
 	libbalsa_mailbox_set_mtime(mailbox, st.st_mtime);
 
@@ -537,21 +554,321 @@ lbm_maildir_check(const gchar * subdir)
     return retval;
 }
 
+/* Drop the messages whose msgnos are in removed, in ascending order,
+ * from msgno_2_msg_info in one pass, renumbering the rest, and tell the
+ * view about all of them at once. */
+static void
+lbm_maildir_remove_messages(LibBalsaMailbox * mailbox, GArray * removed)
+{
+    LibBalsaMailboxMaildir *mdir = LIBBALSA_MAILBOX_MAILDIR(mailbox);
+    GPtrArray *expunged;
+    guint msgno, i, k;
+
+    if (removed->len == 0)
+        return;
+
+    expunged = g_ptr_array_sized_new(removed->len);
+    for (msgno = 1, i = k = 0; msgno <= mdir->msgno_2_msg_info->len;
+         msgno++) {
+        struct message_info *msg_info =
+            message_info_from_msgno(mdir, msgno);
+
+        if (k < removed->len && g_array_index(removed, guint, k) == msgno) {
+            g_ptr_array_add(expunged, msg_info);
+            k++;
+        } else {
+            g_ptr_array_index(mdir->msgno_2_msg_info, i++) = msg_info;
+            if (msg_info->local_info.message)
+                msg_info->local_info.message->msgno = i;
+        }
+    }
+    g_ptr_array_set_size(mdir->msgno_2_msg_info, i);
+
+    libbalsa_mailbox_local_msgnos_removed(mailbox, removed);
+
+    for (i = 0; i < expunged->len; i++) {
+        struct message_info *msg_info = g_ptr_array_index(expunged, i);
+        /* This will free msg_info: */
+        g_hash_table_remove(mdir->messages_info, msg_info->key);
+    }
+    g_ptr_array_free(expunged, TRUE);
+}
+
+/* Rescan an open mailbox: look for every known file, and parse both
+ * subdirectories. */
+static void
+lbm_maildir_rescan(LibBalsaMailbox * mailbox)
+{
+    LibBalsaMailboxMaildir *mdir = LIBBALSA_MAILBOX_MAILDIR(mailbox);
+    guint msgno;
+    struct message_info *msg_info;
+    const gchar *path;
+    GArray *removed;
+
+    /* Was any message removed? */
+    path = libbalsa_mailbox_local_get_path(mailbox);
+    removed = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (msgno = 1; msgno <= mdir->msgno_2_msg_info->len; msgno++) {
+	gchar *filename;
+
+        msg_info = message_info_from_msgno(mdir, msgno);
+	filename = g_build_filename(path, msg_info->subdir,
+				    msg_info->filename, NULL);
+	if (access(filename, F_OK) != 0)
+	    g_array_append_val(removed, msgno);
+	g_free(filename);
+    }
+    lbm_maildir_remove_messages(mailbox, removed);
+    g_array_free(removed, TRUE);
+
+    msgno = mdir->msgno_2_msg_info->len;
+    lbm_maildir_parse_subdirs(mdir);
+    libbalsa_mailbox_local_load_messages(mailbox, msgno);
+}
+
+/* Watched mailbox: the changes since the last check, by key. A file
+ * that was renamed, to change its flags or to move it from new to cur,
+ * ends up with its last name. */
+struct lbm_maildir_change {
+    const gchar *subdir;
+    gchar *filename;            /* NULL if not known */
+    gboolean gone;
+};
+
+static void
+lbm_maildir_change_free(struct lbm_maildir_change *change)
+{
+    g_free(change->filename);
+    g_free(change);
+}
+
+static void
+lbm_maildir_watch_event(LibBalsaMailboxLocal * local, guint dir,
+                        const gchar * name, LibBalsaMailboxWatchEvent what,
+                        GHashTable * changes)
+{
+    LibBalsaMailboxMaildir *mdir = (LibBalsaMailboxMaildir *) local;
+    const gchar *subdir = lbm_maildir_subdirs[dir];
+    struct lbm_maildir_change *change;
+    /* Messages are written in tmp and moved to new or cur, so a file
+     * is complete when it is created there. */
+    gboolean added = what != LB_MAILBOX_WATCH_REMOVED;
+    gchar *key;
+    gchar *p;
+
+    if (name[0] == '.')
+        return;
+
+    key = g_strdup(name);
+    /* strip flags of filename */
+    if ((p = strrchr(key, ':')) && !strncmp(p, ":2,", 3))
+        *p = '\0';
+
+    if (!(change = g_hash_table_lookup(changes, key))) {
+        struct message_info *msg_info =
+            g_hash_table_lookup(mdir->messages_info, key);
+
+        if (!msg_info && !added) {
+            /* Gone before we knew about it. */
+            g_free(key);
+            return;
+        }
+        change = g_new0(struct lbm_maildir_change, 1);
+        if (msg_info) {
+            change->subdir = msg_info->subdir;
+            change->filename = g_strdup(msg_info->filename);
+        }
+        g_hash_table_insert(changes, key, change);
+    } else
+        g_free(key);
+
+    if (added) {
+        change->subdir = subdir;
+        g_free(change->filename);
+        change->filename = g_strdup(name);
+        change->gone = FALSE;
+    } else if (change->filename && strcmp(change->subdir, subdir) == 0
+               && strcmp(change->filename, name) == 0)
+        /* The old name of a renamed file is not its last name. */
+        change->gone = TRUE;
+}
+
+/* Another program changed the flags of a message; take them over,
+ * unless we have changes of our own that are not synced yet. */
+static gboolean
+lbm_maildir_flags_changed(LibBalsaMailbox * mailbox, guint msgno,
+                          struct message_info *msg_info,
+                          LibBalsaMessageFlag flags)
+{
+    LibBalsaMessageFlag old_flags = msg_info->local_info.flags;
+    gboolean was_unread_undeleted, is_unread_undeleted;
+
+    if (FLAGS_CHANGED(msg_info)) {
+        msg_info->orig_flags = flags;
+        return FALSE;
+    }
+
+    msg_info->orig_flags = flags;
+    msg_info->local_info.flags =
+        (old_flags & ~LIBBALSA_MESSAGE_FLAGS_REAL) | REAL_FLAGS(flags);
+    if (msg_info->local_info.message)
+        msg_info->local_info.message->flags = msg_info->local_info.flags;
+    libbalsa_mailbox_index_set_flags(mailbox, msgno,
+                                     msg_info->local_info.flags);
+
+    was_unread_undeleted = (old_flags & LIBBALSA_MESSAGE_FLAG_NEW)
+        && !(old_flags & LIBBALSA_MESSAGE_FLAG_DELETED);
+    is_unread_undeleted = (flags & LIBBALSA_MESSAGE_FLAG_NEW)
+        && !(flags & LIBBALSA_MESSAGE_FLAG_DELETED);
+    mailbox->unread_messages += is_unread_undeleted - was_unread_undeleted;
+
+    return TRUE;
+}
+
+static gint
+lbm_maildir_compare_key(const struct message_info **a,
+                        const struct message_info **b)
+{
+    return strcmp((*a)->key, (*b)->key);
+}
+
+/* Apply the changes reported by the watch; returns FALSE if the
+ * mailbox must be rescanned. */
+static gboolean
+lbm_maildir_watch_apply(LibBalsaMailbox * mailbox)
+{
+    LibBalsaMailboxMaildir *mdir = LIBBALSA_MAILBOX_MAILDIR(mailbox);
+    GHashTable *changes;
+    GHashTable *known;
+    GPtrArray *added;
+    GHashTableIter iter;
+    gpointer key, value;
+    guint msgno, i;
+    gboolean flags_changed = FALSE;
+
+    changes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                    (GDestroyNotify)
+                                    lbm_maildir_change_free);
+    if (!libbalsa_mailbox_local_watch_events
+        (LIBBALSA_MAILBOX_LOCAL(mailbox),
+         (LibBalsaMailboxLocalWatchFunc) lbm_maildir_watch_event,
+         changes)) {
+        g_hash_table_destroy(changes);
+        return FALSE;
+    }
+    if (g_hash_table_size(changes) == 0) {
+        g_hash_table_destroy(changes);
+        return TRUE;
+    }
+
+    /* Sort the changes into those of known messages and new ones. */
+    known = g_hash_table_new(NULL, NULL);
+    added = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, changes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct lbm_maildir_change *change = value;
+        struct message_info *msg_info =
+            g_hash_table_lookup(mdir->messages_info, key);
+
+        if (msg_info)
+            g_hash_table_insert(known, msg_info, change);
+        else if (!change->gone) {
+            msg_info = g_new0(struct message_info, 1);
+            msg_info->key = g_strdup(key);
+            msg_info->subdir = change->subdir;
+            msg_info->filename = g_strdup(change->filename);
+            msg_info->local_info.flags = msg_info->orig_flags =
+                parse_filename(change->subdir, change->filename);
+            g_ptr_array_add(added, msg_info);
+        }
+    }
+
+    /* Renamed and removed messages. */
+    if (g_hash_table_size(known) > 0) {
+        GArray *removed = g_array_new(FALSE, FALSE, sizeof(guint));
+
+        for (msgno = 1; msgno <= mdir->msgno_2_msg_info->len; msgno++) {
+            struct message_info *msg_info =
+                message_info_from_msgno(mdir, msgno);
+            struct lbm_maildir_change *change =
+                g_hash_table_lookup(known, msg_info);
+            LibBalsaMessageFlag flags;
+
+            if (!change)
+                continue;
+            if (change->gone) {
+                g_array_append_val(removed, msgno);
+                continue;
+            }
+
+            g_free(msg_info->filename);
+            msg_info->filename = g_strdup(change->filename);
+            msg_info->subdir = change->subdir;
+            flags = parse_filename(change->subdir, change->filename);
+            if (FLAGS_REALLY_DIFFER(msg_info->orig_flags, flags)
+                && lbm_maildir_flags_changed(mailbox, msgno, msg_info,
+                                             flags))
+                flags_changed = TRUE;
+        }
+        lbm_maildir_remove_messages(mailbox, removed);
+        g_array_free(removed, TRUE);
+    }
+    g_hash_table_destroy(known);
+    g_hash_table_destroy(changes);
+
+    /* New messages, in order of their keys, which begin with the time
+     * of delivery. */
+    msgno = mdir->msgno_2_msg_info->len;
+    if (added->len > 0) {
+        guint filenum = 0;
+
+        for (i = 1; i <= msgno; i++) {
+            struct message_info *msg_info =
+                message_info_from_msgno(mdir, i);
+            if (msg_info->filenum > filenum)
+                filenum = msg_info->filenum;
+        }
+
+        g_ptr_array_sort(added, (GCompareFunc) lbm_maildir_compare_key);
+        for (i = 0; i < added->len; i++) {
+            struct message_info *msg_info = g_ptr_array_index(added, i);
+
+            msg_info->filenum = ++filenum;
+            g_hash_table_insert(mdir->messages_info, msg_info->key,
+                                msg_info);
+            g_ptr_array_add(mdir->msgno_2_msg_info, msg_info);
+        }
+        libbalsa_mailbox_local_load_messages(mailbox, msgno);
+    }
+    g_ptr_array_free(added, TRUE);
+
+    if (flags_changed)
+        libbalsa_mailbox_set_unread_messages_flag(mailbox,
+                                                  mailbox->unread_messages
+                                                  > 0);
+
+    return TRUE;
+}
+
 /* Called with mailbox locked. */
 static void
 libbalsa_mailbox_maildir_check(LibBalsaMailbox * mailbox)
 {
     struct stat st;
     LibBalsaMailboxMaildir *mdir;
-    guint renumber, msgno;
-    struct message_info *msg_info;
-    const gchar *path;
     time_t mtime;
 
     g_assert(LIBBALSA_IS_MAILBOX_MAILDIR(mailbox));
 
     mdir = LIBBALSA_MAILBOX_MAILDIR(mailbox);
 
+    if (MAILBOX_OPEN(mailbox) && LIBBALSA_MAILBOX_LOCAL(mailbox)->watch) {
+        /* No need to look at the files. */
+        if (!lbm_maildir_watch_apply(mailbox))
+            lbm_maildir_rescan(mailbox);
+        return;
+    }
+
     if (stat(mdir->tmpdir, &st) == -1)
 	return;
 
@@ -575,36 +892,7 @@ libbalsa_mailbox_maildir_check(LibBalsaMailbox * mailbox)
 	return;
     }
 
-    /* Was any message removed? */
-    path = libbalsa_mailbox_local_get_path(mailbox);
-    renumber = mdir->msgno_2_msg_info->len + 1;
-    for (msgno = 1; msgno <= mdir->msgno_2_msg_info->len; ) {
-	gchar *filename;
-
-        msg_info = message_info_from_msgno(mdir, msgno);
-	filename = g_build_filename(path, msg_info->subdir,
-				    msg_info->filename, NULL);
-	if (access(filename, F_OK) == 0)
-	    msgno++;
-	else {
-	    g_ptr_array_remove(mdir->msgno_2_msg_info, msg_info);
-	    g_hash_table_remove(mdir->messages_info, msg_info->key);
-	    libbalsa_mailbox_local_msgno_removed(mailbox, msgno);
-	    if (renumber > msgno)
-		/* First message that needs renumbering. */
-		renumber = msgno;
-	}
-	g_free(filename);
-    }
-    for (msgno = renumber; msgno <= mdir->msgno_2_msg_info->len; msgno++) {
-	msg_info = message_info_from_msgno(mdir, msgno);
-	if (msg_info->local_info.message)
-	    msg_info->local_info.message->msgno = msgno;
-    }
-
-    msgno = mdir->msgno_2_msg_info->len;
-    lbm_maildir_parse_subdirs(mdir);
-    libbalsa_mailbox_local_load_messages(mailbox, msgno);
+    lbm_maildir_rescan(mailbox);
 }
 
 static void
@@ -755,10 +1043,9 @@ libbalsa_mailbox_maildir_sync(LibBalsaMailbox * mailbox, gboolean expunge)
      */
     LibBalsaMailboxMaildir *mdir = LIBBALSA_MAILBOX_MAILDIR(mailbox);
     const gchar *path = libbalsa_mailbox_local_get_path(mailbox);
-    GSList *removed_list = NULL;
+    GArray *removed = g_array_new(FALSE, FALSE, sizeof(guint));
     gboolean ok = TRUE;
-    GSList *l;
-    guint renumber, msgno;
+    guint msgno;
     struct message_info *msg_info;
     guint changes = 0;
 
@@ -771,8 +1058,7 @@ libbalsa_mailbox_maildir_sync(LibBalsaMailbox * mailbox, gboolean expunge)
                                            msg_info->filename, NULL);
 	    unlink (orig);
 	    g_free(orig);
-	    removed_list =
-		g_slist_prepend(removed_list, GUINT_TO_POINTER(msgno));
+	    g_array_append_val(removed, msgno);
 	    ++changes;
 	    continue;
 	}
@@ -791,28 +1077,12 @@ libbalsa_mailbox_maildir_sync(LibBalsaMailbox * mailbox, gboolean expunge)
     }
 
     if (!ok) {
-	g_slist_free(removed_list);
+	g_array_free(removed, TRUE);
 	return FALSE;
     }
 
-    renumber = mdir->msgno_2_msg_info->len + 1;
-    for (l = removed_list; l; l = l->next) {
-	msgno = GPOINTER_TO_UINT(l->data);
-	if (renumber > msgno)
-	    renumber = msgno;
-	msg_info = message_info_from_msgno(mdir, msgno);
-
-	g_ptr_array_remove(mdir->msgno_2_msg_info, msg_info);
-	libbalsa_mailbox_local_msgno_removed(mailbox, msgno);
-	/* This will free removed: */
-	g_hash_table_remove(mdir->messages_info, msg_info->key);
-    }
-    g_slist_free(removed_list);
-    for (msgno = renumber; msgno <= mdir->msgno_2_msg_info->len; msgno++) {
-	msg_info = message_info_from_msgno(mdir, msgno);
-	if (msg_info->local_info.message)
-	    msg_info->local_info.message->msgno = msgno;
-    }
+    lbm_maildir_remove_messages(mailbox, removed);
+    g_array_free(removed, TRUE);
 
     if (changes) {              /* Record mtime of dir. */
         struct stat st;
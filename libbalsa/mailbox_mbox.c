@@ -112,6 +112,8 @@ struct _LibBalsaMailboxMbox {
     LibBalsaMailboxLocal parent;
 
     GPtrArray *msgno_2_msg_info;
+    struct message_info *msg_info_block; /* Restored from the cache. */
+    guint msg_info_block_len;
     GMimeStream *gmime_stream;
     gint size;
     gboolean messages_info_changed;
@@ -388,6 +390,218 @@ lbm_mbox_get_cache_filename(LibBalsaMailboxMbox * mbox)
     return filename;
 }
 
+/*
+ * The cache file holds the offsets of the messages, so that opening a
+ * large mbox does not need a full parse.  It is a fixed header followed
+ * by one fixed-size record per message.  All fields have an explicit
+ * width and are stored little-endian, so the file is the same on every
+ * host and its records can be read in place from a mapping.
+ *
+ * The header names the mbox it was made from: its size and mtime when
+ * the cache was saved, the end of the last record, and a hash of the
+ * bytes just before that end.  A checksum covers the header fields.
+ * The records are used as they are only when the size and mtime are
+ * unchanged.  Otherwise they are still used if the mbox has grown and
+ * looks appended to: the last cached message must still start with a
+ * From_ line, the tail hash must match, and the old end must be
+ * followed by the end of the file, a From_ line or a blank line.
+ */
+#define LBM_MBOX_CACHE_MAGIC   0x424d4258 /* "BMBX" */
+#define LBM_MBOX_CACHE_VERSION 1
+#define LBM_MBOX_CACHE_TAIL    64
+#define LBM_MBOX_HASH_INIT     2166136261U
+
+typedef struct {
+    guint32 magic;
+    guint32 version;
+    guint32 record_size;
+    guint32 n_records;
+    guint64 mbox_size;
+    gint64  mbox_mtime;
+    guint64 end;                /* End of the last message. */
+    guint32 tail;               /* Hash of the bytes before end. */
+    guint32 checksum;           /* Hash of the fields above. */
+} LbmMboxCacheHeader;
+
+typedef struct {
+    guint64 start;
+    gint64  status;
+    gint64  x_status;
+    gint64  mime_version;
+    guint64 end;
+    guint32 from_len;
+    guint32 orig_flags;
+    guint32 flags;
+    guint32 reserved;
+} LbmMboxCacheRecord;
+
+/* FNV-1a */
+static guint32
+lbm_mbox_hash(const guint8 * p, gsize len, guint32 hash)
+{
+    while (len-- > 0) {
+        hash ^= *p++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static guint32
+lbm_mbox_header_checksum(const LbmMboxCacheHeader * header)
+{
+    return lbm_mbox_hash((const guint8 *) header,
+                         G_STRUCT_OFFSET(LbmMboxCacheHeader, checksum),
+                         LBM_MBOX_HASH_INIT);
+}
+
+/* Hash the bytes of the mbox open on fd just before offset end; pread
+ * leaves the file position alone, so the stream need not be locked. */
+static gboolean
+lbm_mbox_tail_hash(int fd, off_t end, guint32 * hash)
+{
+    guint8 buf[LBM_MBOX_CACHE_TAIL];
+    size_t len = MIN(end, (off_t) sizeof buf);
+
+    if (pread(fd, buf, len, end - len) != (ssize_t) len)
+        return FALSE;
+
+    *hash = lbm_mbox_hash(buf, len, LBM_MBOX_HASH_INIT);
+
+    return TRUE;
+}
+
+/* Whether the mbox open on fd has a From_ line at offset. */
+static gboolean
+lbm_mbox_from_at(int fd, off_t offset)
+{
+    gchar buf[5];
+
+    return pread(fd, buf, sizeof buf, offset) == (ssize_t) sizeof buf
+        && strncmp(buf, "From ", sizeof buf) == 0;
+}
+
+/* Whether the mbox open on fd, now of size size, differs from the one
+ * the cache was saved for only by mail appended after offset end. */
+static gboolean
+lbm_mbox_appended(int fd, const LbmMboxCacheHeader * header,
+                  const LbmMboxCacheRecord * last, off_t size)
+{
+    guint64 end = GUINT64_FROM_LE(header->end);
+    gchar c;
+
+    if (GUINT64_FROM_LE(header->mbox_size) >= (guint64) size
+        || !lbm_mbox_from_at(fd, GUINT64_FROM_LE(last->start)))
+        return FALSE;
+
+    return lbm_mbox_from_at(fd, end)
+        || (pread(fd, &c, 1, end) == 1 && c == '\n');
+}
+
+static void
+lbm_mbox_cache_unmap(GMappedFile * cache)
+{
+#if GLIB_CHECK_VERSION(2,22,0)
+    g_mapped_file_unref(cache);
+#else                           /* GLIB_CHECK_VERSION(2,22,0) */
+    g_mapped_file_free(cache);
+#endif                          /* GLIB_CHECK_VERSION(2,22,0) */
+}
+
+/* Map the cache file and check it against the mbox open on fd; returns
+ * NULL if there is no cache we can trust. On success, *current is set
+ * if the mbox has not changed at all since the cache was saved, and
+ * cleared if mail has been appended to it. */
+static GMappedFile *
+lbm_mbox_cache_map(LibBalsaMailboxMbox * mbox, int fd,
+                   const LbmMboxCacheRecord ** records,
+                   guint * n_records, gboolean * current)
+{
+    gchar *filename;
+    GMappedFile *cache;
+    struct stat st;
+    const LbmMboxCacheHeader *header;
+    gsize length;
+    guint32 n;
+    guint64 end;
+    guint32 tail;
+    gboolean unchanged;
+
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    filename = lbm_mbox_get_cache_filename(mbox);
+    cache = g_mapped_file_new(filename, FALSE, NULL);
+    g_free(filename);
+    if (!cache)
+        return NULL;
+
+    length = g_mapped_file_get_length(cache);
+    header = (const LbmMboxCacheHeader *) g_mapped_file_get_contents(cache);
+    if (length < sizeof *header
+        || GUINT32_FROM_LE(header->magic) != LBM_MBOX_CACHE_MAGIC
+        || GUINT32_FROM_LE(header->version) != LBM_MBOX_CACHE_VERSION
+        || GUINT32_FROM_LE(header->record_size) !=
+           sizeof(LbmMboxCacheRecord)
+        || GUINT32_FROM_LE(header->checksum) !=
+           lbm_mbox_header_checksum(header)
+        || (n = GUINT32_FROM_LE(header->n_records)) == 0
+        || length != sizeof *header + (gsize) n * sizeof(LbmMboxCacheRecord)
+        || (end = GUINT64_FROM_LE(header->end)) > (guint64) st.st_size
+        || !lbm_mbox_tail_hash(fd, end, &tail)
+        || tail != GUINT32_FROM_LE(header->tail)) {
+        /* Old format, corrupt, or not this version of the mbox. */
+        lbm_mbox_cache_unmap(cache);
+        return NULL;
+    }
+
+    *records = (const LbmMboxCacheRecord *) (header + 1);
+    unchanged = GUINT64_FROM_LE(header->mbox_size) == (guint64) st.st_size
+        && GINT64_FROM_LE(header->mbox_mtime) == (gint64) st.st_mtime;
+    if (!unchanged
+        && !lbm_mbox_appended(fd, header, &(*records)[n - 1], st.st_size)) {
+        /* Rewritten, not just appended to. */
+        lbm_mbox_cache_unmap(cache);
+        return NULL;
+    }
+
+    *n_records = n;
+    if (current)
+        *current = unchanged;
+
+    return cache;
+}
+
+static void
+lbm_mbox_record_set(LbmMboxCacheRecord * record,
+                    const struct message_info *msg_info)
+{
+    record->start        = GUINT64_TO_LE(msg_info->start);
+    record->status       = GINT64_TO_LE(msg_info->status);
+    record->x_status     = GINT64_TO_LE(msg_info->x_status);
+    record->mime_version = GINT64_TO_LE(msg_info->mime_version);
+    record->end          = GUINT64_TO_LE(msg_info->end);
+    record->from_len     = GUINT32_TO_LE(msg_info->from_len);
+    record->orig_flags   = GUINT32_TO_LE(msg_info->orig_flags);
+    record->flags        = GUINT32_TO_LE(msg_info->local_info.flags);
+    record->reserved     = 0;
+}
+
+static void
+lbm_mbox_record_get(const LbmMboxCacheRecord * record,
+                    struct message_info *msg_info)
+{
+    msg_info->start            = GUINT64_FROM_LE(record->start);
+    msg_info->status           = GINT64_FROM_LE(record->status);
+    msg_info->x_status         = GINT64_FROM_LE(record->x_status);
+    msg_info->mime_version     = GINT64_FROM_LE(record->mime_version);
+    msg_info->end              = GUINT64_FROM_LE(record->end);
+    msg_info->from_len         = GUINT32_FROM_LE(record->from_len);
+    msg_info->orig_flags       = GUINT32_FROM_LE(record->orig_flags);
+    msg_info->local_info.flags = GUINT32_FROM_LE(record->flags);
+    msg_info->local_info.message = NULL;
+}
+
 static void
 lbm_mbox_save(LibBalsaMailboxMbox * mbox)
 {
@@ -404,25 +618,56 @@ lbm_mbox_save(LibBalsaMailboxMbox * mbox)
     filename = lbm_mbox_get_cache_filename(mbox);
 
     if (mbox->msgno_2_msg_info->len > 0) {
-        GArray *messages_info =
-            g_array_sized_new(FALSE, FALSE, sizeof(struct message_info), 
-                              mbox->msgno_2_msg_info->len);
+        guint n_records = mbox->msgno_2_msg_info->len;
+        int mbox_fd = GMIME_STREAM_FS(mbox->gmime_stream)->fd;
+        struct stat st;
+        LbmMboxCacheHeader header;
+        GByteArray *contents;
+        off_t end;
+        guint32 tail;
         guint msgno;
 #if defined(__APPLE__)
         gchar *template;
         gint fd;
 #endif                          /* !defined(__APPLE__) */
 
-        for (msgno = 1; msgno <= mbox->msgno_2_msg_info->len; msgno++) {
-            struct message_info *msg_info =
-                message_info_from_msgno(mbox, msgno);
-            g_array_append_val(messages_info, *msg_info);
+        end = message_info_from_msgno(mbox, n_records)->end;
+        if (fstat(mbox_fd, &st) < 0
+            || !lbm_mbox_tail_hash(mbox_fd, end, &tail)) {
+            /* We cannot tie the records to the mbox, and an old cache
+             * would now be wrong. */
+            unlink(filename);
+            g_free(filename);
+            return;
+        }
+
+        header.magic       = GUINT32_TO_LE(LBM_MBOX_CACHE_MAGIC);
+        header.version     = GUINT32_TO_LE(LBM_MBOX_CACHE_VERSION);
+        header.record_size = GUINT32_TO_LE(sizeof(LbmMboxCacheRecord));
+        header.n_records   = GUINT32_TO_LE(n_records);
+        header.mbox_size   = GUINT64_TO_LE(st.st_size);
+        header.mbox_mtime  = GINT64_TO_LE(st.st_mtime);
+        header.end         = GUINT64_TO_LE(end);
+        header.tail        = GUINT32_TO_LE(tail);
+        header.checksum    =
+            GUINT32_TO_LE(lbm_mbox_header_checksum(&header));
+
+        contents =
+            g_byte_array_sized_new(sizeof header +
+                                   n_records * sizeof(LbmMboxCacheRecord));
+        g_byte_array_append(contents, (guint8 *) & header, sizeof header);
+        for (msgno = 1; msgno <= n_records; msgno++) {
+            LbmMboxCacheRecord record;
+
+            lbm_mbox_record_set(&record,
+                                message_info_from_msgno(mbox, msgno));
+            g_byte_array_append(contents, (guint8 *) & record,
+                                sizeof record);
         }
 
 #if !defined(__APPLE__)
-        if (!g_file_set_contents(filename, messages_info->data,
-                                 messages_info->len
-                                 * sizeof(struct message_info), &err)) {
+        if (!g_file_set_contents(filename, (gchar *) contents->data,
+                                 contents->len, &err)) {
             libbalsa_information(LIBBALSA_INFORMATION_WARNING,
                                  _("Could not write file %s: %s"),
                                  filename, err->message);
@@ -431,17 +676,15 @@ lbm_mbox_save(LibBalsaMailboxMbox * mbox)
 #else                           /* !defined(__APPLE__) */
         template = g_strconcat(filename, ":XXXXXX", NULL);
         fd = g_mkstemp(template);
-        if (fd < 0 || write(fd, messages_info->data,
-                            messages_info->len *
-                            sizeof(struct message_info)) <
-            (ssize_t) messages_info->len) {
+        if (fd < 0 || write(fd, contents->data, contents->len) <
+            (ssize_t) contents->len) {
             libbalsa_information(LIBBALSA_INFORMATION_WARNING,
                                  _("Failed to create temporary file "
                                    "\"%s\": %s"), template,
                                  strerror(errno));
             g_free(template);
             g_free(filename);
-            g_array_free(messages_info, TRUE);
+            g_byte_array_free(contents, TRUE);
             return;
         }
         if (close(fd) != 0
@@ -453,8 +696,8 @@ lbm_mbox_save(LibBalsaMailboxMbox * mbox)
                                  filename, strerror(errno), template);
         g_free(template);
 #endif                          /* !defined(__APPLE__) */
-        g_array_free(messages_info, TRUE);
-    } else if (unlink(filename) < 0)
+        g_byte_array_free(contents, TRUE);
+    } else if (unlink(filename) < 0 && errno != ENOENT)
         libbalsa_information(LIBBALSA_INFORMATION_WARNING,
                              _("Could not unlink file %s: %s"),
                              filename, strerror(errno));
@@ -467,60 +710,349 @@ lbm_mbox_save(LibBalsaMailboxMbox * mbox)
 #endif
 }
 
-static LibBalsaMessage *lbm_mbox_message_new(GMimeMessage * mime_message,
-					     struct message_info
-					     *msg_info);
+/*
+ * Header-only scanner for parse_mailbox.
+ *
+ * We need only the offsets of each message, its flags, and the header
+ * fields for the index, so instead of building the whole MIME tree
+ * with GMimeParser we read the file in large blocks, find the From_
+ * lines, and parse only the header block.  Content-Length is honoured
+ * as GMimeParser does with respect_content_length: it is used when the
+ * end it gives is followed by a From_ line or the end of the file.
+ */
+#define LBM_MBOX_SCAN_BLOCK 65536
+
+typedef struct {
+    GMimeStream *stream;
+    off_t length;               /* Length of the file. */
+    off_t offset;               /* File offset of buf[0]. */
+    gchar *buf;
+    gsize size;                 /* Allocated size of buf. */
+    gsize start;                /* Cursor. */
+    gsize end;                  /* End of the data in buf. */
+    gboolean eof;
+} LbmMboxScanner;
+
+static void
+lbm_mbox_scanner_init(LbmMboxScanner * scanner, GMimeStream * stream)
+{
+    struct stat st;
+
+    scanner->stream = stream;
+    scanner->length = fstat(GMIME_STREAM_FS(stream)->fd, &st) == 0 ?
+        st.st_size : G_MAXINT32;
+    scanner->offset = g_mime_stream_tell(stream);
+    scanner->size = LBM_MBOX_SCAN_BLOCK;
+    scanner->buf = g_malloc(scanner->size);
+    scanner->start = scanner->end = 0;
+    scanner->eof = FALSE;
+}
+
+static off_t
+lbm_mbox_scanner_tell(LbmMboxScanner * scanner)
+{
+    return scanner->offset + scanner->start;
+}
+
+static void
+lbm_mbox_scanner_seek(LbmMboxScanner * scanner, off_t offset)
+{
+    if (offset >= scanner->offset
+        && offset <= scanner->offset + (off_t) scanner->end) {
+        scanner->start = offset - scanner->offset;
+        return;
+    }
+
+    scanner->offset = offset;
+    scanner->start = scanner->end = 0;
+    scanner->eof =
+        g_mime_stream_seek(scanner->stream, offset,
+                           GMIME_STREAM_SEEK_SET) < 0;
+}
+
+/* Make len bytes available at the cursor, unless the file ends first;
+ * returns the number available. */
+static gsize
+lbm_mbox_scanner_fill(LbmMboxScanner * scanner, gsize len)
+{
+    while (scanner->end - scanner->start < len && !scanner->eof) {
+        ssize_t nread;
+
+        if (scanner->start > 0) {
+            memmove(scanner->buf, scanner->buf + scanner->start,
+                    scanner->end - scanner->start);
+            scanner->offset += scanner->start;
+            scanner->end -= scanner->start;
+            scanner->start = 0;
+        }
+        if (scanner->end == scanner->size) {
+            /* A very long line. */
+            scanner->size *= 2;
+            scanner->buf = g_realloc(scanner->buf, scanner->size);
+        }
+
+        nread = g_mime_stream_read(scanner->stream,
+                                   scanner->buf + scanner->end,
+                                   scanner->size - scanner->end);
+        if (nread <= 0)
+            scanner->eof = TRUE;
+        else
+            scanner->end += nread;
+    }
+
+    return scanner->end - scanner->start;
+}
+
+/* Return the line at the cursor, including its '\n' if it has one, and
+ * move past it; returns NULL at the end of the file. */
+static const gchar *
+lbm_mbox_scanner_readln(LbmMboxScanner * scanner, gsize * len)
+{
+    gsize scanned = 0;
+    const gchar *line;
+
+    for (;;) {
+        gsize avail = scanner->end - scanner->start;
+        gchar *p = memchr(scanner->buf + scanner->start + scanned, '\n',
+                          avail - scanned);
+
+        if (p) {
+            *len = p + 1 - (scanner->buf + scanner->start);
+            break;
+        }
+        scanned = avail;
+        if (lbm_mbox_scanner_fill(scanner, avail + 1) <= avail) {
+            if (avail == 0)
+                return NULL;
+            /* Last line of the file, with no '\n'. */
+            *len = avail;
+            break;
+        }
+    }
+
+    line = scanner->buf + scanner->start;
+    scanner->start += *len;
+
+    return line;
+}
+
+/* Move the cursor, which must be at the start of a line, to the next
+ * From_ line, or to the end of the file. */
+static void
+lbm_mbox_scanner_find_from(LbmMboxScanner * scanner)
+{
+    gboolean bol = TRUE;
+
+    for (;;) {
+        gsize avail = lbm_mbox_scanner_fill(scanner, 5);
+        gchar *p = scanner->buf + scanner->start;
+        gchar *q;
+
+        if (avail < 5) {
+            /* End of file. */
+            scanner->start = scanner->end;
+            return;
+        }
+        if (bol && strncmp(p, "From ", 5) == 0)
+            return;
+
+        /* If the line runs past the data we have, the next block starts
+         * in the middle of it. */
+        q = memchr(p, '\n', avail);
+        bol = q != NULL;
+        scanner->start = q ? (gsize) (q + 1 - scanner->buf) : scanner->end;
+    }
+}
+
+/* Check whether the body of len bytes starting at the cursor ends at a
+ * From_ line or at the end of the file, and if so, move past it. */
+static gboolean
+lbm_mbox_scanner_skip_content(LbmMboxScanner * scanner, off_t len)
+{
+    off_t body = lbm_mbox_scanner_tell(scanner);
+    gsize avail;
+    gchar *p;
+
+    if (len < 0 || body + len > scanner->length)
+        return FALSE;
+
+    lbm_mbox_scanner_seek(scanner, body + len);
+    avail = lbm_mbox_scanner_fill(scanner, 6);
+    p = scanner->buf + scanner->start;
+    if (avail == 0 || (avail >= 5 && strncmp(p, "From ", 5) == 0))
+        return TRUE;
+    if (avail >= 6 && p[0] == '\n' && strncmp(p + 1, "From ", 5) == 0) {
+        /* The separating blank line belongs to this message. */
+        ++scanner->start;
+        return TRUE;
+    }
+
+    lbm_mbox_scanner_seek(scanner, body);
+    return FALSE;
+}
+
+static void
+lbm_mbox_scanner_free(LbmMboxScanner * scanner)
+{
+    g_free(scanner->buf);
+}
+
+/* Copy the value of a header field, without leading white space or the
+ * line end. */
+static void
+lbm_mbox_scan_value(GString * value, const gchar * p, const gchar * end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+    g_string_truncate(value, 0);
+    g_string_append_len(value, p, end - p);
+}
+
+/* Scan the next message: fill in the offsets in msg_info, the
+ * well-formed header fields in fields, and the values of the Status and
+ * X-Status fields; returns FALSE at the end of the file. */
+static gboolean
+lbm_mbox_scan_message(LbmMboxScanner * scanner,
+                      struct message_info *msg_info, GString * fields,
+                      GString * status, GString * x_status)
+{
+    const gchar *line;
+    gsize len;
+    glong content_length = -1;
+    gboolean in_field = FALSE;
+    gboolean in_body = TRUE;
+
+    lbm_mbox_scanner_find_from(scanner);
+    msg_info->start = lbm_mbox_scanner_tell(scanner);
+    line = lbm_mbox_scanner_readln(scanner, &len);
+    if (!line || line[len - 1] != '\n')
+        return FALSE;
+    msg_info->from_len = len;
+    msg_info->status = msg_info->x_status = msg_info->mime_version = -1;
+    g_string_truncate(fields, 0);
+
+    for (;;) {
+        off_t offset = lbm_mbox_scanner_tell(scanner);
+        const gchar *end, *colon;
+
+        if (!(line = lbm_mbox_scanner_readln(scanner, &len))) {
+            /* Headers end at the end of the file. */
+            in_body = FALSE;
+            break;
+        }
+
+        end = line + len;
+        if (end > line && end[-1] == '\n')
+            --end;
+        if (end > line && end[-1] == '\r')
+            --end;
+
+        if (end == line)
+            /* Blank line ends headers. */
+            break;
+
+        if (*line == ' ' || *line == '\t') {
+            if (in_field) {
+                g_string_append_len(fields, line, end - line);
+                g_string_append_c(fields, '\n');
+            }
+            continue;
+        }
+
+        if (len >= 5 && strncmp(line, "From ", 5) == 0) {
+            /* Next message, with no body in this one. */
+            lbm_mbox_scanner_seek(scanner, offset);
+            in_body = FALSE;
+            break;
+        }
+
+        for (colon = line; colon < end && *colon > 32 && *colon < 127
+             && *colon != ':'; colon++)
+            /* Nothing. */ ;
+        if (colon == line || colon == end || *colon != ':') {
+            /* Not a header field, so the body has begun, and we cannot
+             * tell where it ends from Content-Length. */
+            content_length = -1;
+            break;
+        }
+
+        in_field = TRUE;
+        g_string_append_len(fields, line, end - line);
+        g_string_append_c(fields, '\n');
+
+        /* Save the offsets of the first "Status", "X-Status", and
+         * "MIME-Version" fields; we use the offset of "MIME-Version" as
+         * the place to insert status fields, if necessary. */
+        if (colon - line == 6
+            && g_ascii_strncasecmp(line, "Status", 6) == 0) {
+            if (msg_info->status < 0) {
+                msg_info->status = offset;
+                lbm_mbox_scan_value(status, colon + 1, end);
+            }
+        } else if (colon - line == 8
+                   && g_ascii_strncasecmp(line, "X-Status", 8) == 0) {
+            if (msg_info->x_status < 0) {
+                msg_info->x_status = offset;
+                lbm_mbox_scan_value(x_status, colon + 1, end);
+            }
+        } else if (colon - line == 12
+                   && g_ascii_strncasecmp(line, "MIME-Version", 12) == 0) {
+            if (msg_info->mime_version < 0)
+                msg_info->mime_version = offset;
+        } else if (colon - line == 14
+                   && g_ascii_strncasecmp(line, "Content-Length",
+                                          14) == 0) {
+            gchar *tail;
+
+            content_length = strtol(colon + 1, &tail, 10);
+            if (tail == colon + 1)
+                content_length = -1;
+        }
+    }
+
+    if (in_body
+        && (content_length < 0
+            || !lbm_mbox_scanner_skip_content(scanner, content_length)))
+        lbm_mbox_scanner_find_from(scanner);
+
+    msg_info->end = lbm_mbox_scanner_tell(scanner);
+
+    return TRUE;
+}
+
+static LibBalsaMessage *lbm_mbox_message_new(const gchar * fields,
+                                             const gchar * status,
+                                             const gchar * x_status,
+                                             struct message_info
+                                             *msg_info);
 static void
 parse_mailbox(LibBalsaMailboxMbox * mbox)
 {
     LibBalsaMailboxLocal *local = LIBBALSA_MAILBOX_LOCAL(mbox);
-    GMimeParser *gmime_parser;
+    LbmMboxScanner scanner;
+    GString *fields;
+    GString *status;
+    GString *x_status;
     struct message_info msg_info;
-    struct message_info * msg_info_p = &msg_info;
     unsigned msgno = mbox->msgno_2_msg_info->len;
 
-    gmime_parser = g_mime_parser_new_with_stream(mbox->gmime_stream);
-    g_mime_parser_set_scan_from(gmime_parser, TRUE);
-    g_mime_parser_set_respect_content_length(gmime_parser, TRUE);
-    g_mime_parser_set_header_regex(gmime_parser,
-                                   "^Status|^X-Status|^MIME-Version",
-				   lbm_mbox_header_cb, &msg_info_p);
+    lbm_mbox_scanner_init(&scanner, mbox->gmime_stream);
+    fields   = g_string_sized_new(1024);
+    status   = g_string_new(NULL);
+    x_status = g_string_new(NULL);
 
     libbalsa_mailbox_local_set_threading_info(local);
     msg_info.local_info.message = NULL;
-    while (!g_mime_parser_eos(gmime_parser)) {
-	GMimeMessage *mime_message;
+    while (lbm_mbox_scan_message(&scanner, &msg_info, fields, status,
+                                 x_status)) {
         LibBalsaMessage *msg;
-        gchar *from;
         off_t offset;
 
-        msg_info.status = msg_info.x_status = msg_info.mime_version = -1;
-        mime_message   = g_mime_parser_construct_message(gmime_parser);
-        if (!mime_message)
-            continue;
-        msg_info.start = g_mime_parser_get_from_offset(gmime_parser);
-        msg_info.end   = g_mime_parser_tell(gmime_parser);
-        if (msg_info.end <= msg_info.start
-            || !(from = g_mime_parser_get_from(gmime_parser))) {
-	    g_object_unref(mime_message);
-            continue;
-	}
-        msg_info.from_len = strlen(from) + 1;
-        g_free(from);
-
-	/* Make sure we don't have offsets for any encapsulated headers. */
-	if (!g_mime_object_get_header(GMIME_OBJECT(mime_message),
-                                      "Status"))
-	    msg_info.status = -1;
-	if (!g_mime_object_get_header(GMIME_OBJECT(mime_message),
-                                      "X-Status"))
-	    msg_info.x_status = -1;
-	if (!g_mime_object_get_header(GMIME_OBJECT(mime_message),
-                                      "MIME-Version"))
-	    msg_info.mime_version = -1;
-
-        msg = lbm_mbox_message_new(mime_message, &msg_info);
-        g_object_unref(mime_message);
+        msg = lbm_mbox_message_new(fields->str,
+                                   msg_info.status >= 0 ?
+                                   status->str : NULL,
+                                   msg_info.x_status >= 0 ?
+                                   x_status->str : NULL, &msg_info);
         if (!msg)
             continue;
 
@@ -548,12 +1080,21 @@ parse_mailbox(LibBalsaMailboxMbox * mbox)
         g_object_unref(msg);
     }
 
-    g_object_unref(gmime_parser);
+    /* Leave the stream at the end of the last message, as the callers
+     * expect. */
+    g_mime_stream_seek(mbox->gmime_stream,
+                       lbm_mbox_scanner_tell(&scanner),
+                       GMIME_STREAM_SEEK_SET);
+    lbm_mbox_scanner_free(&scanner);
+    g_string_free(fields, TRUE);
+    g_string_free(status, TRUE);
+    g_string_free(x_status, TRUE);
     lbm_mbox_save(mbox);
 }
 
 static void
-free_message_info(struct message_info *msg_info)
+free_message_info(LibBalsaMailboxMbox * mbox,
+                  struct message_info *msg_info)
 {
     if (msg_info->local_info.message) {
 	msg_info->local_info.message->mailbox = NULL;
@@ -562,70 +1103,65 @@ free_message_info(struct message_info *msg_info)
                                      (gpointer) & msg_info->local_info.message);
 	msg_info->local_info.message = NULL;
     }
-    g_free(msg_info);
+    /* Records restored from the cache share one block. */
+    if (msg_info < mbox->msg_info_block
+        || msg_info >= mbox->msg_info_block + mbox->msg_info_block_len)
+        g_free(msg_info);
 }
 
 static void
-free_messages_info(GPtrArray * msgno_2_msg_info)
+free_messages_info(LibBalsaMailboxMbox * mbox)
 {
     guint i;
 
-    for (i = 0; i < msgno_2_msg_info->len; i++) {
+    for (i = 0; i < mbox->msgno_2_msg_info->len; i++) {
         struct message_info *msg_info =
-            g_ptr_array_index(msgno_2_msg_info, i);
-        free_message_info(msg_info);
+            g_ptr_array_index(mbox->msgno_2_msg_info, i);
+        free_message_info(mbox, msg_info);
     }
-    g_ptr_array_free(msgno_2_msg_info, TRUE);
+    g_ptr_array_free(mbox->msgno_2_msg_info, TRUE);
+    mbox->msgno_2_msg_info = NULL;
+
+    g_free(mbox->msg_info_block);
+    mbox->msg_info_block = NULL;
+    mbox->msg_info_block_len = 0;
 }
 
 static void
 lbm_mbox_restore(LibBalsaMailboxMbox * mbox)
 {
-    gchar *filename;
-    struct stat st;
-    gchar *contents;
-    gsize length;
-    off_t end;
+    GMimeStream *mbox_stream = mbox->gmime_stream;
+    GMappedFile *cache;
+    const LbmMboxCacheRecord *records;
+    guint n_records;
+    gboolean current;
     struct message_info *msg_info;
-    GMimeStream *mbox_stream;
+    guint i;
+    off_t end;
 
-    filename = lbm_mbox_get_cache_filename(mbox);
-    if (stat(filename, &st) < 0 
-        || st.st_mtime < libbalsa_mailbox_get_mtime(LIBBALSA_MAILBOX(mbox))
-        || !g_file_get_contents(filename, &contents, &length, NULL)) {
+    cache = lbm_mbox_cache_map(mbox, GMIME_STREAM_FS(mbox_stream)->fd,
+                               &records, &n_records, &current);
+    if (!cache)
         /* No cache file, stale cache, or read error. */
-        g_free(filename);
-        return;
-    }
-
-    g_free(filename);
-
-    if (length < sizeof(struct message_info)) {
-        /* Error: file always contains at least one record. */
-        g_free(contents);
         return;
-    }
 
 #ifdef DEBUG
-    g_print("%s: %s file has %zd messages\n", __func__,
-            LIBBALSA_MAILBOX(mbox)->name,
-            length / sizeof(struct message_info));
+    g_print("%s: %s file has %u messages\n", __func__,
+            LIBBALSA_MAILBOX(mbox)->name, n_records);
 #endif
 
-    msg_info = (struct message_info *) contents;
-
-    if (msg_info->start != 0) {
-        /* Error: first message should start at 0. */
-        g_free(contents);
-        return;
-    }
+    /* The header has tied the records to this mbox, so we need only
+     * check that they tile it, without touching the mbox itself. */
+    msg_info = g_new(struct message_info, n_records);
+    mbox->msg_info_block = msg_info;
+    mbox->msg_info_block_len = n_records;
 
     end = 0;
-    do {
-        msg_info->local_info.message = NULL;
+    for (i = 0; i < n_records; i++, msg_info++) {
+        lbm_mbox_record_get(&records[i], msg_info);
         if (msg_info->start != end)
             /* Error: this message doesn't start at the end of the
-             * previous one. */
+             * previous one, or the first doesn't start at 0. */
             break;
         end = msg_info->end;
         if (msg_info->from_len < 6
@@ -633,28 +1169,24 @@ lbm_mbox_restore(LibBalsaMailboxMbox * mbox)
             || end > mbox->size)
             /* Error: various. */
             break;
-        if (end < mbox->size
-            && !lbm_mbox_seek_to_message(mbox, msg_info->end))
-            /* Error: no message following this one. */
-            break;
-        g_ptr_array_add(mbox->msgno_2_msg_info,
-                        g_memdup(msg_info, sizeof *msg_info));
-    } while (++msg_info < (struct message_info *) (contents + length));
+        g_ptr_array_add(mbox->msgno_2_msg_info, msg_info);
+    }
+    lbm_mbox_cache_unmap(cache);
+
+    if (i < n_records || !current)
+        /* Save a fresh cache, even if nothing new is found. */
+        mbox->messages_info_changed = TRUE;
 
 #ifdef DEBUG
-    g_print("%s: %s restored %zd messages\n", __func__,
-            LIBBALSA_MAILBOX(mbox)->name,
-            msg_info - (struct message_info *) contents);
+    g_print("%s: %s restored %u messages\n", __func__,
+            LIBBALSA_MAILBOX(mbox)->name, i);
 #endif
 
-    mbox_stream = mbox->gmime_stream;
     libbalsa_mime_stream_shared_lock(mbox_stream);
-    /* Position the stream for parsing; msg_info is pointing either one
-     * message beyond the end of the array, or at the offending message,
-     * so we just seek to the end of the previous message. */
+    /* Position the stream for parsing, at the end of the last message
+     * we restored. */
     g_mime_stream_seek(mbox_stream,
-                       msg_info > (struct message_info *) contents ?
-                       (--msg_info)->end : 0,
+                       i > 0 ? mbox->msg_info_block[i - 1].end : 0,
                        GMIME_STREAM_SEEK_SET);
 
     /* GMimeParser seems to have issues with a file that has no From_
@@ -671,8 +1203,6 @@ lbm_mbox_restore(LibBalsaMailboxMbox * mbox)
                 break;
     }
     libbalsa_mime_stream_shared_unlock(mbox_stream);
-
-    g_free(contents);
 }
 
 static gboolean
@@ -813,29 +1343,26 @@ lbm_mbox_readln(LbmMboxStreamBuffer * buffer, GByteArray * line)
 }
 
 /*
- * Look for an unread, undeleted message using the cache file.
+ * Look for an unread, undeleted message using the cache file; the
+ * records are read in place from the mapping.
  */
 static gboolean
 lbm_mbox_check_cache(LibBalsaMailboxMbox * mbox,
                      LbmMboxStreamBuffer * buffer, GByteArray * line)
 {
-    gchar *filename;
-    gboolean tmp;
-    gchar *contents;
-    gsize length;
-    struct message_info *msg_info;
+    GMappedFile *cache;
+    const LbmMboxCacheRecord *records;
+    const LbmMboxCacheRecord *record;
+    guint n_records;
     gboolean retval = FALSE;
 
-    filename = lbm_mbox_get_cache_filename(mbox);
-    tmp = g_file_get_contents(filename, &contents, &length, NULL);
-    g_free(filename);
-    if (!tmp)
+    cache = lbm_mbox_cache_map(mbox, GMIME_STREAM_FS(buffer->stream)->fd,
+                               &records, &n_records, NULL);
+    if (!cache)
         return retval;
 
-    for (msg_info = (struct message_info *) contents;
-         msg_info < (struct message_info *) (contents + length);
-         msg_info++) {
-        if (lbm_mbox_seek(buffer, msg_info->status) >= 0
+    for (record = records; record < records + n_records; record++) {
+        if (lbm_mbox_seek(buffer, GINT64_FROM_LE(record->status)) >= 0
             && lbm_mbox_readln(buffer, line)) {
             if (g_ascii_strncasecmp((gchar *) line->data,
                                     "Status: ", 8) != 0)
@@ -845,7 +1372,7 @@ lbm_mbox_check_cache(LibBalsaMailboxMbox * mbox,
                 /* Message has been read. */
                 continue;
         }
-        if (lbm_mbox_seek(buffer, msg_info->x_status) >= 0
+        if (lbm_mbox_seek(buffer, GINT64_FROM_LE(record->x_status)) >= 0
             && lbm_mbox_readln(buffer, line)) {
             if (g_ascii_strncasecmp((gchar *) line->data,
                                     "X-Status: ", 10) != 0)
@@ -861,10 +1388,9 @@ lbm_mbox_check_cache(LibBalsaMailboxMbox * mbox,
     }
     if (!retval)
         /* Seek to the end of the last message we checked. */
-        lbm_mbox_seek(buffer, msg_info > (struct message_info *) contents ?
-                      (msg_info-1)->end : 0);
-    g_free(contents); /* msg_info points to contents, cannot free too early */
-
+        lbm_mbox_seek(buffer, record > records ?
+                      (off_t) GUINT64_FROM_LE((record - 1)->end) : 0);
+    lbm_mbox_cache_unmap(cache); /* record points into the mapping */
 
     return retval;
 }
@@ -1093,7 +1619,7 @@ libbalsa_mailbox_mbox_check(LibBalsaMailbox * mailbox)
         libbalsa_mime_stream_shared_lock(mbox_stream);
         g_mime_stream_seek(mbox_stream, offset, GMIME_STREAM_SEEK_SET);
 
-        free_message_info(msg_info);
+        free_message_info(mbox, msg_info);
         g_ptr_array_remove_index(mbox->msgno_2_msg_info, msgno - 1);
         mbox->messages_info_changed = TRUE;
     }
@@ -1136,8 +1662,7 @@ libbalsa_mailbox_mbox_close_mailbox(LibBalsaMailbox * mailbox,
         mbox->gmime_stream = NULL;
     }
 
-    free_messages_info(mbox->msgno_2_msg_info);
-    mbox->msgno_2_msg_info = NULL;
+    free_messages_info(mbox);
 }
 
 static GMimeMessage *
@@ -1420,6 +1945,7 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
     gboolean save_failed;
     GMimeParser *gmime_parser;
     LibBalsaMailboxMbox *mbox;
+    GArray *removed;
 
     /* FIXME: We should probably lock the mailbox file before checking,
      * and hold the lock while we sync it.  As it stands,
@@ -1640,19 +2166,26 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
     unlink(tempfile); /* remove partial copy of the mailbox */
     g_free(tempfile);
 
+    /* Expunged msgnos, in the numbering the view still uses; the view
+     * is told about all of them at once when we are done. */
+    removed = g_array_new(FALSE, FALSE, sizeof(guint));
+
     if (mailbox->state == LB_MAILBOX_STATE_CLOSING) {
 	/* Just shorten the msg_info array. */
 	for (j = first; j < mbox->msgno_2_msg_info->len; ) {
 	    msg_info = message_info_from_msgno(mbox, j + 1);
 	    if (expunge &&
 		(msg_info->local_info.flags & LIBBALSA_MESSAGE_FLAG_DELETED)) {
-	        libbalsa_mailbox_local_msgno_removed(mailbox, j + 1);
-		free_message_info(msg_info);
+	        guint msgno = j + 1 + removed->len;
+	        g_array_append_val(removed, msgno);
+		free_message_info(mbox, msg_info);
 		g_ptr_array_remove_index(mbox->msgno_2_msg_info, j);
                 mbox->messages_info_changed = TRUE;
 	    } else
 		j++;
 	}
+	libbalsa_mailbox_local_msgnos_removed(mailbox, removed);
+	g_array_free(removed, TRUE);
         lbm_mbox_save(mbox);
 	return TRUE;
     }
@@ -1663,6 +2196,7 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
 	== -1) {
 	g_warning("Can't update message info");
 	libbalsa_mime_stream_shared_unlock(mbox_stream);
+	g_array_free(removed, TRUE);
 	return FALSE;
     }
     gmime_parser = g_mime_parser_new_with_stream(mbox_stream);
@@ -1677,17 +2211,9 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
 
 	msg_info = message_info_from_msgno(mbox, j + 1);
 	if (expunge && (msg_info->local_info.flags & LIBBALSA_MESSAGE_FLAG_DELETED)) {
-	    /* We must drop the mime-stream lock to call
-	     * libbalsa_mailbox_local_msgno_removed(), as it will grab
-	     * the gdk lock to emit gtk signals; we save and restore the
-	     * current file position, in case someone changes it while
-	     * we're not holding the lock. */
-	    offset = g_mime_stream_tell(mbox_stream);
-	    libbalsa_mime_stream_shared_unlock(mbox_stream);
-	    libbalsa_mailbox_local_msgno_removed(mailbox, j + 1);
-	    libbalsa_mime_stream_shared_lock(mbox_stream);
-	    g_mime_stream_seek(mbox_stream, offset, GMIME_STREAM_SEEK_SET);
-	    free_message_info(msg_info);
+	    guint msgno = j + 1 + removed->len;
+	    g_array_append_val(removed, msgno);
+	    free_message_info(mbox, msg_info);
 	    g_ptr_array_remove_index(mbox->msgno_2_msg_info, j);
             mbox->messages_info_changed = TRUE;
 	    continue;
@@ -1739,6 +2265,10 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
     libbalsa_mime_stream_shared_unlock(mbox_stream);
     mbox->msgno_2_msg_info->len = j;
     g_object_unref(gmime_parser);
+    /* We must not hold the mime-stream lock here, as this will grab the
+     * gdk lock to emit gtk signals. */
+    libbalsa_mailbox_local_msgnos_removed(mailbox, removed);
+    g_array_free(removed, TRUE);
     lbm_mbox_save(mbox);
 
     return TRUE;
@@ -1765,7 +2295,7 @@ libbalsa_mailbox_mbox_fetch_message_structure(LibBalsaMailbox * mailbox,
         fetch_message_structure(mailbox, message, flags);
 }
 
-/* Create the LibBalsaMessage and call libbalsa_message_init_from_gmime
+/* Create the LibBalsaMessage and call libbalsa_message_init_from_headers
  * to populate the headers we need for the display:
  *   headers->from
  *   headers->date
@@ -1777,47 +2307,40 @@ libbalsa_mailbox_mbox_fetch_message_structure(LibBalsaMailbox * mailbox,
  *   message_id
  *   references
  *   in_reply_to
+ * The flags come from the values of the Status and X-Status fields,
+ * which are NULL if the message has none.
  */
 static LibBalsaMessage *
-lbm_mbox_message_new(GMimeMessage * mime_message,
+lbm_mbox_message_new(const gchar * fields, const gchar * status,
+                     const gchar * x_status,
 		     struct message_info *msg_info)
 {
     LibBalsaMessage *message;
-    const char *header;
     LibBalsaMessageFlag flags = 0;
 
-#if defined(THIS_HAS_BEEN_TESTED)
-    if (mime_message->subject &&
-	!strcmp(mime_message->subject,
-		"DON'T DELETE THIS MESSAGE -- FOLDER INTERNAL DATA")) {
-	return NULL;
-    }
-#endif
-
     message = libbalsa_message_new();
 
-    header = g_mime_object_get_header (GMIME_OBJECT(mime_message), "Status");
-    if (header) {
-	if (strchr(header, 'R') == NULL) /* not found == not READ */
+    if (status) {
+	if (strchr(status, 'R') == NULL) /* not found == not READ */
 	    flags |= LIBBALSA_MESSAGE_FLAG_NEW;
-	if (strchr(header, 'r') != NULL) /* found == REPLIED */
+	if (strchr(status, 'r') != NULL) /* found == REPLIED */
 	    flags |= LIBBALSA_MESSAGE_FLAG_REPLIED;
-	if (strchr(header, 'O') == NULL) /* not found == RECENT */
+	if (strchr(status, 'O') == NULL) /* not found == RECENT */
 	    flags |= LIBBALSA_MESSAGE_FLAG_RECENT;
     } else
 	    flags |= LIBBALSA_MESSAGE_FLAG_NEW |  LIBBALSA_MESSAGE_FLAG_RECENT;
-    header = g_mime_object_get_header (GMIME_OBJECT(mime_message), "X-Status");
-    if (header) {
-	if (strchr(header, 'D') != NULL) /* found == DELETED */
+    if (x_status) {
+	if (strchr(x_status, 'D') != NULL) /* found == DELETED */
 	    flags |= LIBBALSA_MESSAGE_FLAG_DELETED;
-	if (strchr(header, 'F') != NULL) /* found == FLAGGED */
+	if (strchr(x_status, 'F') != NULL) /* found == FLAGGED */
 	    flags |= LIBBALSA_MESSAGE_FLAG_FLAGGED;
-	if (strchr(header, 'A') != NULL) /* found == REPLIED */
+	if (strchr(x_status, 'A') != NULL) /* found == REPLIED */
 	    flags |= LIBBALSA_MESSAGE_FLAG_REPLIED;
     }
     msg_info->orig_flags = flags;
 
-    libbalsa_message_init_from_gmime(message, mime_message);
+    if (*fields)
+        libbalsa_message_init_from_headers(message, fields);
 
     return message;
 }
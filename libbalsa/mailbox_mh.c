@@ -520,6 +520,7 @@ libbalsa_mailbox_mh_open(LibBalsaMailbox * mailbox, GError **err)
     LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(mailbox);
     struct stat st;
     const gchar* path;
+    const gchar *dirs[2];
    
     path = libbalsa_mailbox_local_get_path(mailbox);
 
@@ -536,6 +537,11 @@ libbalsa_mailbox_mh_open(LibBalsaMailbox * mailbox, GError **err)
 		              (GDestroyNotify)lbm_mh_free_message_info);
     mh->msgno_2_msg_info = g_ptr_array_new();
     mh->last_fileno = 0;
+
+    /* Watch before parsing, so that no change is missed. */
+    dirs[0] = path;
+    dirs[1] = NULL;
+    libbalsa_mailbox_local_watch(LIBBALSA_MAILBOX_LOCAL(mailbox), dirs);
     
     mailbox->readonly = access (path, W_OK);
     mailbox->unread_messages = 0;
@@ -613,6 +619,268 @@ lbm_mh_check(LibBalsaMailboxMh * mh, const gchar * path)
     return retval;
 }
 
+/* Drop the messages whose msgnos are in removed, in ascending order,
+ * from msgno_2_msg_info in one pass, renumbering the rest, and tell the
+ * view about all of them at once. */
+static void
+lbm_mh_remove_messages(LibBalsaMailbox * mailbox, GArray * removed)
+{
+    LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(mailbox);
+    GPtrArray *expunged;
+    guint msgno, i, k;
+
+    if (removed->len == 0)
+        return;
+
+    expunged = g_ptr_array_sized_new(removed->len);
+    for (msgno = 1, i = k = 0; msgno <= mh->msgno_2_msg_info->len;
+         msgno++) {
+        struct message_info *msg_info =
+            lbm_mh_message_info_from_msgno(mh, msgno);
+
+        if (k < removed->len && g_array_index(removed, guint, k) == msgno) {
+            g_ptr_array_add(expunged, msg_info);
+            k++;
+        } else {
+            g_ptr_array_index(mh->msgno_2_msg_info, i++) = msg_info;
+            if (msg_info->local_info.message)
+                msg_info->local_info.message->msgno = i;
+        }
+    }
+    g_ptr_array_set_size(mh->msgno_2_msg_info, i);
+
+    libbalsa_mailbox_local_msgnos_removed(mailbox, removed);
+
+    for (i = 0; i < expunged->len; i++) {
+        struct message_info *msg_info = g_ptr_array_index(expunged, i);
+        /* This will free msg_info: */
+        g_hash_table_remove(mh->messages_info,
+                            GINT_TO_POINTER(msg_info->fileno));
+    }
+    g_ptr_array_free(expunged, TRUE);
+}
+
+/* Rescan an open mailbox: look for every known file, and parse the
+ * directory and the sequences. */
+static void
+lbm_mh_rescan(LibBalsaMailbox * mailbox)
+{
+    LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(mailbox);
+    const gchar *path = libbalsa_mailbox_local_get_path(mailbox);
+    guint msgno;
+    struct message_info *msg_info;
+    GArray *removed;
+
+    /* Was any message removed? */
+    removed = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (msgno = 1; msgno <= mh->msgno_2_msg_info->len; msgno++) {
+	gchar *tmp, *filename;
+
+	msg_info = lbm_mh_message_info_from_msgno(mh, msgno);
+	tmp = MH_BASENAME(msg_info);
+	filename = g_build_filename(path, tmp, NULL);
+	g_free(tmp);
+	if (access(filename, F_OK) != 0)
+	    g_array_append_val(removed, msgno);
+	g_free(filename);
+    }
+    lbm_mh_remove_messages(mailbox, removed);
+    g_array_free(removed, TRUE);
+
+    msgno = mh->msgno_2_msg_info->len;
+    lbm_mh_parse_both(mh);
+    libbalsa_mailbox_local_load_messages(mailbox, msgno);
+}
+
+/* Watched mailbox: the changes since the last check, by fileno. A
+ * message that was marked as deleted, by renaming N to ,N, ends up
+ * with its last name. */
+struct lbm_mh_changes {
+    LibBalsaMailboxMh *mh;
+    GHashTable *files;          /* fileno -> struct lbm_mh_change */
+    gboolean sequences;         /* .mh_sequences was rewritten */
+};
+
+struct lbm_mh_change {
+    gboolean known;             /* we know its name */
+    gboolean deleted;           /* the name is ,N */
+    gboolean gone;
+    gboolean written;           /* a new file is complete */
+};
+
+/* Whether the file name in the mh folder has more than one link, as a
+ * message that was linked in rather than written. */
+static gboolean
+lbm_mh_is_linked(LibBalsaMailboxLocal * local, const gchar * name)
+{
+    gchar *path;
+    struct stat st;
+    gboolean retval;
+
+    path = g_build_filename(libbalsa_mailbox_local_get_path(local), name,
+                            NULL);
+    retval = stat(path, &st) == 0 && st.st_nlink > 1;
+    g_free(path);
+
+    return retval;
+}
+
+/* A file that was only created may still be being written, and is not
+ * taken as a new message until it is closed; a message that was linked
+ * in is complete as soon as it is created. */
+static void
+lbm_mh_watch_event(LibBalsaMailboxLocal * local, guint dir,
+                   const gchar * name, LibBalsaMailboxWatchEvent what,
+                   struct lbm_mh_changes *changes)
+{
+    struct lbm_mh_change *change;
+    const gchar *filename = name;
+    gboolean added = what != LB_MAILBOX_WATCH_REMOVED;
+    gboolean deleted = FALSE;
+    gint fileno;
+
+    if (strcmp(name, ".mh_sequences") == 0) {
+        if (what != LB_MAILBOX_WATCH_CREATED)
+            changes->sequences = TRUE;
+        return;
+    }
+
+    if (name[0] == ',') {
+        name++;
+        deleted = TRUE;
+    }
+    if (!*name || lbm_mh_check_filename(name) == FALSE
+        || sscanf(name, "%d", &fileno) != 1)
+        return;
+
+    if (!(change = g_hash_table_lookup(changes->files,
+                                       GINT_TO_POINTER(fileno)))) {
+        struct message_info *msg_info =
+            g_hash_table_lookup(changes->mh->messages_info,
+                                GINT_TO_POINTER(fileno));
+
+        if (!msg_info && !added)
+            /* Gone before we knew about it. */
+            return;
+        change = g_new0(struct lbm_mh_change, 1);
+        if (msg_info) {
+            change->known = TRUE;
+            change->deleted =
+                (msg_info->orig_flags & LIBBALSA_MESSAGE_FLAG_DELETED) != 0;
+        }
+        g_hash_table_insert(changes->files, GINT_TO_POINTER(fileno),
+                            change);
+    }
+
+    if (added) {
+        change->known = TRUE;
+        change->deleted = deleted;
+        change->gone = FALSE;
+        if (what == LB_MAILBOX_WATCH_WRITTEN
+            || lbm_mh_is_linked(local, filename))
+            change->written = TRUE;
+    } else if (change->known && change->deleted == deleted)
+        /* The old name of a renamed file is not its last name. */
+        change->gone = TRUE;
+}
+
+/* Apply the changes reported by the watch; returns FALSE if the
+ * mailbox must be rescanned. */
+static gboolean
+lbm_mh_watch_apply(LibBalsaMailbox * mailbox)
+{
+    LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(mailbox);
+    struct lbm_mh_changes changes;
+    GArray *removed;
+    GPtrArray *added;
+    GHashTableIter iter;
+    gpointer key, value;
+    guint msgno, i;
+
+    changes.mh = mh;
+    changes.files = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    changes.sequences = FALSE;
+    if (!libbalsa_mailbox_local_watch_events
+        (LIBBALSA_MAILBOX_LOCAL(mailbox),
+         (LibBalsaMailboxLocalWatchFunc) lbm_mh_watch_event, &changes)) {
+        g_hash_table_destroy(changes.files);
+        return FALSE;
+    }
+
+    /* Renamed and removed messages. */
+    removed = g_array_new(FALSE, FALSE, sizeof(guint));
+    if (g_hash_table_size(changes.files) > 0)
+        for (msgno = 1; msgno <= mh->msgno_2_msg_info->len; msgno++) {
+            struct message_info *msg_info =
+                lbm_mh_message_info_from_msgno(mh, msgno);
+            struct lbm_mh_change *change =
+                g_hash_table_lookup(changes.files,
+                                    GINT_TO_POINTER(msg_info->fileno));
+
+            if (!change)
+                continue;
+            if (change->gone)
+                g_array_append_val(removed, msgno);
+            else if (change->deleted)
+                msg_info->orig_flags |= LIBBALSA_MESSAGE_FLAG_DELETED;
+            else
+                msg_info->orig_flags &= ~LIBBALSA_MESSAGE_FLAG_DELETED;
+            /* This frees change: */
+            g_hash_table_remove(changes.files,
+                                GINT_TO_POINTER(msg_info->fileno));
+        }
+    lbm_mh_remove_messages(mailbox, removed);
+    g_array_free(removed, TRUE);
+
+    /* What is left are new messages, kept in order of fileno. */
+    added = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, changes.files);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct lbm_mh_change *change = value;
+        struct message_info *msg_info;
+
+        if (change->gone || !change->written)
+            /* A file still being written is added when it is closed. */
+            continue;
+        msg_info = g_new0(struct message_info, 1);
+        msg_info->local_info.flags = INVALID_FLAG;
+        msg_info->orig_flags =
+            change->deleted ? LIBBALSA_MESSAGE_FLAG_DELETED : 0;
+        msg_info->fileno = GPOINTER_TO_INT(key);
+        if (msg_info->fileno > (gint) mh->last_fileno)
+            mh->last_fileno = msg_info->fileno;
+        g_ptr_array_add(added, msg_info);
+    }
+    g_hash_table_destroy(changes.files);
+    g_ptr_array_sort(added, (GCompareFunc) lbm_mh_compare_fileno);
+
+    msgno = mh->msgno_2_msg_info->len;
+    for (i = 0; i < added->len; i++) {
+        struct message_info *msg_info = g_ptr_array_index(added, i);
+
+        g_hash_table_insert(mh->messages_info,
+                            GINT_TO_POINTER(msg_info->fileno), msg_info);
+        g_ptr_array_add(mh->msgno_2_msg_info, msg_info);
+    }
+
+    if (changes.sequences) {
+        /* As in a rescan, the sequences are the flags, except for
+         * deleted. */
+        for (i = 1; i <= mh->msgno_2_msg_info->len; i++) {
+            struct message_info *msg_info =
+                lbm_mh_message_info_from_msgno(mh, i);
+            msg_info->orig_flags &= LIBBALSA_MESSAGE_FLAG_DELETED;
+        }
+        lbm_mh_parse_sequences(mh);
+    }
+
+    if (added->len > 0)
+        libbalsa_mailbox_local_load_messages(mailbox, msgno);
+    g_ptr_array_free(added, TRUE);
+
+    return TRUE;
+}
+
 static int libbalsa_mailbox_mh_open_temp (const gchar *dest_path,
 					  char **name_used);
 /* Called with mailbox locked. */
@@ -623,10 +891,15 @@ libbalsa_mailbox_mh_check(LibBalsaMailbox * mailbox)
     LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(mailbox);
     const gchar *path = libbalsa_mailbox_local_get_path(mailbox);
     int modified = 0;
-    guint renumber, msgno;
-    struct message_info *msg_info;
     time_t mtime;
 
+    if (MAILBOX_OPEN(mailbox) && LIBBALSA_MAILBOX_LOCAL(mailbox)->watch) {
+        /* No need to look at the files. */
+        if (!lbm_mh_watch_apply(mailbox))
+            lbm_mh_rescan(mailbox);
+        return;
+    }
+
     if (stat(path, &st) == -1)
 	return;
 
@@ -673,37 +946,7 @@ libbalsa_mailbox_mh_check(LibBalsaMailbox * mailbox)
 	return;
     }
 
-    /* Was any message removed? */
-    renumber = mh->msgno_2_msg_info->len + 1;
-    for (msgno = 1; msgno <= mh->msgno_2_msg_info->len; ) {
-	gchar *tmp, *filename;
-
-	msg_info = lbm_mh_message_info_from_msgno(mh, msgno);
-	tmp = MH_BASENAME(msg_info);
-	filename = g_build_filename(path, tmp, NULL);
-	g_free(tmp);
-	if (access(filename, F_OK) == 0)
-	    msgno++;
-	else {
-	    g_ptr_array_remove(mh->msgno_2_msg_info, msg_info);
-	    g_hash_table_remove(mh->messages_info, 
-		    		GINT_TO_POINTER(msg_info->fileno));
-	    libbalsa_mailbox_local_msgno_removed(mailbox, msgno);
-	    if (renumber > msgno)
-		/* First message that needs renumbering. */
-		renumber = msgno;
-	}
-	g_free(filename);
-    }
-    for (msgno = renumber; msgno <= mh->msgno_2_msg_info->len; msgno++) {
-	msg_info = lbm_mh_message_info_from_msgno(mh, msgno);
-	if (msg_info->local_info.message)
-	    msg_info->local_info.message->msgno = msgno;
-    }
-
-    msgno = mh->msgno_2_msg_info->len;
-    lbm_mh_parse_both(mh);
-    libbalsa_mailbox_local_load_messages(mailbox, msgno);
+    lbm_mh_rescan(mailbox);
 }
 
 static void
@@ -806,6 +1049,7 @@ libbalsa_mailbox_mh_sync(LibBalsaMailbox * mailbox, gboolean expunge)
     GMimeStream *gmime_stream_buffer;
     GByteArray *line;
     gboolean retval = FALSE;
+    GArray *removed;
 
     g_return_val_if_fail(LIBBALSA_IS_MAILBOX_MH(mailbox), FALSE);
     mh = (LibBalsaMailboxMh *) mailbox;
@@ -831,6 +1075,7 @@ libbalsa_mailbox_mh_sync(LibBalsaMailbox * mailbox, gboolean expunge)
 
     path = libbalsa_mailbox_local_get_path(mailbox);
 
+    removed = g_array_new(FALSE, FALSE, sizeof(guint));
     msgno = 1;
     while (msgno <= mh->msgno_2_msg_info->len) {
 	msg_info = lbm_mh_message_info_from_msgno(mh, msgno);
@@ -851,11 +1096,8 @@ libbalsa_mailbox_mh_sync(LibBalsaMailbox * mailbox, gboolean expunge)
 	    g_free(tmp);
 	    unlink(orig);
 	    g_free(orig);
-	    /* free old information */
-	    g_ptr_array_remove(mh->msgno_2_msg_info, msg_info);
-	    g_hash_table_remove(mh->messages_info, 
-		    		GINT_TO_POINTER(msg_info->fileno));
-	    libbalsa_mailbox_local_msgno_removed(mailbox, msgno);
+	    /* old information is freed below */
+	    g_array_append_val(removed, msgno);
 	} else {
 	    lbm_mh_flag_line(msg_info, LIBBALSA_MESSAGE_FLAG_NEW, &unseen);
 	    lbm_mh_flag_line(msg_info, LIBBALSA_MESSAGE_FLAG_FLAGGED, &flagged);
@@ -887,20 +1129,17 @@ libbalsa_mailbox_mh_sync(LibBalsaMailbox * mailbox, gboolean expunge)
 	    } else
                 msg_info->orig_flags =
                     REAL_FLAGS(msg_info->local_info.flags);
-	    msgno++;
 	}
+	msgno++;
     }
     lbm_mh_print_line(&unseen);
     lbm_mh_print_line(&flagged);
     lbm_mh_print_line(&replied);
     lbm_mh_print_line(&recent);
 
-    /* Renumber */
-    for (msgno = 1; msgno <= mh->msgno_2_msg_info->len; msgno++) {
-	msg_info = lbm_mh_message_info_from_msgno(mh, msgno);
-	if (msg_info->local_info.message)
-	    msg_info->local_info.message->msgno = msgno;
-    }
+    /* Free the expunged messages and renumber the rest */
+    lbm_mh_remove_messages(mailbox, removed);
+    g_array_free(removed, TRUE);
 
     /* open tempfile */
     path = libbalsa_mailbox_local_get_path(mailbox);
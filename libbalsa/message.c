@@ -1205,6 +1205,16 @@ libbalsa_message_set_headers_from_string(LibBalsaMessage *message,
     return lb_message_set_headers_from_string(message, lines, TRUE);
 }
 
+/* Set only the headers that are needed all the time, from a block of
+ * header fields; the counterpart of libbalsa_message_init_from_gmime
+ * for callers that have not parsed the message. */
+gboolean
+libbalsa_message_init_from_headers(LibBalsaMessage *message,
+                                   const gchar *lines)
+{
+    return lb_message_set_headers_from_string(message, lines, FALSE);
+}
+
 void
 libbalsa_message_load_envelope_from_stream(LibBalsaMessage * message,
                                            GMimeStream *gmime_stream)
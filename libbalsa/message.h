@@ -350,6 +350,8 @@ void libbalsa_message_load_envelope_from_stream(LibBalsaMessage * message,
 void libbalsa_message_load_envelope(LibBalsaMessage *message);
 gboolean libbalsa_message_set_headers_from_string(LibBalsaMessage *message,
                                                   const gchar *str);
+gboolean libbalsa_message_init_from_headers(LibBalsaMessage *message,
+                                            const gchar *lines);
 void libbalsa_message_set_references_from_string(LibBalsaMessage * message,
 						 const gchar *str);
 void libbalsa_message_set_in_reply_to_from_string(LibBalsaMessage * message,
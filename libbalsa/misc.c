@@ -557,6 +557,9 @@ libbalsa_utf8_sanitize(gchar **text, gboolean fallback,
 /* libbalsa_utf8_strstr() returns TRUE if s2 is a substring of s1.
  * libbalsa_utf8_strstr is case insensitive
  * this functions understands utf8 strings (as you might have guessed ;-)
+ * It folds s2 again for each call, which is cheapest for a single
+ * search; to search many strings for the same s2, compile it once with
+ * libbalsa_utf8_needle_new().
  */
 gboolean
 libbalsa_utf8_strstr(const gchar *s1, const gchar *s2)
@@ -593,6 +596,166 @@ libbalsa_utf8_strstr(const gchar *s1, const gchar *s2)
     return FALSE;
 }
 
+/* A compiled needle for libbalsa_utf8_strstr: characters match when
+ * their g_unichar_toupper() values are equal.  The needle is folded
+ * once; an ASCII needle is then searched for byte by byte, with
+ * Boyer-Moore-Horspool shifts, and only the rare haystacks that contain
+ * U+0131 or U+017F (which upper-case to I and S) need the general
+ * character by character search. */
+struct _LibBalsaUtf8Needle {
+    gunichar *chars;            /* the upper-cased characters */
+    glong n_chars;
+    guchar *ascii;              /* the upper-cased bytes, if all ASCII */
+    gsize len;
+    gboolean dotless;           /* ascii contains I or S */
+    gsize shift[256];           /* indexed by upper-cased byte */
+};
+
+#define LBU_ASCII_UPPER(c) ((c) >= 'a' && (c) <= 'z' ? (c) - 'a' + 'A' : (c))
+
+LibBalsaUtf8Needle *
+libbalsa_utf8_needle_new(const gchar * str)
+{
+    LibBalsaUtf8Needle *needle;
+    const gchar *p;
+    glong i;
+
+    if (!str)
+        return NULL;
+
+    needle = g_new(LibBalsaUtf8Needle, 1);
+    needle->n_chars = g_utf8_strlen(str, -1);
+    needle->chars = g_new(gunichar, needle->n_chars + 1);
+    for (p = str, i = 0; i < needle->n_chars; p = g_utf8_next_char(p), i++)
+        needle->chars[i] = g_unichar_toupper(g_utf8_get_char(p));
+    needle->chars[i] = 0;
+
+    needle->ascii = NULL;
+    needle->len = strlen(str);
+    needle->dotless = FALSE;
+    if (needle->len == (gsize) needle->n_chars && needle->len > 0) {
+        gsize j;
+
+        needle->ascii = g_new(guchar, needle->len + 1);
+        for (j = 0; j < needle->len; j++) {
+            needle->ascii[j] = needle->chars[j];
+            if (needle->ascii[j] == 'I' || needle->ascii[j] == 'S')
+                needle->dotless = TRUE;
+        }
+        needle->ascii[j] = '\0';
+
+        for (j = 0; j < G_N_ELEMENTS(needle->shift); j++)
+            needle->shift[j] = needle->len;
+        for (j = 0; j + 1 < needle->len; j++)
+            needle->shift[needle->ascii[j]] = needle->len - 1 - j;
+    }
+
+    return needle;
+}
+
+void
+libbalsa_utf8_needle_free(LibBalsaUtf8Needle * needle)
+{
+    if (!needle)
+        return;
+
+    g_free(needle->chars);
+    g_free(needle->ascii);
+    g_free(needle);
+}
+
+static gboolean
+lbu_find_ascii(const LibBalsaUtf8Needle * needle, const guchar * s,
+               gsize len)
+{
+    const guchar *ascii = needle->ascii;
+    gsize m = needle->len;
+    gsize pos;
+
+    if (m == 1) {
+        guchar c = ascii[0];
+
+        return memchr(s, c, len) != NULL
+            || (g_ascii_isupper(c)
+                && memchr(s, g_ascii_tolower(c), len) != NULL);
+    }
+
+    for (pos = 0; pos + m <= len; ) {
+        guchar c = LBU_ASCII_UPPER(s[pos + m - 1]);
+
+        if (c == ascii[m - 1]) {
+            gsize i = m - 1;
+
+            while (i > 0 && LBU_ASCII_UPPER(s[pos + i - 1]) == ascii[i - 1])
+                --i;
+            if (i == 0)
+                return TRUE;
+        }
+        pos += needle->shift[c];
+    }
+
+    return FALSE;
+}
+
+static gunichar
+lbu_get_upper(const gchar * p)
+{
+    guchar c = *p;
+
+    return c < 0x80 ? (gunichar) LBU_ASCII_UPPER(c)
+        : g_unichar_toupper(g_utf8_get_char(p));
+}
+
+static gboolean
+lbu_find_unicode(const LibBalsaUtf8Needle * needle, const gchar * s)
+{
+    for (; *s; s = g_utf8_next_char(s)) {
+        if (lbu_get_upper(s) == needle->chars[0]) {
+            const gchar *q = g_utf8_next_char(s);
+            glong i = 1;
+
+            while (i < needle->n_chars && *q
+                   && lbu_get_upper(q) == needle->chars[i]) {
+                q = g_utf8_next_char(q);
+                ++i;
+            }
+            if (i == needle->n_chars)
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* libbalsa_utf8_needle_find() returns TRUE if the compiled needle is a
+ * case insensitive substring of haystack; like libbalsa_utf8_strstr, a
+ * NULL needle is contained in anything, and a NULL haystack contains
+ * nothing else. */
+gboolean
+libbalsa_utf8_needle_find(const LibBalsaUtf8Needle * needle,
+                          const gchar * haystack)
+{
+    if (!needle)
+        return TRUE;
+    if (!haystack)
+        return FALSE;
+    if (needle->n_chars == 0)
+        return TRUE;
+
+    if (needle->ascii) {
+        if (lbu_find_ascii(needle, (const guchar *) haystack,
+                           strlen(haystack)))
+            return TRUE;
+        /* Only U+0131 and U+017F upper-case to ASCII. */
+        if (!needle->dotless
+            || (!strstr(haystack, "\xc4\xb1")
+                && !strstr(haystack, "\xc5\xbf")))
+            return FALSE;
+    }
+
+    return lbu_find_unicode(needle, haystack);
+}
+
 /* The LibBalsaCodeset enum is not used for anything currently, but this
  * list must be the same length, and should probably be kept consistent: */
 LibBalsaCodesetInfo libbalsa_codeset_info[LIBBALSA_NUM_CODESETS] = {
@@ -137,6 +137,11 @@ LibBalsaCodeset libbalsa_set_fallback_codeset(LibBalsaCodeset codeset);
 gboolean libbalsa_utf8_sanitize(gchar ** text, gboolean fallback,
                                 gchar const **target);
 gboolean libbalsa_utf8_strstr(const gchar *s1,const gchar *s2);
+typedef struct _LibBalsaUtf8Needle LibBalsaUtf8Needle;
+LibBalsaUtf8Needle *libbalsa_utf8_needle_new(const gchar * str);
+gboolean libbalsa_utf8_needle_find(const LibBalsaUtf8Needle * needle,
+                                   const gchar * haystack);
+void libbalsa_utf8_needle_free(LibBalsaUtf8Needle * needle);
 gboolean libbalsa_insert_with_url(GtkTextBuffer * buffer,
 				  const char *chars,
 				  guint len,
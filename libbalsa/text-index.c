@@ -0,0 +1,897 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2013 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * text-index.c
+ *
+ * Words are maximal runs of alphanumeric characters, after each
+ * character has been passed through g_unichar_toupper(), exactly as
+ * libbalsa_utf8_strstr() compares them.  A substring search for a
+ * string that contains the words w1 ... wn can then only match
+ * messages whose text has a word ending with w1, words equal to w2 ...
+ * wn-1, and a word starting with wn (a single word may be anywhere in a
+ * word of the text), so the candidate messages are found from the word
+ * lists without looking at the messages themselves.
+ *
+ * Messages are numbered in the order in which they were first indexed
+ * ("docs"), and each word has the ascending list of the docs that
+ * contain it.  For the searches that need only part of a word, every
+ * suffix of every word is kept in a table sorted by strcmp(), which is
+ * made when it is first needed after words were added: the words that
+ * contain a string are then those with a suffix that starts with it,
+ * which are next to each other in the table.
+ */
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+
+#include <string.h>
+
+#include "text-index.h"
+
+#define LBTI_MAGIC   0x42544958 /* "BTIX" */
+#define LBTI_VERSION 3
+
+static const unsigned lbti_fields[] = {
+    CONDITION_MATCH_FROM,
+    CONDITION_MATCH_SUBJECT,
+    CONDITION_MATCH_BODY
+};
+#define LBTI_N_FIELDS G_N_ELEMENTS(lbti_fields)
+
+/* The msgno of a doc whose message was expunged. */
+#define LBTI_EXPUNGED G_MAXUINT32
+
+typedef struct {
+    guint32 word;               /* in words */
+    guint32 offset;             /* of the suffix in the word */
+} LbtiSuffix;
+
+typedef struct {
+    GHashTable *postings;       /* word -> GArray of docs */
+    GPtrArray *words;           /* the words, for suffixes */
+    GArray *suffixes;           /* sorted LbtiSuffix, or NULL if words
+                                 * were added since it was made */
+} LbtiField;
+
+struct _LibBalsaTextIndex {
+    GPtrArray *doc_keys;        /* key of each doc */
+    GHashTable *docs;           /* key -> doc + 1 */
+    GByteArray *doc_fields;     /* fields indexed, by doc */
+    GArray *doc_msgnos;         /* msgno bound to each doc, or 0 */
+    GArray *msgno_docs;         /* doc + 1 bound to each msgno - 1, or 0 */
+    guint n_bound;
+    LbtiField fields[LBTI_N_FIELDS];
+    guint stamp;
+    gboolean dirty;
+};
+
+static gint
+lbti_field_pos(unsigned field)
+{
+    guint i;
+
+    for (i = 0; i < LBTI_N_FIELDS; i++)
+        if (lbti_fields[i] == field)
+            return i;
+
+    return -1;
+}
+
+static void
+lbti_docs_free(GArray * docs)
+{
+    g_array_free(docs, TRUE);
+}
+
+static void
+lbti_field_forget_suffixes(LbtiField * field)
+{
+    if (field->suffixes) {
+        g_array_free(field->suffixes, TRUE);
+        g_ptr_array_free(field->words, TRUE);
+        field->suffixes = NULL;
+        field->words = NULL;
+    }
+}
+
+LibBalsaTextIndex *
+libbalsa_text_index_new(void)
+{
+    LibBalsaTextIndex *index;
+    guint i;
+
+    index = g_new(LibBalsaTextIndex, 1);
+    index->doc_keys = g_ptr_array_new();
+    index->docs = g_hash_table_new(g_str_hash, g_str_equal);
+    index->doc_fields = g_byte_array_new();
+    index->doc_msgnos = g_array_new(FALSE, FALSE, sizeof(guint32));
+    index->msgno_docs = g_array_new(FALSE, TRUE, sizeof(guint32));
+    index->n_bound = 0;
+    for (i = 0; i < LBTI_N_FIELDS; i++) {
+        index->fields[i].postings =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify) lbti_docs_free);
+        index->fields[i].words = NULL;
+        index->fields[i].suffixes = NULL;
+    }
+    index->stamp = 0;
+    index->dirty = FALSE;
+
+    return index;
+}
+
+void
+libbalsa_text_index_free(LibBalsaTextIndex * index)
+{
+    guint i;
+
+    if (!index)
+        return;
+
+    g_ptr_array_foreach(index->doc_keys, (GFunc) g_free, NULL);
+    g_ptr_array_free(index->doc_keys, TRUE);
+    g_hash_table_destroy(index->docs);
+    g_byte_array_free(index->doc_fields, TRUE);
+    g_array_free(index->doc_msgnos, TRUE);
+    g_array_free(index->msgno_docs, TRUE);
+    for (i = 0; i < LBTI_N_FIELDS; i++) {
+        lbti_field_forget_suffixes(&index->fields[i]);
+        g_hash_table_destroy(index->fields[i].postings);
+    }
+    g_free(index);
+}
+
+gboolean
+libbalsa_text_index_is_dirty(LibBalsaTextIndex * index)
+{
+    return index->dirty;
+}
+
+guint
+libbalsa_text_index_get_stamp(LibBalsaTextIndex * index)
+{
+    return index->stamp;
+}
+
+/*
+ * Docs.
+ */
+
+static guint
+lbti_doc_new(LibBalsaTextIndex * index, const gchar * key)
+{
+    guint doc = index->doc_keys->len;
+    gchar *doc_key = g_strdup(key);
+    guint8 fields = 0;
+    guint32 msgno = 0;
+
+    g_ptr_array_add(index->doc_keys, doc_key);
+    g_hash_table_insert(index->docs, doc_key, GUINT_TO_POINTER(doc + 1));
+    g_byte_array_append(index->doc_fields, &fields, 1);
+    g_array_append_val(index->doc_msgnos, msgno);
+
+    return doc;
+}
+
+/* The doc bound to msgno, or -1. */
+static gint
+lbti_msgno_doc(LibBalsaTextIndex * index, guint msgno)
+{
+    return msgno > 0 && msgno <= index->msgno_docs->len ?
+        (gint) g_array_index(index->msgno_docs, guint32, msgno - 1) - 1 :
+        -1;
+}
+
+void
+libbalsa_text_index_bind(LibBalsaTextIndex * index, guint msgno,
+                         const gchar * key)
+{
+    gpointer value;
+    guint doc;
+
+    g_return_if_fail(msgno > 0);
+
+    if (!key || lbti_msgno_doc(index, msgno) >= 0)
+        return;
+
+    if ((value = g_hash_table_lookup(index->docs, key))) {
+        guint32 bound;
+
+        doc = GPOINTER_TO_UINT(value) - 1;
+        bound = g_array_index(index->doc_msgnos, guint32, doc);
+        /* Two messages with the same key would share their words, and
+         * a search could miss one of them. */
+        if (bound != 0 && bound != LBTI_EXPUNGED)
+            return;
+    } else {
+        doc = lbti_doc_new(index, key);
+        index->dirty = TRUE;
+    }
+
+    if (index->msgno_docs->len < msgno)
+        g_array_set_size(index->msgno_docs, msgno);
+    g_array_index(index->msgno_docs, guint32, msgno - 1) = doc + 1;
+    g_array_index(index->doc_msgnos, guint32, doc) = msgno;
+    index->n_bound++;
+}
+
+/*
+ * Words.
+ */
+
+typedef struct {
+    gchar *word;
+    gboolean bounded_left;      /* a separator precedes it */
+    gboolean bounded_right;     /* a separator follows it */
+} LbtiWord;
+
+/* Split text into upper-cased words; func is called for each one, with
+ * the separator flags. */
+static void
+lbti_split(const gchar * text,
+           void (*func) (GString * word, gboolean bounded_left,
+                         gboolean bounded_right, gpointer data),
+           gpointer data)
+{
+    GString *word = g_string_new(NULL);
+    gboolean bounded_left = FALSE;
+
+    for (; *text; text = g_utf8_next_char(text)) {
+        gunichar c = g_unichar_toupper(g_utf8_get_char(text));
+
+        if (g_unichar_isalnum(c))
+            g_string_append_unichar(word, c);
+        else {
+            if (word->len > 0) {
+                func(word, bounded_left, TRUE, data);
+                g_string_truncate(word, 0);
+            }
+            bounded_left = TRUE;
+        }
+    }
+    if (word->len > 0)
+        func(word, bounded_left, FALSE, data);
+
+    g_string_free(word, TRUE);
+}
+
+static void
+lbti_insert_doc(GArray * docs, guint32 doc)
+{
+    guint lo = 0, hi = docs->len;
+
+    /* Docs are mostly indexed in order, so this is usually an
+     * append. */
+    if (hi == 0 || g_array_index(docs, guint32, hi - 1) < doc) {
+        g_array_append_val(docs, doc);
+        return;
+    }
+
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+
+        if (g_array_index(docs, guint32, mid) < doc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (g_array_index(docs, guint32, lo) != doc)
+        g_array_insert_val(docs, lo, doc);
+}
+
+typedef struct {
+    LbtiField *field;
+    GHashTable *seen;
+    guint32 doc;
+} LbtiAddInfo;
+
+static void
+lbti_add_word(GString * word, gboolean bounded_left,
+              gboolean bounded_right, gpointer data)
+{
+    LbtiAddInfo *info = data;
+    GHashTable *postings = info->field->postings;
+    gpointer key, value;
+
+    if (g_hash_table_lookup(info->seen, word->str))
+        return;
+
+    if (!g_hash_table_lookup_extended(postings, word->str, &key, &value)) {
+        key = g_strndup(word->str, word->len);
+        value = g_array_new(FALSE, FALSE, sizeof(guint32));
+        g_hash_table_insert(postings, key, value);
+        lbti_field_forget_suffixes(info->field);
+    }
+    g_hash_table_insert(info->seen, key, key);
+    lbti_insert_doc(value, info->doc);
+}
+
+gboolean
+libbalsa_text_index_has(LibBalsaTextIndex * index, guint msgno,
+                        unsigned field)
+{
+    gint doc = lbti_msgno_doc(index, msgno);
+
+    return doc >= 0 && (index->doc_fields->data[doc] & field) != 0;
+}
+
+void
+libbalsa_text_index_add(LibBalsaTextIndex * index, guint msgno,
+                        unsigned field, const gchar * text)
+{
+    gint pos = lbti_field_pos(field);
+    gint doc = lbti_msgno_doc(index, msgno);
+    LbtiAddInfo info;
+
+    g_return_if_fail(pos >= 0);
+
+    if (doc < 0 || (index->doc_fields->data[doc] & field) != 0)
+        return;
+
+    index->doc_fields->data[doc] |= field;
+    index->dirty = TRUE;
+
+    if (!text)
+        return;
+
+    info.field = &index->fields[pos];
+    info.seen = g_hash_table_new(g_str_hash, g_str_equal);
+    info.doc = doc;
+    lbti_split(text, lbti_add_word, &info);
+    g_hash_table_destroy(info.seen);
+}
+
+/*
+ * Renumbering: the docs stay, and only the msgnos bound to them move.
+ */
+
+void
+libbalsa_text_index_msgnos_removed(LibBalsaTextIndex * index,
+                                   GArray * seqnos)
+{
+    GArray *msgno_docs = index->msgno_docs;
+    guint i, j, k;
+
+    for (i = j = k = 0; i < msgno_docs->len; i++) {
+        guint32 doc = g_array_index(msgno_docs, guint32, i);
+
+        while (k < seqnos->len && g_array_index(seqnos, guint, k) < i + 1)
+            k++;
+        if (k < seqnos->len && g_array_index(seqnos, guint, k) == i + 1) {
+            if (doc > 0) {
+                g_array_index(index->doc_msgnos, guint32, doc - 1) =
+                    LBTI_EXPUNGED;
+                index->n_bound--;
+                index->dirty = TRUE;
+            }
+            continue;
+        }
+        if (doc > 0)
+            g_array_index(index->doc_msgnos, guint32, doc - 1) = j + 1;
+        g_array_index(msgno_docs, guint32, j++) = doc;
+    }
+    g_array_set_size(msgno_docs, j);
+
+    ++index->stamp;
+}
+
+/*
+ * Candidates.
+ */
+
+static void
+lbti_append_word(GString * word, gboolean bounded_left,
+                 gboolean bounded_right, gpointer data)
+{
+    LbtiWord *w = g_new(LbtiWord, 1);
+
+    w->word = g_strndup(word->str, word->len);
+    w->bounded_left = bounded_left;
+    w->bounded_right = bounded_right;
+    g_ptr_array_add(data, w);
+}
+
+static void
+lbti_word_free(LbtiWord * w)
+{
+    g_free(w->word);
+    g_free(w);
+}
+
+static gint
+lbti_suffix_compare(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const LbtiSuffix *sa = a;
+    const LbtiSuffix *sb = b;
+    GPtrArray *words = data;
+
+    return strcmp((gchar *) g_ptr_array_index(words, sa->word) + sa->offset,
+                  (gchar *) g_ptr_array_index(words, sb->word) + sb->offset);
+}
+
+static void
+lbti_field_sort_suffixes(LbtiField * field)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    if (field->suffixes)
+        return;
+
+    field->words =
+        g_ptr_array_sized_new(g_hash_table_size(field->postings));
+    field->suffixes = g_array_new(FALSE, FALSE, sizeof(LbtiSuffix));
+    g_hash_table_iter_init(&iter, field->postings);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const gchar *p;
+        LbtiSuffix suffix;
+
+        suffix.word = field->words->len;
+        g_ptr_array_add(field->words, key);
+        for (p = key; *p; p = g_utf8_next_char(p)) {
+            suffix.offset = p - (const gchar *) key;
+            g_array_append_val(field->suffixes, suffix);
+        }
+    }
+    g_qsort_with_data(field->suffixes->data, field->suffixes->len,
+                      sizeof(LbtiSuffix), lbti_suffix_compare,
+                      field->words);
+}
+
+static gint
+lbti_doc_compare(gconstpointer a, gconstpointer b)
+{
+    guint32 da = *(const guint32 *) a;
+    guint32 db = *(const guint32 *) b;
+
+    return da < db ? -1 : da > db;
+}
+
+/* The ascending docs in which the word may occur in the field. */
+static GArray *
+lbti_word_docs(LbtiField * field, LbtiWord * w)
+{
+    GArray *docs = g_array_new(FALSE, FALSE, sizeof(guint32));
+    GArray *value;
+    gsize len;
+    guint lo, hi, i, j;
+
+    if (w->bounded_left && w->bounded_right) {
+        if ((value = g_hash_table_lookup(field->postings, w->word)))
+            g_array_append_vals(docs, value->data, value->len);
+        return docs;
+    }
+
+    /* Only part of a word of the text: find the suffixes that start
+     * with the word. */
+    lbti_field_sort_suffixes(field);
+    len = strlen(w->word);
+    lo = 0;
+    hi = field->suffixes->len;
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+        LbtiSuffix *s = &g_array_index(field->suffixes, LbtiSuffix, mid);
+
+        if (strcmp((gchar *) g_ptr_array_index(field->words, s->word)
+                   + s->offset, w->word) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (i = lo; i < field->suffixes->len; i++) {
+        LbtiSuffix *s = &g_array_index(field->suffixes, LbtiSuffix, i);
+        const gchar *word = g_ptr_array_index(field->words, s->word);
+        const gchar *suffix = word + s->offset;
+
+        if (strncmp(suffix, w->word, len) != 0)
+            break;
+        if ((w->bounded_left && s->offset != 0)
+            || (w->bounded_right && suffix[len] != '\0'))
+            continue;
+        value = g_hash_table_lookup(field->postings, word);
+        g_array_append_vals(docs, value->data, value->len);
+    }
+
+    /* A doc may have several of the words. */
+    g_array_sort(docs, lbti_doc_compare);
+    for (i = j = 0; i < docs->len; i++)
+        if (j == 0 || g_array_index(docs, guint32, i)
+            != g_array_index(docs, guint32, j - 1))
+            g_array_index(docs, guint32, j++) =
+                g_array_index(docs, guint32, i);
+    g_array_set_size(docs, j);
+
+    return docs;
+}
+
+/* Keep the docs of docs that are also in other. */
+static void
+lbti_docs_intersect(GArray * docs, GArray * other)
+{
+    guint i, j, k;
+
+    for (i = j = k = 0; i < docs->len; i++) {
+        guint32 doc = g_array_index(docs, guint32, i);
+
+        while (k < other->len && g_array_index(other, guint32, k) < doc)
+            k++;
+        if (k < other->len && g_array_index(other, guint32, k) == doc)
+            g_array_index(docs, guint32, j++) = doc;
+    }
+    g_array_set_size(docs, j);
+}
+
+static void
+lbti_field_candidates(LibBalsaTextIndex * index, unsigned field,
+                      GPtrArray * words, guint total, guint8 * result)
+{
+    LbtiField *f = &index->fields[lbti_field_pos(field)];
+    GArray *docs = NULL;
+    guint i, msgno;
+
+    for (i = 0; i < words->len && (!docs || docs->len > 0); i++) {
+        GArray *word_docs =
+            lbti_word_docs(f, g_ptr_array_index(words, i));
+
+        if (docs) {
+            lbti_docs_intersect(docs, word_docs);
+            g_array_free(word_docs, TRUE);
+        } else
+            docs = word_docs;
+    }
+
+    for (i = 0; i < docs->len; i++) {
+        guint32 doc = g_array_index(docs, guint32, i);
+
+        msgno = g_array_index(index->doc_msgnos, guint32, doc);
+        if (msgno > 0 && msgno <= total)
+            result[msgno - 1] = 1;
+    }
+    g_array_free(docs, TRUE);
+
+    for (msgno = 1; msgno <= total; msgno++)
+        if (!libbalsa_text_index_has(index, msgno, field))
+            result[msgno - 1] = 1;
+}
+
+static guint8 *
+lbti_string_candidates(LibBalsaTextIndex * index,
+                       LibBalsaCondition * cond, guint total)
+{
+    unsigned fields = cond->match.string.fields;
+    GPtrArray *words;
+    guint8 *result = NULL;
+    guint i;
+
+    if (fields == 0 || (fields & ~LIBBALSA_TEXT_INDEX_FIELDS) != 0
+        || !cond->match.string.string)
+        return NULL;
+
+    words = g_ptr_array_new();
+    lbti_split(cond->match.string.string, lbti_append_word, words);
+    if (words->len > 0) {
+        result = g_new0(guint8, total);
+        for (i = 0; i < LBTI_N_FIELDS; i++)
+            if (fields & lbti_fields[i])
+                lbti_field_candidates(index, lbti_fields[i], words, total,
+                                      result);
+    }
+    g_ptr_array_foreach(words, (GFunc) lbti_word_free, NULL);
+    g_ptr_array_free(words, TRUE);
+
+    return result;
+}
+
+guint8 *
+libbalsa_text_index_candidates(LibBalsaTextIndex * index,
+                               LibBalsaCondition * cond, guint total)
+{
+    guint8 *left, *right;
+    guint i;
+
+    /* The complement of a superset says nothing. */
+    if (!cond || cond->negate || total == 0)
+        return NULL;
+
+    switch (cond->type) {
+    case CONDITION_STRING:
+        return lbti_string_candidates(index, cond, total);
+    case CONDITION_AND:
+        left = libbalsa_text_index_candidates(index,
+                                              cond->match.andor.left,
+                                              total);
+        right = libbalsa_text_index_candidates(index,
+                                               cond->match.andor.right,
+                                               total);
+        if (!left)
+            return right;
+        if (right) {
+            for (i = 0; i < total; i++)
+                left[i] &= right[i];
+            g_free(right);
+        }
+        return left;
+    case CONDITION_OR:
+        left = libbalsa_text_index_candidates(index,
+                                              cond->match.andor.left,
+                                              total);
+        if (!left)
+            return NULL;
+        right = libbalsa_text_index_candidates(index,
+                                               cond->match.andor.right,
+                                               total);
+        if (!right) {
+            g_free(left);
+            return NULL;
+        }
+        for (i = 0; i < total; i++)
+            left[i] |= right[i];
+        g_free(right);
+        return left;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Persistence: a header (magic, version, number of docs), the key and
+ * the fields indexed of each doc, then for each field the number of
+ * words and, for each word, its length, its bytes, the number of docs
+ * and the docs.  Numbers are little-endian, so that the file does not
+ * depend on the host.  The docs of expunged messages are dropped, and
+ * so are those of messages that were not bound, if every message of
+ * the mailbox was.
+ */
+
+static void
+lbti_write_uint32(GString * buf, guint32 val)
+{
+    val = GUINT32_TO_LE(val);
+    g_string_append_len(buf, (const gchar *) &val, sizeof val);
+}
+
+static void
+lbti_write_string(GString * buf, const gchar * str)
+{
+    guint32 len = strlen(str);
+
+    lbti_write_uint32(buf, len);
+    g_string_append_len(buf, str, len);
+}
+
+gboolean
+libbalsa_text_index_save(LibBalsaTextIndex * index, const gchar * filename,
+                         guint total, GError ** err)
+{
+    gboolean keep_unbound = index->n_bound < total;
+    GString *buf = g_string_new(NULL);
+    GString *words = g_string_new(NULL);
+    guint32 *new_docs;
+    guint32 n_docs;
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean retval;
+    guint i, j;
+
+    /* Number the docs that are kept from 1, in the same order. */
+    new_docs = g_new(guint32, index->doc_keys->len);
+    for (i = n_docs = 0; i < index->doc_keys->len; i++) {
+        guint32 msgno = g_array_index(index->doc_msgnos, guint32, i);
+
+        new_docs[i] = msgno == LBTI_EXPUNGED
+            || (msgno == 0 && !keep_unbound) ? 0 : ++n_docs;
+    }
+
+    lbti_write_uint32(buf, LBTI_MAGIC);
+    lbti_write_uint32(buf, LBTI_VERSION);
+    lbti_write_uint32(buf, n_docs);
+    for (i = 0; i < index->doc_keys->len; i++)
+        if (new_docs[i]) {
+            lbti_write_string(buf, g_ptr_array_index(index->doc_keys, i));
+            g_string_append_c(buf, index->doc_fields->data[i]);
+        }
+
+    for (i = 0; i < LBTI_N_FIELDS; i++) {
+        guint32 n_words = 0;
+
+        g_string_truncate(words, 0);
+        g_hash_table_iter_init(&iter, index->fields[i].postings);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            GArray *docs = value;
+            guint32 n = 0;
+
+            for (j = 0; j < docs->len; j++)
+                if (new_docs[g_array_index(docs, guint32, j)])
+                    n++;
+            if (n == 0)
+                continue;
+
+            n_words++;
+            lbti_write_string(words, key);
+            lbti_write_uint32(words, n);
+            for (j = 0; j < docs->len; j++) {
+                guint32 doc = new_docs[g_array_index(docs, guint32, j)];
+
+                if (doc)
+                    lbti_write_uint32(words, doc - 1);
+            }
+        }
+        lbti_write_uint32(buf, n_words);
+        g_string_append_len(buf, words->str, words->len);
+    }
+    g_free(new_docs);
+    g_string_free(words, TRUE);
+
+    retval = g_file_set_contents(filename, buf->str, buf->len, err);
+    if (retval)
+        index->dirty = FALSE;
+    g_string_free(buf, TRUE);
+
+    return retval;
+}
+
+typedef struct {
+    const gchar *p;
+    const gchar *end;
+} LbtiReader;
+
+static gboolean
+lbti_read(LbtiReader * reader, gpointer dest, gsize len)
+{
+    if ((gsize) (reader->end - reader->p) < len)
+        return FALSE;
+    memcpy(dest, reader->p, len);
+    reader->p += len;
+
+    return TRUE;
+}
+
+static gboolean
+lbti_read_uint32(LbtiReader * reader, guint32 * val)
+{
+    if (!lbti_read(reader, val, sizeof *val))
+        return FALSE;
+    *val = GUINT32_FROM_LE(*val);
+
+    return TRUE;
+}
+
+/* Returns a newly allocated string, or NULL. */
+static gchar *
+lbti_read_string(LbtiReader * reader)
+{
+    guint32 len;
+    gchar *str;
+
+    if (!lbti_read_uint32(reader, &len)
+        || (gsize) (reader->end - reader->p) < len)
+        return NULL;
+    str = g_strndup(reader->p, len);
+    reader->p += len;
+
+    return str;
+}
+
+static gboolean
+lbti_read_docs(LbtiReader * reader, LibBalsaTextIndex * index)
+{
+    guint32 n_docs;
+
+    if (!lbti_read_uint32(reader, &n_docs))
+        return FALSE;
+
+    while (n_docs-- > 0) {
+        gchar *key;
+        guint8 fields;
+        guint doc;
+
+        if (!(key = lbti_read_string(reader)))
+            return FALSE;
+        if (g_hash_table_lookup(index->docs, key)
+            || !lbti_read(reader, &fields, 1)) {
+            g_free(key);
+            return FALSE;
+        }
+        doc = lbti_doc_new(index, key);
+        index->doc_fields->data[doc] = fields;
+        g_free(key);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+lbti_read_words(LbtiReader * reader, GHashTable * postings, guint32 n_docs)
+{
+    guint32 n_words, n;
+
+    if (!lbti_read_uint32(reader, &n_words))
+        return FALSE;
+
+    while (n_words-- > 0) {
+        gchar *word;
+        GArray *docs;
+        guint32 i;
+
+        if (!(word = lbti_read_string(reader)))
+            return FALSE;
+        if (!lbti_read_uint32(reader, &n)
+            || (gsize) (reader->end - reader->p) / sizeof(guint32) < n) {
+            g_free(word);
+            return FALSE;
+        }
+        docs = g_array_sized_new(FALSE, FALSE, sizeof(guint32), n);
+        g_array_set_size(docs, n);
+        lbti_read(reader, docs->data, n * sizeof(guint32));
+        g_hash_table_insert(postings, word, docs);
+
+        /* Sanity check: ascending docs in range. */
+        for (i = 0; i < n; i++) {
+            guint32 doc = GUINT32_FROM_LE(g_array_index(docs, guint32, i));
+
+            g_array_index(docs, guint32, i) = doc;
+            if (doc >= n_docs
+                || (i > 0 && doc <= g_array_index(docs, guint32, i - 1)))
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+LibBalsaTextIndex *
+libbalsa_text_index_load(const gchar * filename, GError ** err)
+{
+    gchar *contents;
+    gsize length;
+    LbtiReader reader;
+    guint32 magic, version;
+    LibBalsaTextIndex *index;
+    gboolean ok;
+    guint i;
+
+    if (!g_file_get_contents(filename, &contents, &length, err))
+        return NULL;
+
+    reader.p = contents;
+    reader.end = contents + length;
+    if (!lbti_read_uint32(&reader, &magic) || magic != LBTI_MAGIC
+        || !lbti_read_uint32(&reader, &version)
+        || version != LBTI_VERSION) {
+        g_free(contents);
+        return NULL;
+    }
+
+    index = libbalsa_text_index_new();
+    ok = lbti_read_docs(&reader, index);
+    for (i = 0; ok && i < LBTI_N_FIELDS; i++)
+        ok = lbti_read_words(&reader, index->fields[i].postings,
+                             index->doc_keys->len);
+    g_free(contents);
+
+    if (!ok || reader.p != reader.end) {
+        libbalsa_text_index_free(index);
+        return NULL;
+    }
+
+    return index;
+}
@@ -0,0 +1,78 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2013 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option) 
+ * any later version.
+ *  
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * text-index.h
+ *
+ * An inverted index of the words in the From, Subject and body of the
+ * messages of a mailbox, used to narrow down searches before each
+ * remaining message is matched.  Each message is indexed under a key
+ * that identifies it, so that the index stays valid when messages are
+ * appended or expunged, and the msgnos that the mailbox currently
+ * gives those messages are bound to their keys as it loads them.
+ */
+
+#ifndef __LIBBALSA_TEXT_INDEX_H__
+#define __LIBBALSA_TEXT_INDEX_H__
+
+#include <glib.h>
+#include "filter-funcs.h"
+
+/* The fields that can be indexed. */
+#define LIBBALSA_TEXT_INDEX_FIELDS \
+    (CONDITION_MATCH_FROM | CONDITION_MATCH_SUBJECT | CONDITION_MATCH_BODY)
+
+LibBalsaTextIndex *libbalsa_text_index_new(void);
+void libbalsa_text_index_free(LibBalsaTextIndex * index);
+
+/* Persistence; load returns NULL if the file is missing or unusable.
+ * Messages that the file has but the mailbox did not bind are saved
+ * again unless all total messages of the mailbox were bound. */
+LibBalsaTextIndex *libbalsa_text_index_load(const gchar * filename,
+                                            GError ** err);
+gboolean libbalsa_text_index_save(LibBalsaTextIndex * index,
+                                  const gchar * filename, guint total,
+                                  GError ** err);
+gboolean libbalsa_text_index_is_dirty(LibBalsaTextIndex * index);
+
+/* Binds msgno to the message with the key, which is added if it is
+ * new; a msgno that is not bound is never indexed, and a key that is
+ * already bound to another msgno is not bound again. */
+void libbalsa_text_index_bind(LibBalsaTextIndex * index, guint msgno,
+                              const gchar * key);
+
+/* Updating; text is what the matching code searches for the field, and
+ * each field of a message is indexed once. */
+gboolean libbalsa_text_index_has(LibBalsaTextIndex * index, guint msgno,
+                                 unsigned field);
+void libbalsa_text_index_add(LibBalsaTextIndex * index, guint msgno,
+                             unsigned field, const gchar * text);
+void libbalsa_text_index_msgnos_removed(LibBalsaTextIndex * index,
+                                        GArray * seqnos);
+/* Incremented whenever msgnos are renumbered. */
+guint libbalsa_text_index_get_stamp(LibBalsaTextIndex * index);
+
+/* Returns an array of total flags, one per msgno, that is nonzero for
+ * every message that may match the condition, or NULL if the index
+ * cannot narrow down the search; free it with g_free. */
+guint8 *libbalsa_text_index_candidates(LibBalsaTextIndex * index,
+                                       LibBalsaCondition * cond,
+                                       guint total);
+
+#endif                          /* __LIBBALSA_TEXT_INDEX_H__ */
@@ -88,6 +88,13 @@ static void bndx_row_activated(GtkTreeView * tree_view, GtkTreePath * path,
                                gpointer user_data);
 static void bndx_column_resize(GtkWidget * widget,
                                GtkAllocation * allocation, gpointer data);
+static void bndx_update_visible_range(BalsaIndex * index);
+static void bndx_set_scroll_adjustments_cb(GtkTreeView * tree_view,
+                                           GtkAdjustment * hadjustment,
+                                           GtkAdjustment * vadjustment,
+                                           gpointer data);
+static void bndx_follow_vadjustment(BalsaIndex * index,
+                                    GtkAdjustment * vadjustment);
 static void bndx_tree_expand_cb(GtkTreeView * tree_view,
                                 GtkTreeIter * iter, GtkTreePath * path,
                                 gpointer user_data);
@@ -236,6 +243,8 @@ bndx_destroy(GtkObject * obj)
         }
     }
 
+    bndx_follow_vadjustment(index, NULL);
+
     if (index->search_iter) {
         libbalsa_mailbox_search_iter_free(index->search_iter);
         index->search_iter = NULL;
@@ -457,6 +466,13 @@ bndx_instance_init(BalsaIndex * index)
     g_signal_connect_after(tree_view, "size-allocate",
                            G_CALLBACK(bndx_column_resize),
                            NULL);
+    /* ...and to know which rows are shown. */
+    g_signal_connect_after(tree_view, "size-allocate",
+                           G_CALLBACK(bndx_update_visible_range),
+                           NULL);
+    g_signal_connect_after(tree_view, "set-scroll-adjustments",
+                           G_CALLBACK(bndx_set_scroll_adjustments_cb),
+                           NULL);
     gtk_tree_view_set_enable_search(tree_view, FALSE);
 
     gtk_drag_source_set(GTK_WIDGET (index), 
@@ -813,6 +829,69 @@ bndx_column_resize(GtkWidget * widget, GtkAllocation * allocation,
                                        (tree_view, LB_MBOX_SIZE_COL));
 }
 
+/* Tell the mailbox which rows are visible, so that a remote mailbox
+ * fetches what is about to be drawn instead of guessing. */
+static void
+bndx_update_visible_range(BalsaIndex * index)
+{
+    GtkTreeView *tree_view = GTK_TREE_VIEW(index);
+    GtkTreeModel *model = gtk_tree_view_get_model(tree_view);
+    GtkTreePath *start_path, *end_path;
+    GtkTreeIter iter;
+    guint first = 0, last = 0;
+
+    if (!model || !index->mailbox_node || !index->mailbox_node->mailbox
+        || !gtk_tree_view_get_visible_range(tree_view, &start_path,
+                                            &end_path))
+        return;
+
+    if (gtk_tree_model_get_iter(model, &iter, start_path))
+        gtk_tree_model_get(model, &iter, LB_MBOX_MSGNO_COL, &first, -1);
+    if (gtk_tree_model_get_iter(model, &iter, end_path))
+        gtk_tree_model_get(model, &iter, LB_MBOX_MSGNO_COL, &last, -1);
+    gtk_tree_path_free(start_path);
+    gtk_tree_path_free(end_path);
+
+    libbalsa_mailbox_set_visible_range(index->mailbox_node->mailbox,
+                                       first, last);
+}
+
+/* The tree view has been given a new vertical adjustment, by the
+ * scrolled window it has been put in; follow it. */
+static void
+bndx_set_scroll_adjustments_cb(GtkTreeView * tree_view,
+                               GtkAdjustment * hadjustment,
+                               GtkAdjustment * vadjustment,
+                               gpointer data)
+{
+    bndx_follow_vadjustment(BALSA_INDEX(tree_view), vadjustment);
+}
+
+/* Stop following the old vertical adjustment, if any, and start
+ * following the new one, if any. */
+static void
+bndx_follow_vadjustment(BalsaIndex * index, GtkAdjustment * vadjustment)
+{
+    if (index->vadjustment == vadjustment)
+        return;
+
+    if (index->vadjustment) {
+        g_signal_handler_disconnect(index->vadjustment,
+                                    index->vadjustment_changed_id);
+        g_object_unref(index->vadjustment);
+        index->vadjustment = NULL;
+        index->vadjustment_changed_id = 0;
+    }
+
+    if (vadjustment) {
+        index->vadjustment = g_object_ref(vadjustment);
+        index->vadjustment_changed_id =
+            g_signal_connect_swapped(vadjustment, "value-changed",
+                                     G_CALLBACK(bndx_update_visible_range),
+                                     index);
+    }
+}
+
 /* bndx_drag_cb 
  * 
  * This is the drag_data_get callback for the index widgets.
@@ -71,6 +71,10 @@ extern "C" {
         gulong row_collapsed_id;
         gulong selection_changed_id;
 
+        /* the vertical adjustment we follow, and our handler on it */
+        GtkAdjustment *vadjustment;
+        gulong vadjustment_changed_id;
+
 	LibBalsaMailboxSearchIter *search_iter;
         BalsaIndexWidthPreference width_preference;
     };
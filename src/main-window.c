@@ -32,6 +32,7 @@
 #include "main-window.h"
 
 #include <string.h>
+#include <sys/stat.h>
 #include <gdk/gdkkeysyms.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
@@ -144,7 +145,9 @@ static void bw_idle_remove(BalsaWindow * window);
 static gboolean bw_idle_cb(BalsaWindow * window);
 
 
+#ifndef BALSA_USE_THREADS
 static void bw_check_mailbox_list(BalsaWindow * window, GList * list);
+#endif
 static gboolean bw_mailbox_check_func(GtkTreeModel * model,
                                       GtkTreePath * path,
                                       GtkTreeIter * iter,
@@ -2783,6 +2786,7 @@ bw_show_about_box(GtkAction * action, gpointer user_data)
     g_object_unref(balsa_logo);
 }
 
+#ifndef BALSA_USE_THREADS
 /* Check all mailboxes in a list
  *
  */
@@ -2805,6 +2809,74 @@ bw_check_mailbox_list(BalsaWindow * window, GList * mailbox_list)
         libbalsa_mailbox_check(mailbox);
     }
 }
+#endif /* BALSA_USE_THREADS */
+
+/* Bulk check of the mailboxes on one IMAP server; the mailboxes it
+ * could not check are added to rest.
+ */
+static void
+bw_check_imap_server(LibBalsaImapServer * server, GSList * mailboxes,
+                     GSList ** rest)
+{
+#ifdef BALSA_USE_THREADS
+    MailThreadMessage *threadmessage;
+    gchar *string =
+        g_strdup_printf(_("IMAP server: %s"), LIBBALSA_SERVER(server)->host);
+
+    MSGMAILTHREAD(threadmessage, LIBBALSA_NTFY_SOURCE, NULL, string, 0, 0);
+    g_free(string);
+#endif
+
+    if (libbalsa_imap_server_check_mailboxes(server, mailboxes))
+        g_slist_free(mailboxes);
+    else
+        *rest = g_slist_concat(mailboxes, *rest);
+}
+
+/* Sort the closed IMAP mailboxes in the list by server; returns a
+ * table mapping each server to a list of its mailboxes, the others
+ * are prepended to rest. The lists do not hold references.
+ */
+static GHashTable *
+bw_group_imap_mailboxes(GSList * list, GSList ** rest)
+{
+    GHashTable *servers = g_hash_table_new(NULL, NULL);
+
+    for (; list; list = list->next) {
+        LibBalsaMailbox *mailbox = list->data;
+
+        if (LIBBALSA_IS_MAILBOX_IMAP(mailbox) && !MAILBOX_OPEN(mailbox)
+            && libbalsa_mailbox_get_subscribe(mailbox) !=
+            LB_MAILBOX_SUBSCRIBE_NO) {
+            LibBalsaServer *server = LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox);
+            g_hash_table_insert(servers, server,
+                                g_slist_prepend(g_hash_table_lookup
+                                                (servers, server),
+                                                mailbox));
+        } else
+            *rest = g_slist_prepend(*rest, mailbox);
+    }
+
+    return servers;
+}
+
+#ifndef BALSA_USE_THREADS
+/* Check the closed IMAP mailboxes in the list with one bulk command
+ * per server; returns a list of the mailboxes that remain to be
+ * checked one by one. The list does not hold references.
+ */
+static GSList *
+bw_check_imap_bulk(GSList * list)
+{
+    GSList *rest = NULL;
+    GHashTable *servers = bw_group_imap_mailboxes(list, &rest);
+
+    g_hash_table_foreach(servers, (GHFunc) bw_check_imap_server, &rest);
+    g_hash_table_destroy(servers);
+
+    return g_slist_reverse(rest);
+}
+#endif /* BALSA_USE_THREADS */
 
 /*Callback to check a mailbox in a balsa-mblist */
 static gboolean
@@ -2958,12 +3030,16 @@ check_new_messages_real(BalsaWindow * window, int type)
     pthread_detach(get_mail_thread);
 #else
 
+    GSList *rest;
+
     bw_check_mailbox_list(window, balsa_app.inbox_input);
 
     gtk_tree_model_foreach(GTK_TREE_MODEL(balsa_app.mblist_tree_store),
 			   (GtkTreeModelForeachFunc) bw_mailbox_check_func,
 			   &list);
-    g_slist_foreach(list, (GFunc) libbalsa_mailbox_check, NULL);
+    rest = bw_check_imap_bulk(list);
+    g_slist_foreach(rest, (GFunc) libbalsa_mailbox_check, NULL);
+    g_slist_free(rest);
     g_slist_foreach(list, (GFunc) g_object_unref, NULL);
     g_slist_free(list);
 #endif
@@ -3101,6 +3177,169 @@ bw_mailbox_check(LibBalsaMailbox * mailbox)
     libbalsa_mailbox_check(mailbox);
 }
 
+/* The check thread hands the mailboxes to a small pool of workers, so
+ * that different servers and file systems are checked concurrently.
+ * Every job names the resource it uses; at most `limit' jobs run on
+ * one resource at a time: the connection limit for an IMAP server,
+ * one for a local file system, and one for all POP3 mailboxes
+ * together since they share the inbox.
+ */
+#define BW_CHECK_WORKERS 4
+
+typedef struct {
+    gchar *resource;
+    guint limit;
+    LibBalsaMailbox *mailbox;   /* single mailbox check... */
+    LibBalsaImapServer *server; /* ...or bulk check of mailboxes */
+    GSList *mailboxes;
+    gboolean pop3;
+} BwCheckJob;
+
+struct bw_check_scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GList *queue;               /* BwCheckJob, waiting */
+    GHashTable *running;        /* resource -> number of running jobs */
+    guint busy;
+};
+
+static BwCheckJob *
+bw_check_job_new(LibBalsaMailbox * mailbox, gboolean pop3)
+{
+    BwCheckJob *job = g_new0(BwCheckJob, 1);
+
+    job->mailbox = mailbox;
+    job->pop3 = pop3;
+    job->limit = 1;
+    if (pop3)
+        /* All POP3 mailboxes deliver to balsa_app.inbox: check them
+         * one at a time, in the order of balsa_app.inbox_input. */
+        job->resource = g_strdup("pop3");
+    else if (LIBBALSA_IS_MAILBOX_IMAP(mailbox)) {
+        LibBalsaServer *server = LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox);
+        job->resource = g_strdup_printf("imap:%p", server);
+        job->limit = MAX(1, libbalsa_imap_server_get_max_connections
+                         (LIBBALSA_IMAP_SERVER(server)));
+    } else if (LIBBALSA_IS_MAILBOX_REMOTE(mailbox))
+        job->resource =
+            g_strdup_printf("remote:%s",
+                            LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox)->host);
+    else if (LIBBALSA_IS_MAILBOX_LOCAL(mailbox)) {
+        struct stat st;
+        if (stat(libbalsa_mailbox_local_get_path(mailbox), &st) == 0)
+            job->resource = g_strdup_printf("fs:%lu",
+                                            (unsigned long) st.st_dev);
+    }
+    if (!job->resource)
+        job->resource = g_strdup("other");
+
+    return job;
+}
+
+static void
+bw_check_job_free(BwCheckJob * job)
+{
+    g_slist_free(job->mailboxes);
+    g_free(job->resource);
+    g_free(job);
+}
+
+/* GHFunc for the table from bw_group_imap_mailboxes. */
+static void
+bw_check_queue_server(LibBalsaImapServer * server, GSList * mailboxes,
+                      GList ** queue)
+{
+    BwCheckJob *job = g_new0(BwCheckJob, 1);
+
+    job->server = server;
+    job->mailboxes = mailboxes;
+    job->resource = g_strdup_printf("imap:%p", server);
+    job->limit = MAX(1, libbalsa_imap_server_get_max_connections(server));
+    *queue = g_list_prepend(*queue, job);
+}
+
+/* Run one job without the scheduler lock; mailboxes that a bulk
+ * check left over are queued again as single checks.
+ */
+static void
+bw_check_job_run(struct bw_check_scheduler *sched, BwCheckJob * job)
+{
+    GTimer *timer = g_timer_new();
+
+    if (job->server) {
+        GSList *rest = NULL, *l;
+
+        bw_check_imap_server(job->server, job->mailboxes, &rest);
+        job->mailboxes = NULL;
+        if (rest) {
+            pthread_mutex_lock(&sched->lock);
+            for (l = rest; l; l = l->next)
+                sched->queue =
+                    g_list_append(sched->queue,
+                                  bw_check_job_new(l->data, FALSE));
+            pthread_mutex_unlock(&sched->lock);
+            g_slist_free(rest);
+        }
+    } else if (job->pop3) {
+        libbalsa_mailbox_pop3_set_inbox(job->mailbox, balsa_app.inbox);
+        libbalsa_mailbox_pop3_set_msg_size_limit
+            (LIBBALSA_MAILBOX_POP3(job->mailbox),
+             balsa_app.msg_size_limit * 1024);
+        libbalsa_mailbox_check(job->mailbox);
+    } else
+        bw_mailbox_check(job->mailbox);
+
+    if (balsa_app.debug)
+        fprintf(stderr, "%s: checked in %.3f s\n",
+                job->server ? LIBBALSA_SERVER(job->server)->host
+                : job->mailbox->name, g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+}
+
+static void *
+bw_check_worker(struct bw_check_scheduler *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    for (;;) {
+        BwCheckJob *job = NULL;
+        guint running = 0;
+        GList *l;
+
+        for (l = sched->queue; l; l = l->next) {
+            job = l->data;
+            running = GPOINTER_TO_UINT(g_hash_table_lookup
+                                       (sched->running, job->resource));
+            if (running < job->limit)
+                break;
+        }
+
+        if (l) {
+            sched->queue = g_list_delete_link(sched->queue, l);
+            g_hash_table_insert(sched->running, g_strdup(job->resource),
+                                GUINT_TO_POINTER(running + 1));
+            sched->busy++;
+            pthread_mutex_unlock(&sched->lock);
+
+            bw_check_job_run(sched, job);
+
+            pthread_mutex_lock(&sched->lock);
+            running = GPOINTER_TO_UINT(g_hash_table_lookup
+                                       (sched->running, job->resource));
+            g_hash_table_insert(sched->running, g_strdup(job->resource),
+                                GUINT_TO_POINTER(running - 1));
+            sched->busy--;
+            pthread_cond_broadcast(&sched->cond);
+            bw_check_job_free(job);
+        } else if (!sched->queue && !sched->busy)
+            break;
+        else
+            pthread_cond_wait(&sched->cond, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    return NULL;
+}
+
 static void
 bw_check_messages_thread(struct check_messages_thread_info *info)
 {
@@ -3111,13 +3350,61 @@ bw_check_messages_thread(struct check_messages_thread_info *info)
      */
     MailThreadMessage *threadmessage;
     GSList *list = info->list;
+    GSList *rest = NULL, *l;
+    GList *mbl;
+    GHashTable *servers;
+    struct bw_check_scheduler sched;
+    pthread_t workers[BW_CHECK_WORKERS];
+    gboolean check_pop3 = TRUE;
+    int i;
     
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-    MSGMAILTHREAD(threadmessage, LIBBALSA_NTFY_SOURCE, NULL, "POP3", 0, 0);
-    bw_check_mailbox_list(info->window, balsa_app.inbox_input);
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.cond, NULL);
+    sched.queue = NULL;
+    sched.running = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, NULL);
+    sched.busy = 0;
+
+#if defined(HAVE_LIBNM_GLIB)
+    if (info->window && info->window->nm_state != NM_STATE_CONNECTED) {
+        info->window->check_mail_skipped = TRUE;
+        check_pop3 = FALSE;
+    }
+#endif /* LIBNM_GLIB */
+    if (check_pop3) {
+        MSGMAILTHREAD(threadmessage, LIBBALSA_NTFY_SOURCE, NULL, "POP3",
+                      0, 0);
+        for (mbl = balsa_app.inbox_input; mbl; mbl = mbl->next)
+            sched.queue =
+                g_list_prepend(sched.queue,
+                               bw_check_job_new(BALSA_MAILBOX_NODE
+                                                (mbl->data)->mailbox,
+                                                TRUE));
+    }
+
+    servers = bw_group_imap_mailboxes(list, &rest);
+    g_hash_table_foreach(servers, (GHFunc) bw_check_queue_server,
+                         &sched.queue);
+    g_hash_table_destroy(servers);
+    rest = g_slist_reverse(rest);
+    for (l = rest; l; l = l->next)
+        sched.queue =
+            g_list_prepend(sched.queue, bw_check_job_new(l->data, FALSE));
+    g_slist_free(rest);
+    sched.queue = g_list_reverse(sched.queue);
+
+    for (i = 0; i < BW_CHECK_WORKERS; i++)
+        pthread_create(&workers[i], NULL, (void *(*)(void *)) bw_check_worker,
+                       &sched);
+    for (i = 0; i < BW_CHECK_WORKERS; i++)
+        pthread_join(workers[i], NULL);
+
+    g_hash_table_destroy(sched.running);
+    pthread_cond_destroy(&sched.cond);
+    pthread_mutex_destroy(&sched.lock);
 
-    g_slist_foreach(list, (GFunc) bw_mailbox_check, NULL);
     g_slist_foreach(list, (GFunc) g_object_unref, NULL);
     g_slist_free(list);
 
@@ -4466,6 +4753,7 @@ bw_find_real(BalsaWindow * window, BalsaIndex * bindex, gboolean again)
 		    CONDITION_SETMATCH(cnd,CONDITION_MATCH_FROM);
 		if (gtk_toggle_button_get_active(matching_cc))
 		    CONDITION_SETMATCH(cnd,CONDITION_MATCH_CC);
+                libbalsa_condition_reset_program(cnd);
 		if (!(cnd->match.string.fields!=CONDITION_EMPTY &&
                     cnd->match.string.string[0]))
                     